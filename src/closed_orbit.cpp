@@ -0,0 +1,405 @@
+#include <math.h>
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_permutation.h>
+#include <gsl/gsl_linalg.h>
+#include <gsl/gsl_eigen.h>
+#include <gsl/gsl_complex.h>
+#include <gsl/gsl_errno.h>
+#include "closed_orbit.hpp"
+#include "simulator.hpp"
+#include "type.hpp"
+#include "util.hpp"
+#include "frame.hpp"
+#include "node_index.hpp"
+#include "dop853.hpp"
+
+#define CLOSED_ORBIT_PIVOT_RATIO	1E-12	// Smallest LU pivot of the Newton step, relative to the largest one
+
+/**
+ * Section of the turn: the plane through the initial position, normal to the initial momentum. v is the direction of
+ * the plane nearest to z (to y if the momentum is along z), so for a layout in the xy plane u is the horizontal one.
+ */
+void init_closed_orbit_section(ParticleStateGlobal& particle_state, ClosedOrbit& closed_orbit)
+{
+	double momentum = vector_module(particle_state.momentum_x, particle_state.momentum_y, particle_state.momentum_z);
+
+	if (momentum == 0)
+	{
+		printf("ERROR - The closed orbit needs a moving particle\n");
+		exit(-8);
+	}
+
+	Vec3 n = {particle_state.momentum_x / momentum, particle_state.momentum_y / momentum, particle_state.momentum_z / momentum};
+	Vec3 a = {0, 0, 1};
+
+	if (fabs(n.z) > 0.9)
+		a = {0, 1, 0};
+
+	double an = a.x * n.x + a.y * n.y + a.z * n.z;
+	Vec3 v = {a.x - an * n.x, a.y - an * n.y, a.z - an * n.z};
+	double v_module = vector_module(v.x, v.y, v.z);
+	v = {v.x / v_module, v.y / v_module, v.z / v_module};
+
+	// u = v × n, so (u, v, n) is right handed
+	Vec3 u = {v.y * n.z - v.z * n.y, v.z * n.x - v.x * n.z, v.x * n.y - v.y * n.x};
+
+	Mat3 frame = {{{u.x, u.y, u.z}, {v.x, v.y, v.z}, {n.x, n.y, n.z}}};
+
+	closed_orbit.origin_x			= particle_state.position_x;
+	closed_orbit.origin_y			= particle_state.position_y;
+	closed_orbit.origin_z			= particle_state.position_z;
+	closed_orbit.frame				= frame;
+	closed_orbit.momentum_reference	= momentum;
+}
+
+bool simulate_turn(Simulation& simulation, Pulse& laser, Particle& particle, Laboratory& laboratory, ClosedOrbit& closed_orbit, const double z_in[], double z_out[], string& error, FunctionFieldType function_field)
+{
+	unsigned int interactions = simulation.closed_orbit_interactions > 0 ? simulation.closed_orbit_interactions : laboratory.nodes.size();
+
+	Mat3 frame_t = mat3_transpose(closed_orbit.frame);
+
+	ParticleStateGlobal state;
+	frame_to_global(frame_t, z_in[0], z_in[2], 0, closed_orbit.origin_x, closed_orbit.origin_y, closed_orbit.origin_z, state.position_x, state.position_y, state.position_z);
+
+	Vec3 momentum = frame_to_global(frame_t, z_in[1], z_in[3], closed_orbit.momentum_reference + z_in[5]);
+	state.momentum_x = momentum.x;
+	state.momentum_y = momentum.y;
+	state.momentum_z = momentum.z;
+
+	if (find_node_index_containing(laboratory, state.position_x, state.position_y, state.position_z) >= 0)
+	{
+		error = "The section of the closed orbit must be outside the influence radius of the nodes";
+		return false;
+	}
+
+	Dop853Workspace workspace;
+	dop853_init(workspace, 6, simulation.error_abs, simulation.error_rel, simulation.dense_output);
+
+	FunctionNodeTimeProgress on_node_time_progress = NULL;
+
+	GlobalCoord time = 0;
+	int node_left = -1;
+
+	double velocity_x;
+	double velocity_y;
+	double velocity_z;
+	double steps;
+	double time_entry;
+	int    node_entered;
+
+	for (unsigned int i = 0; i < interactions; i++)
+	{
+		get_free_velocity(particle, state, velocity_x, velocity_y, velocity_z);
+		get_free_motion_end(simulation, laboratory, state, time, velocity_x, velocity_y, velocity_z, node_left, steps, time_entry, node_entered);
+
+		if (node_entered < 0)
+		{
+			error = (bo::format("The closed orbit search lost the particle after %u interactions of %u (try smaller steps or a longer duration)") % i % interactions).str();
+			return false;
+		}
+
+		state.position_x = state.position_x + velocity_x * time_entry;
+		state.position_y = state.position_y + velocity_y * time_entry;
+		state.position_z = state.position_z + velocity_z * time_entry;
+		time = time + time_entry;
+
+		Node& node = laboratory.nodes[node_entered];
+
+		ParticleStateLocal state_local;
+		state_global_to_local(state_local, state, node);
+
+		double local_time;
+
+		if (laser.timing_mode == ENTER)
+			local_time = laser.timing_offset;
+		else
+			local_time = get_timing_local_time(simulation, laser, particle, state_local, node);
+
+		double local_time_enter = local_time;
+
+		SimluationResultNodeSummary summary;
+		simulate_node(simulation, laser, node, particle, state_local, local_time, i, on_node_time_progress, summary, function_field, workspace, RECORD_NONE);
+
+		state_local_to_global(state, state_local, node);
+		time = time + (local_time - local_time_enter);
+		node_left = node_entered;
+	}
+
+	// Free motion until the section
+	get_free_velocity(particle, state, velocity_x, velocity_y, velocity_z);
+
+	Vec3 offset   = frame_to_local(closed_orbit.frame, state.position_x, state.position_y, state.position_z, closed_orbit.origin_x, closed_orbit.origin_y, closed_orbit.origin_z);
+	Vec3 velocity = frame_to_local(closed_orbit.frame, velocity_x, velocity_y, velocity_z);
+
+	double time_section = -offset.z / velocity.z;
+
+	if (!(velocity.z > 0 && time_section >= 0))
+	{
+		error = (bo::format("The particle doesn't cross the section of the closed orbit after %u interactions") % interactions).str();
+		return false;
+	}
+
+	get_free_motion_end(simulation, laboratory, state, time, velocity_x, velocity_y, velocity_z, node_left, steps, time_entry, node_entered);
+
+	if (node_entered >= 0 && time_entry < time_section)
+	{
+		error = (bo::format("The particle enters node %d before the end of the turn: check 'closed_orbit_interactions'") % laboratory.nodes[node_entered].id).str();
+		return false;
+	}
+
+	Vec3 momentum_end = frame_to_local(closed_orbit.frame, state.momentum_x, state.momentum_y, state.momentum_z);
+
+	z_out[0] = offset.x + velocity.x * time_section;
+	z_out[1] = momentum_end.x;
+	z_out[2] = offset.y + velocity.y * time_section;
+	z_out[3] = momentum_end.y;
+	z_out[4] = (double) time + time_section;
+	z_out[5] = momentum_end.z - closed_orbit.momentum_reference;
+
+	return true;
+}
+
+/**
+ * Simulate in parallel the turns starting from z and from z ± h·eᵢ for the given coordinates. The results are in
+ * z_out[0] (central) and z_out[2k + 1], z_out[2k + 2] (k-th coordinate, plus and minus).
+ */
+void simulate_turns_perturbed(Simulation& simulation, Pulse& laser, Particle& particle, Laboratory& laboratory, ClosedOrbit& closed_orbit, const double z[], const vector<unsigned int>& coordinates, const double h[], vector<vector<double>>& z_out, FunctionFieldType function_field)
+{
+	unsigned int turns = 2 * coordinates.size() + 1;
+	z_out.assign(turns, vector<double>(6));
+
+	// exit() can't be called inside the parallel region: the first error is reported after it
+	bool   failed = false;
+	string error;
+
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (unsigned int t = 0; t < turns; t++)
+	{
+		double z_in[6];
+
+		for (unsigned int c = 0; c < 6; c++)
+			z_in[c] = z[c];
+
+		if (t > 0)
+		{
+			unsigned int c = coordinates[(t - 1) / 2];
+			z_in[c] += (t % 2 == 1) ? h[c] : -h[c];
+		}
+
+		string error_turn;
+
+		if (!simulate_turn(simulation, laser, particle, laboratory, closed_orbit, z_in, z_out[t].data(), error_turn, function_field))
+		{
+			#pragma omp critical (closed_orbit_error)
+			if (!failed)
+			{
+				failed = true;
+				error  = error_turn;
+			}
+		}
+	}
+
+	if (failed)
+	{
+		printf("ERROR - %s\n", error.c_str());
+		exit(-8);
+	}
+}
+
+void find_closed_orbit(Simulation& simulation, Pulse& laser_orig, Particle& particle, ParticleStateGlobal& particle_state, Laboratory& laboratory, ClosedOrbit& closed_orbit, FunctionFieldType function_field)
+{
+	// The finite differences need the exact node motions
+	Pulse laser = laser_orig;
+	laser.transfer_map_cache = NULL;
+
+	init_closed_orbit_section(particle_state, closed_orbit);
+
+	double h[6];
+	h[0] = h[2] = simulation.closed_orbit_step_position;
+	h[1] = h[3] = h[5] = simulation.closed_orbit_step_momentum;
+	h[4] = 0;
+
+	double tolerance[4];
+	tolerance[0] = tolerance[2] = simulation.closed_orbit_tolerance_position;
+	tolerance[1] = tolerance[3] = simulation.closed_orbit_tolerance_momentum;
+
+	double z[6] = {0, 0, 0, 0, 0, 0};
+
+	vector<unsigned int>	transverse = {0, 1, 2, 3};
+	vector<vector<double>>	z_out;
+
+	gsl_matrix*      a    = gsl_matrix_alloc(4, 4);
+	gsl_vector*      b    = gsl_vector_alloc(4);
+	gsl_vector*      dz   = gsl_vector_alloc(4);
+	gsl_permutation* perm = gsl_permutation_alloc(4);
+
+	closed_orbit.converged  = false;
+	closed_orbit.iterations = 0;
+	closed_orbit.residuals.clear();
+
+	// Evaluated iterate with the smallest residual, kept if the search doesn't converge
+	double z_best[6];
+	double residual_best  = INFINITY;
+	double turn_time_best = 0;
+
+	for (unsigned int iteration = 0; iteration < simulation.closed_orbit_max_iterations; iteration++)
+	{
+		simulate_turns_perturbed(simulation, laser, particle, laboratory, closed_orbit, z, transverse, h, z_out, function_field);
+
+		double residual = 0;
+		for (unsigned int r = 0; r < 4; r++)
+			residual = max(residual, fabs(z_out[0][r] - z[r]) / tolerance[r]);
+
+		closed_orbit.residuals.push_back(residual);
+		closed_orbit.iterations = iteration + 1;
+
+		if (residual < residual_best)
+		{
+			for (unsigned int c = 0; c < 6; c++)
+				z_best[c] = z[c];
+
+			residual_best  = residual;
+			turn_time_best = z_out[0][4];
+		}
+
+		if (residual <= 1)
+		{
+			closed_orbit.converged = true;
+			break;
+		}
+
+		// (J - I)·Δz = -(M(z) - z)
+		for (unsigned int r = 0; r < 4; r++)
+		{
+			for (unsigned int c = 0; c < 4; c++)
+				gsl_matrix_set(a, r, c, (z_out[2 * c + 1][r] - z_out[2 * c + 2][r]) / (2 * h[c]) - (r == c ? 1 : 0));
+
+			gsl_vector_set(b, r, -(z_out[0][r] - z[r]));
+		}
+
+		int signum;
+		gsl_linalg_LU_decomp(a, perm, &signum);
+
+		// A finite difference Jacobian is almost never exactly singular: a pivot small compared to the largest one
+		// is an almost neutral direction, where the Newton step diverges
+		double pivot_max = 0;
+		for (unsigned int r = 0; r < 4; r++)
+			pivot_max = max(pivot_max, fabs(gsl_matrix_get(a, r, r)));
+
+		bool singular = pivot_max == 0;
+		for (unsigned int r = 0; r < 4; r++)
+			singular |= fabs(gsl_matrix_get(a, r, r)) < CLOSED_ORBIT_PIVOT_RATIO * pivot_max;
+
+		if (singular)
+		{
+			printf("ERROR - The closed orbit search found a singular Jacobian (the orbit is not isolated)\n");
+			exit(-8);
+		}
+
+		gsl_linalg_LU_solve(a, perm, b, dz);
+
+		for (unsigned int r = 0; r < 4; r++)
+			z[r] += gsl_vector_get(dz, r);
+	}
+
+	gsl_permutation_free(perm);
+	gsl_vector_free(dz);
+	gsl_vector_free(b);
+	gsl_matrix_free(a);
+
+	// The last Newton step was never evaluated: no map around a point which is not the orbit
+	if (!closed_orbit.converged)
+	{
+		closed_orbit.turn_time   = turn_time_best;
+		closed_orbit.eigen_valid = false;
+
+		for (unsigned int c = 0; c < 6; c++)
+			closed_orbit.orbit[c] = z_best[c];
+
+		for (unsigned int r = 0; r < 6; r++)
+		{
+			for (unsigned int c = 0; c < 6; c++)
+				closed_orbit.matrix[r][c] = NAN;
+
+			closed_orbit.eigen_real[r] = NAN;
+			closed_orbit.eigen_imag[r] = NAN;
+		}
+
+		return;
+	}
+
+	// Linear map around the orbit. τ doesn't change the motion, so its column is known: ∂τ'/∂τ = 1.
+	vector<unsigned int> coordinates = {0, 1, 2, 3, 5};
+	simulate_turns_perturbed(simulation, laser, particle, laboratory, closed_orbit, z, coordinates, h, z_out, function_field);
+
+	closed_orbit.turn_time = z_out[0][4];
+
+	for (unsigned int c = 0; c < 6; c++)
+		closed_orbit.orbit[c] = z[c];
+
+	for (unsigned int r = 0; r < 6; r++)
+		closed_orbit.matrix[r][4] = (r == 4 ? 1 : 0);
+
+	for (unsigned int k = 0; k < coordinates.size(); k++)
+	{
+		unsigned int c = coordinates[k];
+
+		for (unsigned int r = 0; r < 6; r++)
+			closed_orbit.matrix[r][c] = (z_out[2 * k + 1][r] - z_out[2 * k + 2][r]) / (2 * h[c]);
+	}
+
+	gsl_matrix*                 m    = gsl_matrix_alloc(6, 6);
+	gsl_vector_complex*         eval = gsl_vector_complex_alloc(6);
+	gsl_eigen_nonsymm_workspace* w   = gsl_eigen_nonsymm_alloc(6);
+
+	for (unsigned int r = 0; r < 6; r++)
+		for (unsigned int c = 0; c < 6; c++)
+			gsl_matrix_set(m, r, c, closed_orbit.matrix[r][c]);
+
+	// The QR iteration can fail to converge: the default GSL handler would abort
+	gsl_error_handler_t* handler = gsl_set_error_handler_off();
+	int status = gsl_eigen_nonsymm(m, eval, w);
+	gsl_set_error_handler(handler);
+
+	closed_orbit.eigen_valid = status == GSL_SUCCESS;
+
+	for (unsigned int e = 0; e < 6; e++)
+	{
+		gsl_complex value = gsl_vector_complex_get(eval, e);
+		closed_orbit.eigen_real[e] = closed_orbit.eigen_valid ? GSL_REAL(value) : NAN;
+		closed_orbit.eigen_imag[e] = closed_orbit.eigen_valid ? GSL_IMAG(value) : NAN;
+	}
+
+	gsl_eigen_nonsymm_free(w);
+	gsl_vector_complex_free(eval);
+	gsl_matrix_free(m);
+}
+
+void extrapolate_closed_orbit(ClosedOrbit& closed_orbit, const double z_start[], unsigned int turns, vector<vector<double>>& z_turns)
+{
+	vector<double> dz(6);
+
+	for (unsigned int c = 0; c < 6; c++)
+		dz[c] = z_start[c] - closed_orbit.orbit[c];
+
+	z_turns.clear();
+
+	for (unsigned int k = 0; k <= turns; k++)
+	{
+		vector<double> z(6);
+
+		for (unsigned int c = 0; c < 6; c++)
+			z[c] = closed_orbit.orbit[c] + dz[c];
+
+		z_turns.push_back(z);
+
+		vector<double> dz_next(6, 0);
+
+		for (unsigned int r = 0; r < 6; r++)
+			for (unsigned int c = 0; c < 6; c++)
+				dz_next[r] += closed_orbit.matrix[r][c] * dz[c];
+
+		dz = dz_next;
+	}
+}
@@ -0,0 +1,42 @@
+#include "type.hpp"
+
+#ifndef CIRCLESIM_CLOSED_ORBIT
+#define CIRCLESIM_CLOSED_ORBIT
+
+/**
+ * Closed orbit and one turn map of a circular layout.
+ *
+ * A turn starts on the section (the plane through the initial position of the particle, normal to its initial
+ * momentum n), goes through closed_orbit_interactions node motions and ends when the particle crosses the section
+ * again. On the section the state is described by (x, p_x, y, p_y, τ, δ): position and momentum along the two
+ * directions u, v of the plane, delay of the arrival and momentum along n minus the initial one. A turn is a map
+ * z → M(z) and, since the laser timing is relative to the node entry, it doesn't depend on the starting time
+ * (τ' = τ + T(z) - T₀ where T₀ is the duration of a turn on the closed orbit).
+ *
+ * The closed orbit with the initial momentum (δ = 0) is the fixed point of the transverse part of M, found by Newton
+ * iterations starting from the initial state of the particle:
+ *
+ *   z ← z - (J - I)⁻¹·(M(z) - z)
+ *
+ * The Jacobian J is calculated with central finite differences: the 2·4 perturbed turns and the central one are
+ * simulated in parallel. At the end the 6×6 linearized map is calculated in the same way around the closed orbit: its
+ * eigenvalues on the unit circle e^(±2πiQ) give the tunes Q, and M^k extrapolates k turns near the orbit.
+ *
+ * If the search doesn't converge in closed_orbit_max_iterations the orbit is the evaluated iterate with the smallest
+ * residual, and there is no map (the matrix is NaN and eigen_valid is false).
+ */
+
+void find_closed_orbit(Simulation& simulation, Pulse& laser, Particle& particle, ParticleStateGlobal& particle_state, Laboratory& laboratory, ClosedOrbit& closed_orbit, FunctionFieldType function_field);
+
+/**
+ * Simulate one turn starting from the section coordinates z_in. z_out[4] is the duration of the turn. It runs inside
+ * parallel regions, so a turn that can't be completed returns false with the reason in error instead of exiting.
+ */
+bool simulate_turn(Simulation& simulation, Pulse& laser, Particle& particle, Laboratory& laboratory, ClosedOrbit& closed_orbit, const double z_in[], double z_out[], string& error, FunctionFieldType function_field);
+
+/**
+ * Deviation from the closed orbit after k turns, δz_k = M^k·δz_0 (linear approximation)
+ */
+void extrapolate_closed_orbit(ClosedOrbit& closed_orbit, const double z_start[], unsigned int turns, vector<vector<double>>& z_turns);
+
+#endif
@@ -1,5 +1,6 @@
 #include <libconfig.h++>
 #include <math.h>
+#include <string.h>
 #include <omp.h>
 #include <boost/regex.hpp>
 #include <boost/unordered_map.hpp>
@@ -8,7 +9,11 @@
 #include "config.hpp"
 #include "type.hpp"
 #include "util.hpp"
+#include "unit.hpp"
+#include "frame.hpp"
 #include "response.hpp"
+#include "response_design.hpp"
+#include "sensitivity.hpp"
 
 using namespace libconfig;
 
@@ -33,6 +38,16 @@ bool wrong_param(string param, string message)
 }
 
 
+void inject_laser_strings(string& s, Pulse& laser, string v_attr)
+{
+	for (map<string,string>::iterator	entry = laser.params.params_string.begin(); entry != laser.params.params_string.end(); ++entry)
+	{
+		string value = entry->second;
+		bo::replace_all(value, "\"", "\\\"");
+		s += (bo::format("    const string %s % -12s\t= %s;\n") 		% v_attr % entry->first % value).str();
+	}
+}
+
 void inject_laser_variables(string& s, Pulse& laser, bool hide_unused)
 {
 	
@@ -47,18 +62,53 @@ void inject_laser_variables(string& s, Pulse& laser, bool hide_unused)
 		s += (bo::format("    const long   %s % -12s\t= %l;\n") 		% v_attr % entry->first % entry->second).str();
 	for (map<string,double>::iterator	entry = laser.params.params_float.begin(); entry != laser.params.params_float.end(); ++entry) 
 		s += (bo::format("    const double %s % -12s\t= %.16E;\n") 	% v_attr % entry->first % entry->second).str();
-	for (map<string,string>::iterator	entry = laser.params.params_string.begin(); entry != laser.params.params_string.end(); ++entry)
-	{
-		string value = entry->second;
-		bo::replace_all(value, "\"", "\\\"");
-		s += (bo::format("    const string %s % -12s\t= %s;\n") 		% v_attr % entry->first % value).str();
-	}
 	for (map<string,bool>::iterator	entry = laser.params.params_boolean.begin(); entry != laser.params.params_boolean.end(); ++entry) 
 		s += (bo::format("    const bool   %s % -12s\t= %s;\n") 		% v_attr % entry->first % (entry->second ? "true" : "false")).str();
+	inject_laser_strings(s, laser, v_attr);
 	s += "    // completed\n\n";	
 	
 }
 
+/**
+ * Declare the struct FieldParams with all the laser attributes (except the strings, which are always injected). The
+ * custom functions receive it by pointer instead of the maps of PulseParams, so no lookup is done when they are called.
+ * The offsets of the members are exported in this order: int, int64, float and boolean attributes.
+ */
+void declare_laser_variables(string& s_hpp, string& s_cpp, Pulse& laser)
+{
+	string members = "";
+	string offsets = "";
+	
+	for (map<string,int>::iterator	entry = laser.params.params_int.begin(); entry != laser.params.params_int.end(); ++entry) 
+		members += (bo::format("	int    %s;\n") % entry->first).str();
+	for (map<string,long>::iterator	entry = laser.params.params_int64.begin(); entry != laser.params.params_int64.end(); ++entry) 
+		members += (bo::format("	long   %s;\n") % entry->first).str();
+	for (map<string,double>::iterator	entry = laser.params.params_float.begin(); entry != laser.params.params_float.end(); ++entry) 
+		members += (bo::format("	double %s;\n") % entry->first).str();
+	for (map<string,bool>::iterator	entry = laser.params.params_boolean.begin(); entry != laser.params.params_boolean.end(); ++entry) 
+		members += (bo::format("	bool   %s;\n") % entry->first).str();
+	
+	for (map<string,int>::iterator	entry = laser.params.params_int.begin(); entry != laser.params.params_int.end(); ++entry) 
+		offsets += (bo::format("offsetof(FieldParams, %s), ") % entry->first).str();
+	for (map<string,long>::iterator	entry = laser.params.params_int64.begin(); entry != laser.params.params_int64.end(); ++entry) 
+		offsets += (bo::format("offsetof(FieldParams, %s), ") % entry->first).str();
+	for (map<string,double>::iterator	entry = laser.params.params_float.begin(); entry != laser.params.params_float.end(); ++entry) 
+		offsets += (bo::format("offsetof(FieldParams, %s), ") % entry->first).str();
+	for (map<string,bool>::iterator	entry = laser.params.params_boolean.begin(); entry != laser.params.params_boolean.end(); ++entry) 
+		offsets += (bo::format("offsetof(FieldParams, %s), ") % entry->first).str();
+	
+	s_hpp  = "typedef struct FieldParams\n";
+	s_hpp += "{\n";
+	s_hpp += members;
+	s_hpp += "} FieldParams;\n";
+	s_hpp += "\n";
+	s_hpp += "extern \"C\" const size_t field_params_size;\n";
+	s_hpp += "extern \"C\" const size_t field_params_offsets[];\n";
+	
+	s_cpp  = "const size_t field_params_size      = sizeof(FieldParams);\n";
+	s_cpp += "const size_t field_params_offsets[] = {" + offsets + "0};\n";
+}
+
 void link_laser_variables(string& s, Pulse& laser, bool hide_unused)
 {
 	
@@ -68,19 +118,94 @@ void link_laser_variables(string& s, Pulse& laser, bool hide_unused)
 	
 	s += "    // Linking laser attributes\n";
 	for (map<string,int>::iterator	entry = laser.params.params_int.begin(); entry != laser.params.params_int.end(); ++entry) 
-		s += (bo::format("    const int&    %s % -12s\t= params.params_int.at(\"%s\");\n") 		% v_attr % entry->first % entry->first).str();
+		s += (bo::format("    const int&    %s % -12s\t= params->%s;\n") 		% v_attr % entry->first % entry->first).str();
 	for (map<string,long>::iterator	entry = laser.params.params_int64.begin(); entry != laser.params.params_int64.end(); ++entry) 
-		s += (bo::format("    const long&   %s % -12s\t= params.params_int64.at(\"%s\");\n") 		% v_attr % entry->first % entry->first).str();
+		s += (bo::format("    const long&   %s % -12s\t= params->%s;\n") 		% v_attr % entry->first % entry->first).str();
 	for (map<string,double>::iterator	entry = laser.params.params_float.begin(); entry != laser.params.params_float.end(); ++entry) 
-		s += (bo::format("    const double& %s % -12s\t= params.params_float.at(\"%s\");\n") 	% v_attr % entry->first 	% entry->first).str();
-	for (map<string,string>::iterator	entry = laser.params.params_string.begin(); entry != laser.params.params_string.end(); ++entry)
-		s += (bo::format("    const string& %s % -12s\t= params.params_string.at(\"%s\");\n") 		% v_attr % entry->first % entry->first).str();
+		s += (bo::format("    const double& %s % -12s\t= params->%s;\n") 		% v_attr % entry->first % entry->first).str();
+	for (map<string,bool>::iterator	entry = laser.params.params_boolean.begin(); entry != laser.params.params_boolean.end(); ++entry) 
+		s += (bo::format("    const bool&   %s % -12s\t= params->%s;\n") 		% v_attr % entry->first % entry->first).str();
+	inject_laser_strings(s, laser, v_attr);
+	s += "    // completed\n\n";	
+	
+}
+
+void copy_laser_variables(string& s, Pulse& laser, bool hide_unused)
+{
+	
+	string v_attr = "";
+	if (hide_unused)
+		v_attr = "__attribute__ ((unused))";
+	
+	s += "    // Copying laser attributes\n";
+	for (map<string,int>::iterator	entry = laser.params.params_int.begin(); entry != laser.params.params_int.end(); ++entry) 
+		s += (bo::format("    const int    %s % -12s\t= params->%s;\n") 		% v_attr % entry->first % entry->first).str();
+	for (map<string,long>::iterator	entry = laser.params.params_int64.begin(); entry != laser.params.params_int64.end(); ++entry) 
+		s += (bo::format("    const long   %s % -12s\t= params->%s;\n") 		% v_attr % entry->first % entry->first).str();
+	for (map<string,double>::iterator	entry = laser.params.params_float.begin(); entry != laser.params.params_float.end(); ++entry) 
+		s += (bo::format("    const double %s % -12s\t= params->%s;\n") 		% v_attr % entry->first % entry->first).str();
 	for (map<string,bool>::iterator	entry = laser.params.params_boolean.begin(); entry != laser.params.params_boolean.end(); ++entry) 
-		s += (bo::format("    const bool&   %s % -12s\t= params.params_boolean.at(\"%s\");\n") 		% v_attr % entry->first % entry->first).str();
+		s += (bo::format("    const bool   %s % -12s\t= params->%s;\n") 		% v_attr % entry->first % entry->first).str();
+	inject_laser_strings(s, laser, v_attr);
 	s += "    // completed\n\n";	
 	
 }
 
+/**
+ * As copy_laser_variables, but the float attributes of laser.sensitivity_params are the dual variables of field_dual
+ * (after t, x, y, z). The result is compiled with double defined as Dual (see script.cpp).
+ */
+void seed_laser_variables(string& s, Pulse& laser)
+{
+	
+	string v_attr = "__attribute__ ((unused))";
+	
+	s += "    // Seeding laser attributes\n";
+	for (map<string,int>::iterator	entry = laser.params.params_int.begin(); entry != laser.params.params_int.end(); ++entry) 
+		s += (bo::format("    const int    %s % -12s\t= params->%s;\n") 		% v_attr % entry->first % entry->first).str();
+	for (map<string,long>::iterator	entry = laser.params.params_int64.begin(); entry != laser.params.params_int64.end(); ++entry) 
+		s += (bo::format("    const long   %s % -12s\t= params->%s;\n") 		% v_attr % entry->first % entry->first).str();
+	for (map<string,double>::iterator	entry = laser.params.params_float.begin(); entry != laser.params.params_float.end(); ++entry) 
+	{
+		vector<string>::iterator seeded = find(laser.sensitivity_params.begin(), laser.sensitivity_params.end(), entry->first);
+		
+		if (seeded != laser.sensitivity_params.end())
+			s += (bo::format("    const double %s % -12s\t= dual_variable(params->%s, %u);\n") 	% v_attr % entry->first % entry->first % (TANGENT_DUAL_SPACE + (seeded - laser.sensitivity_params.begin()))).str();
+		else
+			s += (bo::format("    const double %s % -12s\t= params->%s;\n") 		% v_attr % entry->first % entry->first).str();
+	}
+	for (map<string,bool>::iterator	entry = laser.params.params_boolean.begin(); entry != laser.params.params_boolean.end(); ++entry) 
+		s += (bo::format("    const bool   %s % -12s\t= params->%s;\n") 		% v_attr % entry->first % entry->first).str();
+	inject_laser_strings(s, laser, v_attr);
+	s += "    // completed\n\n";	
+	
+}
+
+/**
+ * Fill laser.params_data (the FieldParams struct of the custom library) with the laser attributes. The offsets are
+ * the ones exported by the library, in the same order used by declare_laser_variables.
+ */
+void init_laser_params_data(Pulse& laser, size_t size, const size_t offsets[])
+{
+	laser.params_data.assign(size / sizeof(double) + 1, 0);
+	laser.params_offsets.clear();
+	
+	char* data = (char*) laser.params_data.data();
+	unsigned int k = 0;
+	
+	for (map<string,int>::iterator	entry = laser.params.params_int.begin(); entry != laser.params.params_int.end(); ++entry) 
+		memcpy(data + offsets[k++], &entry->second, sizeof(int));
+	for (map<string,long>::iterator	entry = laser.params.params_int64.begin(); entry != laser.params.params_int64.end(); ++entry) 
+		memcpy(data + offsets[k++], &entry->second, sizeof(long));
+	for (map<string,double>::iterator	entry = laser.params.params_float.begin(); entry != laser.params.params_float.end(); ++entry) 
+	{
+		laser.params_offsets[entry->first] = offsets[k];
+		memcpy(data + offsets[k++], &entry->second, sizeof(double));
+	}
+	for (map<string,bool>::iterator	entry = laser.params.params_boolean.begin(); entry != laser.params.params_boolean.end(); ++entry) 
+		memcpy(data + offsets[k++], &entry->second, sizeof(bool));
+}
+
 void init_position_and_momentum(Parameters& parameters, Particle& particle, Laboratory& laboratory, ParticleStateGlobal& state_global)
 {
 
@@ -91,13 +216,21 @@ void init_position_and_momentum(Parameters& parameters, Particle& particle, Labo
 	}
 	else if (parameters.has_position_sphe)
 	{
-		spherical_to_cartesian<long double>(
+		double position_x;
+		double position_y;
+		double position_z;
+		
+		spherical_to_cartesian<double>(
 			parameters.initial_position_rho / AU_LENGTH,
 			parameters.initial_position_theta,
 			parameters.initial_position_phi,
-			state_global.position_x,
-			state_global.position_y,
-			state_global.position_z);
+			position_x,
+			position_y,
+			position_z);
+		
+		state_global.position_x = position_x;
+		state_global.position_y = position_y;
+		state_global.position_z = position_z;
 	}
 	else if (parameters.has_position_cart)
 	{
@@ -165,7 +298,7 @@ void init_position_and_momentum(Parameters& parameters, Particle& particle, Labo
 	}
 }
 
-void read_config_renders(Setting* field_renders_config, vector<FieldRender>& renders, vector<string>& headers, vector<string>& sources, Pulse& laser)
+void read_config_renders(Setting* field_renders_config, vector<FieldRender>& renders, CustomScripts& scripts, Pulse& laser)
 {
 	try 
 	{
@@ -251,7 +384,7 @@ void read_config_renders(Setting* field_renders_config, vector<FieldRender>& ren
 			if (!render_config.exists("formula")) missing_param("formula");
 			
 			
-			headers.push_back((bo::format("extern \"C\" vector<double> func_field_render_%s(double t, double x, double y, double z);") % render.id).str());
+			scripts.headers.push_back((bo::format("extern \"C\" vector<double> func_field_render_%s(double t, double x, double y, double z);") % render.id).str());
 			
 			string s = (bo::format("vector<double> func_field_render_%s(double t, double x, double y, double z)\n") % render.id).str();
 			s += "{\n";
@@ -276,7 +409,7 @@ void read_config_renders(Setting* field_renders_config, vector<FieldRender>& ren
 			s += (bo::format("%s\n") % (formula)).str();
 			s += "}\n";
 				
-			sources.push_back(s);
+			scripts.renders.push_back(s);
 			
 
 
@@ -292,35 +425,11 @@ void read_config_renders(Setting* field_renders_config, vector<FieldRender>& ren
 	}
 }
 
-double get_conversion_si(string type)
-{
-	if (type == "MASS") 				return AU_MASS;
-	if (type == "LENGTH")				return AU_LENGTH;
-	if (type == "CHARGE")				return AU_CHARGE;
-	if (type == "ENERGY")				return AU_ENERGY;
-	if (type == "TIME")					return AU_TIME;
-	if (type == "FREQUENCY")			return 1.d;
-	if (type == "PULSATION")			return 1.d;
-	if (type == "SPEED")				return AU_SPEED;
-	if (type == "FORCE")				return AU_FORCE;
-	if (type == "ELECTRIC_FIELD")		return AU_ELECTRIC_FIELD;
-	if (type == "ELECTRIC_POTENTIAL")	return AU_ELECTRIC_POTENTIAL;
-	if (type == "MOMENTUM")				return AU_MOMENTUM;
-	if (type == "MAGNETIC_FIELD")		return AU_MAGNETIC_FIELD;
-	if (type == "ANGLE")				return 1.d;
-	if (type == "PERCENTUAL")			return 1.d;
-	if (type == "PURE_FLOAT")			return 1.d;
-	if (type == "PURE_INT")				return 1.d;
-	if (type == "IGNORE")				return 1.d;
-	if (type == "IGNORE_START")			return 1.d;
-	if (type == "IGNORE_END")			return 1.d;
-	
-	printf("Unable to find the conversion for unit: %s\n", type.c_str());
-	exit(-1);
-}
-
+/**
+ * Read the config already converted to SI units (see convert_config_units)
+ */
 void read_config(
-	fs::path& cfg_file,
+	const string& cfg_si,
 	Simulation& simulation,
 	Pulse& laser,
 	Particle& particle,
@@ -328,8 +437,7 @@ void read_config(
 	Laboratory& laboratory,
 	vector<FieldRender>&      field_renders,
 	vector<ResponseAnalysis>& response_analyses,
-	vector<string>& headers,
-	vector<string>& sources)
+	CustomScripts& scripts)
 {
 	Parameters parameters;
 	
@@ -346,7 +454,7 @@ void read_config(
 	// Read the file. If there is an error, report it and exit.
 	try 
 	{
-		config->readFile(cfg_file.c_str());
+		config->readString(cfg_si);
 
 		Setting&  config_simulation	 		= config->lookup("simulation");
 		Setting&  config_laser 				= config->lookup("laser");
@@ -356,6 +464,9 @@ void read_config(
 
 		config_laser.lookupValue			("func_fields",	parameters.func_fields)		|| missing_param("func_fields");
 		
+		parameters.func_envelope = "";
+		config_laser.lookupValue			("func_envelope",	parameters.func_envelope);
+		
 		static const bo::regex e("^func_param_([A-Za-z\\_0-9]+)$");
 		for (int i = 0; i < config_laser.getLength(); i++)
 		{
@@ -398,6 +509,9 @@ void read_config(
 
 		config_laser.lookupValue			("timing_mode",  				parameters.timing_mode)				|| missing_param("timing_mode");
 		config_laser.lookupValue			("timing_offset",  				parameters.timing_offset)			|| missing_param("timing_offset");
+		
+		parameters.timing_sampled = false;
+		config_laser.lookupValue			("timing_sampled",  			parameters.timing_sampled);
 
 		config_particle.lookupValue			("rest_mass",  				parameters.rest_mass)					|| missing_param("rest_mass");
 		config_particle.lookupValue			("charge",  				parameters.charge)						|| missing_param("charge");
@@ -456,6 +570,112 @@ void read_config(
 		config_simulation.lookupValue	("basename",  				parameters.basename)				|| missing_param("basename");
 		config_simulation.lookupValue	("error_abs",  				parameters.error_abs)				|| missing_param("error_abs");
 		config_simulation.lookupValue	("error_rel",  				parameters.error_rel)				|| missing_param("error_rel");
+		
+		parameters.integrator = "gsl";
+		config_simulation.lookupValue	("integrator",  			parameters.integrator);
+		
+		parameters.dense_output = false;
+		config_simulation.lookupValue	("dense_output",  			parameters.dense_output);
+		
+		parameters.pusher_substeps = 1;
+		config_simulation.lookupValue	("pusher_substeps",  		parameters.pusher_substeps);
+		
+		parameters.field_cache = false;
+		config_simulation.lookupValue	("field_cache",  			parameters.field_cache);
+		
+		if (parameters.field_cache)
+		{
+			config_simulation.lookupValue	("field_cache_space_resolution",	parameters.field_cache_space_resolution)	|| missing_param("field_cache_space_resolution");
+			config_simulation.lookupValue	("field_cache_time_resolution",		parameters.field_cache_time_resolution)		|| missing_param("field_cache_time_resolution");
+			config_simulation.lookupValue	("field_cache_time_start",			parameters.field_cache_time_start)			|| missing_param("field_cache_time_start");
+			config_simulation.lookupValue	("field_cache_time_end",			parameters.field_cache_time_end)			|| missing_param("field_cache_time_end");
+			config_simulation.lookupValue	("field_cache_error",				parameters.field_cache_error)				|| missing_param("field_cache_error");
+		}
+		
+		parameters.ensemble = false;
+		config_simulation.lookupValue	("ensemble",  				parameters.ensemble);
+		
+		if (parameters.ensemble)
+		{
+			parameters.ensemble_file = "";
+			config_simulation.lookupValue	("ensemble_file",					parameters.ensemble_file);
+			
+			if (parameters.ensemble_file == "")
+			{
+				parameters.ensemble_seed = 1;
+				config_simulation.lookupValue	("ensemble_seed",					parameters.ensemble_seed);
+				
+				config_simulation.lookupValue	("ensemble_count",					parameters.ensemble_count)				|| missing_param("ensemble_count");
+				config_simulation.lookupValue	("ensemble_position_sigma_x",		parameters.ensemble_position_sigma_x)	|| missing_param("ensemble_position_sigma_x");
+				config_simulation.lookupValue	("ensemble_position_sigma_y",		parameters.ensemble_position_sigma_y)	|| missing_param("ensemble_position_sigma_y");
+				config_simulation.lookupValue	("ensemble_position_sigma_z",		parameters.ensemble_position_sigma_z)	|| missing_param("ensemble_position_sigma_z");
+				config_simulation.lookupValue	("ensemble_momentum_sigma_x",		parameters.ensemble_momentum_sigma_x)	|| missing_param("ensemble_momentum_sigma_x");
+				config_simulation.lookupValue	("ensemble_momentum_sigma_y",		parameters.ensemble_momentum_sigma_y)	|| missing_param("ensemble_momentum_sigma_y");
+				config_simulation.lookupValue	("ensemble_momentum_sigma_z",		parameters.ensemble_momentum_sigma_z)	|| missing_param("ensemble_momentum_sigma_z");
+			}
+		}
+		
+		parameters.space_charge = false;
+		config_simulation.lookupValue	("space_charge",  			parameters.space_charge);
+		
+		if (parameters.space_charge)
+		{
+			parameters.space_charge_opening_angle = 0.5;
+			parameters.space_charge_softening     = 0;
+			
+			config_simulation.lookupValue	("space_charge_bunch_charge",		parameters.space_charge_bunch_charge)	|| missing_param("space_charge_bunch_charge");
+			config_simulation.lookupValue	("space_charge_opening_angle",		parameters.space_charge_opening_angle);
+			config_simulation.lookupValue	("space_charge_softening",			parameters.space_charge_softening);
+		}
+		
+		parameters.transfer_map_cache = false;
+		config_simulation.lookupValue	("transfer_map_cache",  	parameters.transfer_map_cache);
+		
+		if (parameters.transfer_map_cache)
+		{
+			config_simulation.lookupValue	("transfer_map_cache_position_resolution",	parameters.transfer_map_cache_position_resolution)	|| missing_param("transfer_map_cache_position_resolution");
+			config_simulation.lookupValue	("transfer_map_cache_momentum_resolution",	parameters.transfer_map_cache_momentum_resolution)	|| missing_param("transfer_map_cache_momentum_resolution");
+			config_simulation.lookupValue	("transfer_map_cache_time_resolution",		parameters.transfer_map_cache_time_resolution)		|| missing_param("transfer_map_cache_time_resolution");
+			config_simulation.lookupValue	("transfer_map_cache_error_position",		parameters.transfer_map_cache_error_position)		|| missing_param("transfer_map_cache_error_position");
+			config_simulation.lookupValue	("transfer_map_cache_error_momentum",		parameters.transfer_map_cache_error_momentum)		|| missing_param("transfer_map_cache_error_momentum");
+		}
+		
+		parameters.closed_orbit = false;
+		config_simulation.lookupValue	("closed_orbit",  			parameters.closed_orbit);
+		
+		if (parameters.closed_orbit)
+		{
+			parameters.closed_orbit_interactions   = 0;
+			parameters.closed_orbit_max_iterations = 20;
+			parameters.closed_orbit_turns          = 0;
+			
+			config_simulation.lookupValue	("closed_orbit_interactions",			parameters.closed_orbit_interactions);
+			config_simulation.lookupValue	("closed_orbit_max_iterations",			parameters.closed_orbit_max_iterations);
+			config_simulation.lookupValue	("closed_orbit_tolerance_position",		parameters.closed_orbit_tolerance_position)	|| missing_param("closed_orbit_tolerance_position");
+			config_simulation.lookupValue	("closed_orbit_tolerance_momentum",		parameters.closed_orbit_tolerance_momentum)	|| missing_param("closed_orbit_tolerance_momentum");
+			config_simulation.lookupValue	("closed_orbit_step_position",			parameters.closed_orbit_step_position)		|| missing_param("closed_orbit_step_position");
+			config_simulation.lookupValue	("closed_orbit_step_momentum",			parameters.closed_orbit_step_momentum)		|| missing_param("closed_orbit_step_momentum");
+			config_simulation.lookupValue	("closed_orbit_turns",					parameters.closed_orbit_turns);
+		}
+		
+		parameters.ponderomotive = false;
+		config_simulation.lookupValue	("ponderomotive",  			parameters.ponderomotive);
+		
+		if (parameters.ponderomotive)
+		{
+			parameters.ponderomotive_samples		= 16;
+			parameters.ponderomotive_max_a0			= 0.1;
+			parameters.ponderomotive_max_gradient	= 0.05;
+			parameters.ponderomotive_validation		= false;
+			
+			config_simulation.lookupValue	("ponderomotive_wavelength",		parameters.ponderomotive_wavelength)	|| missing_param("ponderomotive_wavelength");
+			config_simulation.lookupValue	("ponderomotive_time_step",			parameters.ponderomotive_time_step)		|| missing_param("ponderomotive_time_step");
+			config_simulation.lookupValue	("ponderomotive_samples",			parameters.ponderomotive_samples);
+			config_simulation.lookupValue	("ponderomotive_max_a0",			parameters.ponderomotive_max_a0);
+			config_simulation.lookupValue	("ponderomotive_max_gradient",		parameters.ponderomotive_max_gradient);
+			config_simulation.lookupValue	("ponderomotive_validation",		parameters.ponderomotive_validation);
+		}
+		
 		config_simulation.lookupValue	("time_resolution_laser",	parameters.time_resolution_laser)	|| missing_param("time_resolution_laser");
 		config_simulation.lookupValue	("time_resolution_free",	parameters.time_resolution_free)	|| missing_param("time_resolution_free");
 		config_simulation.lookupValue	("duration",  				parameters.simulation_duration)		|| missing_param("duration (simulation)");
@@ -463,9 +683,23 @@ void read_config(
 		config_simulation.lookupValue	("labmap_max_size",  		parameters.labmap_max_size)			|| missing_param("labmap_max_size");
 		config_simulation.lookupValue	("labmap_full",  			parameters.labmap_full)				|| missing_param("labmap_full");
 		config_simulation.lookupValue	("func_commons",  			parameters.func_commons)			|| missing_param("func_commons");
+		
+		parameters.func_fast_math = false;
+		config_simulation.lookupValue	("func_fast_math",  		parameters.func_fast_math);
 
 		config_response_analyses.lookupValue ("enabled",  			parameters.response_analyses_enabled)	|| missing_param("response_analyses_enabled");
 		
+		parameters.response_analyses_seed = 1;
+		config_response_analyses.lookupValue ("seed",  				parameters.response_analyses_seed);
+		
+		parameters.response_analyses_adaptive_steps     = 16;
+		parameters.response_analyses_adaptive_tolerance = 0.01;
+		config_response_analyses.lookupValue ("adaptive_steps",  		parameters.response_analyses_adaptive_steps);
+		config_response_analyses.lookupValue ("adaptive_tolerance",  	parameters.response_analyses_adaptive_tolerance);
+		
+		parameters.response_analyses_sensitivity = false;
+		config_response_analyses.lookupValue ("sensitivity",  		parameters.response_analyses_sensitivity);
+		
 		static const bo::regex e_node("^node\\_([0-9]+)$");
 		for (int i = 0; i < config_laboratory.getLength(); i++)
 		{
@@ -494,7 +728,7 @@ void read_config(
 				node.position_y = position_y;
 				node.position_z = position_z;
 				
-				node.axis = mat(3, 3, fill::eye);
+				node.axis = mat3_identity();
 				
 				double theta;
 				double phi;
@@ -519,12 +753,15 @@ void read_config(
 				if (abs(node.axis(1,2)) < 1E-15)  node.axis(1,2) =  0; 
 				if (abs(node.axis(2,2)) < 1E-15)  node.axis(2,2) =  0; 
 				
+				node.axis_t = mat3_transpose(node.axis);
+				
 				laboratory.nodes.push_back(node);
 			}
 		}
 		
 		static const bo::regex e_resp1("^analysis\\_([0-9]+)$");
-		static const bo::regex e_resp2("^\\s*analyze\\s+([a-zA-Z\\_\\s,]+)\\s+when\\s+([a-zA-Z\\_]+)\\s+([a-zA-Z\\_]+)\\s+([a-zA-Z\\_]+)\\s+changes\\s+(by\\s+([-+]?[0-9]*\\.?[0-9]+([eE][-+]?[0-9]+)?)\\s*(\\%?))?(between\\s+([-+]?[0-9]*\\.?[0-9]+([eE][-+]?[0-9]+)?)\\s*(\\%?)\\s+and\\s+([-+]?[0-9]*\\.?[0-9]+([eE][-+]?[0-9]+)?)\\s*(\\%?))?\\s+in\\s+([0-9]+)\\s+steps\\s*$");
+		static const bo::regex e_resp2("^\\s*analyze\\s+([a-zA-Z\\_\\s,]+)\\s+when\\s+(.+?)\\s+in\\s+([0-9]+)\\s+steps(\\s+with\\s+([a-zA-Z\\_\\s]+?)\\s+design)?\\s*$");
+		static const bo::regex e_resp3("^\\s*([a-zA-Z\\_]+)\\s+([a-zA-Z\\_]+)\\s+(([a-zA-Z\\_]+)\\s+)?changes\\s+(by\\s+([-+]?[0-9]*\\.?[0-9]+([eE][-+]?[0-9]+)?)\\s*(\\%?))?(between\\s+([-+]?[0-9]*\\.?[0-9]+([eE][-+]?[0-9]+)?)\\s*(\\%?)\\s+and\\s+([-+]?[0-9]*\\.?[0-9]+([eE][-+]?[0-9]+)?)\\s*(\\%?))?\\s*$");
 		
 		for (int i = 0; i < config_response_analyses.getLength(); i++)
 		{
@@ -542,6 +779,10 @@ void read_config(
 					ResponseAnalysis response_analysis;
 					response_analysis.id = stoi(what1[1]);
 					response_analysis.enabled = parameters.response_analyses_enabled;
+					response_analysis.seed    = parameters.response_analyses_seed;
+					response_analysis.adaptive_steps     = parameters.response_analyses_adaptive_steps;
+					response_analysis.adaptive_tolerance = parameters.response_analyses_adaptive_tolerance;
+					response_analysis.sensitivity        = parameters.response_analyses_sensitivity;
 					
 					string last_object = "";
 					
@@ -587,66 +828,172 @@ void read_config(
 						}
 					}
 					
-					response_analysis.object_in		= what2[2];
-					response_analysis.attribute_in	= what2[3];
-					
-					if (what2[4] == "linearly")
-						response_analysis.change_type		= LINEAR;
-					else if (what2[4] == "randomly")
-						response_analysis.change_type		= RANDOM;
-					else
-					{
-						printf("ERROR - Wrong value for '%s' expression. Allowed mode are: 'linerly' or 'randomly' but '%s' was found.\n", config_analysis.getName(), string(what2[4]).c_str());
-						exit(-1);
-						return;	
-					}
+					for (unsigned int o = 0; o < response_analysis.attribute_out.size(); o++)
+						response_analysis.attribute_out_id.push_back(get_attribute_id(response_analysis.object_out[o], response_analysis.attribute_out[o]));
 					
+					// The inputs are separated by commas: <object> <attribute> [linearly|randomly] changes <by|between>
+					string inputs_str = what2[2];
+					vector<string> inputs;
+					string change_mode = "";
 					
-					if (what2[5] != "" && what2[9] == "")
+					bo::split(inputs, inputs_str, bo::is_any_of(","));
+					for (string input_str: inputs)
 					{
-						if (what2[8] == "%")
+						bo::match_results<string::const_iterator> what3;
+						if (!bo::regex_match(input_str, what3, e_resp3))
 						{
-							response_analysis.value_type    = PERCENTUAL;
-							response_analysis.change_from	= -stod(what2[6]) / 100.d;
-							response_analysis.change_to		= +stod(what2[6]) / 100.d;
+							printf("ERROR - Error parsing the input '%s' of %s. Expected format <object> <attribute> changes by <value> or <object> <attribute> changes between <value_1> and <value_2>\n", input_str.c_str(), config_analysis.getName());
+							exit(-1);
+							return;
 						}
-						else
+						
+						ResponseInput input;
+						input.object		= what3[1];
+						input.attribute		= what3[2];
+						input.attribute_id	= get_attribute_id(input.object, input.attribute);
+						
+						string input_mode = what3[4] == "" ? "linearly" : string(what3[4]);
+						
+						if (input_mode != "linearly" && input_mode != "randomly")
 						{
-							response_analysis.value_type    = VALUE_RELATIVE;
-							response_analysis.change_from	= -stod(what2[6]) / get_conversion_si_value(response_analysis.object_in, response_analysis.attribute_in);
-							response_analysis.change_to		= +stod(what2[6]) / get_conversion_si_value(response_analysis.object_in, response_analysis.attribute_in);
+							printf("ERROR - Wrong value for '%s' expression. Allowed mode are: 'linerly' or 'randomly' but '%s' was found.\n", config_analysis.getName(), input_mode.c_str());
+							exit(-1);
+							return;	
 						}
-					}
-					else if (what2[5] == "" && what2[9] != "")
-					{
-						if (what2[12] == "%" && what2[15] == "%")
+						
+						if (what3[4] != "" && what2[4] != "")
+						{
+							printf("ERROR - Error in %s syntax: the inputs can't have a change mode ('%s') when the design is given.\n", config_analysis.getName(), input_mode.c_str());
+							exit(-1);
+							return;
+						}
+						
+						if (change_mode != "" && change_mode != input_mode)
+						{
+							printf("ERROR - Error in %s syntax: all the inputs must change in the same way (linearly or randomly).\n", config_analysis.getName());
+							exit(-1);
+							return;
+						}
+						change_mode = input_mode;
+						
+						for (ResponseInput& other: response_analysis.inputs)
 						{
-							response_analysis.value_type    = PERCENTUAL;
-							response_analysis.change_from	= stod(what2[10]) / 100.d;
-							response_analysis.change_to		= stod(what2[13]) / 100.d;
+							if (other.object == input.object && other.attribute == input.attribute)
+							{
+								printf("ERROR - Error in %s syntax: the input %s %s is repeated.\n", config_analysis.getName(), input.object.c_str(), input.attribute.c_str());
+								exit(-1);
+								return;
+							}
 						}
-						else if (what2[12] == "" && what2[15] == "")
+						
+						if (what3[5] != "" && what3[9] == "")
 						{
-							response_analysis.value_type    = VALUE_ABSOLUTE;
-							response_analysis.change_from	= stod(what2[10]) / get_conversion_si_value(response_analysis.object_in, response_analysis.attribute_in);
-							response_analysis.change_to		= stod(what2[13]) / get_conversion_si_value(response_analysis.object_in, response_analysis.attribute_in);
+							if (what3[8] == "%")
+							{
+								input.value_type    = PERCENTUAL;
+								input.change_from	= -stod(what3[6]) / 100.d;
+								input.change_to		= +stod(what3[6]) / 100.d;
+							}
+							else
+							{
+								input.value_type    = VALUE_RELATIVE;
+								input.change_from	= -stod(what3[6]) / get_conversion_si_value(input.attribute_id);
+								input.change_to		= +stod(what3[6]) / get_conversion_si_value(input.attribute_id);
+							}
+						}
+						else if (what3[5] == "" && what3[9] != "")
+						{
+							if (what3[12] == "%" && what3[15] == "%")
+							{
+								input.value_type    = PERCENTUAL;
+								input.change_from	= stod(what3[10]) / 100.d;
+								input.change_to		= stod(what3[13]) / 100.d;
+							}
+							else if (what3[12] == "" && what3[15] == "")
+							{
+								input.value_type    = VALUE_ABSOLUTE;
+								input.change_from	= stod(what3[10]) / get_conversion_si_value(input.attribute_id);
+								input.change_to		= stod(what3[13]) / get_conversion_si_value(input.attribute_id);
+							}
+							else
+							{
+								printf("ERROR - Error in %s syntax: when using between, both elements must be percentual or absolute values.\n", config_analysis.getName());
+								exit(-1);
+								return;
+							}
 						}
 						else
 						{
-							printf("ERROR - Error in %s syntax: when using between, both elements must be percentual or absolute values.\n", config_analysis.getName());
+							printf("ERROR - Error in %s syntax: we must have one 'by' clause or 'between' clause.\n", config_analysis.getName());
 							exit(-1);
 							return;
 						}
+						
+						response_analysis.inputs.push_back(input);
 					}
+					
+					string design = bo::regex_replace(string(what2[5]), bo::regex("[[:blank:]]+"), " ");
+					
+					if (design == "")
+						response_analysis.change_type = change_mode == "randomly" ? RANDOM : LINEAR;
+					else if (design == "grid")
+						response_analysis.change_type = LINEAR;
+					else if (design == "random")
+						response_analysis.change_type = RANDOM;
+					else if (design == "latin hypercube")
+						response_analysis.change_type = LATIN_HYPERCUBE;
+					else if (design == "sobol")
+						response_analysis.change_type = SOBOL;
+					else if (design == "adaptive")
+						response_analysis.change_type = ADAPTIVE;
 					else
 					{
-						printf("ERROR - Error in %s syntax: we must have one 'by' clause or 'between' clause.\n", config_analysis.getName());
+						printf("ERROR - Wrong design '%s' for '%s' expression. Allowed designs are: 'grid', 'random', 'latin hypercube', 'sobol' or 'adaptive'.\n", design.c_str(), config_analysis.getName());
+						exit(-1);
+						return;
+					}
+					
+					if (response_analysis.change_type == SOBOL && response_analysis.inputs.size() > RESPONSE_SOBOL_DIMENSIONS)
+					{
+						printf("ERROR - Error in %s: the sobol design supports up to %u inputs.\n", config_analysis.getName(), RESPONSE_SOBOL_DIMENSIONS);
 						exit(-1);
 						return;
 					}
 					
+					response_analysis.steps	= stoi(what2[3]);
 					
-					response_analysis.steps	= stoi(what2[16]);
+					// The grid takes the steps along every input
+					double samples = response_analysis.change_type == LINEAR ? pow(response_analysis.steps, response_analysis.inputs.size()) : response_analysis.steps;
+					
+					if (response_analysis.steps == 0 || samples > UINT_MAX)
+					{
+						printf("ERROR - Error in %s: wrong number of steps (%u steps for %lu inputs).\n", config_analysis.getName(), response_analysis.steps, response_analysis.inputs.size());
+						exit(-1);
+						return;
+					}
+					
+					response_analysis.samples = (unsigned int) samples;
+					
+					// The derivatives come from a single simulation at the nominal inputs
+					if (response_analysis.sensitivity)
+						response_analysis.samples = 1;
+					
+					if (response_analysis.change_type == ADAPTIVE)
+					{
+						if (response_analysis.inputs.size() != 1)
+						{
+							printf("ERROR - Error in %s: the adaptive design supports a single input.\n", config_analysis.getName());
+							exit(-1);
+							return;
+						}
+						
+						if (response_analysis.adaptive_steps == 0 || response_analysis.steps < response_analysis.adaptive_steps + 1)
+						{
+							printf("ERROR - Error in %s: the adaptive design needs at least adaptive_steps + 1 = %u steps.\n", config_analysis.getName(), response_analysis.adaptive_steps + 1);
+							exit(-1);
+							return;
+						}
+					}
 					response_analyses.push_back(response_analysis);
 				}
 				else
@@ -657,13 +1004,15 @@ void read_config(
 					printf("  analyze particle <attribute> when <object> <attribute> randomly changes by <value> in <n> steps\n");
 					printf("  analyze particle <attribute> when <object> <attribute> linearly changes between <value_1> and <value_2> in <n> steps\n");
 					printf("  analyze particle <attribute> when <object> <attribute> randomly changes between <value_1> and <value_2> in <n> steps\n");
+					printf("  analyze particle <attribute> when <object> <attribute> changes by <value>, <object> <attribute> changes between <value_1> and <value_2>, ... in <n> steps with <grid|random|latin hypercube|sobol> design\n");
+					printf("  analyze particle <attribute> when <object> <attribute> changes by <value> in <n> steps with adaptive design\n");
 					printf("Provided format was:\n");
 					printf("  %s\n", analysis_expression.c_str());
 					exit(-1);
 					return;
 				}
 			}
-			else if (string(config_analysis.getName()) != "enabled")
+			else if (string(config_analysis.getName()) != "enabled" && string(config_analysis.getName()) != "seed" && string(config_analysis.getName()) != "adaptive_steps" && string(config_analysis.getName()) != "adaptive_tolerance" && string(config_analysis.getName()) != "sensitivity")
 			{
 				printf("ERROR - Wrong '%s' parameter name. Allowed format is: analysis_<1-9999>\n", config_analysis.getName());
 				exit(-1);
@@ -675,7 +1024,7 @@ void read_config(
 	}
 	catch (ParseException& e)  
 	{
-		printf("Error while reading configuration file: %s\n", e.getFile());
+		printf("Error while reading configuration file: %s\n", e.getFile() != NULL ? e.getFile() : "(converted to SI)");
 		printf("Line %d: %s\n", e.getLine(), e.getError());
 		exit(-1);
 	}
@@ -686,6 +1035,218 @@ void read_config(
 	simulation.basename 				= parameters.basename;
 	simulation.error_abs				= parameters.error_abs;
 	simulation.error_rel				= parameters.error_rel;
+	
+	if (parameters.integrator == "gsl")
+		simulation.integrator = RK8PD;
+	else if (parameters.integrator == "dop853")
+		simulation.integrator = DOP853;
+	else if (parameters.integrator == "boris")
+		simulation.integrator = BORIS;
+	else if (parameters.integrator == "vay")
+		simulation.integrator = VAY;
+	else if (parameters.integrator == "higuera_cary")
+		simulation.integrator = HIGUERA_CARY;
+	else
+	{
+		printf("ERROR - integrator has unknown values. Allowed values are: gsl, dop853, boris, vay, higuera_cary'\n");
+		exit(-1);
+		return;
+	}
+	
+	simulation.dense_output = parameters.dense_output;
+	
+	if (simulation.dense_output && simulation.integrator != DOP853)
+	{
+		printf("ERROR - 'dense_output' is available only with the dop853 integrator\n");
+		exit(-1);
+		return;
+	}
+	
+	simulation.pusher_substeps = parameters.pusher_substeps;
+	
+	if (simulation.pusher_substeps == 0)
+	{
+		printf("ERROR - 'pusher_substeps' must be at least 1\n");
+		exit(-1);
+		return;
+	}
+	
+	simulation.field_cache = parameters.field_cache;
+	
+	if (simulation.field_cache)
+	{
+		simulation.field_cache_space_resolution	= parameters.field_cache_space_resolution	/ AU_LENGTH;
+		simulation.field_cache_time_resolution	= parameters.field_cache_time_resolution	/ AU_TIME;
+		simulation.field_cache_time_start		= parameters.field_cache_time_start			/ AU_TIME;
+		simulation.field_cache_time_end			= parameters.field_cache_time_end			/ AU_TIME;
+		simulation.field_cache_error			= parameters.field_cache_error;
+		
+		if (simulation.field_cache_space_resolution <= 0 || simulation.field_cache_time_resolution <= 0)
+		{
+			printf("ERROR - 'field_cache_space_resolution' and 'field_cache_time_resolution' must be positive\n");
+			exit(-1);
+			return;
+		}
+		
+		if (simulation.field_cache_time_end <= simulation.field_cache_time_start)
+		{
+			printf("ERROR - 'field_cache_time_end' must be greater than 'field_cache_time_start'\n");
+			exit(-1);
+			return;
+		}
+	}
+	
+	simulation.ensemble = parameters.ensemble;
+	
+	if (simulation.ensemble)
+	{
+		simulation.ensemble_file = parameters.ensemble_file;
+		
+		if (simulation.ensemble_file == "")
+		{
+			simulation.ensemble_count				= parameters.ensemble_count;
+			simulation.ensemble_seed				= parameters.ensemble_seed;
+			simulation.ensemble_position_sigma_x	= parameters.ensemble_position_sigma_x	/ AU_LENGTH;
+			simulation.ensemble_position_sigma_y	= parameters.ensemble_position_sigma_y	/ AU_LENGTH;
+			simulation.ensemble_position_sigma_z	= parameters.ensemble_position_sigma_z	/ AU_LENGTH;
+			simulation.ensemble_momentum_sigma_x	= parameters.ensemble_momentum_sigma_x	/ AU_MOMENTUM;
+			simulation.ensemble_momentum_sigma_y	= parameters.ensemble_momentum_sigma_y	/ AU_MOMENTUM;
+			simulation.ensemble_momentum_sigma_z	= parameters.ensemble_momentum_sigma_z	/ AU_MOMENTUM;
+			
+			if (simulation.ensemble_count == 0)
+			{
+				printf("ERROR - 'ensemble_count' must be at least 1\n");
+				exit(-1);
+				return;
+			}
+		}
+	}
+	
+	simulation.space_charge = parameters.space_charge;
+	
+	if (simulation.space_charge)
+	{
+		simulation.space_charge_bunch_charge	= parameters.space_charge_bunch_charge	/ AU_CHARGE;
+		simulation.space_charge_opening_angle	= parameters.space_charge_opening_angle;
+		simulation.space_charge_softening		= parameters.space_charge_softening		/ AU_LENGTH;
+		
+		if (!simulation.ensemble)
+		{
+			printf("ERROR - 'space_charge' is available only with 'ensemble'\n");
+			exit(-1);
+			return;
+		}
+		
+		if (simulation.integrator != BORIS && simulation.integrator != VAY && simulation.integrator != HIGUERA_CARY)
+		{
+			printf("ERROR - 'space_charge' is available only with the boris, vay and higuera_cary integrators\n");
+			exit(-1);
+			return;
+		}
+		
+		if (simulation.space_charge_opening_angle < 0 || simulation.space_charge_softening < 0)
+		{
+			printf("ERROR - 'space_charge_opening_angle' and 'space_charge_softening' must not be negative\n");
+			exit(-1);
+			return;
+		}
+	}
+	
+	simulation.transfer_map_cache = parameters.transfer_map_cache;
+	
+	if (simulation.transfer_map_cache)
+	{
+		simulation.transfer_map_cache_position_resolution	= parameters.transfer_map_cache_position_resolution	/ AU_LENGTH;
+		simulation.transfer_map_cache_momentum_resolution	= parameters.transfer_map_cache_momentum_resolution	/ AU_MOMENTUM;
+		simulation.transfer_map_cache_time_resolution		= parameters.transfer_map_cache_time_resolution		/ AU_TIME;
+		simulation.transfer_map_cache_error_position		= parameters.transfer_map_cache_error_position		/ AU_LENGTH;
+		simulation.transfer_map_cache_error_momentum		= parameters.transfer_map_cache_error_momentum		/ AU_MOMENTUM;
+		
+		if (simulation.transfer_map_cache_position_resolution <= 0 || simulation.transfer_map_cache_momentum_resolution <= 0 || simulation.transfer_map_cache_time_resolution <= 0)
+		{
+			printf("ERROR - The resolutions of 'transfer_map_cache' must be positive\n");
+			exit(-1);
+			return;
+		}
+		
+		if (simulation.transfer_map_cache_error_position < 0 || simulation.transfer_map_cache_error_momentum < 0)
+		{
+			printf("ERROR - 'transfer_map_cache_error_position' and 'transfer_map_cache_error_momentum' must not be negative\n");
+			exit(-1);
+			return;
+		}
+		
+		if (simulation.space_charge)
+		{
+			printf("ERROR - 'transfer_map_cache' can't be used with 'space_charge' (the motion inside a node depends on the other particles)\n");
+			exit(-1);
+			return;
+		}
+	}
+	
+	simulation.closed_orbit = parameters.closed_orbit;
+	
+	if (simulation.closed_orbit)
+	{
+		simulation.closed_orbit_interactions		= parameters.closed_orbit_interactions;
+		simulation.closed_orbit_max_iterations		= parameters.closed_orbit_max_iterations;
+		simulation.closed_orbit_tolerance_position	= parameters.closed_orbit_tolerance_position	/ AU_LENGTH;
+		simulation.closed_orbit_tolerance_momentum	= parameters.closed_orbit_tolerance_momentum	/ AU_MOMENTUM;
+		simulation.closed_orbit_step_position		= parameters.closed_orbit_step_position			/ AU_LENGTH;
+		simulation.closed_orbit_step_momentum		= parameters.closed_orbit_step_momentum			/ AU_MOMENTUM;
+		simulation.closed_orbit_turns				= parameters.closed_orbit_turns;
+		
+		if (simulation.closed_orbit_tolerance_position <= 0 || simulation.closed_orbit_tolerance_momentum <= 0 || simulation.closed_orbit_step_position <= 0 || simulation.closed_orbit_step_momentum <= 0)
+		{
+			printf("ERROR - The tolerances and the steps of 'closed_orbit' must be positive\n");
+			exit(-1);
+			return;
+		}
+		
+		if (simulation.closed_orbit_max_iterations < 1)
+		{
+			printf("ERROR - 'closed_orbit_max_iterations' must be at least 1\n");
+			exit(-1);
+			return;
+		}
+	}
+	
+	simulation.ponderomotive = parameters.ponderomotive;
+	
+	if (simulation.ponderomotive)
+	{
+		simulation.ponderomotive_wavelength		= parameters.ponderomotive_wavelength	/ AU_LENGTH;
+		simulation.ponderomotive_time_step		= parameters.ponderomotive_time_step	/ AU_TIME;
+		simulation.ponderomotive_samples		= parameters.ponderomotive_samples;
+		simulation.ponderomotive_max_a0			= parameters.ponderomotive_max_a0;
+		simulation.ponderomotive_max_gradient	= parameters.ponderomotive_max_gradient;
+		simulation.ponderomotive_validation		= parameters.ponderomotive_validation;
+		
+		if (simulation.ponderomotive_wavelength <= 0 || simulation.ponderomotive_time_step <= 0 || simulation.ponderomotive_samples < 4)
+		{
+			printf("ERROR - 'ponderomotive_wavelength' and 'ponderomotive_time_step' must be positive and 'ponderomotive_samples' at least 4\n");
+			exit(-1);
+			return;
+		}
+		
+		if (simulation.space_charge)
+		{
+			printf("ERROR - 'ponderomotive' can't be used with 'space_charge'\n");
+			exit(-1);
+			return;
+		}
+	}
+	
+	for (ResponseAnalysis& analysis: response_analyses)
+	{
+		if (analysis.enabled && analysis.sensitivity && (simulation.integrator != DOP853 || simulation.ponderomotive || simulation.transfer_map_cache || simulation.field_cache))
+		{
+			printf("ERROR - The response analyses with 'sensitivity' need the dop853 integrator, without 'ponderomotive', 'transfer_map_cache' and 'field_cache'\n");
+			exit(-1);
+			return;
+		}
+	}
+	
 	simulation.time_resolution_laser	= parameters.time_resolution_laser	/ AU_TIME;
 	simulation.time_resolution_free		= parameters.time_resolution_free	/ AU_TIME;
 	
@@ -699,9 +1260,11 @@ void read_config(
 	simulation.laser_influence_radius	= parameters.laser_influence_radius	/ AU_LENGTH;
 	simulation.labmap_max_size			= parameters.labmap_max_size;
 	simulation.labmap_full				= parameters.labmap_full;
+	simulation.func_fast_math			= parameters.func_fast_math;
 	simulation.duration					= parameters.simulation_duration 	/ AU_TIME;
 
 	
+	laser.params.params_int			= laser_field_param_map_int;
 	laser.params.params_int64		= laser_field_param_map_int64;
 	laser.params.params_float		= laser_field_param_map_float;
 	laser.params.params_string		= laser_field_param_map_string;
@@ -720,18 +1283,54 @@ void read_config(
 		return;
 	}
 	
-	laser.timing_offset = parameters.timing_offset / AU_TIME;
+	laser.timing_offset  = parameters.timing_offset / AU_TIME;
+	laser.timing_sampled = parameters.timing_sampled;
+	laser.field_cache	 = NULL;	// Built once the field function is compiled
+	laser.transfer_map_cache = NULL;	// Created by main
+	laser.function_envelope  = NULL;	// Loaded from the custom library
+	laser.function_field_dual = NULL;	// Loaded from the custom library
 	
 	
 	
 	// Loading the common functins.
-	sources.push_back(parameters.func_commons);
+	scripts.commons.push_back(parameters.func_commons);
 	
 	
 	
 	// Loading field function
 	
-	headers.push_back("extern \"C\" Field field(double t, double x, double y, double z, const PulseParams& params);");
+	// The laser attributes are passed as a flat struct only if a response analysis changes them, otherwise they are
+	// injected as constants and the compiler can fold them
+	bool laser_variable = false;
+	for (ResponseAnalysis& analysis: response_analyses)
+		for (ResponseInput& input: analysis.inputs)
+			if (analysis.enabled && input.object == "laser")
+				laser_variable = true;
+	
+	// The laser attributes changed by the sensitivity analyses are the variables of the dual numbers of field_dual
+	bool sensitivity = false;
+	laser.sensitivity_params.clear();
+	
+	for (ResponseAnalysis& analysis: response_analyses)
+		if (analysis.enabled && analysis.sensitivity)
+		{
+			sensitivity = true;
+			
+			for (ResponseInput& input: analysis.inputs)
+				if (input.object == "laser" && find(laser.sensitivity_params.begin(), laser.sensitivity_params.end(), input.attribute) == laser.sensitivity_params.end())
+					laser.sensitivity_params.push_back(input.attribute);
+		}
+	
+	scripts.dual_variables = sensitivity ? TANGENT_DUAL_SPACE + laser.sensitivity_params.size() : 0;
+	
+	string params_hpp;
+	string params_cpp;
+	declare_laser_variables(params_hpp, params_cpp, laser);
+	
+	scripts.headers.push_back(params_hpp);
+	scripts.sources.push_back(params_cpp);
+	
+	scripts.headers.push_back("extern \"C\" Field field(double t, double x, double y, double z, const FieldParams* params);");
 	
 	
 	string s1 = "// This function is only for internal use\n";
@@ -743,17 +1342,93 @@ void read_config(
 	s1 += parameters.func_fields + "\n";
 	s1 += "}\n";
 	
-	sources.push_back(s1);
+	scripts.commons.push_back(s1);
 		
-	string s2 = (bo::format("Field field(double t, double x, double y, double z, const PulseParams& params)\n")).str();
+	string s2 = (bo::format("Field field(double t, double x, double y, double z, const FieldParams* params)\n")).str();
 	s2 += "{\n";
 	
-	link_laser_variables(s2, laser, false);
+	if (laser_variable)
+		link_laser_variables(s2, laser, false);
+	else
+		inject_laser_variables(s2, laser, false);
 	
 	s2 += parameters.func_fields + "\n";
 	s2 += "}\n";
 	
-	sources.push_back(s2);
+	scripts.sources.push_back(s2);
+	
+	// Batched version: the laser attributes are read once and the loop can be vectorized (the body is inlined)
+	scripts.headers.push_back("extern \"C\" void field_batch(unsigned int n, const double* t, const double* x, const double* y, const double* z, const FieldBatch& field, const FieldParams* params);");
+	
+	string s3 = (bo::format("void field_batch(unsigned int batch_n, const double* batch_t, const double* batch_x, const double* batch_y, const double* batch_z, const FieldBatch& batch_field, const FieldParams* params)\n")).str();
+	s3 += "{\n";
+	
+	if (laser_variable)
+		copy_laser_variables(s3, laser, true);
+	else
+		inject_laser_variables(s3, laser, true);
+	
+	s3 += "    auto field_point = [&](double t, double x, double y, double z) -> Field\n";
+	s3 += "    {\n";
+	s3 += parameters.func_fields + "\n";
+	s3 += "    };\n";
+	s3 += "\n";
+	s3 += "    double* batch_e_x = batch_field.e_x;\n";
+	s3 += "    double* batch_e_y = batch_field.e_y;\n";
+	s3 += "    double* batch_e_z = batch_field.e_z;\n";
+	s3 += "    double* batch_b_x = batch_field.b_x;\n";
+	s3 += "    double* batch_b_y = batch_field.b_y;\n";
+	s3 += "    double* batch_b_z = batch_field.b_z;\n";
+	s3 += "\n";
+	s3 += "    #pragma omp simd\n";
+	s3 += "    for (unsigned int i = 0; i < batch_n; i++)\n";
+	s3 += "    {\n";
+	s3 += "        Field f = field_point(batch_t[i], batch_x[i], batch_y[i], batch_z[i]);\n";
+	s3 += "        batch_e_x[i] = f.e_x;\n";
+	s3 += "        batch_e_y[i] = f.e_y;\n";
+	s3 += "        batch_e_z[i] = f.e_z;\n";
+	s3 += "        batch_b_x[i] = f.b_x;\n";
+	s3 += "        batch_b_y[i] = f.b_y;\n";
+	s3 += "        batch_b_z[i] = f.b_z;\n";
+	s3 += "    }\n";
+	s3 += "}\n";
+	
+	scripts.sources.push_back(s3);
+	
+	// Envelope of the electric field for the ponderomotive model (optional)
+	if (!parameters.func_envelope.empty())
+	{
+		scripts.headers.push_back("extern \"C\" double envelope(double t, double x, double y, double z, const FieldParams* params);");
+		
+		string s4 = (bo::format("double envelope(double t, double x, double y, double z, const FieldParams* params)\n")).str();
+		s4 += "{\n";
+		
+		if (laser_variable)
+			link_laser_variables(s4, laser, false);
+		else
+			inject_laser_variables(s4, laser, false);
+		
+		s4 += parameters.func_envelope + "\n";
+		s4 += "}\n";
+		
+		scripts.sources.push_back(s4);
+	}
+	
+	// Fields and their derivatives for the sensitivity analyses (the wrapper field_dual is written by script.cpp)
+	if (sensitivity)
+	{
+		scripts.headers.push_back("extern \"C\" void field_dual(double t, double x, double y, double z, const FieldParams* params, double* field, double* jacobian);");
+		
+		string s5 = (bo::format("Field field_dual_point(double t, double x, double y, double z, const FieldParams* params)\n")).str();
+		s5 += "{\n";
+		
+		seed_laser_variables(s5, laser);
+		
+		s5 += parameters.func_fields + "\n";
+		s5 += "}\n";
+		
+		scripts.duals.push_back(s5);
+	}
 
 	
 	
@@ -762,7 +1437,7 @@ void read_config(
 	particle.charge 					= parameters.charge    				/ AU_CHARGE;
 	
 	Setting& field_renders_setting = config->lookup("field_renders");
-	read_config_renders(&field_renders_setting, field_renders, headers, sources, laser);
+	read_config_renders(&field_renders_setting, field_renders, scripts, laser);
 
 	delete config;
 	
@@ -772,6 +1447,32 @@ void read_config(
 
 }
 
+
+void read_config(
+	fs::path& cfg_file,
+	Simulation& simulation,
+	Pulse& laser,
+	Particle& particle,
+	ParticleStateGlobal& particle_state,
+	Laboratory& laboratory,
+	vector<FieldRender>&      field_renders,
+	vector<ResponseAnalysis>& response_analyses,
+	CustomScripts& scripts)
+{
+	ifstream file(cfg_file.string());
+	
+	if (!file.is_open())
+	{
+		printf("Unable to read file '%s'\n", cfg_file.c_str());
+		exit(-1);
+	}
+	
+	stringstream cfg_si;
+	cfg_si << file.rdbuf();
+	
+	read_config(cfg_si.str(), simulation, laser, particle, particle_state, laboratory, field_renders, response_analyses, scripts);
+}
+
 void read_config_render_movie(fs::path& cfg_file, FieldMovieConfig& movie_config)
 {
 	
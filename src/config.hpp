@@ -1,5 +1,16 @@
 #include "type.hpp"
 
+void read_config(
+	const string& cfg_si,
+	Simulation& simulation,
+	Pulse& laser,
+	Particle& particle,
+	ParticleStateGlobal& particle_state,
+	Laboratory& laboratory,
+	vector<FieldRender>&      field_renders,
+	vector<ResponseAnalysis>& response_analyses,
+	CustomScripts& scripts);
+
 void read_config(
 	fs::path& cfg_file,
 	Simulation& simulation,
@@ -9,8 +20,9 @@ void read_config(
 	Laboratory& laboratory,
 	vector<FieldRender>&      field_renders,
 	vector<ResponseAnalysis>& response_analyses,
-	vector<string>& sources,
-	vector<string>& headers);
+	CustomScripts& scripts);
+
 
+void init_laser_params_data(Pulse& laser, size_t size, const size_t offsets[]);
 
 void read_config_render_movie(fs::path& cfg_file, FieldMovieConfig& config);
@@ -0,0 +1,578 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "type.hpp"
+
+#ifndef CIRCLESIM_DOP853
+#define CIRCLESIM_DOP853
+
+using namespace std;
+
+/**
+ * Explicit Runge-Kutta method of order 8(5,3) by Dormand & Prince, as in the DOP853 code of Hairer & Wanner
+ * ("Solving Ordinary Differential Equations I", 2nd edition, section II.10).
+ *
+ * The right hand side is any functor callable as f(t, y, dydt): being a template parameter its body is inlined in the
+ * stages instead of going through a function pointer and a void* like gsl_odeiv_system.
+ *
+ * All the buffers are allocated once in a Dop853Workspace, which also keeps the step size proposed by the controller
+ * and the FSAL stage. The integration can therefore be stopped at every output time and continued without warming up
+ * the step size control again.
+ */
+
+namespace dop853
+{
+	static const double c2  = 0.526001519587677318785587544488e-01;
+	static const double c3  = 0.789002279381515978178381316732e-01;
+	static const double c4  = 0.118350341907227396726757197510e+00;
+	static const double c5  = 0.281649658092772603273242802490e+00;
+	static const double c6  = 0.333333333333333333333333333333e+00;
+	static const double c7  = 0.25e+00;
+	static const double c8  = 0.307692307692307692307692307692e+00;
+	static const double c9  = 0.651282051282051282051282051282e+00;
+	static const double c10 = 0.6e+00;
+	static const double c11 = 0.857142857142857142857142857142e+00;
+
+	static const double b1  =  5.42937341165687622380535766363e-2;
+	static const double b6  =  4.45031289275240888144113950566e0;
+	static const double b7  =  1.89151789931450038304281599044e0;
+	static const double b8  = -5.8012039600105847814672114227e0;
+	static const double b9  =  3.1116436695781989440891606237e-1;
+	static const double b10 = -1.52160949662516078556178806805e-1;
+	static const double b11 =  2.01365400804030348374776537501e-1;
+	static const double b12 =  4.47106157277725905176885569043e-2;
+
+	static const double bhh1 = 0.244094488188976377952755905512e+00;
+	static const double bhh2 = 0.733846688281611857341361741547e+00;
+	static const double bhh3 = 0.220588235294117647058823529412e-01;
+
+	static const double er1  =  0.1312004499419488073250102996e-01;
+	static const double er6  = -0.1225156446376204440720569753e+01;
+	static const double er7  = -0.4957589496572501915214079952e+00;
+	static const double er8  =  0.1664377182454986536961530415e+01;
+	static const double er9  = -0.3503288487499736816886487290e+00;
+	static const double er10 =  0.3341791187130174790297318841e+00;
+	static const double er11 =  0.8192320648511571246570742613e-01;
+	static const double er12 = -0.2235530786388629525884427845e-01;
+
+	static const double a21   =  5.26001519587677318785587544488e-2;
+	static const double a31   =  1.97250569845378994544595329183e-2;
+	static const double a32   =  5.91751709536136983633785987549e-2;
+	static const double a41   =  2.95875854768068491816892993775e-2;
+	static const double a43   =  8.87627564304205475450678981324e-2;
+	static const double a51   =  2.41365134159266685502369798665e-1;
+	static const double a53   = -8.84549479328286085344864962717e-1;
+	static const double a54   =  9.24834003261792003115737966543e-1;
+	static const double a61   =  3.7037037037037037037037037037e-2;
+	static const double a64   =  1.70828608729473871279604482173e-1;
+	static const double a65   =  1.25467687566822425016691814123e-1;
+	static const double a71   =  3.7109375e-2;
+	static const double a74   =  1.70252211019544039314978060272e-1;
+	static const double a75   =  6.02165389804559606850219397283e-2;
+	static const double a76   = -1.7578125e-2;
+	static const double a81   =  3.70920001185047927108779319836e-2;
+	static const double a84   =  1.70383925712239993810214054705e-1;
+	static const double a85   =  1.07262030446373284651809199168e-1;
+	static const double a86   = -1.53194377486244017527936158236e-2;
+	static const double a87   =  8.27378916381402288758473766002e-3;
+	static const double a91   =  6.24110958716075717114429577812e-1;
+	static const double a94   = -3.36089262944694129406857109825e0;
+	static const double a95   = -8.68219346841726006818189891453e-1;
+	static const double a96   =  2.75920996994467083049415600797e1;
+	static const double a97   =  2.01540675504778934086186788979e1;
+	static const double a98   = -4.34898841810699588477366255144e1;
+	static const double a101  =  4.77662536438264365890433908527e-1;
+	static const double a104  = -2.48811461997166764192642586468e0;
+	static const double a105  = -5.90290826836842996371446475743e-1;
+	static const double a106  =  2.12300514481811942347288949897e1;
+	static const double a107  =  1.52792336328824235832596922938e1;
+	static const double a108  = -3.32882109689848629194453265587e1;
+	static const double a109  = -2.03312017085086261358222928593e-2;
+	static const double a111  = -9.3714243008598732571704021658e-1;
+	static const double a114  =  5.18637242884406370830023853209e0;
+	static const double a115  =  1.09143734899672957818500254654e0;
+	static const double a116  = -8.14978701074692612513997267357e0;
+	static const double a117  = -1.85200656599969598641566180701e1;
+	static const double a118  =  2.27394870993505042818970056734e1;
+	static const double a119  =  2.49360555267965238987089396762e0;
+	static const double a1110 = -3.0467644718982195003823669022e0;
+	static const double a121  =  2.27331014751653820792359768449e0;
+	static const double a124  = -1.05344954667372501984066689879e1;
+	static const double a125  = -2.00087205822486249909675718444e0;
+	static const double a126  = -1.79589318631187989172765950534e1;
+	static const double a127  =  2.79488845294199600508499808837e1;
+	static const double a128  = -2.85899827713502369474065508674e0;
+	static const double a129  = -8.87285693353062954433549289258e0;
+	static const double a1210 =  1.23605671757943030647266201528e1;
+	static const double a1211 =  6.43392746015763530355970484046e-1;
+
+	// Extra stages and coefficients of the 7th order dense output
+	static const double c14 = 0.1e+00;
+	static const double c15 = 0.2e+00;
+	static const double c16 = 0.777777777777777777777777777778e+00;
+
+	static const double a141  =  5.61675022830479523392909219681e-2;
+	static const double a147  =  2.53500210216624811088794765333e-1;
+	static const double a148  = -2.46239037470802489917441475441e-1;
+	static const double a149  = -1.24191423263816360469010140626e-1;
+	static const double a1410 =  1.5329179827876569731206322685e-1;
+	static const double a1411 =  8.20105229563468988491666602057e-3;
+	static const double a1412 =  7.56789766054569976138603589584e-3;
+	static const double a1413 = -8.298e-3;
+	static const double a151  =  3.18346481635021405060768473261e-2;
+	static const double a156  =  2.83009096723667755288322961402e-2;
+	static const double a157  =  5.35419883074385676223797384372e-2;
+	static const double a158  = -5.49237485713909884646569340306e-2;
+	static const double a1511 = -1.08347328697249322858509316994e-4;
+	static const double a1512 =  3.82571090835658412954920192323e-4;
+	static const double a1513 = -3.40465008687404560802977114492e-4;
+	static const double a1514 =  1.41312443674632500278074618366e-1;
+	static const double a161  = -4.28896301583791923408573538692e-1;
+	static const double a166  = -4.69762141536116384314449447206e0;
+	static const double a167  =  7.68342119606259904184240953878e0;
+	static const double a168  =  4.06898981839711007970213554331e0;
+	static const double a169  =  3.56727187455281109270669543021e-1;
+	static const double a1613 = -1.39902416515901462129418009734e-3;
+	static const double a1614 =  2.9475147891527723389556272149e0;
+	static const double a1615 = -9.15095847217987001081870187138e0;
+
+	static const double d41  = -0.84289382761090128651353491142e+01;
+	static const double d46  =  0.56671495351937776962531783590e+00;
+	static const double d47  = -0.30689499459498916912797304727e+01;
+	static const double d48  =  0.23846676565120698287728149680e+01;
+	static const double d49  =  0.21170345824450282767155149946e+01;
+	static const double d410 = -0.87139158377797299206789907490e+00;
+	static const double d411 =  0.22404374302607882758541771650e+01;
+	static const double d412 =  0.63157877876946881815570249290e+00;
+	static const double d413 = -0.88990336451333310820698117400e-01;
+	static const double d414 =  0.18148505520854727256656404962e+02;
+	static const double d415 = -0.91946323924783554000451984436e+01;
+	static const double d416 = -0.44360363875948939664310572000e+01;
+
+	static const double d51  =  0.10427508642579134603413151009e+02;
+	static const double d56  =  0.24228349177525818288430175319e+03;
+	static const double d57  =  0.16520045171727028198505394887e+03;
+	static const double d58  = -0.37454675472269020279518312152e+03;
+	static const double d59  = -0.22113666853125306036270938578e+02;
+	static const double d510 =  0.77334326684722638389603898808e+01;
+	static const double d511 = -0.30674084731089398182061213626e+02;
+	static const double d512 = -0.93321305264302278729567221706e+01;
+	static const double d513 =  0.15697238121770843886131091075e+02;
+	static const double d514 = -0.31139403219565177677282850411e+02;
+	static const double d515 = -0.93529243588444783865713862664e+01;
+	static const double d516 =  0.35816841486394083752465898540e+02;
+
+	static const double d61  =  0.19985053242002433820987653617e+02;
+	static const double d66  = -0.38703730874935176555105901742e+03;
+	static const double d67  = -0.18917813819516756882830838328e+03;
+	static const double d68  =  0.52780815920542364900561016686e+03;
+	static const double d69  = -0.11573902539959630126141871134e+02;
+	static const double d610 =  0.68812326946963000169666922661e+01;
+	static const double d611 = -0.10006050966910838403183860980e+01;
+	static const double d612 =  0.77771377980534432092869265740e+00;
+	static const double d613 = -0.27782057523535084065932004339e+01;
+	static const double d614 = -0.60196695231264120758267380846e+02;
+	static const double d615 =  0.84320405506677161018159903784e+02;
+	static const double d616 =  0.11992291136182789328035130030e+02;
+
+	static const double d71  = -0.25693933462703749003312586129e+02;
+	static const double d76  = -0.15418974869023643374053993627e+03;
+	static const double d77  = -0.23152937917604549567536039109e+03;
+	static const double d78  =  0.35763911791061412378285349910e+03;
+	static const double d79  =  0.93405324183624310003907691704e+02;
+	static const double d710 = -0.37458323136451633156875139351e+02;
+	static const double d711 =  0.10409964950896230045147246184e+03;
+	static const double d712 =  0.29840293426660503123344363579e+02;
+	static const double d713 = -0.43533456590011143754432175058e+02;
+	static const double d714 =  0.96324553959188282948394950600e+02;
+	static const double d715 = -0.39177261675615439165231486172e+02;
+	static const double d716 = -0.14972683625798562581422125276e+03;
+
+	// Step size control (see the comments of DOP853 for the meaning of each value)
+	static const double safety     = 0.9;
+	static const double factor_min = 0.333;
+	static const double factor_max = 6.0;
+	static const double beta       = 0.04;
+	static const double exponent   = 1.0 / 8.0 - beta * 0.2;
+}
+
+
+typedef struct Dop853Workspace
+{
+	unsigned int dimension;
+	unsigned int error_dimension;	// The first components are controlled, the others follow their steps
+
+	double error_abs;
+	double error_rel;
+
+	double step;				// Step size proposed by the controller for the next step (0 means it must be estimated)
+	double error_old;			// Error of the last accepted step, used by the PI controller
+	bool   rejected;			// The last attempt was rejected
+	bool   fsal;				// k1 contains f(t, y) of the current state
+
+	bool   dense;				// Prepare the dense output at every accepted step
+	double dense_time;			// The dense output covers [dense_time, dense_time + dense_step]
+	double dense_step;
+
+	unsigned long steps_accepted;
+	unsigned long steps_rejected;
+	unsigned long evaluations;
+
+	vector<double> k1, k2, k3, k4, k5, k6, k7, k8, k9, k10, k11, k12, k13, k14, k15, k16;
+	vector<double> r1, r2, r3, r4, r5, r6, r7, r8;
+	vector<double> y_stage;
+	vector<double> y_new;
+
+} Dop853Workspace;
+
+
+inline void dop853_init(Dop853Workspace& workspace, unsigned int dimension, double error_abs, double error_rel, bool dense = false)
+{
+	workspace.dimension = dimension;
+	workspace.error_dimension = dimension;
+	workspace.error_abs = error_abs;
+	workspace.error_rel = error_rel;
+
+	workspace.step      = 0;
+	workspace.error_old = 1e-4;
+	workspace.rejected  = false;
+	workspace.fsal      = false;
+
+	workspace.dense      = dense;
+	workspace.dense_time = 0;
+	workspace.dense_step = 0;
+
+	workspace.steps_accepted = 0;
+	workspace.steps_rejected = 0;
+	workspace.evaluations    = 0;
+
+	vector<double>* buffers[] = {
+		&workspace.k1, &workspace.k2, &workspace.k3, &workspace.k4, &workspace.k5, &workspace.k6, &workspace.k7,
+		&workspace.k8, &workspace.k9, &workspace.k10, &workspace.k11, &workspace.k12, &workspace.k13, &workspace.k14,
+		&workspace.k15, &workspace.k16, &workspace.y_stage, &workspace.y_new};
+
+	vector<double>* buffers_dense[] = {
+		&workspace.r1, &workspace.r2, &workspace.r3, &workspace.r4, &workspace.r5, &workspace.r6, &workspace.r7, &workspace.r8};
+
+	for (vector<double>* buffer: buffers)
+		buffer->assign(dimension, 0.d);
+
+	for (vector<double>* buffer: buffers_dense)
+		buffer->assign(dense ? dimension : 0, 0.d);
+}
+
+/**
+ * The state was changed from outside (for example moving to another node): the stored f(t, y) is not valid anymore.
+ * The step size is kept since it is still the best guess we have.
+ */
+inline void dop853_restart(Dop853Workspace& workspace)
+{
+	workspace.fsal      = false;
+	workspace.rejected  = false;
+	workspace.error_old = 1e-4;
+}
+
+
+/**
+ * Initial step size estimation, as in the HINIT subroutine of DOP853. It requires k1 = f(t, y).
+ */
+template <typename F> double dop853_initial_step(Dop853Workspace& workspace, F& f, double t, const double* y, double step_max)
+{
+	const unsigned int n = workspace.dimension;
+	double* k1 = workspace.k1.data();
+	double* k2 = workspace.k2.data();
+	double* y1 = workspace.y_stage.data();
+
+	double norm_f = 0;
+	double norm_y = 0;
+	for (unsigned int i = 0; i < workspace.error_dimension; i++)
+	{
+		double sk = workspace.error_abs + workspace.error_rel * fabs(y[i]);
+		if (sk == 0)
+			continue;
+		norm_f += pow2(k1[i] / sk);
+		norm_y += pow2(y[i]  / sk);
+	}
+
+	double step = (norm_f <= 1e-10 || norm_y <= 1e-10) ? 1e-6 : sqrt(norm_y / norm_f) * 0.01;
+	step = min(step, step_max);
+
+	// Explicit Euler step to estimate the second derivative
+	for (unsigned int i = 0; i < n; i++)
+		y1[i] = y[i] + step * k1[i];
+
+	f(t + step, y1, k2);
+	workspace.evaluations++;
+
+	double derivative2 = 0;
+	for (unsigned int i = 0; i < workspace.error_dimension; i++)
+	{
+		double sk = workspace.error_abs + workspace.error_rel * fabs(y[i]);
+		if (sk == 0)
+			continue;
+		derivative2 += pow2((k2[i] - k1[i]) / sk);
+	}
+	derivative2 = sqrt(derivative2) / step;
+
+	double derivative = max(fabs(derivative2), sqrt(norm_f));
+	double step_order = (derivative <= 1e-15) ? max(1e-6, step * 1e-3) : pow(0.01 / derivative, 1.0 / 8.0);
+
+	return min(min(100 * step, step_order), step_max);
+}
+
+
+/**
+ * Coefficients of the continuous extension of the step from t to t + h (CONTD8 in DOP853), which needs three more
+ * evaluations. It requires the stages of the step and k13 = f(t + h, y_new).
+ */
+template <typename F> void dop853_dense_prepare(Dop853Workspace& workspace, F& f, double t, double h, const double* y)
+{
+	using namespace dop853;
+
+	const unsigned int n = workspace.dimension;
+
+	double* k1  = workspace.k1.data();
+	double* k6  = workspace.k6.data();
+	double* k7  = workspace.k7.data();
+	double* k8  = workspace.k8.data();
+	double* k9  = workspace.k9.data();
+	double* k10 = workspace.k10.data();
+	double* k11 = workspace.k11.data();
+	double* k12 = workspace.k12.data();
+	double* k13 = workspace.k13.data();
+	double* k14 = workspace.k14.data();
+	double* k15 = workspace.k15.data();
+	double* k16 = workspace.k16.data();
+	double* y1  = workspace.y_stage.data();
+	double* yn  = workspace.y_new.data();
+
+	for (unsigned int i = 0; i < n; i++)
+		y1[i] = y[i] + h * (a141 * k1[i] + a147 * k7[i] + a148 * k8[i] + a149 * k9[i] + a1410 * k10[i] + a1411 * k11[i] + a1412 * k12[i] + a1413 * k13[i]);
+	f(t + c14 * h, y1, k14);
+
+	for (unsigned int i = 0; i < n; i++)
+		y1[i] = y[i] + h * (a151 * k1[i] + a156 * k6[i] + a157 * k7[i] + a158 * k8[i] + a1511 * k11[i] + a1512 * k12[i] + a1513 * k13[i] + a1514 * k14[i]);
+	f(t + c15 * h, y1, k15);
+
+	for (unsigned int i = 0; i < n; i++)
+		y1[i] = y[i] + h * (a161 * k1[i] + a166 * k6[i] + a167 * k7[i] + a168 * k8[i] + a169 * k9[i] + a1613 * k13[i] + a1614 * k14[i] + a1615 * k15[i]);
+	f(t + c16 * h, y1, k16);
+
+	workspace.evaluations += 3;
+
+	for (unsigned int i = 0; i < n; i++)
+	{
+		double difference = yn[i] - y[i];
+		double spline     = h * k1[i] - difference;
+
+		workspace.r1[i] = y[i];
+		workspace.r2[i] = difference;
+		workspace.r3[i] = spline;
+		workspace.r4[i] = difference - h * k13[i] - spline;
+		workspace.r5[i] = h * (d41 * k1[i] + d46 * k6[i] + d47 * k7[i] + d48 * k8[i] + d49 * k9[i] + d410 * k10[i] + d411 * k11[i] + d412 * k12[i] + d413 * k13[i] + d414 * k14[i] + d415 * k15[i] + d416 * k16[i]);
+		workspace.r6[i] = h * (d51 * k1[i] + d56 * k6[i] + d57 * k7[i] + d58 * k8[i] + d59 * k9[i] + d510 * k10[i] + d511 * k11[i] + d512 * k12[i] + d513 * k13[i] + d514 * k14[i] + d515 * k15[i] + d516 * k16[i]);
+		workspace.r7[i] = h * (d61 * k1[i] + d66 * k6[i] + d67 * k7[i] + d68 * k8[i] + d69 * k9[i] + d610 * k10[i] + d611 * k11[i] + d612 * k12[i] + d613 * k13[i] + d614 * k14[i] + d615 * k15[i] + d616 * k16[i]);
+		workspace.r8[i] = h * (d71 * k1[i] + d76 * k6[i] + d77 * k7[i] + d78 * k8[i] + d79 * k9[i] + d710 * k10[i] + d711 * k11[i] + d712 * k12[i] + d713 * k13[i] + d714 * k14[i] + d715 * k15[i] + d716 * k16[i]);
+	}
+
+	workspace.dense_time = t;
+	workspace.dense_step = h;
+}
+
+/**
+ * Evaluate the 7th order continuous extension of the last accepted step at time t (which should be inside the step).
+ */
+inline void dop853_dense(const Dop853Workspace& workspace, double t, double* y)
+{
+	double s  = (t - workspace.dense_time) / workspace.dense_step;
+	double s1 = 1.0 - s;
+
+	for (unsigned int i = 0; i < workspace.dimension; i++)
+		y[i] = workspace.r1[i] + s * (workspace.r2[i] + s1 * (workspace.r3[i] + s * (workspace.r4[i] + s1 * (workspace.r5[i] + s * (workspace.r6[i] + s1 * (workspace.r7[i] + s * workspace.r8[i]))))));
+}
+
+
+/**
+ * Perform one accepted step from t towards t_limit (never beyond it), updating t and y.
+ * If the dense output is enabled, the state at any time of the step can then be obtained with dop853_dense.
+ */
+template <typename F> void dop853_step(Dop853Workspace& workspace, F& f, double& t, double* y, double t_limit)
+{
+	using namespace dop853;
+
+	const unsigned int n = workspace.dimension;
+
+	double* k1  = workspace.k1.data();
+	double* k2  = workspace.k2.data();
+	double* k3  = workspace.k3.data();
+	double* k4  = workspace.k4.data();
+	double* k5  = workspace.k5.data();
+	double* k6  = workspace.k6.data();
+	double* k7  = workspace.k7.data();
+	double* k8  = workspace.k8.data();
+	double* k9  = workspace.k9.data();
+	double* k10 = workspace.k10.data();
+	double* k11 = workspace.k11.data();
+	double* k12 = workspace.k12.data();
+	double* k13 = workspace.k13.data();
+	double* y1  = workspace.y_stage.data();
+	double* yn  = workspace.y_new.data();
+
+	if (!workspace.fsal)
+	{
+		f(t, y, k1);
+		workspace.evaluations++;
+		workspace.fsal = true;
+	}
+
+	if (workspace.step <= 0)
+		workspace.step = dop853_initial_step(workspace, f, t, y, t_limit - t);
+
+	while (true)
+	{
+		double h    = workspace.step;
+		bool   last = false;
+
+		if (t + 1.01 * h >= t_limit)
+		{
+			h    = t_limit - t;
+			last = true;
+		}
+
+		if (h <= fabs(t) * 1e-15)
+		{
+			printf("ERROR - DOP853 step size too small at t=%g\n", t);
+			exit(-6);
+		}
+
+		// The twelve stages
+		for (unsigned int i = 0; i < n; i++)
+			y1[i] = y[i] + h * a21 * k1[i];
+		f(t + c2 * h, y1, k2);
+
+		for (unsigned int i = 0; i < n; i++)
+			y1[i] = y[i] + h * (a31 * k1[i] + a32 * k2[i]);
+		f(t + c3 * h, y1, k3);
+
+		for (unsigned int i = 0; i < n; i++)
+			y1[i] = y[i] + h * (a41 * k1[i] + a43 * k3[i]);
+		f(t + c4 * h, y1, k4);
+
+		for (unsigned int i = 0; i < n; i++)
+			y1[i] = y[i] + h * (a51 * k1[i] + a53 * k3[i] + a54 * k4[i]);
+		f(t + c5 * h, y1, k5);
+
+		for (unsigned int i = 0; i < n; i++)
+			y1[i] = y[i] + h * (a61 * k1[i] + a64 * k4[i] + a65 * k5[i]);
+		f(t + c6 * h, y1, k6);
+
+		for (unsigned int i = 0; i < n; i++)
+			y1[i] = y[i] + h * (a71 * k1[i] + a74 * k4[i] + a75 * k5[i] + a76 * k6[i]);
+		f(t + c7 * h, y1, k7);
+
+		for (unsigned int i = 0; i < n; i++)
+			y1[i] = y[i] + h * (a81 * k1[i] + a84 * k4[i] + a85 * k5[i] + a86 * k6[i] + a87 * k7[i]);
+		f(t + c8 * h, y1, k8);
+
+		for (unsigned int i = 0; i < n; i++)
+			y1[i] = y[i] + h * (a91 * k1[i] + a94 * k4[i] + a95 * k5[i] + a96 * k6[i] + a97 * k7[i] + a98 * k8[i]);
+		f(t + c9 * h, y1, k9);
+
+		for (unsigned int i = 0; i < n; i++)
+			y1[i] = y[i] + h * (a101 * k1[i] + a104 * k4[i] + a105 * k5[i] + a106 * k6[i] + a107 * k7[i] + a108 * k8[i] + a109 * k9[i]);
+		f(t + c10 * h, y1, k10);
+
+		for (unsigned int i = 0; i < n; i++)
+			y1[i] = y[i] + h * (a111 * k1[i] + a114 * k4[i] + a115 * k5[i] + a116 * k6[i] + a117 * k7[i] + a118 * k8[i] + a119 * k9[i] + a1110 * k10[i]);
+		f(t + c11 * h, y1, k11);
+
+		for (unsigned int i = 0; i < n; i++)
+			y1[i] = y[i] + h * (a121 * k1[i] + a124 * k4[i] + a125 * k5[i] + a126 * k6[i] + a127 * k7[i] + a128 * k8[i] + a129 * k9[i] + a1210 * k10[i] + a1211 * k11[i]);
+		f(t + h, y1, k12);
+
+		workspace.evaluations += 11;
+
+		// 8th order solution and the two embedded error estimators (5th and 3rd order)
+		double error_5 = 0;
+		double error_3 = 0;
+		for (unsigned int i = 0; i < n; i++)
+		{
+			double increment = b1 * k1[i] + b6 * k6[i] + b7 * k7[i] + b8 * k8[i] + b9 * k9[i] + b10 * k10[i] + b11 * k11[i] + b12 * k12[i];
+			yn[i] = y[i] + h * increment;
+
+			if (i >= workspace.error_dimension)
+				continue;
+
+			double sk = workspace.error_abs + workspace.error_rel * max(fabs(y[i]), fabs(yn[i]));
+
+			// With error_abs = 0 a component that stays exactly zero has no tolerance (and no error)
+			if (sk == 0)
+				continue;
+
+			double e3 = increment - bhh1 * k1[i] - bhh2 * k9[i] - bhh3 * k12[i];
+			double e5 = er1 * k1[i] + er6 * k6[i] + er7 * k7[i] + er8 * k8[i] + er9 * k9[i] + er10 * k10[i] + er11 * k11[i] + er12 * k12[i];
+
+			error_3 += pow2(e3 / sk);
+			error_5 += pow2(e5 / sk);
+		}
+
+		double denominator = error_5 + 0.01 * error_3;
+		if (denominator <= 0)
+			denominator = 1;
+
+		double error = fabs(h) * error_5 * sqrt(1.0 / (workspace.error_dimension * denominator));
+
+		// PI controller (Lund stabilization)
+		double factor_11 = pow(error, exponent);
+		double factor    = factor_11 / pow(workspace.error_old, beta);
+		factor = max(1.0 / factor_max, min(1.0 / factor_min, factor / safety));
+
+		double step_new = h / factor;
+
+		if (error <= 1.0)
+		{
+			workspace.error_old = max(error, 1e-4);
+			workspace.steps_accepted++;
+
+			// First same as last: f at the new state is the first stage of the next step
+			f(t + h, yn, k13);
+			workspace.evaluations++;
+
+			if (workspace.dense)
+				dop853_dense_prepare(workspace, f, t, h, y);
+
+			workspace.k1.swap(workspace.k13);
+
+			for (unsigned int i = 0; i < n; i++)
+				y[i] = yn[i];
+
+			t = last ? t_limit : t + h;
+
+			if (workspace.rejected)
+				step_new = min(step_new, h);
+
+			workspace.rejected = false;
+
+			// A step shortened to hit t_limit tells nothing about the natural step size, so it can't reduce it
+			workspace.step = last ? max(step_new, workspace.step) : step_new;
+
+			return;
+		}
+
+		workspace.steps_rejected++;
+		workspace.rejected = true;
+		workspace.step = h / min(1.0 / factor_min, factor_11 / safety);
+	}
+}
+
+/**
+ * Integrate from t to t_end, updating t and y.
+ */
+template <typename F> void dop853_evolve(Dop853Workspace& workspace, F& f, double& t, double* y, double t_end)
+{
+	while (t < t_end)
+		dop853_step(workspace, f, t, y, t_end);
+}
+
+#endif
@@ -0,0 +1,940 @@
+#include <math.h>
+#include <random>
+#include "ensemble.hpp"
+#include "simulator.hpp"
+#include "type.hpp"
+#include "util.hpp"
+#include "node_index.hpp"
+#include "dop853.hpp"
+#include "pusher.hpp"
+#include "space_charge.hpp"
+#include "transfer_map_cache.hpp"
+#include "csv.h"
+
+/**
+ * The bunch seen by the space charge (see simulate_ensemble_space_charge). The particles inside the nodes (the lanes,
+ * pushed together) are at the same global time, and the field is calculated there from all the particles: the lanes
+ * and the others, which move along straight lines. The positions are relative to 'origin' in the global frame.
+ */
+typedef struct EnsembleSpaceCharge
+{
+	double					particle_charge;	// Charge of every particle of the ensemble
+	GlobalCoord				origin_x;
+	GlobalCoord				origin_y;
+	GlobalCoord				origin_z;
+
+	double					lane_time;			// Local time of the first lane at the start of the step
+	vector<const Node*>		lane_node;			// Node of every lane, and its position relative to the origin
+	vector<double>			lane_node_x;
+	vector<double>			lane_node_y;
+	vector<double>			lane_node_z;
+
+	vector<double>			free_x;				// The other particles at the start of the step, and their velocities
+	vector<double>			free_y;
+	vector<double>			free_z;
+	vector<double>			free_velocity_x;
+	vector<double>			free_velocity_y;
+	vector<double>			free_velocity_z;
+
+	vector<double>			x;					// All the particles at the time of the field evaluation (lanes first)
+	vector<double>			y;
+	vector<double>			z;
+	vector<double>			field;				// e_x, e_y, e_z at the lanes (global frame)
+	SpaceChargeTree			tree;
+} EnsembleSpaceCharge;
+
+/**
+ * Add the space charge to the fields of the n lanes at local times t and local positions x, y, z. The lanes are pushed
+ * with the same steps from the same global time, so t - lane_time is the same for all of them.
+ */
+void add_ensemble_space_charge(EnsembleSpaceCharge& space_charge, const Simulation& simulation, unsigned int n, const double t[], const double x[], const double y[], const double z[], FieldBatch& field)
+{
+	double elapsed = t[0] - space_charge.lane_time;
+
+	unsigned int free  = space_charge.free_x.size();
+	unsigned int total = n + free;
+
+	for (unsigned int k = 0; k < n; k++)
+	{
+		Vec3 position = frame_to_global(space_charge.lane_node[k]->axis_t, x[k], y[k], z[k]);
+
+		space_charge.x[k] = space_charge.lane_node_x[k] + position.x;
+		space_charge.y[k] = space_charge.lane_node_y[k] + position.y;
+		space_charge.z[k] = space_charge.lane_node_z[k] + position.z;
+	}
+
+	for (unsigned int f = 0; f < free; f++)
+	{
+		space_charge.x[n + f] = space_charge.free_x[f] + space_charge.free_velocity_x[f] * elapsed;
+		space_charge.y[n + f] = space_charge.free_y[f] + space_charge.free_velocity_y[f] * elapsed;
+		space_charge.z[n + f] = space_charge.free_z[f] + space_charge.free_velocity_z[f] * elapsed;
+	}
+
+	fill(space_charge.field.begin(), space_charge.field.begin() + 3 * n, 0);
+
+	FieldBatch field_global;
+	field_global.e_x = &space_charge.field[0];
+	field_global.e_y = &space_charge.field[n];
+	field_global.e_z = &space_charge.field[2 * n];
+	field_global.b_x = NULL;
+	field_global.b_y = NULL;
+	field_global.b_z = NULL;
+
+	calculate_space_charge(space_charge.tree, total, n, space_charge.x.data(), space_charge.y.data(), space_charge.z.data(),
+		space_charge.particle_charge, simulation.space_charge_opening_angle, simulation.space_charge_softening, field_global);
+
+	for (unsigned int k = 0; k < n; k++)
+	{
+		Vec3 e = frame_to_local(space_charge.lane_node[k]->axis, field_global.e_x[k], field_global.e_y[k], field_global.e_z[k]);
+
+		field.e_x[k] += e.x;
+		field.e_y[k] += e.y;
+		field.e_z[k] += e.z;
+	}
+}
+
+/**
+ * Equations of motion for the pushers, with the batched field evaluation used by push_step_batch. With the space charge
+ * the particles passed to field_batch are all the particles inside the nodes, so the laser fields are evaluated by many
+ * threads and the Coulomb field of the bunch is added. The single particle field (used only to reach the exit of the
+ * sphere) has no space charge.
+ */
+typedef struct LaserBatchSystem
+{
+	const Pulse*			laser;
+	const Simulation*		simulation;
+	FunctionFieldType		function_field;
+	FunctionFieldBatchType	function_field_batch;
+	vector<double>			pos_t;				// Buffer of field_batch, sized for the chunk
+	EnsembleSpaceCharge*	space_charge;		// NULL without space charge
+
+	inline void field(double t, const double position[], Field& field) const
+	{
+		calculate_fields(C0*t, position[0], position[1], position[2], *laser, field, function_field);
+	}
+
+	inline void field_batch(unsigned int n, const double t[], const double x[], const double y[], const double z[], FieldBatch& field)
+	{
+		for (unsigned int i = 0; i < n; i++)
+			pos_t[i] = C0*t[i];
+
+		if (space_charge == NULL)
+		{
+			calculate_fields_batch(n, pos_t.data(), x, y, z, *laser, field, function_field_batch);
+			return;
+		}
+		
+		#pragma omp parallel for schedule(dynamic, 1)
+		for (unsigned int start = 0; start < n; start += ENSEMBLE_CHUNK_SIZE)
+		{
+			FieldBatch chunk;
+			chunk.e_x = field.e_x + start;
+			chunk.e_y = field.e_y + start;
+			chunk.e_z = field.e_z + start;
+			chunk.b_x = field.b_x + start;
+			chunk.b_y = field.b_y + start;
+			chunk.b_z = field.b_z + start;
+			
+			calculate_fields_batch(min(n - start, (unsigned int) ENSEMBLE_CHUNK_SIZE), &pos_t[start], x + start, y + start, z + start, *laser, chunk, function_field_batch);
+		}
+		
+		add_ensemble_space_charge(*space_charge, *simulation, n, t, x, y, z, field);
+	}
+
+} LaserBatchSystem;
+
+
+void get_ensemble_particle(EnsembleState& ensemble, unsigned int i, ParticleStateGlobal& state)
+{
+	state.position_x = ensemble.position_x[i];
+	state.position_y = ensemble.position_y[i];
+	state.position_z = ensemble.position_z[i];
+	state.momentum_x = ensemble.momentum_x[i];
+	state.momentum_y = ensemble.momentum_y[i];
+	state.momentum_z = ensemble.momentum_z[i];
+}
+
+void set_ensemble_particle(EnsembleState& ensemble, unsigned int i, ParticleStateGlobal& state)
+{
+	ensemble.position_x[i] = state.position_x;
+	ensemble.position_y[i] = state.position_y;
+	ensemble.position_z[i] = state.position_z;
+	ensemble.momentum_x[i] = state.momentum_x;
+	ensemble.momentum_y[i] = state.momentum_y;
+	ensemble.momentum_z[i] = state.momentum_z;
+}
+
+void add_ensemble_particle(EnsembleState& ensemble, ParticleStateGlobal& state)
+{
+	ensemble.position_x.push_back(state.position_x);
+	ensemble.position_y.push_back(state.position_y);
+	ensemble.position_z.push_back(state.position_z);
+	ensemble.momentum_x.push_back(state.momentum_x);
+	ensemble.momentum_y.push_back(state.momentum_y);
+	ensemble.momentum_z.push_back(state.momentum_z);
+}
+
+/**
+ * The initial states are read from simulation.ensemble_file (columns position_x, position_y, position_z, momentum_x,
+ * momentum_y, momentum_z in SI units, separated by ';' like particle.csv) or sampled with a gaussian distribution
+ * around particle_state.
+ */
+void init_ensemble(Simulation& simulation, ParticleStateGlobal& particle_state, EnsembleState& ensemble)
+{
+	ensemble.position_x.clear();
+	ensemble.position_y.clear();
+	ensemble.position_z.clear();
+	ensemble.momentum_x.clear();
+	ensemble.momentum_y.clear();
+	ensemble.momentum_z.clear();
+
+	if (simulation.ensemble_file != "")
+	{
+		try
+		{
+			csv::CSVReader<6, csv::trim_chars<>, csv::no_quote_escape<';'>> in(simulation.ensemble_file);
+
+			in.read_header(csv::ignore_extra_column,
+				"position_x",
+				"position_y",
+				"position_z",
+				"momentum_x",
+				"momentum_y",
+				"momentum_z");
+
+			double position_x, position_y, position_z;
+			double momentum_x, momentum_y, momentum_z;
+
+			while (in.read_row(position_x, position_y, position_z, momentum_x, momentum_y, momentum_z))
+			{
+				ParticleStateGlobal state;
+				state.position_x = position_x / AU_LENGTH;
+				state.position_y = position_y / AU_LENGTH;
+				state.position_z = position_z / AU_LENGTH;
+				state.momentum_x = momentum_x / AU_MOMENTUM;
+				state.momentum_y = momentum_y / AU_MOMENTUM;
+				state.momentum_z = momentum_z / AU_MOMENTUM;
+
+				add_ensemble_particle(ensemble, state);
+			}
+		}
+		catch (csv::error::base& e)
+		{
+			printf("ERROR - Unable to read the ensemble file '%s': %s\n", simulation.ensemble_file.c_str(), e.what());
+			exit(-1);
+		}
+
+		if (ensemble.position_x.empty())
+		{
+			printf("ERROR - The ensemble file '%s' contains no particles\n", simulation.ensemble_file.c_str());
+			exit(-1);
+		}
+	}
+	else
+	{
+		mt19937 generator(simulation.ensemble_seed);
+		normal_distribution<double> normal(0, 1);
+
+		for (unsigned int i = 0; i < simulation.ensemble_count; i++)
+		{
+			ParticleStateGlobal state;
+			state.position_x = particle_state.position_x + simulation.ensemble_position_sigma_x * normal(generator);
+			state.position_y = particle_state.position_y + simulation.ensemble_position_sigma_y * normal(generator);
+			state.position_z = particle_state.position_z + simulation.ensemble_position_sigma_z * normal(generator);
+			state.momentum_x = particle_state.momentum_x + simulation.ensemble_momentum_sigma_x * normal(generator);
+			state.momentum_y = particle_state.momentum_y + simulation.ensemble_momentum_sigma_y * normal(generator);
+			state.momentum_z = particle_state.momentum_z + simulation.ensemble_momentum_sigma_z * normal(generator);
+
+			add_ensemble_particle(ensemble, state);
+		}
+	}
+
+	ensemble.count = ensemble.position_x.size();
+
+	ensemble.time.assign(ensemble.count, 0);
+	ensemble.node.assign(ensemble.count, -1);
+	ensemble.node_left.assign(ensemble.count, -1);
+	ensemble.interactions.assign(ensemble.count, 0);
+}
+
+
+/**
+ * The free motion of the particle i (see simulate_free), jumping directly to its end.
+ */
+void simulate_ensemble_free(Simulation& simulation, Laboratory& laboratory, Particle& particle, EnsembleState& ensemble, unsigned int i)
+{
+	ParticleStateGlobal state;
+	get_ensemble_particle(ensemble, i, state);
+
+	double velocity_x;
+	double velocity_y;
+	double velocity_z;
+	get_free_velocity(particle, state, velocity_x, velocity_y, velocity_z);
+
+	double steps;
+	double time_entry;
+	int    node_entered;
+
+	get_free_motion_end(simulation, laboratory, state, ensemble.time[i], velocity_x, velocity_y, velocity_z, ensemble.node_left[i], steps, time_entry, node_entered);
+
+	double local_t = (node_entered >= 0 && time_entry > 0) ? time_entry : steps * simulation.time_resolution_free;
+
+	if (local_t > 0)
+	{
+		ensemble.position_x[i] = state.position_x + velocity_x * local_t;
+		ensemble.position_y[i] = state.position_y + velocity_y * local_t;
+		ensemble.position_z[i] = state.position_z + velocity_z * local_t;
+		ensemble.time[i]       = ensemble.time[i] + local_t;
+	}
+
+	ensemble.node[i] = node_entered;
+}
+
+/**
+ * The particle left the influence sphere between (time, y) and (time_after, y_after): it is integrated again alone from
+ * (time, y), stopping on the crossing.
+ */
+void push_ensemble_exit(Simulation& simulation, Particle& particle, LaserBatchSystem& system, double& time, double y[], double time_after, const double y_after[])
+{
+	double radius = simulation.laser_influence_radius;
+	double step   = simulation.time_resolution_laser / simulation.pusher_substeps;
+
+	double position[3];
+	double time_crossing = find_sphere_crossing(time, time_after, [&](double t)
+	{
+		interpolate_position(particle, time, y, time_after, y_after, t, position);
+		return !is_in_influence_radius(position, radius);
+	});
+
+	push_evolve(simulation.integrator, system, particle, time, y, time_crossing, step);
+}
+
+/**
+ * Push the particles of a chunk in lockstep, every time_resolution_laser, until all of them have left the influence
+ * sphere. The particles leaving it are integrated again alone from the previous sample to the crossing, like in
+ * simulate_node.
+ */
+void push_ensemble_node(Simulation& simulation, Particle& particle, LaserBatchSystem& system, unsigned int n, vector<double>& local_time, vector<double> y[])
+{
+	double radius = simulation.laser_influence_radius;
+	double step   = simulation.time_resolution_laser / simulation.pusher_substeps;
+
+	// Particles still inside the sphere (positions in local_time and y)
+	vector<unsigned int> lanes(n);
+
+	for (unsigned int j = 0; j < n; j++)
+		lanes[j] = j;
+
+	// The buffers of the lanes are allocated once for the chunk
+	PusherBatchWorkspace workspace;
+	push_batch_init(workspace, n);
+
+	system.pos_t.resize(n);
+
+	vector<double> time(n);
+	vector<double> time_before(n);
+	vector<double> time_end(n);
+	vector<double> lane_y[6];
+	vector<double> lane_y_before[6];
+	double*        lane_y_pointers[6];
+
+	for (unsigned int c = 0; c < 6; c++)
+	{
+		lane_y[c].resize(n);
+		lane_y_before[c].resize(n);
+		lane_y_pointers[c] = lane_y[c].data();
+	}
+
+	vector<unsigned int> lanes_inside;
+	lanes_inside.reserve(n);
+
+	while (!lanes.empty())
+	{
+		unsigned int m = lanes.size();
+
+		for (unsigned int c = 0; c < 6; c++)
+		{
+			for (unsigned int k = 0; k < m; k++)
+			{
+				lane_y[c][k]        = y[c][lanes[k]];
+				lane_y_before[c][k] = lane_y[c][k];
+			}
+		}
+
+		for (unsigned int k = 0; k < m; k++)
+		{
+			time[k]        = local_time[lanes[k]];
+			time_before[k] = time[k];
+			time_end[k]    = time[k] + simulation.time_resolution_laser;
+		}
+
+		push_evolve_batch(simulation.integrator, system, particle, m, time.data(), lane_y_pointers, time_end.data(), step, workspace);
+
+		lanes_inside.clear();
+
+		for (unsigned int k = 0; k < m; k++)
+		{
+			unsigned int j = lanes[k];
+
+			double y_before[6];
+			double y_after[6];
+
+			for (unsigned int c = 0; c < 6; c++)
+			{
+				y_before[c] = lane_y_before[c][k];
+				y_after[c]  = lane_y[c][k];
+			}
+
+			if (is_in_influence_radius(y_after, radius))
+			{
+				lanes_inside.push_back(j);
+
+				for (unsigned int c = 0; c < 6; c++)
+					y[c][j] = y_after[c];
+
+				local_time[j] = time[k];
+				continue;
+			}
+
+			double time_crossing = time_before[k];
+			push_ensemble_exit(simulation, particle, system, time_crossing, y_before, time[k], y_after);
+
+			for (unsigned int c = 0; c < 6; c++)
+				y[c][j] = y_before[c];
+
+			local_time[j] = time_crossing;
+		}
+
+		lanes.swap(lanes_inside);
+	}
+}
+
+/**
+ * The node motion of the particles of a chunk (all inside the same node)
+ */
+void simulate_ensemble_node(
+	Simulation& simulation,
+	Pulse& laser,
+	Particle& particle,
+	Laboratory& laboratory,
+	unsigned int node_index,
+	EnsembleState& ensemble,
+	vector<unsigned int>& chunk,
+	FunctionFieldType function_field,
+	FunctionFieldBatchType function_field_batch)
+{
+	Node& node = laboratory.nodes[node_index];
+	unsigned int n = chunk.size();
+
+	vector<double> local_time(n);
+	vector<double> local_time_enter(n);
+	vector<double> y[6];
+
+	for (unsigned int c = 0; c < 6; c++)
+		y[c].resize(n);
+
+	for (unsigned int j = 0; j < n; j++)
+	{
+		ParticleStateGlobal state_global;
+		ParticleStateLocal  state_local;
+
+		get_ensemble_particle(ensemble, chunk[j], state_global);
+		state_global_to_local(state_local, state_global, node);
+
+		if (laser.timing_mode == ENTER)
+			local_time[j] = laser.timing_offset;
+		else
+			local_time[j] = get_timing_local_time(simulation, laser, particle, state_local, node);
+
+		local_time_enter[j] = local_time[j];
+
+		y[0][j] = state_local.position_x;
+		y[1][j] = state_local.position_y;
+		y[2][j] = state_local.position_z;
+		y[3][j] = state_local.momentum_x;
+		y[4][j] = state_local.momentum_y;
+		y[5][j] = state_local.momentum_z;
+	}
+
+	// The ponderomotive model is integrated one particle at a time by simulate_node
+	if ((simulation.integrator == BORIS || simulation.integrator == VAY || simulation.integrator == HIGUERA_CARY) && !simulation.ponderomotive)
+	{
+		LaserBatchSystem system = {&laser, &simulation, function_field, function_field_batch, vector<double>(), NULL};
+		
+		if (laser.transfer_map_cache == NULL)
+		{
+			push_ensemble_node(simulation, particle, system, n, local_time, y);
+		}
+		else
+		{
+			// Only the particles without a known motion are pushed
+			vector<unsigned int> missed;
+			vector<double>       missed_local_time;
+			vector<double>       missed_y[6];
+			vector<double>       entries;
+
+			for (unsigned int j = 0; j < n; j++)
+			{
+				double entry[7];
+				double exit_state[7];
+
+				for (unsigned int c = 0; c < 6; c++)
+					entry[c] = y[c][j];
+
+				entry[6] = local_time[j];
+
+				if (lookup_transfer_map_cache(*laser.transfer_map_cache, entry, exit_state))
+				{
+					for (unsigned int c = 0; c < 6; c++)
+						y[c][j] = exit_state[c];
+
+					local_time[j] += exit_state[6];
+					continue;
+				}
+
+				missed.push_back(j);
+				missed_local_time.push_back(local_time[j]);
+				entries.insert(entries.end(), entry, entry + 7);
+
+				for (unsigned int c = 0; c < 6; c++)
+					missed_y[c].push_back(y[c][j]);
+			}
+
+			push_ensemble_node(simulation, particle, system, missed.size(), missed_local_time, missed_y);
+
+			for (unsigned int k = 0; k < missed.size(); k++)
+			{
+				unsigned int j = missed[k];
+				double exit_state[7];
+
+				for (unsigned int c = 0; c < 6; c++)
+				{
+					y[c][j]       = missed_y[c][k];
+					exit_state[c] = missed_y[c][k];
+				}
+
+				local_time[j] = missed_local_time[k];
+				exit_state[6] = local_time[j] - local_time_enter[j];
+
+				insert_transfer_map_cache(*laser.transfer_map_cache, &entries[7 * k], exit_state);
+			}
+		}
+	}
+	else
+	{
+		// The buffers (and the step size) of DOP853 are shared by the particles of the chunk
+		Dop853Workspace workspace;
+		dop853_init(workspace, 6, simulation.error_abs, simulation.error_rel, simulation.dense_output);
+
+		FunctionNodeTimeProgress on_node_time_progress = NULL;
+
+		for (unsigned int j = 0; j < n; j++)
+		{
+			ParticleStateLocal state_local;
+			state_local.position_x = y[0][j];
+			state_local.position_y = y[1][j];
+			state_local.position_z = y[2][j];
+			state_local.momentum_x = y[3][j];
+			state_local.momentum_y = y[4][j];
+			state_local.momentum_z = y[5][j];
+
+			SimluationResultNodeSummary summary;
+			simulate_node(simulation, laser, node, particle, state_local, local_time[j], ensemble.interactions[chunk[j]], on_node_time_progress, summary, function_field, workspace, RECORD_NONE);
+
+			y[0][j] = state_local.position_x;
+			y[1][j] = state_local.position_y;
+			y[2][j] = state_local.position_z;
+			y[3][j] = state_local.momentum_x;
+			y[4][j] = state_local.momentum_y;
+			y[5][j] = state_local.momentum_z;
+		}
+	}
+
+	for (unsigned int j = 0; j < n; j++)
+	{
+		unsigned int i = chunk[j];
+
+		ParticleStateLocal  state_local;
+		ParticleStateGlobal state_global;
+
+		state_local.position_x = y[0][j];
+		state_local.position_y = y[1][j];
+		state_local.position_z = y[2][j];
+		state_local.momentum_x = y[3][j];
+		state_local.momentum_y = y[4][j];
+		state_local.momentum_z = y[5][j];
+
+		state_local_to_global(state_global, state_local, node);
+		set_ensemble_particle(ensemble, i, state_global);
+
+		ensemble.time[i]		+= local_time[j] - local_time_enter[j];
+		ensemble.node_left[i]	 = node_index;
+		ensemble.node[i]		 = -1;
+		ensemble.interactions[i]++;
+	}
+}
+
+
+/**
+ * The ensemble with the space charge: every particle feels the other ones at the same global time.
+ *
+ * The particles inside the nodes (the lanes) are pushed together, from the same global time, every
+ * time_resolution_laser, so at every field evaluation they are at the same global instant (their local times differ by
+ * the node entry). The sources of the field are all the particles at that instant: the lanes and the others along their
+ * straight lines. A particle entering a node joins the lanes at the next step, moved along its line from the sphere
+ * (where the laser field is negligible) to the global time of the lanes. When no particle is inside a node the clock
+ * jumps to the next entry.
+ */
+void simulate_ensemble_space_charge(
+	Simulation& simulation,
+	Pulse& laser,
+	Particle& particle,
+	Laboratory& laboratory,
+	EnsembleState& ensemble,
+	FunctionFieldType function_field,
+	FunctionFieldBatchType function_field_batch,
+	FunctionEnsembleProgress& on_progress)
+{
+	unsigned int count  = ensemble.count;
+	double       radius = simulation.laser_influence_radius;
+	double       step   = simulation.time_resolution_laser / simulation.pusher_substeps;
+
+	EnsembleSpaceCharge space_charge;
+	space_charge.particle_charge = simulation.space_charge_bunch_charge / count;
+
+	vector<double>* buffers[] = {
+		&space_charge.lane_node_x, &space_charge.lane_node_y, &space_charge.lane_node_z,
+		&space_charge.free_x, &space_charge.free_y, &space_charge.free_z,
+		&space_charge.free_velocity_x, &space_charge.free_velocity_y, &space_charge.free_velocity_z,
+		&space_charge.x, &space_charge.y, &space_charge.z};
+
+	for (vector<double>* buffer: buffers)
+		buffer->reserve(count);
+
+	space_charge.lane_node.reserve(count);
+	space_charge.field.resize(3 * count);
+
+	LaserBatchSystem system = {&laser, &simulation, function_field, function_field_batch, vector<double>(count), &space_charge};
+
+	PusherBatchWorkspace workspace;
+	push_batch_init(workspace, count);
+
+	// The lanes: particle, node, local time and local state
+	vector<unsigned int> lane_particle;
+	vector<int>          lane_node;
+	vector<double>       lane_time(count);
+	vector<double>       lane_time_end(count);
+	vector<double>       lane_y[6];
+	double*              lane_y_pointers[6];
+	vector<double>       lane_y_before[6];
+	vector<bool>         in_lane(count, false);
+
+	for (unsigned int c = 0; c < 6; c++)
+	{
+		lane_y[c].resize(count);
+		lane_y_before[c].resize(count);
+		lane_y_pointers[c] = lane_y[c].data();
+	}
+
+	// A particle outside the nodes waits at its next entry (node >= 0) or it is at the end of the simulation
+	auto is_waiting = [&](unsigned int i)
+	{
+		return !in_lane[i] && ensemble.node[i] >= 0 && ensemble.time[i] < simulation.duration;
+	};
+
+	GlobalCoord time_global = ensemble.time[0];
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		time_global = min(time_global, ensemble.time[i]);
+
+		if (ensemble.node[i] < 0 && ensemble.time[i] < simulation.duration)
+			simulate_ensemble_free(simulation, laboratory, particle, ensemble, i);
+	}
+
+	unsigned int done = count + 1;
+
+	while (true)
+	{
+		// Entries until time_global
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (!is_waiting(i) || ensemble.time[i] > time_global)
+				continue;
+
+			Node& node = laboratory.nodes[ensemble.node[i]];
+
+			ParticleStateGlobal state_global;
+			ParticleStateLocal  state_local;
+
+			get_ensemble_particle(ensemble, i, state_global);
+			state_global_to_local(state_local, state_global, node);
+
+			double local_time = (laser.timing_mode == ENTER) ? laser.timing_offset : get_timing_local_time(simulation, laser, particle, state_local, node);
+			double delay      = global_coord_delta(time_global, ensemble.time[i]);
+
+			double velocity_x;
+			double velocity_y;
+			double velocity_z;
+			get_free_velocity(particle, state_global, velocity_x, velocity_y, velocity_z);
+
+			Vec3 velocity = frame_to_local(node.axis, velocity_x, velocity_y, velocity_z);
+
+			unsigned int k = lane_particle.size();
+
+			lane_particle.push_back(i);
+			lane_node.push_back(ensemble.node[i]);
+			lane_time[k] = local_time + delay;
+			lane_y[0][k] = state_local.position_x + velocity.x * delay;
+			lane_y[1][k] = state_local.position_y + velocity.y * delay;
+			lane_y[2][k] = state_local.position_z + velocity.z * delay;
+			lane_y[3][k] = state_local.momentum_x;
+			lane_y[4][k] = state_local.momentum_y;
+			lane_y[5][k] = state_local.momentum_z;
+			in_lane[i]   = true;
+		}
+
+		unsigned int done_now = 0;
+		for (unsigned int i = 0; i < count; i++)
+			if (!in_lane[i] && !is_waiting(i))
+				done_now++;
+
+		if (on_progress != NULL && done_now != done)
+			on_progress(done_now, count);
+
+		done = done_now;
+
+		unsigned int m = lane_particle.size();
+
+		if (m == 0)
+		{
+			// Nobody is inside a node: the clock jumps to the next entry
+			bool waiting = false;
+
+			for (unsigned int i = 0; i < count; i++)
+			{
+				if (!is_waiting(i))
+					continue;
+
+				time_global = waiting ? min(time_global, ensemble.time[i]) : ensemble.time[i];
+				waiting     = true;
+			}
+
+			if (!waiting)
+				break;
+
+			continue;
+		}
+
+		// The bunch at time_global, relative to the node of the first lane
+		Node& node_reference = laboratory.nodes[lane_node[0]];
+
+		space_charge.origin_x  = node_reference.position_x;
+		space_charge.origin_y  = node_reference.position_y;
+		space_charge.origin_z  = node_reference.position_z;
+		space_charge.lane_time = lane_time[0];
+
+		space_charge.lane_node.clear();
+		space_charge.lane_node_x.clear();
+		space_charge.lane_node_y.clear();
+		space_charge.lane_node_z.clear();
+
+		for (unsigned int k = 0; k < m; k++)
+		{
+			Node& node = laboratory.nodes[lane_node[k]];
+
+			space_charge.lane_node.push_back(&node);
+			space_charge.lane_node_x.push_back(global_coord_delta(node.position_x, space_charge.origin_x));
+			space_charge.lane_node_y.push_back(global_coord_delta(node.position_y, space_charge.origin_y));
+			space_charge.lane_node_z.push_back(global_coord_delta(node.position_z, space_charge.origin_z));
+		}
+
+		space_charge.free_x.clear();
+		space_charge.free_y.clear();
+		space_charge.free_z.clear();
+		space_charge.free_velocity_x.clear();
+		space_charge.free_velocity_y.clear();
+		space_charge.free_velocity_z.clear();
+
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (in_lane[i])
+				continue;
+
+			ParticleStateGlobal state;
+			get_ensemble_particle(ensemble, i, state);
+
+			double velocity_x;
+			double velocity_y;
+			double velocity_z;
+			get_free_velocity(particle, state, velocity_x, velocity_y, velocity_z);
+
+			// The state is the one at ensemble.time (the next entry or the end), on the same line
+			double delay = global_coord_delta(time_global, ensemble.time[i]);
+
+			space_charge.free_x.push_back(global_coord_delta(state.position_x, space_charge.origin_x) + velocity_x * delay);
+			space_charge.free_y.push_back(global_coord_delta(state.position_y, space_charge.origin_y) + velocity_y * delay);
+			space_charge.free_z.push_back(global_coord_delta(state.position_z, space_charge.origin_z) + velocity_z * delay);
+			space_charge.free_velocity_x.push_back(velocity_x);
+			space_charge.free_velocity_y.push_back(velocity_y);
+			space_charge.free_velocity_z.push_back(velocity_z);
+		}
+
+		space_charge.x.resize(count);
+		space_charge.y.resize(count);
+		space_charge.z.resize(count);
+
+		// One step of all the lanes
+		for (unsigned int k = 0; k < m; k++)
+		{
+			for (unsigned int c = 0; c < 6; c++)
+				lane_y_before[c][k] = lane_y[c][k];
+
+			lane_time_end[k] = lane_time[k] + simulation.time_resolution_laser;
+		}
+
+		vector<double> lane_time_before(lane_time.begin(), lane_time.begin() + m);
+
+		push_evolve_batch(simulation.integrator, system, particle, m, lane_time.data(), lane_y_pointers, lane_time_end.data(), step, workspace);
+
+		// Exits: the lanes outside the sphere go on with the free motion
+		unsigned int inside = 0;
+
+		for (unsigned int k = 0; k < m; k++)
+		{
+			unsigned int i = lane_particle[k];
+
+			double y_before[6];
+			double y_after[6];
+
+			for (unsigned int c = 0; c < 6; c++)
+			{
+				y_before[c] = lane_y_before[c][k];
+				y_after[c]  = lane_y[c][k];
+			}
+
+			if (is_in_influence_radius(y_after, radius))
+			{
+				lane_particle[inside] = i;
+				lane_node[inside]     = lane_node[k];
+				lane_time[inside]     = lane_time[k];
+
+				for (unsigned int c = 0; c < 6; c++)
+					lane_y[c][inside] = y_after[c];
+
+				inside++;
+				continue;
+			}
+
+			double time_crossing = lane_time_before[k];
+			push_ensemble_exit(simulation, particle, system, time_crossing, y_before, lane_time[k], y_after);
+
+			ParticleStateLocal  state_local;
+			ParticleStateGlobal state_global;
+
+			state_local.position_x = y_before[0];
+			state_local.position_y = y_before[1];
+			state_local.position_z = y_before[2];
+			state_local.momentum_x = y_before[3];
+			state_local.momentum_y = y_before[4];
+			state_local.momentum_z = y_before[5];
+
+			state_local_to_global(state_global, state_local, laboratory.nodes[lane_node[k]]);
+			set_ensemble_particle(ensemble, i, state_global);
+
+			ensemble.time[i]		 = time_global + (time_crossing - lane_time_before[k]);
+			ensemble.node_left[i]	 = lane_node[k];
+			ensemble.node[i]		 = -1;
+			ensemble.interactions[i]++;
+			in_lane[i] = false;
+
+			if (ensemble.time[i] < simulation.duration)
+				simulate_ensemble_free(simulation, laboratory, particle, ensemble, i);
+		}
+
+		lane_particle.resize(inside);
+		lane_node.resize(inside);
+
+		time_global += simulation.time_resolution_laser;
+	}
+}
+
+
+void simulate_ensemble(
+	Simulation& simulation,
+	Pulse& laser,
+	Particle& particle,
+	Laboratory& laboratory,
+	EnsembleState& ensemble,
+	FunctionFieldType function_field,
+	FunctionFieldBatchType function_field_batch,
+	FunctionEnsembleProgress& on_progress)
+{
+	for (unsigned int i = 0; i < ensemble.count; i++)
+		ensemble.node[i] = find_node_index_containing(laboratory, ensemble.position_x[i], ensemble.position_y[i], ensemble.position_z[i]);
+
+	if (simulation.space_charge)
+	{
+		simulate_ensemble_space_charge(simulation, laser, particle, laboratory, ensemble, function_field, function_field_batch, on_progress);
+		return;
+	}
+
+	// Particles not yet at the end of the simulation
+	vector<unsigned int> active;
+
+	for (unsigned int i = 0; i < ensemble.count; i++)
+		if (ensemble.time[i] < simulation.duration)
+			active.push_back(i);
+
+	if (on_progress != NULL) on_progress(ensemble.count - active.size(), ensemble.count);
+
+	while (!active.empty())
+	{
+		// Node motions: the particles inside the same node are pushed together
+		vector<vector<unsigned int>> groups(laboratory.nodes.size());
+
+		for (unsigned int i: active)
+			if (ensemble.node[i] >= 0)
+				groups[ensemble.node[i]].push_back(i);
+
+		vector<unsigned int>		 chunks_node;
+		vector<vector<unsigned int>> chunks;
+
+		for (unsigned int g = 0; g < groups.size(); g++)
+		{
+			for (unsigned int start = 0; start < groups[g].size(); start += ENSEMBLE_CHUNK_SIZE)
+			{
+				unsigned int end = min(start + ENSEMBLE_CHUNK_SIZE, (unsigned int) groups[g].size());
+
+				chunks_node.push_back(g);
+				chunks.push_back(vector<unsigned int>(groups[g].begin() + start, groups[g].begin() + end));
+			}
+		}
+
+		// The chunks have very different costs (a particle can cross the sphere near its border), so they are taken
+		// one at a time by the free threads
+		#pragma omp parallel for schedule(dynamic, 1)
+		for (unsigned int c = 0; c < chunks.size(); c++)
+			simulate_ensemble_node(simulation, laser, particle, laboratory, chunks_node[c], ensemble, chunks[c], function_field, function_field_batch);
+
+		// Free motions until the next node or the end of the simulation
+		#pragma omp parallel for schedule(dynamic, ENSEMBLE_CHUNK_SIZE)
+		for (unsigned int k = 0; k < active.size(); k++)
+		{
+			unsigned int i = active[k];
+
+			if (ensemble.time[i] < simulation.duration)
+				simulate_ensemble_free(simulation, laboratory, particle, ensemble, i);
+		}
+
+		vector<unsigned int> still_active;
+
+		for (unsigned int i: active)
+			if (ensemble.time[i] < simulation.duration)
+				still_active.push_back(i);
+
+		active.swap(still_active);
+
+		if (on_progress != NULL) on_progress(ensemble.count - active.size(), ensemble.count);
+	}
+}
@@ -0,0 +1,44 @@
+#include "type.hpp"
+
+#ifndef CIRCLESIM_ENSEMBLE
+#define CIRCLESIM_ENSEMBLE
+
+/**
+ * Simulation of a beam: many particles with the same rest mass and charge, but different initial states.
+ *
+ * The particles are advanced by phases. All the free motions are done (in closed form) until every particle is inside
+ * an influence radius or at the end of the simulation, then the particles inside the same node are pushed together,
+ * and so on. The groups are split in chunks of ENSEMBLE_CHUNK_SIZE particles, which the threads take dynamically.
+ *
+ * With the fixed step pushers the particles of a chunk are pushed in lockstep and their fields are evaluated with one
+ * call of the batched field function. The adaptive integrators choose a different step for every particle, so they
+ * integrate the particles of a chunk one at a time.
+ *
+ * With the space charge the particles are synchronized on the global time: all the particles inside the nodes are
+ * pushed together, every time_resolution_laser, and every one feels the Coulomb field (see space_charge.hpp) of the
+ * whole bunch at the same global instant, the particles outside the nodes moving along their straight lines. A particle
+ * joins the others at the first step after its entry, moved along its line inside the sphere of influence. There is no
+ * space charge during the free motion.
+ *
+ * Only the final states are kept (no samples, no callbacks). Without space charge the result of every particle is the
+ * one of simulate.
+ */
+
+#define ENSEMBLE_CHUNK_SIZE 256
+
+void init_ensemble(Simulation& simulation, ParticleStateGlobal& particle_state, EnsembleState& ensemble);
+
+void simulate_ensemble(
+	Simulation& simulation,
+	Pulse& laser,
+	Particle& particle,
+	Laboratory& laboratory,
+	EnsembleState& ensemble,
+	FunctionFieldType function_field,
+	FunctionFieldBatchType function_field_batch,
+	FunctionEnsembleProgress& on_progress);
+
+void get_ensemble_particle(EnsembleState& ensemble, unsigned int i, ParticleStateGlobal& state);
+void set_ensemble_particle(EnsembleState& ensemble, unsigned int i, ParticleStateGlobal& state);
+
+#endif
@@ -0,0 +1,346 @@
+#include <stdio.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <random>
+#include "field_cache.hpp"
+#include "simulator.hpp"
+#include "type.hpp"
+#include "util.hpp"
+
+// Change it every time the layout of the file changes, so old files are not loaded
+#define FIELD_CACHE_VERSION			1
+// The data starts after the header, aligned to a cache line
+#define FIELD_CACHE_HEADER_SIZE		128
+// Points where the field is sampled to recognize the same field in the following runs
+#define FIELD_CACHE_PROBES			256
+// Random points where the interpolation is compared with the field function
+#define FIELD_CACHE_CHECKS			20000
+
+typedef struct FieldCacheHeader
+{
+	char		magic[8];
+	uint64_t	version;
+	uint64_t	key;
+	uint32_t	nt;
+	uint32_t	nx;
+	uint32_t	ny;
+	uint32_t	nz;
+	double		time_start;
+	double		time_step;
+	double		space_start;
+	double		space_step;
+	double		error_e;
+	double		error_b;
+} FieldCacheHeader;
+
+static const char field_cache_magic[8] = {'C', 'S', 'F', 'C', 'A', 'C', 'H', 'E'};
+
+size_t get_field_cache_size(FieldCache& cache)
+{
+	return (size_t) cache.nt * cache.nx * cache.ny * cache.nz * 6 * sizeof(double);
+}
+
+/**
+ * The key identifies the lattice and the field: it is the hash of the lattice geometry and of the field function
+ * evaluated on some fixed points, so a change in the field function or in its parameters gives a different file.
+ */
+uint64_t get_field_cache_key(FieldCache& cache, Pulse& laser, FunctionFieldType function_field)
+{
+	uint64_t key = FNV1A_OFFSET_BASIS;
+	uint64_t version = FIELD_CACHE_VERSION;
+
+	key = hash_fnv1a(&version,            sizeof(version),            key);
+	key = hash_fnv1a(&cache.nt,           sizeof(cache.nt),           key);
+	key = hash_fnv1a(&cache.nx,           sizeof(cache.nx),           key);
+	key = hash_fnv1a(&cache.ny,           sizeof(cache.ny),           key);
+	key = hash_fnv1a(&cache.nz,           sizeof(cache.nz),           key);
+	key = hash_fnv1a(&cache.time_start,   sizeof(cache.time_start),   key);
+	key = hash_fnv1a(&cache.time_step,    sizeof(cache.time_step),    key);
+	key = hash_fnv1a(&cache.space_start,  sizeof(cache.space_start),  key);
+	key = hash_fnv1a(&cache.space_step,   sizeof(cache.space_step),   key);
+
+	mt19937_64 generator(FIELD_CACHE_VERSION);
+	uniform_real_distribution<double> distribution(0, 1);
+
+	for (unsigned int i = 0; i < FIELD_CACHE_PROBES; i++)
+	{
+		double t = cache.time_start  + distribution(generator) * (cache.nt - 1) * cache.time_step;
+		double x = cache.space_start + distribution(generator) * (cache.nx - 1) * cache.space_step;
+		double y = cache.space_start + distribution(generator) * (cache.ny - 1) * cache.space_step;
+		double z = cache.space_start + distribution(generator) * (cache.nz - 1) * cache.space_step;
+
+		Field field;
+		calculate_fields(C0 * t, x, y, z, laser, field, function_field);
+
+		key = hash_fnv1a(&field, sizeof(field), key);
+	}
+
+	return key;
+}
+
+bool load_field_cache(FieldCache& cache, fs::path path, uint64_t key)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+
+	if (fd < 0)
+		return false;
+
+	struct stat file_stat;
+	size_t size = FIELD_CACHE_HEADER_SIZE + get_field_cache_size(cache);
+
+	if (fstat(fd, &file_stat) != 0 || (size_t) file_stat.st_size != size)
+	{
+		close(fd);
+		return false;
+	}
+
+	void* mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (mapping == MAP_FAILED)
+		return false;
+
+	FieldCacheHeader& header = *((FieldCacheHeader*) mapping);
+
+	if (memcmp(header.magic, field_cache_magic, sizeof(field_cache_magic)) != 0 || header.version != FIELD_CACHE_VERSION || header.key != key ||
+		header.nt != cache.nt || header.nx != cache.nx || header.ny != cache.ny || header.nz != cache.nz)
+	{
+		munmap(mapping, size);
+		return false;
+	}
+
+	printf("Field cache loaded from '%s' (interpolation error E: %.2e, B: %.2e)\n", path.c_str(), header.error_e, header.error_b);
+
+	cache.mapping 		= mapping;
+	cache.mapping_size	= size;
+	cache.data			= (const double*) ((char*) mapping + FIELD_CACHE_HEADER_SIZE);
+
+	return true;
+}
+
+/**
+ * Fill the lattice and check the interpolation error. It returns false if the error is bigger than the one allowed.
+ */
+bool fill_field_cache(FieldCache& cache, double* data, Simulation& simulation, Pulse& laser, FunctionFieldType function_field, FunctionFieldBatchType function_field_batch, double& error_e, double& error_b)
+{
+	size_t slice = (size_t) cache.nx * cache.ny * cache.nz;
+
+	double max_e = 0;
+	double max_b = 0;
+
+	// Every x plane is evaluated with a single call of the batched field function
+	size_t plane = (size_t) cache.ny * cache.nz;
+
+	#pragma omp parallel for schedule(dynamic) reduction(max:max_e,max_b)
+	for (unsigned int it = 0; it < cache.nt; it++)
+	{
+		vector<double> buffer(10 * plane);
+
+		double* pos_t = &buffer[0 * plane];
+		double* pos_x = &buffer[1 * plane];
+		double* pos_y = &buffer[2 * plane];
+		double* pos_z = &buffer[3 * plane];
+
+		FieldBatch fields;
+		fields.e_x = &buffer[4 * plane];
+		fields.e_y = &buffer[5 * plane];
+		fields.e_z = &buffer[6 * plane];
+		fields.b_x = &buffer[7 * plane];
+		fields.b_y = &buffer[8 * plane];
+		fields.b_z = &buffer[9 * plane];
+
+		double* item = data + it * slice * 6;
+
+		for (unsigned int ix = 0; ix < cache.nx; ix++)
+		{
+			for (unsigned int iy = 0; iy < cache.ny; iy++)
+			for (unsigned int iz = 0; iz < cache.nz; iz++)
+			{
+				size_t p = (size_t) iy * cache.nz + iz;
+
+				pos_t[p] = C0 * (cache.time_start + it * cache.time_step);
+				pos_x[p] = cache.space_start + ix * cache.space_step;
+				pos_y[p] = cache.space_start + iy * cache.space_step;
+				pos_z[p] = cache.space_start + iz * cache.space_step;
+			}
+
+			calculate_fields_batch(plane, pos_t, pos_x, pos_y, pos_z, laser, fields, function_field_batch);
+
+			for (size_t p = 0; p < plane; p++)
+			{
+				item[0] = fields.e_x[p];
+				item[1] = fields.e_y[p];
+				item[2] = fields.e_z[p];
+				item[3] = fields.b_x[p];
+				item[4] = fields.b_y[p];
+				item[5] = fields.b_z[p];
+				item += 6;
+
+				max_e = max(max_e, vector_module(fields.e_x[p], fields.e_y[p], fields.e_z[p]));
+				max_b = max(max_b, vector_module(fields.b_x[p], fields.b_y[p], fields.b_z[p]));
+			}
+		}
+	}
+
+	cache.data = data;
+
+	// Checking the interpolation on random points inside the influence radius
+	double radius = simulation.laser_influence_radius;
+
+	vector<double> points(FIELD_CACHE_CHECKS * 4);
+	mt19937_64 generator(FIELD_CACHE_VERSION);
+	uniform_real_distribution<double> distribution(-1, 1);
+
+	for (unsigned int i = 0; i < FIELD_CACHE_CHECKS; i++)
+	{
+		double x, y, z;
+		do
+		{
+			x = distribution(generator);
+			y = distribution(generator);
+			z = distribution(generator);
+		}
+		while (x * x + y * y + z * z > 1);
+
+		points[4 * i + 0] = simulation.field_cache_time_start + (distribution(generator) + 1) / 2 * (simulation.field_cache_time_end - simulation.field_cache_time_start);
+		points[4 * i + 1] = x * radius;
+		points[4 * i + 2] = y * radius;
+		points[4 * i + 3] = z * radius;
+	}
+
+	double delta_e = 0;
+	double delta_b = 0;
+
+	#pragma omp parallel for reduction(max:delta_e,delta_b)
+	for (unsigned int i = 0; i < FIELD_CACHE_CHECKS; i++)
+	{
+		double t = points[4 * i + 0];
+		double x = points[4 * i + 1];
+		double y = points[4 * i + 2];
+		double z = points[4 * i + 3];
+
+		Field field_exact;
+		Field field_cached;
+		calculate_fields(C0 * t, x, y, z, laser, field_exact, function_field);
+
+		if (!lookup_field_cache(cache, t, x, y, z, field_cached))
+			continue;
+
+		delta_e = max(delta_e, vector_module(field_cached.e_x - field_exact.e_x, field_cached.e_y - field_exact.e_y, field_cached.e_z - field_exact.e_z));
+		delta_b = max(delta_b, vector_module(field_cached.b_x - field_exact.b_x, field_cached.b_y - field_exact.b_y, field_cached.b_z - field_exact.b_z));
+	}
+
+	cache.data = NULL;
+
+	error_e = (max_e > 0) ? delta_e / max_e : 0;
+	error_b = (max_b > 0) ? delta_b / max_b : 0;
+
+	printf("Field cache interpolation error E: %.2e, B: %.2e (max allowed %.2e)\n", error_e, error_b, simulation.field_cache_error);
+
+	return error_e <= simulation.field_cache_error && error_b <= simulation.field_cache_error;
+}
+
+/**
+ * Load the lattice from the cache directory or calculate it. If the interpolation is not accurate enough the cache
+ * is left empty (cache.data == NULL) and the field function is used directly.
+ */
+void build_field_cache(FieldCache& cache, Simulation& simulation, Pulse& laser, FunctionFieldType function_field, FunctionFieldBatchType function_field_batch)
+{
+	double radius = simulation.laser_influence_radius;
+
+	// One more point before and two more points after the covered interval, so every point inside it has the 4 points needed
+	cache.space_step	= simulation.field_cache_space_resolution;
+	cache.space_start	= -radius - cache.space_step;
+	cache.nx			= ceil(2 * radius / cache.space_step) + 4;
+	cache.ny			= cache.nx;
+	cache.nz			= cache.nx;
+
+	cache.time_step		= simulation.field_cache_time_resolution;
+	cache.time_start	= simulation.field_cache_time_start - cache.time_step;
+	cache.nt			= ceil((simulation.field_cache_time_end - simulation.field_cache_time_start) / cache.time_step) + 4;
+
+	cache.data			= NULL;
+	cache.mapping		= NULL;
+	cache.mapping_size	= 0;
+
+	uint64_t key = get_field_cache_key(cache, laser, function_field);
+
+	fs::path cache_dir = get_cache_directory();
+	fs::path path      = cache_dir / fs::path((bo::format("field_cache_%016llx.bin") % key).str());
+
+	if (load_field_cache(cache, path, key))
+		return;
+
+	size_t size = FIELD_CACHE_HEADER_SIZE + get_field_cache_size(cache);
+
+	printf("Building field cache %ux%ux%ux%u (%.1f MB)\n", cache.nt, cache.nx, cache.ny, cache.nz, size / 1048576.0);
+
+	// Written in a temporary file and renamed at the end, so a run never sees an half written lattice
+	fs::path path_tmp = cache_dir / fs::unique_path("field_cache_%%%%-%%%%-%%%%-%%%%.tmp");
+	int fd = open(path_tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0 || ftruncate(fd, size) != 0)
+	{
+		printf("ERROR - Unable to create the field cache file '%s'\n", path_tmp.c_str());
+		exit(-7);
+	}
+
+	void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (mapping == MAP_FAILED)
+	{
+		printf("ERROR - Unable to map the field cache file '%s'\n", path_tmp.c_str());
+		exit(-7);
+	}
+
+	FieldCacheHeader& header = *((FieldCacheHeader*) mapping);
+	double* data = (double*) ((char*) mapping + FIELD_CACHE_HEADER_SIZE);
+
+	bool accurate = fill_field_cache(cache, data, simulation, laser, function_field, function_field_batch, header.error_e, header.error_b);
+
+	if (!accurate)
+	{
+		printf("WARNING - The field cache is not accurate enough, the field function will be used. Try a lower resolution.\n");
+		munmap(mapping, size);
+		fs::remove(path_tmp);
+		return;
+	}
+
+	memcpy(header.magic, field_cache_magic, sizeof(field_cache_magic));
+	header.version		= FIELD_CACHE_VERSION;
+	header.key			= key;
+	header.nt			= cache.nt;
+	header.nx			= cache.nx;
+	header.ny			= cache.ny;
+	header.nz			= cache.nz;
+	header.time_start	= cache.time_start;
+	header.time_step	= cache.time_step;
+	header.space_start	= cache.space_start;
+	header.space_step	= cache.space_step;
+
+	msync(mapping, size, MS_SYNC);
+	munmap(mapping, size);
+
+	fs::rename(path_tmp, path);
+
+	if (!load_field_cache(cache, path, key))
+	{
+		printf("ERROR - Unable to load the field cache file '%s'\n", path.c_str());
+		exit(-7);
+	}
+}
+
+void release_field_cache(FieldCache& cache)
+{
+	if (cache.mapping != NULL)
+		munmap(cache.mapping, cache.mapping_size);
+
+	cache.data			= NULL;
+	cache.mapping		= NULL;
+	cache.mapping_size	= 0;
+}
@@ -0,0 +1,101 @@
+#include <math.h>
+#include "type.hpp"
+
+#ifndef CIRCLESIM_FIELD_CACHE
+#define CIRCLESIM_FIELD_CACHE
+
+/**
+ * Tabulated fields of the laser in the node local frame.
+ *
+ * Every node uses the same pulse, so the fields inside the influence radius are the same for every interaction: they are
+ * calculated once on a regular 4D lattice (t, x, y, z) and then interpolated with 4 points Lagrange polynomials on every
+ * axis (tricubic in space, cubic in time). The lattice is stored in a memory mapped file inside the cache directory, so
+ * the following runs with the same field and the same lattice load it instead of calculating it again.
+ */
+
+void build_field_cache(FieldCache& cache, Simulation& simulation, Pulse& laser, FunctionFieldType function_field, FunctionFieldBatchType function_field_batch);
+void release_field_cache(FieldCache& cache);
+
+/**
+ * Weights of the 4 points cubic Lagrange interpolation on the points -1, 0, 1, 2 evaluated in s ∈ [0,1)
+ */
+inline void get_field_cache_weights(double s, double w[])
+{
+	w[0] = -s * (s - 1) * (s - 2) / 6;
+	w[1] = (s + 1) * (s - 1) * (s - 2) / 2;
+	w[2] = -(s + 1) * s * (s - 2) / 2;
+	w[3] = (s + 1) * s * (s - 1) / 6;
+}
+
+/**
+ * Index of the first of the 4 points used to interpolate on an axis. Returns false if the point is outside the lattice.
+ */
+inline bool get_field_cache_index(double position, double start, double step, unsigned int count, unsigned int& index, double w[])
+{
+	double u = (position - start) / step;
+	double i = floor(u);
+
+	if (!(i >= 1 && i <= (double) count - 3))
+		return false;
+
+	index = (unsigned int) i - 1;
+	get_field_cache_weights(u - i, w);
+	return true;
+}
+
+/**
+ * Fields (A.U.) at local time t and local position x,y,z (A.U.). Returns false if the point is outside the lattice.
+ */
+inline bool lookup_field_cache(const FieldCache& cache, double t, double x, double y, double z, Field& field)
+{
+	unsigned int it, ix, iy, iz;
+	double wt[4], wx[4], wy[4], wz[4];
+
+	if (!get_field_cache_index(t, cache.time_start,  cache.time_step,  cache.nt, it, wt) ||
+		!get_field_cache_index(x, cache.space_start, cache.space_step, cache.nx, ix, wx) ||
+		!get_field_cache_index(y, cache.space_start, cache.space_step, cache.ny, iy, wy) ||
+		!get_field_cache_index(z, cache.space_start, cache.space_step, cache.nz, iz, wz))
+		return false;
+
+	size_t stride_z = 6;
+	size_t stride_y = stride_z * cache.nz;
+	size_t stride_x = stride_y * cache.ny;
+	size_t stride_t = stride_x * cache.nx;
+
+	double f[6] = {0, 0, 0, 0, 0, 0};
+
+	for (unsigned int a = 0; a < 4; a++)
+	{
+		for (unsigned int b = 0; b < 4; b++)
+		{
+			double w_tx = wt[a] * wx[b];
+
+			for (unsigned int c = 0; c < 4; c++)
+			{
+				double w_txy = w_tx * wy[c];
+				const double* item = cache.data + (it + a) * stride_t + (ix + b) * stride_x + (iy + c) * stride_y + iz * stride_z;
+
+				for (unsigned int d = 0; d < 4; d++)
+				{
+					double w = w_txy * wz[d];
+
+					for (unsigned int k = 0; k < 6; k++)
+						f[k] += w * item[k];
+
+					item += stride_z;
+				}
+			}
+		}
+	}
+
+	field.e_x = f[0];
+	field.e_y = f[1];
+	field.e_z = f[2];
+	field.b_x = f[3];
+	field.b_y = f[4];
+	field.b_z = f[5];
+
+	return true;
+}
+
+#endif
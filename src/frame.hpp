@@ -0,0 +1,114 @@
+#include "type.hpp"
+
+#ifndef CIRCLESIM_FRAME
+#define CIRCLESIM_FRAME
+
+/**
+ * Operations on the fixed size Vec3 and Mat3 and the transformations between the global frame and the local frame of a
+ * node. The local frame is rotated by R = node.axis and translated to the node position (a GlobalCoord like the
+ * global positions):
+ *
+ *   local  = R·(global - origin)
+ *   global = Rᵀ·local + origin
+ */
+
+inline Mat3 mat3_identity()
+{
+	Mat3 a = {{{1, 0, 0}, {0, 1, 0}, {0, 0, 1}}};
+	return a;
+}
+
+inline Mat3 mat3_transpose(const Mat3& a)
+{
+	Mat3 t;
+
+	for (unsigned int r = 0; r < 3; r++)
+		for (unsigned int c = 0; c < 3; c++)
+			t.m[r][c] = a.m[c][r];
+
+	return t;
+}
+
+inline Mat3 mat3_mul(const Mat3& a, const Mat3& b)
+{
+	Mat3 p;
+
+	for (unsigned int r = 0; r < 3; r++)
+		for (unsigned int c = 0; c < 3; c++)
+			p.m[r][c] = a.m[r][0] * b.m[0][c] + a.m[r][1] * b.m[1][c] + a.m[r][2] * b.m[2][c];
+
+	return p;
+}
+
+inline Vec3 mat3_mul(const Mat3& a, const Vec3& v)
+{
+	Vec3 p;
+
+	p.x = a.m[0][0] * v.x + a.m[0][1] * v.y + a.m[0][2] * v.z;
+	p.y = a.m[1][0] * v.x + a.m[1][1] * v.y + a.m[1][2] * v.z;
+	p.z = a.m[2][0] * v.x + a.m[2][1] * v.y + a.m[2][2] * v.z;
+
+	return p;
+}
+
+/**
+ * Rotation around the x (γ), y (β) or z (α) axis
+ */
+inline Mat3 mat3_rotation_x(double gamma)
+{
+	Mat3 a = {{{1, 0, 0}, {0, cos(gamma), -sin(gamma)}, {0, sin(gamma), cos(gamma)}}};
+	return a;
+}
+
+inline Mat3 mat3_rotation_y(double beta)
+{
+	Mat3 a = {{{cos(beta), 0, sin(beta)}, {0, 1, 0}, {-sin(beta), 0, cos(beta)}}};
+	return a;
+}
+
+inline Mat3 mat3_rotation_z(double alpha)
+{
+	Mat3 a = {{{cos(alpha), -sin(alpha), 0}, {sin(alpha), cos(alpha), 0}, {0, 0, 1}}};
+	return a;
+}
+
+/**
+ * R·v, without translation (momenta and directions)
+ */
+inline Vec3 frame_to_local(const Mat3& r, double x, double y, double z)
+{
+	Vec3 v = {x, y, z};
+	return mat3_mul(r, v);
+}
+
+/**
+ * R·(p - origin). The difference is done with GlobalCoord, so the local position keeps its precision far from the origin.
+ */
+inline Vec3 frame_to_local(const Mat3& r, const GlobalCoord& x, const GlobalCoord& y, const GlobalCoord& z, const GlobalCoord& origin_x, const GlobalCoord& origin_y, const GlobalCoord& origin_z)
+{
+	Vec3 v = {global_coord_delta(x, origin_x), global_coord_delta(y, origin_y), global_coord_delta(z, origin_z)};
+	return mat3_mul(r, v);
+}
+
+/**
+ * Rᵀ·v (r_t is the cached transpose), without translation
+ */
+inline Vec3 frame_to_global(const Mat3& r_t, double x, double y, double z)
+{
+	Vec3 v = {x, y, z};
+	return mat3_mul(r_t, v);
+}
+
+/**
+ * Rᵀ·v + origin
+ */
+inline void frame_to_global(const Mat3& r_t, double x, double y, double z, const GlobalCoord& origin_x, const GlobalCoord& origin_y, const GlobalCoord& origin_z, GlobalCoord& global_x, GlobalCoord& global_y, GlobalCoord& global_z)
+{
+	Vec3 p = frame_to_global(r_t, x, y, z);
+
+	global_x = origin_x + p.x;
+	global_y = origin_y + p.y;
+	global_z = origin_z + p.z;
+}
+
+#endif
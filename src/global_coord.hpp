@@ -0,0 +1,107 @@
+#ifndef CIRCLESIM_GLOBAL_COORD
+#define CIRCLESIM_GLOBAL_COORD
+
+/**
+ * Coordinate of the global frame (position or time) as a double-double: the value is hi + lo with |lo| ≤ ulp(hi)/2.
+ *
+ * The precision needed is explained in ParticleStateGlobal: 66 bits of mantissa. A double-double has 106 bits, like a
+ * 128 bit fixed point number, but it uses only the SSE/AVX (or NEON) double arithmetic, instead of the 80 bit x87 long
+ * double that can't be vectorized and that is a plain double (or a slow software quad) on other architectures.
+ *
+ * Only what the global bookkeeping needs is provided: sums and differences with doubles and other coordinates, the
+ * comparisons and the conversion to double. The sums are the error free transformations of Knuth and Dekker: they
+ * have no branches, so a loop over many coordinates can be vectorized. They need the IEEE rounding of every operation,
+ * so this file must not be compiled with -ffast-math (that would remove the error terms).
+ */
+
+#ifdef __FAST_MATH__
+#error "GlobalCoord needs IEEE arithmetic: don't compile circlesim with -ffast-math"
+#endif
+
+typedef struct GlobalCoord
+{
+	double hi;
+	double lo;
+
+	GlobalCoord() = default;
+	GlobalCoord(double value) : hi(value), lo(0) {}
+
+	explicit operator double() const { return hi + lo; }
+} GlobalCoord;
+
+/**
+ * s + e = a + b exactly
+ */
+inline void global_coord_two_sum(double a, double b, double& s, double& e)
+{
+	s = a + b;
+	double b_virtual = s - a;
+	e = (a - (s - b_virtual)) + (b - b_virtual);
+}
+
+/**
+ * s + e = a + b exactly when |a| ≥ |b|
+ */
+inline void global_coord_quick_two_sum(double a, double b, double& s, double& e)
+{
+	s = a + b;
+	e = b - (s - a);
+}
+
+inline GlobalCoord operator+(const GlobalCoord& a, double b)
+{
+	double s, e;
+	global_coord_two_sum(a.hi, b, s, e);
+	e += a.lo;
+
+	GlobalCoord r;
+	global_coord_quick_two_sum(s, e, r.hi, r.lo);
+	return r;
+}
+
+inline GlobalCoord operator+(const GlobalCoord& a, const GlobalCoord& b)
+{
+	double s1, s2, t1, t2;
+	global_coord_two_sum(a.hi, b.hi, s1, s2);
+	global_coord_two_sum(a.lo, b.lo, t1, t2);
+
+	s2 += t1;
+	global_coord_quick_two_sum(s1, s2, s1, s2);
+	s2 += t2;
+
+	GlobalCoord r;
+	global_coord_quick_two_sum(s1, s2, r.hi, r.lo);
+	return r;
+}
+
+inline GlobalCoord operator-(const GlobalCoord& a)
+{
+	GlobalCoord r;
+	r.hi = -a.hi;
+	r.lo = -a.lo;
+	return r;
+}
+
+inline GlobalCoord operator-(const GlobalCoord& a, double b)				{ return a + (-b); }
+inline GlobalCoord operator-(const GlobalCoord& a, const GlobalCoord& b)	{ return a + (-b); }
+
+inline GlobalCoord& operator+=(GlobalCoord& a, double b)					{ return a = a + b; }
+inline GlobalCoord& operator+=(GlobalCoord& a, const GlobalCoord& b)		{ return a = a + b; }
+inline GlobalCoord& operator-=(GlobalCoord& a, double b)					{ return a = a - b; }
+
+inline bool operator< (const GlobalCoord& a, const GlobalCoord& b)	{ return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo); }
+inline bool operator> (const GlobalCoord& a, const GlobalCoord& b)	{ return b < a; }
+inline bool operator<=(const GlobalCoord& a, const GlobalCoord& b)	{ return !(b < a); }
+inline bool operator>=(const GlobalCoord& a, const GlobalCoord& b)	{ return !(a < b); }
+inline bool operator==(const GlobalCoord& a, const GlobalCoord& b)	{ return a.hi == b.hi && a.lo == b.lo; }
+inline bool operator!=(const GlobalCoord& a, const GlobalCoord& b)	{ return !(a == b); }
+
+/**
+ * a - b rounded to double: the difference between two near coordinates keeps all its precision
+ */
+inline double global_coord_delta(const GlobalCoord& a, const GlobalCoord& b)
+{
+	return (double) (a - b);
+}
+
+#endif
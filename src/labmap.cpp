@@ -66,26 +66,26 @@ void get_node_center(Node& node, short axis_1, short axis_2, double& center_1, d
 	switch (axis_1)
 	{
 		case 1:
-			center_1 = node.position_x;
+			center_1 = (double) node.position_x;
 		break;
 		case 2:
-			center_1 = node.position_y;
+			center_1 = (double) node.position_y;
 		break;
 		case 3:
-			center_1 = node.position_z;
+			center_1 = (double) node.position_z;
 		break;
 	}
 	
 	switch (axis_2)
 	{
 		case 1:
-			center_2 = node.position_x;
+			center_2 = (double) node.position_x;
 		break;
 		case 2:
-			center_2 = node.position_y;
+			center_2 = (double) node.position_y;
 		break;
 		case 3:
-			center_2 = node.position_z;
+			center_2 = (double) node.position_z;
 		break;
 	}
 }
@@ -95,26 +95,26 @@ void get_particle_position(ParticleStateGlobal& state, short axis_1, short axis_
 	switch (axis_1)
 	{
 		case 1:
-			position_1 = state.position_x;
+			position_1 = (double) state.position_x;
 		break;
 		case 2:
-			position_1 = state.position_y;
+			position_1 = (double) state.position_y;
 		break;
 		case 3:
-			position_1 = state.position_z;
+			position_1 = (double) state.position_z;
 		break;
 	}
 
 	switch (axis_2)
 	{
 		case 1:
-			position_2 = state.position_x;
+			position_2 = (double) state.position_x;
 		break;
 		case 2:
-			position_2 = state.position_y;
+			position_2 = (double) state.position_y;
 		break;
 		case 3:
-			position_2 = state.position_z;
+			position_2 = (double) state.position_z;
 		break;
 	}
 }
@@ -132,18 +132,18 @@ void compute_lab_limits(Laboratory& laboratory, Simulation& simulation, vector<S
 	for (Node& node: laboratory.nodes)
 	{
 		if (lab_size.min_x > node.position_x)
-			lab_size.min_x = node.position_x;
+			lab_size.min_x = (double) node.position_x;
 		if (lab_size.min_y > node.position_y)
-			lab_size.min_y = node.position_y;
+			lab_size.min_y = (double) node.position_y;
 		if (lab_size.min_z > node.position_z)
-			lab_size.min_z = node.position_z;
+			lab_size.min_z = (double) node.position_z;
 			
 		if (lab_size.max_x < node.position_x)
-			lab_size.max_x = node.position_x;
+			lab_size.max_x = (double) node.position_x;
 		if (lab_size.max_y < node.position_y)
-			lab_size.max_y = node.position_y;
+			lab_size.max_y = (double) node.position_y;
 		if (lab_size.max_z < node.position_z)
-			lab_size.max_z = node.position_z;	
+			lab_size.max_z = (double) node.position_z;	
 	}
 	
 	if (simulation.labmap_full)
@@ -155,11 +155,11 @@ void compute_lab_limits(Laboratory& laboratory, Simulation& simulation, vector<S
 				ParticleStateGlobal& state = item.state;
 				
 				if (lab_size.max_x < state.position_x)
-					lab_size.max_x = state.position_x;
+					lab_size.max_x = (double) state.position_x;
 				if (lab_size.max_y < state.position_y)
-					lab_size.max_y = state.position_y;
+					lab_size.max_y = (double) state.position_y;
 				if (lab_size.max_z < state.position_z)
-					lab_size.max_z = state.position_z;		
+					lab_size.max_z = (double) state.position_z;		
 			}
 		}
 	}
@@ -307,12 +307,8 @@ void draw_particle(image<rgb_pixel>& image, int count_i, int count_j, ParticleSt
 }
 
 
-void get_node_field(Field& field, Node& node, Pulse& laser, LabSizePlane& lab_size, int i, int j, short axis_1, short axis_2, double local_time, FunctionFieldType function_field)
+void get_node_position(LabSizePlane& lab_size, int i, int j, short axis_1, short axis_2, double& local_position_x, double& local_position_y, double& local_position_z)
 {
-	double local_position_x;
-	double local_position_y;
-	double local_position_z;
-	
 	if (axis_1 == 1 && axis_2 == 2)
 	{
 		local_position_x =  i * lab_size.dr;
@@ -354,12 +350,62 @@ void get_node_field(Field& field, Node& node, Pulse& laser, LabSizePlane& lab_si
 		printf("ERROR - Unexprect combination of axis1 and axis2. Contact developer.\n");
 		exit(-2);
 	}
+}
+
+/**
+ * Pixels (relative to the node center) inside the laser influence radius
+ */
+void get_node_pixels(Simulation& simulation, LabSizePlane& lab_size, vector<int>& pixels_i, vector<int>& pixels_j)
+{
+	int radius = trunc(simulation.laser_influence_radius / lab_size.dr);
+	
+	for (int i = -radius + 1; i < radius - 1; i++)
+	{
+		for (int j = -radius + 1; j < radius - 1; j++)
+		{
+			if (i * i + j * j  < radius * radius)
+			{
+				pixels_i.push_back(i);
+				pixels_j.push_back(j);
+			}
+		}
+	}
+}
 
-	calculate_fields(local_time * C0, local_position_x, local_position_y, local_position_z, laser, field, function_field);
+/**
+ * Fields of all the pixels at the same local time, evaluated with a single call of the batched field function.
+ * The fields are stored in buffer.
+ */
+void get_node_fields(FieldBatch& fields, vector<double>& buffer, Pulse& laser, LabSizePlane& lab_size, vector<int>& pixels_i, vector<int>& pixels_j, short axis_1, short axis_2, double local_time, FunctionFieldBatchType function_field_batch)
+{
+	unsigned int count = pixels_i.size();
+	
+	buffer.resize(10 * count);
+	
+	double* pos_t = &buffer[0 * count];
+	double* pos_x = &buffer[1 * count];
+	double* pos_y = &buffer[2 * count];
+	double* pos_z = &buffer[3 * count];
+	
+	for (unsigned int p = 0; p < count; p++)
+	{
+		pos_t[p] = local_time * C0;
+		get_node_position(lab_size, pixels_i[p], pixels_j[p], axis_1, axis_2, pos_x[p], pos_y[p], pos_z[p]);
+	}
+	
+	fields.e_x = &buffer[4 * count];
+	fields.e_y = &buffer[5 * count];
+	fields.e_z = &buffer[6 * count];
+	fields.b_x = &buffer[7 * count];
+	fields.b_y = &buffer[8 * count];
+	fields.b_z = &buffer[9 * count];
+	
+	if (count > 0)
+		calculate_fields_batch(count, pos_t, pos_x, pos_y, pos_z, laser, fields, function_field_batch);
 }
 
 
-void draw_field(image<rgb_pixel>& image, int count_i, int count_j, SimluationResultNodeItem& item, Node& node, LabMapLimit& limit, LabSizePlane& lab_size, short axis_1, short axis_2, Simulation& simulation, Pulse& laser, FunctionFieldType function_field)
+void draw_field(image<rgb_pixel>& image, int count_i, int count_j, SimluationResultNodeItem& item, Node& node, LabMapLimit& limit, LabSizePlane& lab_size, short axis_1, short axis_2, Simulation& simulation, Pulse& laser, FunctionFieldBatchType function_field_batch)
 {
 	double center_1, center_2;
 	get_node_center(node, axis_1, axis_2, center_1, center_2);
@@ -367,38 +413,51 @@ void draw_field(image<rgb_pixel>& image, int count_i, int count_j, SimluationRes
 	int global_center_i = get_i(lab_size, center_1);
 	int global_center_j = get_j(lab_size, center_2);
 	
-	int radius = trunc(simulation.laser_influence_radius / lab_size.dr);
+	vector<int> node_pixels_i;
+	vector<int> node_pixels_j;
+	get_node_pixels(simulation, lab_size, node_pixels_i, node_pixels_j);
 	
-	for (int i = -radius + 1; i < radius - 1; i++)
+	// Only the pixels still with the background color are drawn
+	vector<int> pixels_i;
+	vector<int> pixels_j;
+	
+	for (unsigned int p = 0; p < node_pixels_i.size(); p++)
 	{
-		for (int j = -radius + 1; j < radius - 1; j++)
+		int i = node_pixels_i[p];
+		int j = node_pixels_j[p];
+		
+		rgb_pixel current_color = image[global_center_j+j][global_center_i+i];
+		if (current_color.red == color_bg.red && current_color.green == color_bg.green && current_color.blue == color_bg.blue)
 		{
-			if (i * i + j * j  < radius * radius)
-			{
-				rgb_pixel current_color = image[global_center_j+j][global_center_i+i];
-				if (current_color.red == color_bg.red && current_color.green == color_bg.green && current_color.blue == color_bg.blue)
-				{
-					Field field;
-					get_node_field(field, node, laser, lab_size, i, j, axis_1, axis_2, item.local_time, function_field);
-					
-					double value     = vector_module(field.e_x, field.e_y, field.e_z);
-					double value_max = limit.e_mod_max;
-					
-					unsigned short red   = 0xff;
-					unsigned short green = 0xff;
-					unsigned short blue  = 0xff;
-					
-					if (value_max > 0)
-					{
-						red   = 255 - round(0xff * value/value_max);
-						green = 255 - round(0x7f * value/value_max);
-						blue  = 255 - round(0x00 * value/value_max);
-					}
-					
-					image[global_center_j+j][global_center_i+i] = rgb_pixel(red, green, blue);
-				}
-			}
+			pixels_i.push_back(i);
+			pixels_j.push_back(j);
+		}
+	}
+	
+	FieldBatch fields;
+	vector<double> buffer;
+	get_node_fields(fields, buffer, laser, lab_size, pixels_i, pixels_j, axis_1, axis_2, item.local_time, function_field_batch);
+	
+	for (unsigned int p = 0; p < pixels_i.size(); p++)
+	{
+		int i = pixels_i[p];
+		int j = pixels_j[p];
+		
+		double value     = vector_module(fields.e_x[p], fields.e_y[p], fields.e_z[p]);
+		double value_max = limit.e_mod_max;
+		
+		unsigned short red   = 0xff;
+		unsigned short green = 0xff;
+		unsigned short blue  = 0xff;
+		
+		if (value_max > 0)
+		{
+			red   = 255 - round(0xff * value/value_max);
+			green = 255 - round(0x7f * value/value_max);
+			blue  = 255 - round(0x00 * value/value_max);
 		}
+		
+		image[global_center_j+j][global_center_i+i] = rgb_pixel(red, green, blue);
 	}
 	
 }
@@ -456,7 +515,7 @@ void draw_free(image<rgb_pixel> frame_base, SimluationResultFreeSummary& summary
 	}
 }
 
-void draw_node(image<rgb_pixel> frame_base, Simulation& simulation, SimluationResultNodeSummary& summary_node, LabSizePlane& lab_size, LabMapLimit& limit, int count_i, int count_j, short axis_1, short axis_2, double dt, long unsigned int& t, Pulse& laser, FunctionFieldType function_field, fs::path output_dir)
+void draw_node(image<rgb_pixel> frame_base, Simulation& simulation, SimluationResultNodeSummary& summary_node, LabSizePlane& lab_size, LabMapLimit& limit, int count_i, int count_j, short axis_1, short axis_2, double dt, long unsigned int& t, Pulse& laser, FunctionFieldBatchType function_field_batch, fs::path output_dir)
 {
 	double last_time  = summary_node.items.front().local_time;
 
@@ -474,7 +533,7 @@ void draw_node(image<rgb_pixel> frame_base, Simulation& simulation, SimluationRe
 					frame[j][i] = frame_base[j][i];	
 					
 			// Drawing fields
-			draw_field(frame, count_i, count_j, item, summary_node.node, limit, lab_size, axis_1, axis_2, simulation, laser, function_field);
+			draw_field(frame, count_i, count_j, item, summary_node.node, limit, lab_size, axis_1, axis_2, simulation, laser, function_field_batch);
 				
 			// Drawing particle
 			ParticleStateGlobal state_global;
@@ -492,7 +551,7 @@ void draw_node(image<rgb_pixel> frame_base, Simulation& simulation, SimluationRe
 }
 
 
-void get_field_limits(Simulation& simulation, Pulse& laser, LabSizePlane& lab_size, LabMapLimit& limit, vector<SimluationResultNodeSummary>& summaries_node, short axis_1, short axis_2, FunctionFieldType function_field)
+void get_field_limits(Simulation& simulation, Pulse& laser, LabSizePlane& lab_size, LabMapLimit& limit, vector<SimluationResultNodeSummary>& summaries_node, short axis_1, short axis_2, FunctionFieldBatchType function_field_batch)
 {
 	limit.e_mod_min = +INFINITY;
 	limit.b_mod_min = +INFINITY;
@@ -500,7 +559,12 @@ void get_field_limits(Simulation& simulation, Pulse& laser, LabSizePlane& lab_si
 	limit.e_mod_max = -INFINITY;
 	limit.b_mod_max = -INFINITY;
 	
-	int radius = trunc(simulation.laser_influence_radius / lab_size.dr);
+	vector<int> pixels_i;
+	vector<int> pixels_j;
+	get_node_pixels(simulation, lab_size, pixels_i, pixels_j);
+	
+	FieldBatch fields;
+	vector<double> buffer;
 	
 	for (SimluationResultNodeSummary& summary_node: summaries_node)
 	{
@@ -513,25 +577,17 @@ void get_field_limits(Simulation& simulation, Pulse& laser, LabSizePlane& lab_si
 		
 			if (current_time >= simulation.time_resolution_free)
 			{
-				for (int i = -radius + 1; i < radius - 1; i++)
+				get_node_fields(fields, buffer, laser, lab_size, pixels_i, pixels_j, axis_1, axis_2, item.local_time, function_field_batch);
+				
+				for (unsigned int p = 0; p < pixels_i.size(); p++)
 				{
-					for (int j = -radius + 1; j < radius - 1; j++)
-					{
-						if (i * i + j * j < radius * radius)
-						{
-							Field field;
-							
-							get_node_field(field, summary_node.node, laser, lab_size, i, j, axis_1, axis_2, item.local_time, function_field);
-							
-							double e_mod = vector_module(field.e_x, field.e_y, field.e_z);
-							double b_mod = vector_module(field.b_x, field.b_y, field.b_z);
-							
-							if (e_mod < limit.e_mod_min) limit.e_mod_min = e_mod;
-							if (e_mod > limit.e_mod_max) limit.e_mod_max = e_mod;
-							if (b_mod < limit.b_mod_min) limit.b_mod_min = b_mod;
-							if (b_mod > limit.b_mod_max) limit.b_mod_max = b_mod;
-						}
-					}
+					double e_mod = vector_module(fields.e_x[p], fields.e_y[p], fields.e_z[p]);
+					double b_mod = vector_module(fields.b_x[p], fields.b_y[p], fields.b_z[p]);
+					
+					if (e_mod < limit.e_mod_min) limit.e_mod_min = e_mod;
+					if (e_mod > limit.e_mod_max) limit.e_mod_max = e_mod;
+					if (b_mod < limit.b_mod_min) limit.b_mod_min = b_mod;
+					if (b_mod > limit.b_mod_max) limit.b_mod_max = b_mod;
 				}
 				
 				last_time += simulation.time_resolution_free;
@@ -541,7 +597,7 @@ void get_field_limits(Simulation& simulation, Pulse& laser, LabSizePlane& lab_si
 }
 
 
-void render_labmap(Laboratory& laboratory, Simulation& simulation, Pulse& laser, vector<SimluationResultFreeSummary>& summaries_free, vector<SimluationResultNodeSummary>& summaries_node, short axis_1, short axis_2, FunctionFieldType function_field, fs::path output_dir)
+void render_labmap(Laboratory& laboratory, Simulation& simulation, Pulse& laser, vector<SimluationResultFreeSummary>& summaries_free, vector<SimluationResultNodeSummary>& summaries_node, short axis_1, short axis_2, FunctionFieldBatchType function_field_batch, fs::path output_dir)
 {
 	
 	LabSizeGlobal lab_size_global;
@@ -558,7 +614,7 @@ void render_labmap(Laboratory& laboratory, Simulation& simulation, Pulse& laser,
 	frame_base.write((output_dir / fs::path((bo::format("labmap_%s%s_base.png") % get_axis(axis_1) % get_axis(axis_2)).str())).string());
 
 	LabMapLimit limit;
-	get_field_limits(simulation, laser, lab_size, limit, summaries_node, axis_1, axis_2, function_field);
+	get_field_limits(simulation, laser, lab_size, limit, summaries_node, axis_1, axis_2, function_field_batch);
 
 	unsigned long t = 0;
 	
@@ -578,7 +634,7 @@ void render_labmap(Laboratory& laboratory, Simulation& simulation, Pulse& laser,
 			}
 			else
 			{
-				draw_node(frame_base, simulation, summaries_node[n], lab_size, limit, count_i, count_j, axis_1, axis_2, simulation.time_resolution_free, t, laser, function_field, output_dir);
+				draw_node(frame_base, simulation, summaries_node[n], lab_size, limit, count_i, count_j, axis_1, axis_2, simulation.time_resolution_free, t, laser, function_field_batch, output_dir);
 				n++;
 			}
 		}
@@ -589,7 +645,7 @@ void render_labmap(Laboratory& laboratory, Simulation& simulation, Pulse& laser,
 		}
 		else if (n < summaries_node.size())
 		{
-			draw_node(frame_base, simulation, summaries_node[n], lab_size, limit, count_i, count_j, axis_1, axis_2, simulation.time_resolution_free, t, laser, function_field, output_dir);
+			draw_node(frame_base, simulation, summaries_node[n], lab_size, limit, count_i, count_j, axis_1, axis_2, simulation.time_resolution_free, t, laser, function_field_batch, output_dir);
 			n++;
 		}
 	}
@@ -14,6 +14,14 @@
 #include "labmap.hpp"
 #include "script.hpp"
 #include "field_map.hpp"
+#include "node_index.hpp"
+#include "field_cache.hpp"
+#include "transfer_map_cache.hpp"
+#include "closed_orbit.hpp"
+#include "ponderomotive.hpp"
+#include "unit.hpp"
+#include "ensemble.hpp"
+#include "space_charge.hpp"
 
 extern string exe_path;
 extern string exe_name;
@@ -25,11 +33,13 @@ void print_help()
 	
 	printf("Usage:\n\n");
 	printf("  %s -c <config_file.cfg> [-o <output_dir>] [-j <num_threads>]\n", exe_name.c_str());
+	printf("  %s --space-charge-benchmark <particles> [-j <num_threads>]\n", exe_name.c_str());
 	printf("  %s -h\n", exe_name.c_str());
 	printf("\n");
 	printf("  -o  --output  <output_dir>                Set output directory (default /tmp)\n");
 	printf("  -c  --config  <config_file>               Set configuration file\n");
 	printf("  -j  --threads <num_threads>               Set how many threads to use (default 1)\n");
+	printf("      --space-charge-benchmark <particles>  Compare the space charge tree with the direct sum and exit\n");
 	printf("  -h  --help                                Print this help menu\n");
 	printf("\n");
 }
@@ -49,6 +59,7 @@ int main(int argc, char *argv[])
 	fs::path cfg_file_orig = fs::path("");
 	fs::path base_dir = fs::current_path();
 	int num_threads = 1;
+	unsigned int benchmark_particles = 0;
 
 	int flag;
 	static struct option long_options[] = {
@@ -56,6 +67,7 @@ int main(int argc, char *argv[])
 		{"output",  1, 0, 'o'},
 		{"threads", 1, 0, 'j'},
 		{"config",  1, 0, 'c'},
+		{"space-charge-benchmark", 1, 0, 'b'},
 		{NULL, 0, NULL, 0}
 	};
 	
@@ -73,6 +85,9 @@ int main(int argc, char *argv[])
 		case 'j':
 			num_threads = stoi(optarg);
 			break;
+		case 'b':
+			benchmark_particles = stoi(optarg);
+			break;
 		case 'h':
 			print_help();
 			exit(0);
@@ -89,6 +104,15 @@ int main(int argc, char *argv[])
 	}
 	
 	
+	if (benchmark_particles > 0)
+	{
+		if (num_threads >= 1)
+			omp_set_num_threads(num_threads);
+		
+		benchmark_space_charge(benchmark_particles);
+		exit(0);
+	}
+	
 	if (cfg_file_orig == fs::path(""))
 	{
 		printf("Please specify the configuration filename using the -c flag\n");
@@ -147,21 +171,17 @@ int main(int argc, char *argv[])
 	vector<ResponseAnalysis>    response_analyses;
 	
 	// Convert the config file to a SI compliant version
-	fs::path cfg_file_si_tmp = fs::temp_directory_path() / fs::unique_path();
-	string convert_cmd = (bo::format("java -jar '%s/util/unit/ConfigUnitConvertor.jar' --convert-cfg SI '%s/util/unit/conversions.csv' '%s' '%s'") % exe_path % exe_path % cfg_file_orig.string() % cfg_file_si_tmp.string()).str();
-	int convert_status = system(convert_cmd.c_str());
+	UnitConversions conversions;
+	load_unit_conversions(fs::path(exe_path) / fs::path("util/unit/conversions.csv"), conversions);
 	
-	if (convert_status != 0)
-	{
-		printf("ERROR - There was a problem when converting the units to SI system. Please check the output above.\n");
-		printf("Executed cmd: %s\n", convert_cmd.c_str());
-		exit(-2);
-	}
+	string cfg_si = convert_config_units(conversions, cfg_file_orig);
 	
-	vector<string> headers;
-	vector<string> sources;
+	CustomScripts scripts;
 	
-	read_config(cfg_file_si_tmp, simulation, laser, particle, particle_state, laboratory, field_renders, response_analyses, headers, sources);
+	read_config(cfg_si, simulation, laser, particle, particle_state, laboratory, field_renders, response_analyses, scripts);
+	
+	// Indexing the nodes, so we can quickly find which influence radius the particle is crossing
+	build_node_index(laboratory, simulation.laser_influence_radius);
 	
 	particle_state_initial = particle_state;
 	
@@ -182,13 +202,16 @@ int main(int argc, char *argv[])
 	fs::create_directories(output_dir);
 	fs::copy_file(cfg_file_orig,   output_dir / fs::path("parameters_orig.cfg"));
 	
-	fs::path cfg_file_si = output_dir / fs::path("parameters_si.cfg");
-	fs::copy_file(cfg_file_si_tmp, cfg_file_si);
-	fs::remove(fs::path(cfg_file_si_tmp));
+	ofstream stream_cfg_si;
+	stream_cfg_si.open((output_dir / fs::path("parameters_si.cfg")).string());
+	stream_cfg_si << cfg_si;
+	stream_cfg_si.close();
 	
 	// Append to README.txt the conversion units used
-	string units_txt_cmd = (bo::format("java -jar '%s/util/unit/ConfigUnitConvertor.jar' --print-units SI '%s/util/unit/conversions.csv' >> %s/README.txt") %  exe_path % exe_path % output_dir.string()).str();
-	system(units_txt_cmd.c_str());
+	ofstream stream_readme;
+	stream_readme.open((output_dir / fs::path("README.txt")).string(), ios::app);
+	print_units(conversions, stream_readme);
+	stream_readme.close();
 	
 	ofstream stream_node;
 	stream_node.open(get_filename_node(output_dir));
@@ -199,7 +222,7 @@ int main(int argc, char *argv[])
 	
 	
 	// Building auxiliary library
-	build_auxiliary_library(headers, sources, output_dir);
+	build_auxiliary_library(scripts, output_dir, simulation.func_fast_math);
 	
 	fs::path shared_lib = output_dir / fs::path("custom_scripts.so");
 	void* custom_lib = dlopen(shared_lib.string().c_str(), RTLD_NOW);
@@ -225,6 +248,64 @@ int main(int argc, char *argv[])
 		exit(-5);
 	}
 	
+	const size_t* field_params_size		= (const size_t*) dlsym(custom_lib, "field_params_size");
+	const size_t* field_params_offsets	= (const size_t*) dlsym(custom_lib, "field_params_offsets");
+	
+	if ((error = dlerror()) != NULL)
+	{
+		printf("ERROR - Error during dynamic variable '%s' loading: %s\n", "field_params", error);
+		exit(-5);
+	}
+	
+	init_laser_params_data(laser, *field_params_size, field_params_offsets);
+	
+	FunctionFieldBatchType function_field_batch = (FunctionFieldBatchType) dlsym(custom_lib, "field_batch");
+	
+	if ((error = dlerror()) != NULL)
+	{
+		printf("ERROR - Error during dynamic function '%s' loading: %s\n", "field_batch", error);
+		exit(-5);
+	}
+	
+	// Fields with their derivatives for the sensitivity analyses
+	if (scripts.dual_variables > 0)
+	{
+		laser.function_field_dual = (FunctionFieldDualType) dlsym(custom_lib, "field_dual");
+		
+		if ((error = dlerror()) != NULL)
+		{
+			printf("ERROR - Error during dynamic function '%s' loading: %s\n", "field_dual", error);
+			exit(-5);
+		}
+	}
+	
+	// Tabulating the fields inside the influence radius
+	FieldCache field_cache;
+	
+	if (simulation.field_cache)
+	{
+		build_field_cache(field_cache, simulation, laser, function_field, function_field_batch);
+		
+		if (field_cache.data != NULL)
+			laser.field_cache = &field_cache;
+	}
+	
+	// Envelope of the ponderomotive model (extracted from the fields if not given)
+	if (simulation.ponderomotive)
+	{
+		laser.function_envelope = (FunctionEnvelopeType) dlsym(custom_lib, "envelope");
+		dlerror();
+	}
+	
+	// Reusing the node motions of near entry states
+	TransferMapCache transfer_map_cache;
+	
+	if (simulation.transfer_map_cache)
+	{
+		init_transfer_map_cache(transfer_map_cache, simulation);
+		laser.transfer_map_cache = &transfer_map_cache;
+	}
+	
 	for (FieldRender& render: field_renders)
 	{
 		string function_name = (bo::format("func_field_render_%s") % render.id).str();
@@ -285,12 +366,12 @@ int main(int argc, char *argv[])
 		}
 	};
 	
-	FunctionFreeEnter        on_free_enter          = [&](Simulation& simulation, Particle& particle, ParticleStateGlobal& particle_state, Laboratory& laboratory, long double time_global) mutable
+	FunctionFreeEnter        on_free_enter          = [&](Simulation& simulation, Particle& particle, ParticleStateGlobal& particle_state, Laboratory& laboratory, GlobalCoord time_global) mutable
 	{
 		write_particle(stream_particle, time_global, particle_state);
 	};
 	
-	FunctionFreeTimeProgress on_free_time_progress  = [&](Simulation& simulation, Particle& particle, ParticleStateGlobal& particle_state, Laboratory& laboratory, long double time_global) mutable
+	FunctionFreeTimeProgress on_free_time_progress  = [&](Simulation& simulation, Particle& particle, ParticleStateGlobal& particle_state, Laboratory& laboratory, GlobalCoord time_global) mutable
 	{
 		printf("\rSimulating free: %3.4f%%", (double) time_global / simulation.duration * 100);
 		fflush(stdout);
@@ -299,7 +380,7 @@ int main(int argc, char *argv[])
 		
 	};
 	
-	FunctionFreeExit         on_free_exit           = [&](Simulation& simulation, Particle& particle, ParticleStateGlobal& particle_state, Laboratory& laboratory, long double time_global) mutable
+	FunctionFreeExit         on_free_exit           = [&](Simulation& simulation, Particle& particle, ParticleStateGlobal& particle_state, Laboratory& laboratory, GlobalCoord time_global) mutable
 	{
 		write_particle(stream_particle, time_global, particle_state);
 		printf("\n");
@@ -323,20 +404,77 @@ int main(int argc, char *argv[])
 	{
 		#pragma omp section
 		{
-				render_labmap(laboratory, simulation, laser, summaries_free, summaries_node, 1, 2, *function_field, output_dir);
+				render_labmap(laboratory, simulation, laser, summaries_free, summaries_node, 1, 2, *function_field_batch, output_dir);
 		}
 		
 		#pragma omp section 
 		{
-				render_labmap(laboratory, simulation, laser, summaries_free, summaries_node, 1, 3, *function_field, output_dir);
+				render_labmap(laboratory, simulation, laser, summaries_free, summaries_node, 1, 3, *function_field_batch, output_dir);
 		}
 		
 		#pragma omp section 
 		{
-				render_labmap(laboratory, simulation, laser, summaries_free, summaries_node, 2, 3, *function_field, output_dir);
+				render_labmap(laboratory, simulation, laser, summaries_free, summaries_node, 2, 3, *function_field_batch, output_dir);
 		}
 	}
 	
+	// Executing the ensemble simulation
+	if (simulation.ensemble)
+	{
+		EnsembleState ensemble;
+		init_ensemble(simulation, particle_state_initial, ensemble);
+		
+		ofstream stream_ensemble;
+		stream_ensemble.open(get_filename_ensemble(output_dir, true));
+		setup_ensemble(stream_ensemble);
+		write_ensemble(stream_ensemble, ensemble);
+		stream_ensemble.close();
+		
+		FunctionEnsembleProgress on_ensemble_progress = [&](unsigned int particles_done, unsigned int particles_count) mutable
+		{
+			printf("\rSimulating ensemble: %u/%u", particles_done, particles_count);
+			fflush(stdout);
+		};
+		
+		simulate_ensemble(simulation, laser, particle, laboratory, ensemble, *function_field, *function_field_batch, on_ensemble_progress);
+		printf("\n");
+		
+		stream_ensemble.open(get_filename_ensemble(output_dir, false));
+		setup_ensemble(stream_ensemble);
+		write_ensemble(stream_ensemble, ensemble);
+		stream_ensemble.close();
+	}
+	
+	// Searching the closed orbit and the one turn map
+	if (simulation.closed_orbit)
+	{
+		printf("Searching closed orbit\n");
+		
+		ClosedOrbit closed_orbit;
+		find_closed_orbit(simulation, laser, particle, particle_state_initial, laboratory, closed_orbit, *function_field);
+		
+		for (unsigned int i = 0; i < closed_orbit.residuals.size(); i++)
+			printf("  iteration %u: residual %.3e tolerances\n", i + 1, closed_orbit.residuals[i]);
+		
+		if (!closed_orbit.converged)
+			printf("WARNING: The closed orbit search didn't converge in %u iterations: closed_orbit.csv has the best iterate, there is no one turn map\n", closed_orbit.iterations);
+		else if (!closed_orbit.eigen_valid)
+			printf("WARNING: The eigenvalues of the one turn map could not be computed (no tunes)\n");
+		else
+			for (unsigned int e = 0; e < 6; e++)
+				printf("  eigenvalue %u: %+.10f %+.10fi  (modulus %.10f, tune %.10f)\n", e, closed_orbit.eigen_real[e], closed_orbit.eigen_imag[e],
+					hypot(closed_orbit.eigen_real[e], closed_orbit.eigen_imag[e]), fabs(atan2(closed_orbit.eigen_imag[e], closed_orbit.eigen_real[e])) / (2 * M_PI));
+		
+		// The particle starts from the origin of the section
+		double z_start[6] = {0, 0, 0, 0, 0, 0};
+		vector<vector<double>> z_turns;
+		
+		if (simulation.closed_orbit_turns > 0 && closed_orbit.converged)
+			extrapolate_closed_orbit(closed_orbit, z_start, simulation.closed_orbit_turns, z_turns);
+		
+		save_closed_orbit(closed_orbit, z_turns, output_dir);
+	}
+	
 	// Executing response analyses simulations
 	
 	for (unsigned int a = 0; a < response_analyses.size(); a++)
@@ -345,11 +483,11 @@ int main(int argc, char *argv[])
 		
 		if (analysis.enabled)
 		{
-			printf("\rResponse analisys %u: %u/%u", analysis.id, 0, analysis.steps);
+			printf("\rResponse analisys %u: %u/%u", analysis.id, 0, analysis.samples);
 			fflush(stdout);
-			FunctionResponseAnalysisCalculated on_calculate          = [&](ResponseAnalysis& analisys, unsigned int step) mutable
+			FunctionResponseAnalysisCalculated on_calculate          = [&](ResponseAnalysis& analisys, unsigned int steps_completed) mutable
 			{
-				printf("\rResponse analisys %u: %u/%u", analisys.id, step + 1, analisys.steps);
+				printf("\rResponse analisys %u: %u/%u", analisys.id, steps_completed, analisys.samples);
 				fflush(stdout);
 			};
 			
@@ -359,6 +497,22 @@ int main(int argc, char *argv[])
 	}
 	
 	
+	if (simulation.transfer_map_cache)
+		printf("Transfer map cache: %lu hits on %lu node motions (%.1f%%), emptied %lu times\n", transfer_map_cache.hits, transfer_map_cache.lookups, transfer_map_cache.lookups > 0 ? 100.0 * transfer_map_cache.hits / transfer_map_cache.lookups : 0.0, transfer_map_cache.clears);
+	
+	if (simulation.ponderomotive)
+	{
+		PonderomotiveReport& report = get_ponderomotive_report();
+		
+		printf("Ponderomotive model: %lu node motions, %lu continued with the full integration\n", report.nodes, report.switched);
+		
+		if (report.validated > 0)
+			printf("Ponderomotive validation: %lu node motions, max deviation %e m (position) %e (momentum), time %.3f s against %.3f s\n", report.validated, report.max_position_error * AU_LENGTH, report.max_momentum_error, report.time_ponderomotive, report.time_lorentz);
+	}
+	
+	if (simulation.field_cache)
+		release_field_cache(field_cache);
+	
 	dlclose(custom_lib);
 
 }
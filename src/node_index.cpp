@@ -0,0 +1,243 @@
+#include <math.h>
+#include <algorithm>
+#include "node_index.hpp"
+#include "type.hpp"
+#include "util.hpp"
+
+// Maximum number of spheres stored in a leaf box
+#define NODE_INDEX_LEAF_SIZE	4
+// Maximum depth of the hierarchy: more than enough for any number of nodes that fits in memory
+#define NODE_INDEX_STACK_SIZE	64
+
+GlobalCoord get_node_coordinate(Node& node, short axis)
+{
+	switch (axis)
+	{
+		case 0:
+			return node.position_x;
+		case 1:
+			return node.position_y;
+		default:
+			return node.position_z;
+	}
+}
+
+void build_node_index_box(Laboratory& laboratory, unsigned int position, unsigned int first, unsigned int count)
+{
+	NodeIndex& index = laboratory.index;
+	
+	NodeIndexBox box;
+	box.min_x = box.min_y = box.min_z = +INFINITY;
+	box.max_x = box.max_y = box.max_z = -INFINITY;
+	
+	for (unsigned int i = first; i < first + count; i++)
+	{
+		Node& node = laboratory.nodes[index.items[i]];
+		
+		box.min_x = min(box.min_x, node.position_x - index.radius);
+		box.min_y = min(box.min_y, node.position_y - index.radius);
+		box.min_z = min(box.min_z, node.position_z - index.radius);
+		box.max_x = max(box.max_x, node.position_x + index.radius);
+		box.max_y = max(box.max_y, node.position_y + index.radius);
+		box.max_z = max(box.max_z, node.position_z + index.radius);
+	}
+	
+	if (count <= NODE_INDEX_LEAF_SIZE)
+	{
+		box.first = first;
+		box.count = count;
+		index.boxes[position] = box;
+		return;
+	}
+	
+	// Splitting on the median of the longest axis
+	double size_x = global_coord_delta(box.max_x, box.min_x);
+	double size_y = global_coord_delta(box.max_y, box.min_y);
+	double size_z = global_coord_delta(box.max_z, box.min_z);
+	
+	short axis = 2;
+	if (size_x >= size_y && size_x >= size_z)
+		axis = 0;
+	else if (size_y >= size_z)
+		axis = 1;
+	
+	unsigned int half = count / 2;
+	
+	nth_element(index.items.begin() + first, index.items.begin() + first + half, index.items.begin() + first + count, [&](unsigned int a, unsigned int b)
+	{
+		return get_node_coordinate(laboratory.nodes[a], axis) < get_node_coordinate(laboratory.nodes[b], axis);
+	});
+	
+	// The two children are stored one after the other, so only the position of the left one is needed
+	unsigned int left = index.boxes.size();
+	index.boxes.resize(left + 2);
+	
+	box.first = left;
+	box.count = 0;
+	index.boxes[position] = box;
+	
+	build_node_index_box(laboratory, left,     first,        half);
+	build_node_index_box(laboratory, left + 1, first + half, count - half);
+}
+
+/**
+ * Build the bounding volume hierarchy used to find the nodes near the particle.
+ * It must be called every time the nodes or the influence radius change.
+ */
+void build_node_index(Laboratory& laboratory, double laser_influence_radius)
+{
+	NodeIndex& index = laboratory.index;
+	
+	index.radius = laser_influence_radius;
+	index.boxes.clear();
+	index.items.clear();
+	
+	for (unsigned int n = 0; n < laboratory.nodes.size(); n++)
+		index.items.push_back(n);
+	
+	if (!index.items.empty())
+	{
+		index.boxes.resize(1);
+		build_node_index_box(laboratory, 0, 0, index.items.size());
+	}
+}
+
+bool inside_node_index_box(NodeIndexBox& box, const GlobalCoord& position_x, const GlobalCoord& position_y, const GlobalCoord& position_z)
+{
+	return	position_x >= box.min_x && position_x <= box.max_x &&
+			position_y >= box.min_y && position_y <= box.max_y &&
+			position_z >= box.min_z && position_z <= box.max_z;
+}
+
+/**
+ * Slab test between the segment origin + direction·t, t ∈ [0, time_limit] and the box
+ */
+bool cross_node_index_box(NodeIndexBox& box, const GlobalCoord& origin_x, const GlobalCoord& origin_y, const GlobalCoord& origin_z, double direction_x, double direction_y, double direction_z, double time_limit)
+{
+	double time_min = 0;
+	double time_max = time_limit;
+	
+	// Box relative to the origin
+	double 		direction[3]	= {direction_x, direction_y, direction_z};
+	double		box_min[3]		= {global_coord_delta(box.min_x, origin_x), global_coord_delta(box.min_y, origin_y), global_coord_delta(box.min_z, origin_z)};
+	double		box_max[3]		= {global_coord_delta(box.max_x, origin_x), global_coord_delta(box.max_y, origin_y), global_coord_delta(box.max_z, origin_z)};
+	
+	for (short a = 0; a < 3; a++)
+	{
+		if (direction[a] == 0)
+		{
+			if (box_min[a] > 0 || box_max[a] < 0)
+				return false;
+		}
+		else
+		{
+			double time_1 = box_min[a] / direction[a];
+			double time_2 = box_max[a] / direction[a];
+			
+			if (time_1 > time_2)
+				swap(time_1, time_2);
+			
+			time_min = max(time_min, time_1);
+			time_max = min(time_max, time_2);
+			
+			if (time_min > time_max)
+				return false;
+		}
+	}
+	
+	return true;
+}
+
+/**
+ * Return the position (inside laboratory.nodes) of the node whose influence sphere contains the point, or -1.
+ * If more spheres contain the point, the one with the lowest position is returned.
+ */
+int find_node_index_containing(Laboratory& laboratory, const GlobalCoord& position_x, const GlobalCoord& position_y, const GlobalCoord& position_z)
+{
+	NodeIndex& index = laboratory.index;
+	
+	int found = -1;
+	
+	if (index.boxes.empty())
+		return found;
+	
+	unsigned int stack[NODE_INDEX_STACK_SIZE];
+	unsigned int stack_size = 0;
+	
+	stack[stack_size++] = 0;
+	
+	while (stack_size > 0)
+	{
+		NodeIndexBox& box = index.boxes[stack[--stack_size]];
+		
+		if (!inside_node_index_box(box, position_x, position_y, position_z))
+			continue;
+		
+		if (box.count > 0)
+		{
+			for (unsigned int i = box.first; i < box.first + box.count; i++)
+			{
+				unsigned int n = index.items[i];
+				Node& node = laboratory.nodes[n];
+				
+				if ((found < 0 || (int) n < found) && vector_module(global_coord_delta(position_x, node.position_x), global_coord_delta(position_y, node.position_y), global_coord_delta(position_z, node.position_z)) <= index.radius)
+					found = n;
+			}
+		}
+		else
+		{
+			stack[stack_size++] = box.first;
+			stack[stack_size++] = box.first + 1;
+		}
+	}
+	
+	return found;
+}
+
+/**
+ * Collect all the influence spheres crossed by the segment origin + direction·t, with t ∈ [0, time_limit].
+ * The hits are sorted by entering time.
+ */
+void find_node_index_ray(Laboratory& laboratory, const GlobalCoord& origin_x, const GlobalCoord& origin_y, const GlobalCoord& origin_z, double direction_x, double direction_y, double direction_z, double time_limit, vector<NodeIndexHit>& hits)
+{
+	NodeIndex& index = laboratory.index;
+	
+	hits.clear();
+	
+	if (index.boxes.empty())
+		return;
+	
+	unsigned int stack[NODE_INDEX_STACK_SIZE];
+	unsigned int stack_size = 0;
+	
+	stack[stack_size++] = 0;
+	
+	while (stack_size > 0)
+	{
+		NodeIndexBox& box = index.boxes[stack[--stack_size]];
+		
+		if (!cross_node_index_box(box, origin_x, origin_y, origin_z, direction_x, direction_y, direction_z, time_limit))
+			continue;
+		
+		if (box.count > 0)
+		{
+			for (unsigned int i = box.first; i < box.first + box.count; i++)
+			{
+				Node& node = laboratory.nodes[index.items[i]];
+				
+				NodeIndexHit hit;
+				hit.node = index.items[i];
+				
+				if (ray_sphere_intersection(origin_x, origin_y, origin_z, direction_x, direction_y, direction_z, node.position_x, node.position_y, node.position_z, index.radius, hit.time_enter, hit.time_exit) && hit.time_exit >= 0 && hit.time_enter <= time_limit)
+					hits.push_back(hit);
+			}
+		}
+		else
+		{
+			stack[stack_size++] = box.first;
+			stack[stack_size++] = box.first + 1;
+		}
+	}
+	
+	sort(hits.begin(), hits.end(), [](const NodeIndexHit& a, const NodeIndexHit& b) { return a.time_enter < b.time_enter; });
+}
@@ -0,0 +1,6 @@
+#include "type.hpp"
+
+void build_node_index(Laboratory& laboratory, double laser_influence_radius);
+
+int  find_node_index_containing(Laboratory& laboratory, const GlobalCoord& position_x, const GlobalCoord& position_y, const GlobalCoord& position_z);
+void find_node_index_ray(Laboratory& laboratory, const GlobalCoord& origin_x, const GlobalCoord& origin_y, const GlobalCoord& origin_z, double direction_x, double direction_y, double direction_z, double time_limit, vector<NodeIndexHit>& hits);
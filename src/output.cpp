@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include "response.hpp"
 #include "util.hpp"
+#include "unit.hpp"
 #include "type.hpp"
+#include "frame.hpp"
 
 extern string ffmpeg_name;
 
@@ -19,6 +21,22 @@ void setup_particle(ofstream& stream)
 		<< "momentum_z" 			<< endl;
 }
 
+void setup_ensemble(ofstream& stream)
+{
+	stream.setf(ios::scientific);
+	stream.precision(16);
+	stream
+		<< "id" 					<< ";" 
+		<< "time" 					<< ";" 
+		<< "position_x" 			<< ";" 
+		<< "position_y" 			<< ";"
+		<< "position_z" 			<< ";"
+		<< "momentum_x" 			<< ";"
+		<< "momentum_y" 			<< ";"
+		<< "momentum_z" 			<< ";"
+		<< "interactions" 			<< endl;
+}
+
 void setup_node(ofstream& stream)
 {
 	stream.setf(ios::scientific);
@@ -71,10 +89,13 @@ void setup_response_analysis(ofstream& stream, ResponseAnalysis& response_analys
 	stream.setf(ios::scientific);
 	stream.precision(16);
 	
-	stream
-		<< (bo::format("in_%s_%s_perc (%%)")   % response_analysis.object_in  % response_analysis.attribute_in ).str()	<< ";"
-		<< (bo::format("in_%s_%s_delta (%s)")  % response_analysis.object_in  % response_analysis.attribute_in  % get_conversion_si_unit(response_analysis.object_in,  response_analysis.attribute_in )).str() << ";" 
-		<< (bo::format("in_%s_%s_abs (%s)")    % response_analysis.object_in  % response_analysis.attribute_in  % get_conversion_si_unit(response_analysis.object_in,  response_analysis.attribute_in )).str() << ";" ;
+	for (ResponseInput& input: response_analysis.inputs)
+	{
+		stream
+			<< (bo::format("in_%s_%s_perc (%%)")   % input.object  % input.attribute ).str()	<< ";"
+			<< (bo::format("in_%s_%s_delta (%s)")  % input.object  % input.attribute  % get_conversion_si_unit(input.attribute_id)).str() << ";" 
+			<< (bo::format("in_%s_%s_abs (%s)")    % input.object  % input.attribute  % get_conversion_si_unit(input.attribute_id)).str() << ";" ;
+	}
 	
 	for (unsigned int o = 0; o < response_analysis.attribute_out.size(); o++)
 	{
@@ -83,8 +104,8 @@ void setup_response_analysis(ofstream& stream, ResponseAnalysis& response_analys
 		
 		stream
 			<< (bo::format("out_%s_%s_perc (%%)")  % object_out % attribute_out).str()	<< ";"
-			<< (bo::format("out_%s_%s_delta (%s)") % object_out % attribute_out % get_conversion_si_unit(object_out, attribute_out)).str() <<  ";"
-			<< (bo::format("out_%s_%s_abs (%s)")   % object_out % attribute_out % get_conversion_si_unit(object_out, attribute_out)).str() <<  ";";
+			<< (bo::format("out_%s_%s_delta (%s)") % object_out % attribute_out % get_conversion_si_unit(response_analysis.attribute_out_id[o])).str() <<  ";"
+			<< (bo::format("out_%s_%s_abs (%s)")   % object_out % attribute_out % get_conversion_si_unit(response_analysis.attribute_out_id[o])).str() <<  ";";
 	}
 	stream << endl;
 }
@@ -92,19 +113,21 @@ void setup_response_analysis(ofstream& stream, ResponseAnalysis& response_analys
 
 
 
-void write_response_analysis(ofstream& stream, ResponseAnalysis& response_analysis, double perc_in,  double delta_in, double value_in, vector<double> perct_out, vector<double> delta_out, vector<double> value_out)
+void write_response_analysis(ofstream& stream, ResponseAnalysis& response_analysis, vector<double>& perct_in, vector<double>& delta_in, vector<double>& value_in, vector<double>& perct_out, vector<double>& delta_out, vector<double>& value_out)
 {
-	double unit_in  = get_conversion_si_value(response_analysis.object_in,  response_analysis.attribute_in);
-	
-	
-	stream
-		<< perc_in				<< ";"
-		<< delta_in * unit_in 	<< ";" 
-		<< value_in * unit_in 	<< ";";
+	for (unsigned int i = 0; i < response_analysis.inputs.size(); i++)
+	{
+		double unit_in = get_conversion_si_value(response_analysis.inputs[i].attribute_id);
+		
+		stream
+			<< perct_in[i]				<< ";"
+			<< delta_in[i] * unit_in 	<< ";" 
+			<< value_in[i] * unit_in 	<< ";";
+	}
 		
 	for (unsigned int o = 0; o < response_analysis.attribute_out.size(); o++)
 	{
-		double unit_out = get_conversion_si_value(response_analysis.object_out[o], response_analysis.attribute_out[o]);
+		double unit_out = get_conversion_si_value(response_analysis.attribute_out_id[o]);
 		
 		stream
 			<< perct_out[o]				<< ";"
@@ -115,11 +138,73 @@ void write_response_analysis(ofstream& stream, ResponseAnalysis& response_analys
 	stream << endl;
 }
 
+
+void setup_response_sensitivity(ofstream& stream, ResponseAnalysis& response_analysis)
+{
+	stream.setf(ios::scientific);
+	stream.precision(16);
+	
+	for (ResponseInput& input: response_analysis.inputs)
+		stream << (bo::format("in_%s_%s_abs (%s)") % input.object % input.attribute % get_conversion_si_unit(input.attribute_id)).str() << ";";
+	
+	for (unsigned int o = 0; o < response_analysis.attribute_out.size(); o++)
+		stream << (bo::format("out_%s_%s_abs (%s)") % response_analysis.object_out[o] % response_analysis.attribute_out[o] % get_conversion_si_unit(response_analysis.attribute_out_id[o])).str() << ";";
+	
+	for (unsigned int o = 0; o < response_analysis.attribute_out.size(); o++)
+	{
+		string out = (bo::format("out_%s_%s") % response_analysis.object_out[o] % response_analysis.attribute_out[o]).str();
+		
+		for (ResponseInput& input: response_analysis.inputs)
+		{
+			string in = (bo::format("in_%s_%s") % input.object % input.attribute).str();
+			
+			stream
+				<< (bo::format("d_%s_by_%s (%s/%s)") % out % in % get_conversion_si_unit(response_analysis.attribute_out_id[o]) % get_conversion_si_unit(input.attribute_id)).str() << ";"
+				<< (bo::format("d_%s_by_%s_perc (%%/%%)") % out % in).str() << ";";
+		}
+	}
+	stream << endl;
+}
+
+/**
+ * The derivatives out_by_in[o][i] in SI units and as elasticities (relative change of the output by the relative change
+ * of the input)
+ */
+void write_response_sensitivity(ofstream& stream, ResponseAnalysis& response_analysis, vector<double>& value_in, vector<double>& value_out, vector<vector<double>>& out_by_in)
+{
+	for (unsigned int i = 0; i < response_analysis.inputs.size(); i++)
+		stream << value_in[i] * get_conversion_si_value(response_analysis.inputs[i].attribute_id) << ";";
+	
+	for (unsigned int o = 0; o < response_analysis.attribute_out.size(); o++)
+		stream << value_out[o] * get_conversion_si_value(response_analysis.attribute_out_id[o]) << ";";
+	
+	for (unsigned int o = 0; o < response_analysis.attribute_out.size(); o++)
+	{
+		double unit_out = get_conversion_si_value(response_analysis.attribute_out_id[o]);
+		
+		for (unsigned int i = 0; i < response_analysis.inputs.size(); i++)
+		{
+			double unit_in = get_conversion_si_value(response_analysis.inputs[i].attribute_id);
+			
+			stream
+				<< out_by_in[o][i] * unit_out / unit_in				<< ";"
+				<< out_by_in[o][i] * value_in[i] / value_out[o]	<< ";";
+		}
+	}
+	
+	stream << endl;
+}
+
 string get_filename_particle(fs::path output_dir)
 {
 	return (output_dir / fs::path("particle.csv")).string();
 }
 
+string get_filename_ensemble(fs::path output_dir, bool initial)
+{
+	return (output_dir / fs::path(initial ? "ensemble_initial.csv" : "ensemble.csv")).string();
+}
+
 string get_filename_node(fs::path output_dir)
 {
 	return (output_dir / fs::path("node.csv")).string();
@@ -131,17 +216,26 @@ string get_filename_interaction(fs::path output_dir)
 }
 
 
-void write_particle(ofstream& stream, double current_time, ParticleStateGlobal& state)
+/**
+ * The global positions are written with 20 digits, more than a double holds: the long double is used only to format the
+ * GlobalCoord (on architectures where it is a plain double the last digits are lost in the text, not in the simulation).
+ */
+static long double get_global_coord_output(const GlobalCoord& value, double unit)
+{
+	return (long double) value.hi * unit + (long double) value.lo * unit;
+}
+
+void write_particle(ofstream& stream, const GlobalCoord& current_time, ParticleStateGlobal& state)
 {
 	stream.precision(16);
 	stream 
-		<< current_time		* AU_TIME		<< ";";
+		<< (double) current_time * AU_TIME	<< ";";
 		
 	stream.precision(20);
 	stream 
-		<< state.position_x	* AU_LENGTH		<< ";" 
-		<< state.position_y	* AU_LENGTH		<< ";" 
-		<< state.position_z	* AU_LENGTH		<< ";";
+		<< get_global_coord_output(state.position_x, AU_LENGTH)	<< ";" 
+		<< get_global_coord_output(state.position_y, AU_LENGTH)	<< ";" 
+		<< get_global_coord_output(state.position_z, AU_LENGTH)	<< ";";
 		
 	stream.precision(16);
 	stream  
@@ -150,6 +244,30 @@ void write_particle(ofstream& stream, double current_time, ParticleStateGlobal&
 		<< state.momentum_z * AU_MOMENTUM	<< endl;
 }
 
+void write_ensemble(ofstream& stream, EnsembleState& ensemble)
+{
+	for (unsigned int i = 0; i < ensemble.count; i++)
+	{
+		stream.precision(16);
+		stream 
+			<< i										<< ";"
+			<< (double) ensemble.time[i] * AU_TIME		<< ";";
+			
+		stream.precision(20);
+		stream 
+			<< get_global_coord_output(ensemble.position_x[i], AU_LENGTH)	<< ";" 
+			<< get_global_coord_output(ensemble.position_y[i], AU_LENGTH)	<< ";" 
+			<< get_global_coord_output(ensemble.position_z[i], AU_LENGTH)	<< ";";
+			
+		stream.precision(16);
+		stream  
+			<< ensemble.momentum_x[i] * AU_MOMENTUM		<< ";"
+			<< ensemble.momentum_y[i] * AU_MOMENTUM		<< ";"
+			<< ensemble.momentum_z[i] * AU_MOMENTUM		<< ";"
+			<< ensemble.interactions[i]					<< endl;
+	}
+}
+
 void write_interaction(
 	ofstream& stream, 
 	double current_time, 
@@ -201,9 +319,9 @@ void write_node(ofstream& stream, Node& node)
 {
 	stream 
 		<< node.id 						<< ";" 
-		<< node.position_x * AU_LENGTH	<< ";" 
-		<< node.position_y * AU_LENGTH	<< ";" 
-		<< node.position_z * AU_LENGTH	<< ";" 
+		<< (double) node.position_x * AU_LENGTH	<< ";" 
+		<< (double) node.position_y * AU_LENGTH	<< ";" 
+		<< (double) node.position_z * AU_LENGTH	<< ";" 
 		<< node.axis(0,0)				<< ";"
 		<< node.axis(0,1)				<< ";"
 		<< node.axis(0,2)				<< ";"
@@ -516,73 +634,93 @@ void save_field_render_sh(FieldRenderResult& field_render_result, fs::path outpu
 	}
 }
 
+/**
+ * Name of the plots of an output against an input: response_<out> with a single input, response_<out>_by_<in> otherwise
+ */
+string get_response_analysis_plot_name(ResponseAnalysis& response_analysis, unsigned int i, unsigned int o)
+{
+	string name = (bo::format("response_%s_%s") % response_analysis.object_out[o] % response_analysis.attribute_out[o]).str();
+	
+	if (response_analysis.inputs.size() > 1)
+		name += (bo::format("_by_%s_%s") % response_analysis.inputs[i].object % response_analysis.inputs[i].attribute).str();
+	
+	return name;
+}
+
 void save_response_analysis_ct2(ResponseAnalysis& response_analysis, fs::path output_dir)
 {
-	string object_in     = response_analysis.object_in;
-	string attribute_in  = response_analysis.attribute_in;
+	unsigned int ni = response_analysis.inputs.size();
 	
-	for (unsigned int o = 0; o < response_analysis.attribute_out.size(); o++)
+	for (unsigned int i = 0; i < ni; i++)
 	{
-		string object_out    = response_analysis.object_out[o];
-		string attribute_out = response_analysis.attribute_out[o];
+		string object_in     = response_analysis.inputs[i].object;
+		string attribute_in  = response_analysis.inputs[i].attribute;
+		unsigned int offset_in = i * 3;
 		
-		unsigned int offset = (1+o) * 3;
-		//------------------------------------------------------------------
-		ofstream s1;
-		s1.open((output_dir / fs::path((bo::format("response_%s_%s_perc.ct2") % object_out % attribute_out).str())).string());
-		
-		string xlabel2 = (bo::format("in %s %s [\\%%]")  % object_in  % attribute_in).str();
-		string ylabel2 = (bo::format("out %s %s [\\%%]") % object_out % attribute_out).str();
-		bo::replace_all(xlabel2, "_", " ");
-		bo::replace_all(ylabel2, "_", " ");
-		
-		s1 << bo::format("title 'Response perc %u'") % response_analysis.id << endl;
-		s1 << bo::format("name 'response_%s_%s_perc'") % object_out % attribute_out << endl;
-		s1 << bo::format("xlabel '%s'") % xlabel2 << endl;
-		s1 << bo::format("ylabel '%s'") % ylabel2 << endl;
-		s1 << "marker bullet" << endl;
-		s1 << "marker-scale 0.20" << endl;
-		s1 << "line-style no" << endl;
-		s1 << "plot @$1*100:$" << offset + 1 << "*100" << endl;
-		s1.close();
-		
-		//------------------------------------------------------------------
-		ofstream s2;
-		s2.open((output_dir / fs::path((bo::format("response_%s_%s_delta.ct2") % object_out % attribute_out).str())).string());
-		
-		string xlabel1 = (bo::format("in %s %s [%s]")  % object_in  % attribute_in  % get_conversion_si_unit(object_in,  attribute_in )).str();
-		string ylabel1 = (bo::format("out %s %s [%s]") % object_out % attribute_out % get_conversion_si_unit(object_out, attribute_out)).str();
-		bo::replace_all(xlabel1, "_", " ");
-		bo::replace_all(ylabel1, "_", " ");
-		
-		s2 << bo::format("title 'Response delta %u'") % response_analysis.id << endl;
-		s2 << bo::format("name 'response_%s_%s_delta'") % object_out % attribute_out << endl;
-		s2 << bo::format("xlabel '%s'") % xlabel1 << endl;
-		s2 << bo::format("ylabel '%s'") % ylabel1 << endl;
-		s2 << "marker bullet" << endl;
-		s2 << "marker-scale 0.20" << endl;
-		s2 << "line-style no" << endl;
-		s2 << "plot @2:" << offset + 2 << endl;
-		s2.close();
-		
-		//------------------------------------------------------------------
-		ofstream s3;
-		s3.open((output_dir / fs::path((bo::format("response_%s_%s_abs.ct2") % object_out % attribute_out).str())).string());
-		
-		string xlabel3 = (bo::format("in %s %s [%s]")  % object_in  % attribute_in  % get_conversion_si_unit(object_in,  attribute_in )).str();
-		string ylabel3 = (bo::format("out %s %s [%s]") % object_out % attribute_out % get_conversion_si_unit(object_out, attribute_out)).str();
-		bo::replace_all(xlabel3, "_", " ");
-		bo::replace_all(ylabel3, "_", " ");
-		
-		s3 << bo::format("title 'Response abs %u'") % response_analysis.id << endl;
-		s3 << bo::format("name 'response_%s_%s_abs'") % object_out % attribute_out << endl;
-		s3 << bo::format("xlabel '%s'") % xlabel3 << endl;
-		s3 << bo::format("ylabel '%s'") % ylabel3 << endl;
-		s3 << "marker bullet" << endl;
-		s3 << "marker-scale 0.20" << endl;
-		s3 << "line-style no" << endl;
-		s3 << "plot @3:" << offset + 3 << endl;
-		s3.close();
+		for (unsigned int o = 0; o < response_analysis.attribute_out.size(); o++)
+		{
+			string object_out    = response_analysis.object_out[o];
+			string attribute_out = response_analysis.attribute_out[o];
+			string name          = get_response_analysis_plot_name(response_analysis, i, o);
+			
+			unsigned int offset = (ni + o) * 3;
+			//------------------------------------------------------------------
+			ofstream s1;
+			s1.open((output_dir / fs::path((bo::format("%s_perc.ct2") % name).str())).string());
+			
+			string xlabel2 = (bo::format("in %s %s [\\%%]")  % object_in  % attribute_in).str();
+			string ylabel2 = (bo::format("out %s %s [\\%%]") % object_out % attribute_out).str();
+			bo::replace_all(xlabel2, "_", " ");
+			bo::replace_all(ylabel2, "_", " ");
+			
+			s1 << bo::format("title 'Response perc %u'") % response_analysis.id << endl;
+			s1 << bo::format("name '%s_perc'") % name << endl;
+			s1 << bo::format("xlabel '%s'") % xlabel2 << endl;
+			s1 << bo::format("ylabel '%s'") % ylabel2 << endl;
+			s1 << "marker bullet" << endl;
+			s1 << "marker-scale 0.20" << endl;
+			s1 << "line-style no" << endl;
+			s1 << "plot @$" << offset_in + 1 << "*100:$" << offset + 1 << "*100" << endl;
+			s1.close();
+			
+			//------------------------------------------------------------------
+			ofstream s2;
+			s2.open((output_dir / fs::path((bo::format("%s_delta.ct2") % name).str())).string());
+			
+			string xlabel1 = (bo::format("in %s %s [%s]")  % object_in  % attribute_in  % get_conversion_si_unit(response_analysis.inputs[i].attribute_id)).str();
+			string ylabel1 = (bo::format("out %s %s [%s]") % object_out % attribute_out % get_conversion_si_unit(response_analysis.attribute_out_id[o])).str();
+			bo::replace_all(xlabel1, "_", " ");
+			bo::replace_all(ylabel1, "_", " ");
+			
+			s2 << bo::format("title 'Response delta %u'") % response_analysis.id << endl;
+			s2 << bo::format("name '%s_delta'") % name << endl;
+			s2 << bo::format("xlabel '%s'") % xlabel1 << endl;
+			s2 << bo::format("ylabel '%s'") % ylabel1 << endl;
+			s2 << "marker bullet" << endl;
+			s2 << "marker-scale 0.20" << endl;
+			s2 << "line-style no" << endl;
+			s2 << "plot @" << offset_in + 2 << ":" << offset + 2 << endl;
+			s2.close();
+			
+			//------------------------------------------------------------------
+			ofstream s3;
+			s3.open((output_dir / fs::path((bo::format("%s_abs.ct2") % name).str())).string());
+			
+			string xlabel3 = (bo::format("in %s %s [%s]")  % object_in  % attribute_in  % get_conversion_si_unit(response_analysis.inputs[i].attribute_id)).str();
+			string ylabel3 = (bo::format("out %s %s [%s]") % object_out % attribute_out % get_conversion_si_unit(response_analysis.attribute_out_id[o])).str();
+			bo::replace_all(xlabel3, "_", " ");
+			bo::replace_all(ylabel3, "_", " ");
+			
+			s3 << bo::format("title 'Response abs %u'") % response_analysis.id << endl;
+			s3 << bo::format("name '%s_abs'") % name << endl;
+			s3 << bo::format("xlabel '%s'") % xlabel3 << endl;
+			s3 << bo::format("ylabel '%s'") % ylabel3 << endl;
+			s3 << "marker bullet" << endl;
+			s3 << "marker-scale 0.20" << endl;
+			s3 << "line-style no" << endl;
+			s3 << "plot @" << offset_in + 3 << ":" << offset + 3 << endl;
+			s3.close();
+		}
 	}
 }
 
@@ -595,15 +733,147 @@ void save_response_analysis_sh(ResponseAnalysis& response_analysis, fs::path out
 	s << "#!/bin/sh" << endl << endl;
 	s << "echo \"Running ctioga2 ...\"" << endl;
 	
-	for (unsigned int o = 0; o < response_analysis.attribute_out.size(); o++)
+	for (unsigned int i = 0; i < response_analysis.inputs.size(); i++)
 	{
-		string object_out    = response_analysis.object_out[o];
-		string attribute_out = response_analysis.attribute_out[o];
-		
-		s << bo::format("ctioga2 --no-mark --text-separator \\; --load 'response.csv' -f 'response_%s_%s_delta.ct2'") % object_out % attribute_out << endl;
-		s << bo::format("ctioga2 --no-mark --text-separator \\; --load 'response.csv' -f 'response_%s_%s_perc.ct2'" ) % object_out % attribute_out << endl;
-		s << bo::format("ctioga2 --no-mark --text-separator \\; --load 'response.csv' -f 'response_%s_%s_abs.ct2'"  ) % object_out % attribute_out << endl;
+		for (unsigned int o = 0; o < response_analysis.attribute_out.size(); o++)
+		{
+			string name = get_response_analysis_plot_name(response_analysis, i, o);
+			
+			s << bo::format("ctioga2 --no-mark --text-separator \\; --load 'response.csv' -f '%s_delta.ct2'") % name << endl;
+			s << bo::format("ctioga2 --no-mark --text-separator \\; --load 'response.csv' -f '%s_perc.ct2'" ) % name << endl;
+			s << bo::format("ctioga2 --no-mark --text-separator \\; --load 'response.csv' -f '%s_abs.ct2'"  ) % name << endl;
+		}
 	}
 	
 	system((bo::format("chmod a+x %s") % f.string()).str().c_str());	
 }
+
+/**
+ * Files of the closed orbit search:
+ *   closed_orbit.csv			the orbit on the section (global state and section coordinates) and the turn duration
+ *   one_turn_map.csv			the linearized one turn map (SI units, columns and rows x, p_x, y, p_y, τ, δ), only if
+ *   							the search converged
+ *   one_turn_eigen.csv		its eigenvalues and the tunes (if they could be computed)
+ *   closed_orbit_turns.csv	the turns of the particle extrapolated with the map
+ */
+void save_closed_orbit(ClosedOrbit& closed_orbit, vector<vector<double>>& z_turns, fs::path output_dir)
+{
+	double units[6] = {AU_LENGTH, AU_MOMENTUM, AU_LENGTH, AU_MOMENTUM, AU_TIME, AU_MOMENTUM};
+	string names[6] = {"x", "p_x", "y", "p_y", "tau", "delta"};
+	
+	Mat3 frame_t = mat3_transpose(closed_orbit.frame);
+	
+	ParticleStateGlobal state;
+	frame_to_global(frame_t, closed_orbit.orbit[0], closed_orbit.orbit[2], 0, closed_orbit.origin_x, closed_orbit.origin_y, closed_orbit.origin_z, state.position_x, state.position_y, state.position_z);
+	
+	Vec3 momentum = frame_to_global(frame_t, closed_orbit.orbit[1], closed_orbit.orbit[3], closed_orbit.momentum_reference + closed_orbit.orbit[5]);
+	state.momentum_x = momentum.x;
+	state.momentum_y = momentum.y;
+	state.momentum_z = momentum.z;
+	
+	ofstream stream;
+	stream.open((output_dir / fs::path("closed_orbit.csv")).string());
+	stream.setf(ios::scientific);
+	stream
+		<< "turn_time"				<< ";"
+		<< "position_x"				<< ";"
+		<< "position_y"				<< ";"
+		<< "position_z"				<< ";"
+		<< "momentum_x"				<< ";"
+		<< "momentum_y"				<< ";"
+		<< "momentum_z"				<< ";"
+		<< "x"						<< ";"
+		<< "p_x"					<< ";"
+		<< "y"						<< ";"
+		<< "p_y"					<< ";"
+		<< "iterations"				<< ";"
+		<< "converged"				<< endl;
+	
+	stream.precision(16);
+	stream
+		<< closed_orbit.turn_time * AU_TIME	<< ";";
+	
+	stream.precision(20);
+	stream
+		<< get_global_coord_output(state.position_x, AU_LENGTH)	<< ";"
+		<< get_global_coord_output(state.position_y, AU_LENGTH)	<< ";"
+		<< get_global_coord_output(state.position_z, AU_LENGTH)	<< ";";
+	
+	stream.precision(16);
+	stream
+		<< state.momentum_x * AU_MOMENTUM		<< ";"
+		<< state.momentum_y * AU_MOMENTUM		<< ";"
+		<< state.momentum_z * AU_MOMENTUM		<< ";"
+		<< closed_orbit.orbit[0] * AU_LENGTH	<< ";"
+		<< closed_orbit.orbit[1] * AU_MOMENTUM	<< ";"
+		<< closed_orbit.orbit[2] * AU_LENGTH	<< ";"
+		<< closed_orbit.orbit[3] * AU_MOMENTUM	<< ";"
+		<< closed_orbit.iterations				<< ";"
+		<< (closed_orbit.converged ? 1 : 0)		<< endl;
+	stream.close();
+	
+	if (!closed_orbit.converged)
+		return;
+	
+	stream.open((output_dir / fs::path("one_turn_map.csv")).string());
+	stream.setf(ios::scientific);
+	stream.precision(16);
+	stream << "row";
+	for (unsigned int c = 0; c < 6; c++)
+		stream << ";" << names[c];
+	stream << endl;
+	
+	for (unsigned int r = 0; r < 6; r++)
+	{
+		stream << names[r];
+		for (unsigned int c = 0; c < 6; c++)
+			stream << ";" << closed_orbit.matrix[r][c] * units[r] / units[c];
+		stream << endl;
+	}
+	stream.close();
+	
+	// Not written if the eigenvalues could not be computed
+	if (closed_orbit.eigen_valid)
+	{
+		stream.open((output_dir / fs::path("one_turn_eigen.csv")).string());
+		stream.setf(ios::scientific);
+		stream.precision(16);
+		stream
+			<< "id"						<< ";"
+			<< "real"					<< ";"
+			<< "imag"					<< ";"
+			<< "modulus"				<< ";"
+			<< "tune"					<< endl;
+		
+		for (unsigned int e = 0; e < 6; e++)
+		{
+			stream
+				<< e																			<< ";"
+				<< closed_orbit.eigen_real[e]													<< ";"
+				<< closed_orbit.eigen_imag[e]													<< ";"
+				<< vector_module(closed_orbit.eigen_real[e], closed_orbit.eigen_imag[e], 0.d)	<< ";"
+				<< fabs(atan2(closed_orbit.eigen_imag[e], closed_orbit.eigen_real[e])) / (2 * M_PI)	<< endl;
+		}
+		stream.close();
+	}
+	
+	if (z_turns.empty())
+		return;
+	
+	stream.open((output_dir / fs::path("closed_orbit_turns.csv")).string());
+	stream.setf(ios::scientific);
+	stream.precision(16);
+	stream << "turn";
+	for (unsigned int c = 0; c < 6; c++)
+		stream << ";" << names[c];
+	stream << endl;
+	
+	for (unsigned int k = 0; k < z_turns.size(); k++)
+	{
+		stream << k;
+		for (unsigned int c = 0; c < 6; c++)
+			stream << ";" << z_turns[k][c] * units[c];
+		stream << endl;
+	}
+	stream.close();
+}
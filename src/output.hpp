@@ -1,18 +1,23 @@
 #include "type.hpp"
 
 void setup_particle			(ofstream& stream);
+void setup_ensemble			(ofstream& stream);
 void setup_node				(ofstream& stream);
 void setup_interaction		(ofstream& stream);
 void setup_response_analysis(ofstream& stream, ResponseAnalysis& response_analysis);
+void setup_response_sensitivity(ofstream& stream, ResponseAnalysis& response_analysis);
 
 string get_filename_particle		(fs::path output_dir);
+string get_filename_ensemble		(fs::path output_dir, bool initial);
 string get_filename_node			(fs::path output_dir);
 string get_filename_interaction		(fs::path output_dir);
 
-void write_particle			(ofstream& stream, double current_time, ParticleStateGlobal& state);
+void write_particle			(ofstream& stream, const GlobalCoord& current_time, ParticleStateGlobal& state);
 void write_interaction		(ofstream& stream, double current_time, ParticleStateLocal&  state, Field& field);
 void write_node				(ofstream& stream, Node& node);
-void write_response_analysis(ofstream& stream, ResponseAnalysis& response_analysis, double perc_in,  double delta_in, double value_in, vector<double> perct_out, vector<double> delta_out, vector<double> value_out);
+void write_ensemble			(ofstream& stream, EnsembleState& ensemble);
+void write_response_analysis(ofstream& stream, ResponseAnalysis& response_analysis, vector<double>& perct_in, vector<double>& delta_in, vector<double>& value_in, vector<double>& perct_out, vector<double>& delta_out, vector<double>& value_out);
+void write_response_sensitivity(ofstream& stream, ResponseAnalysis& response_analysis, vector<double>& value_in, vector<double>& value_out, vector<vector<double>>& out_by_in);
 void write_field_render_bindata(vector<ofstream*> files, FieldRenderResult& field_render_result, FieldRenderData& field_render_data);
 
 void save_field_render_cfg	(FieldRenderResult& field_render_result, fs::path output_dir);
@@ -22,3 +27,5 @@ void save_field_render_sh 	(FieldRenderResult& field_render_result, fs::path out
 
 void save_response_analysis_ct2(ResponseAnalysis& response_analysis, fs::path output_dir);
 void save_response_analysis_sh (ResponseAnalysis& response_analysis, fs::path output_dir);
+
+void save_closed_orbit(ClosedOrbit& closed_orbit, vector<vector<double>>& z_turns, fs::path output_dir);
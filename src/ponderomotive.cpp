@@ -0,0 +1,370 @@
+#include <math.h>
+#include <omp.h>
+#include <gsl/gsl_errno.h>
+#include <gsl/gsl_odeiv.h>
+#include "ponderomotive.hpp"
+#include "simulator.hpp"
+#include "type.hpp"
+#include "util.hpp"
+#include "dop853.hpp"
+
+static PonderomotiveReport ponderomotive_report = {0, 0, 0, 0, 0, 0, 0};
+
+PonderomotiveReport& get_ponderomotive_report()
+{
+	return ponderomotive_report;
+}
+
+double get_ponderomotive_frequency(const Simulation& simulation)
+{
+	return 2 * M_PI * C0 / simulation.ponderomotive_wavelength;
+}
+
+double get_ponderomotive_intensity(const Simulation& simulation, const Pulse& laser, const Particle& particle, FunctionFieldType function_field, double t, double x, double y, double z)
+{
+	double omega = get_ponderomotive_frequency(simulation);
+	double e2;
+
+	if (laser.function_envelope != NULL)
+	{
+		double e0 = laser.function_envelope(t * AU_TIME, x * AU_LENGTH, y * AU_LENGTH, z * AU_LENGTH, laser.params_data.data()) / AU_ELECTRIC_FIELD;
+
+		e2 = e0 * e0 / 2;
+	}
+	else
+	{
+		// Mean of |E|² over the optical cycle centred at t (midpoint rule)
+		unsigned int n      = simulation.ponderomotive_samples;
+		double       period = 2 * M_PI / omega;
+
+		e2 = 0;
+
+		for (unsigned int k = 0; k < n; k++)
+		{
+			Field field;
+			calculate_fields(C0 * (t + period * ((k + 0.5) / n - 0.5)), x, y, z, laser, field, function_field);
+
+			e2 += field.e_x * field.e_x + field.e_y * field.e_y + field.e_z * field.e_z;
+		}
+
+		e2 /= n;
+	}
+
+	return pow2(particle.charge) * e2 / pow2(particle.rest_mass * C0 * omega);
+}
+
+/**
+ * Gradient of a² with central differences, λ/10 apart
+ */
+void get_ponderomotive_gradient(const Simulation& simulation, const Pulse& laser, const Particle& particle, FunctionFieldType function_field, double t, const double position[], double gradient[])
+{
+	double h = simulation.ponderomotive_wavelength / 10;
+
+	for (unsigned int i = 0; i < 3; i++)
+	{
+		double after[3]  = {position[0], position[1], position[2]};
+		double before[3] = {position[0], position[1], position[2]};
+
+		after[i]  += h;
+		before[i] -= h;
+
+		double a2_after  = get_ponderomotive_intensity(simulation, laser, particle, function_field, t, after[0],  after[1],  after[2]);
+		double a2_before = get_ponderomotive_intensity(simulation, laser, particle, function_field, t, before[0], before[1], before[2]);
+
+		// Differences at the rounding level are dropped: a momentum component that must stay zero would get a force
+		// with no error tolerance (with error_abs = 0)
+		if (fabs(a2_after - a2_before) <= 1e-12 * (a2_after + a2_before))
+			gradient[i] = 0;
+		else
+			gradient[i] = (a2_after - a2_before) / (2 * h);
+	}
+}
+
+void get_ponderomotive_potential(const Simulation& simulation, const Pulse& laser, FunctionFieldType function_field, double t, const double position[], double potential[])
+{
+	// A = -∫E dt over the cycle centred at t: value at t minus the mean over the cycle
+	unsigned int n      = simulation.ponderomotive_samples;
+	double       period = 2 * M_PI / get_ponderomotive_frequency(simulation);
+	double       dt     = period / n;
+
+	double integral[3] = {0, 0, 0};
+	double centre[3]   = {0, 0, 0};
+	double mean[3]     = {0, 0, 0};
+
+	for (unsigned int k = 0; k < n; k++)
+	{
+		Field field;
+		calculate_fields(C0 * (t + period * ((k + 0.5) / n - 0.5)), position[0], position[1], position[2], laser, field, function_field);
+
+		double e[3] = {field.e_x, field.e_y, field.e_z};
+
+		// Part of the sample before t (only the middle one can be split)
+		double weight = min(max(0.5 * n - k, 0.d), 1.d);
+
+		for (unsigned int i = 0; i < 3; i++)
+		{
+			centre[i]   -= e[i] * dt * weight;
+			mean[i]     += (integral[i] - e[i] * dt / 2) / n;
+			integral[i] -= e[i] * dt;
+		}
+	}
+
+	for (unsigned int i = 0; i < 3; i++)
+		potential[i] = centre[i] - mean[i];
+}
+
+/**
+ * Guiding centre equations as a functor for the DOP853 integrator. y contains the position and the cycle averaged momentum.
+ */
+typedef struct PonderomotiveSystem
+{
+	const Simulation*	simulation;
+	const Pulse*		laser;
+	const Particle*		particle;
+	FunctionFieldType	function_field;
+
+	inline void operator()(double t, const double y[], double f[]) const
+	{
+		double mass = particle->rest_mass;
+		double a2   = get_ponderomotive_intensity(*simulation, *laser, *particle, function_field, t, y[0], y[1], y[2]);
+
+		double gradient[3];
+		get_ponderomotive_gradient(*simulation, *laser, *particle, function_field, t, y, gradient);
+
+		double gamma = sqrt(1 + (y[3] * y[3] + y[4] * y[4] + y[5] * y[5]) / pow2(mass * C0) + a2);
+
+		for (unsigned int i = 0; i < 3; i++)
+		{
+			f[i]     = y[i + 3] / (gamma * mass);
+			f[i + 3] = - mass * C0 * C0 / (2 * gamma) * gradient[i];
+		}
+	}
+
+} PonderomotiveSystem;
+
+/**
+ * Check that the envelope approximation holds at the time t and position
+ */
+bool is_ponderomotive_valid(const Simulation& simulation, const Pulse& laser, const Particle& particle, FunctionFieldType function_field, double t, const double position[])
+{
+	double a2 = get_ponderomotive_intensity(simulation, laser, particle, function_field, t, position[0], position[1], position[2]);
+
+	if (sqrt(2 * a2) > simulation.ponderomotive_max_a0)
+		return false;
+
+	// Where there is almost no field (a₀ below 1% of the limit) the relative variations don't matter
+	if (a2 < 1e-4 * pow2(simulation.ponderomotive_max_a0) / 2)
+		return true;
+
+	double omega  = get_ponderomotive_frequency(simulation);
+	double period = 2 * M_PI / omega;
+
+	double gradient[3];
+	get_ponderomotive_gradient(simulation, laser, particle, function_field, t, position, gradient);
+
+	if (simulation.ponderomotive_wavelength / (2 * M_PI) * vector_module(gradient[0], gradient[1], gradient[2]) / a2 > simulation.ponderomotive_max_gradient)
+		return false;
+
+	double a2_after  = get_ponderomotive_intensity(simulation, laser, particle, function_field, t + period, position[0], position[1], position[2]);
+	double a2_before = get_ponderomotive_intensity(simulation, laser, particle, function_field, t - period, position[0], position[1], position[2]);
+
+	if (fabs(a2_after - a2_before) / (2 * period) / (omega * a2) > simulation.ponderomotive_max_gradient)
+		return false;
+
+	return true;
+}
+
+/**
+ * Instantaneous momentum from the cycle averaged one (sign = 1) or vice versa (sign = -1): p = p̄ + charge·A
+ */
+void convert_ponderomotive_momentum(const Simulation& simulation, const Pulse& laser, const Particle& particle, FunctionFieldType function_field, double t, double y[], double sign)
+{
+	double potential[3];
+	get_ponderomotive_potential(simulation, laser, function_field, t, y, potential);
+
+	for (unsigned int i = 0; i < 3; i++)
+		y[i + 3] += sign * particle.charge * potential[i];
+}
+
+/**
+ * Full integration of the node motion from the entry to local_time_exit, used as reference by the validation
+ */
+void integrate_lorentz(Simulation& simulation, Pulse& laser, Particle& particle, FunctionFieldType function_field, double local_time, double local_time_exit, double y[])
+{
+	gsl_odeiv_custom_params params;
+	params.laser 	  = &laser;
+	params.particle	  = &particle;
+	params.function_field = &function_field;
+
+	gsl_odeiv_step* 	steps 	= gsl_odeiv_step_alloc(gsl_odeiv_step_rk8pd, 6);
+	gsl_odeiv_control* 	control	= gsl_odeiv_control_y_new (simulation.error_abs, simulation.error_rel);
+	gsl_odeiv_evolve* 	evolve	= gsl_odeiv_evolve_alloc(6);
+	gsl_odeiv_system 	system 	= {gsl_odeiv_func_laser, gsl_odeiv_jac, 6, &params};
+
+	double local_time_step = simulation.time_resolution_laser / 100;
+
+	while (local_time < local_time_exit)
+	{
+		gsl_odeiv_evolve_apply(evolve, control, steps, &system, &local_time, local_time_exit, &local_time_step, y);
+	}
+
+	gsl_odeiv_evolve_free(evolve);
+	gsl_odeiv_control_free(control);
+	gsl_odeiv_step_free(steps);
+}
+
+bool simulate_node_ponderomotive(
+	Simulation& simulation,
+	Pulse& laser,
+	Node& node,
+	Particle& particle,
+	ParticleStateLocal& state,
+	double& local_time_current,
+	unsigned int interaction,
+	FunctionNodeTimeProgress& on_node_time_progress,
+	SimluationResultNodeSummary& summary,
+	FunctionFieldType function_field,
+	RecordPolicy record)
+{
+	double time_start = omp_get_wtime();
+
+	#pragma omp critical (ponderomotive_report)
+	ponderomotive_report.nodes++;
+
+	double y_entry[6] = {state.position_x, state.position_y, state.position_z, state.momentum_x, state.momentum_y, state.momentum_z};
+	double local_time_entry = local_time_current;
+
+	double y[6];
+	for (unsigned int i = 0; i < 6; i++)
+		y[i] = y_entry[i];
+
+	convert_ponderomotive_momentum(simulation, laser, particle, function_field, local_time_current, y, -1);
+
+	PonderomotiveSystem system = {&simulation, &laser, &particle, function_field};
+
+	// The averaged force is tiny far from the axis: a component starting from zero would need steps shrinking with it,
+	// so the absolute tolerance is at least the relative one applied to the momentum
+	double error_abs = max(simulation.error_abs, simulation.error_rel * vector_module(y[3], y[4], y[5]));
+
+	Dop853Workspace workspace;
+	dop853_init(workspace, 6, error_abs, simulation.error_rel);
+
+	bool   crossed = false;
+	double local_time_crossing = INFINITY;
+	double radius = simulation.laser_influence_radius;
+
+	// The rest of the motion is left to the full integration, from the last state where the approximation holds
+	auto fail = [&](double local_time, const double y_valid[])
+	{
+		double y_state[6];
+		for (unsigned int i = 0; i < 6; i++)
+			y_state[i] = y_valid[i];
+
+		convert_ponderomotive_momentum(simulation, laser, particle, function_field, local_time, y_state, 1);
+
+		local_time_current = local_time;
+		state.position_x = y_state[0];
+		state.position_y = y_state[1];
+		state.position_z = y_state[2];
+		state.momentum_x = y_state[3];
+		state.momentum_y = y_state[4];
+		state.momentum_z = y_state[5];
+
+		#pragma omp critical (ponderomotive_report)
+		ponderomotive_report.switched++;
+	};
+
+	if (!is_ponderomotive_valid(simulation, laser, particle, function_field, local_time_current, y))
+	{
+		fail(local_time_current, y);
+		return false;
+	}
+
+	while (true)
+	{
+		double y_before[6];
+		double local_time_before = local_time_current;
+
+		for (unsigned int i = 0; i < 6; i++)
+			y_before[i] = y[i];
+
+		// The approximation is checked after every step, not only on the samples
+		double local_time_limit = local_time_current + simulation.ponderomotive_time_step;
+
+		while (local_time_current < local_time_limit)
+		{
+			double y_step[6];
+			double local_time_step = local_time_current;
+
+			for (unsigned int i = 0; i < 6; i++)
+				y_step[i] = y[i];
+
+			dop853_step(workspace, system, local_time_current, y, local_time_limit);
+
+			if (!is_ponderomotive_valid(simulation, laser, particle, function_field, local_time_current, y))
+			{
+				fail(local_time_step, y_step);
+				return false;
+			}
+		}
+
+		if (!is_in_influence_radius(y, radius))
+		{
+			double position[3];
+
+			crossed = true;
+			local_time_crossing = find_sphere_crossing(local_time_before, local_time_current, [&](double time)
+			{
+				interpolate_position(particle, local_time_before, y_before, local_time_current, y, time, position);
+				return !is_in_influence_radius(position, radius);
+			});
+
+			// Integrate again from the previous sample, stopping on the crossing
+			for (unsigned int i = 0; i < 6; i++)
+				y[i] = y_before[i];
+
+			local_time_current = local_time_before;
+			dop853_restart(workspace);
+
+			dop853_evolve(workspace, system, local_time_current, y, local_time_crossing);
+
+			// The motion continues with the instantaneous momentum
+			convert_ponderomotive_momentum(simulation, laser, particle, function_field, local_time_current, y, 1);
+		}
+
+		state.position_x = y[0];
+		state.position_y = y[1];
+		state.position_z = y[2];
+		state.momentum_x = y[3];
+		state.momentum_y = y[4];
+		state.momentum_z = y[5];
+
+		record_node_sample(simulation, laser, node, particle, state, local_time_current, interaction, on_node_time_progress, summary, function_field, record);
+
+		if (crossed)
+			break;
+	}
+
+	if (simulation.ponderomotive_validation)
+	{
+		double time_ponderomotive = omp_get_wtime() - time_start;
+
+		time_start = omp_get_wtime();
+		integrate_lorentz(simulation, laser, particle, function_field, local_time_entry, local_time_current, y_entry);
+		double time_lorentz = omp_get_wtime() - time_start;
+
+		double error_position = vector_module(y[0] - y_entry[0], y[1] - y_entry[1], y[2] - y_entry[2]);
+		double error_momentum = vector_module(y[3] - y_entry[3], y[4] - y_entry[4], y[5] - y_entry[5]) / vector_module(y_entry[3], y_entry[4], y_entry[5]);
+
+		#pragma omp critical (ponderomotive_report)
+		{
+			ponderomotive_report.validated++;
+			ponderomotive_report.max_position_error  = max(ponderomotive_report.max_position_error, error_position);
+			ponderomotive_report.max_momentum_error  = max(ponderomotive_report.max_momentum_error, error_momentum);
+			ponderomotive_report.time_ponderomotive += time_ponderomotive;
+			ponderomotive_report.time_lorentz       += time_lorentz;
+		}
+	}
+
+	return true;
+}
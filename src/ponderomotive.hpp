@@ -0,0 +1,62 @@
+#include "type.hpp"
+
+#ifndef CIRCLESIM_PONDEROMOTIVE
+#define CIRCLESIM_PONDEROMOTIVE
+
+/**
+ * Cycle averaged (ponderomotive) model of the node motion, for pulses lasting many optical cycles.
+ *
+ * The fast oscillation of the particle in the carrier wave (angular frequency ω = 2πc₀/λ) is averaged out and only its
+ * guiding centre is integrated. With a² = charge²·⟨|E|²⟩/(m²c₀²ω²), the cycle average of the squared normalized vector
+ * potential, the relativistic guiding centre equations are:
+ *
+ *   γ̄ = √(1 + p̄²/c₀² + a²)        dr/dt = p̄/(γ̄·m)        dp̄/dt = -m·c₀²/(2γ̄)·∇a²
+ *
+ * ⟨|E|²⟩ is E₀²/2 for the envelope E₀ given by the user ('func_envelope'), otherwise it is averaged over
+ * ponderomotive_samples field samples spanning an optical cycle. The gradient is calculated with central differences
+ * (λ/10 apart). The step of the averaged motion is limited only by the envelope, not by the optical cycle.
+ *
+ * The instantaneous momentum is p = p̄ + charge·A, where A is the oscillating vector potential (the integral of -E over
+ * the cycle, without its mean): it is applied entering the averaged motion and leaving it. The quiver displacement is
+ * neglected and the samples of the averaged motion contain the guiding centre.
+ *
+ * The approximation needs a non relativistic quiver and an envelope varying slowly over a wavelength and a cycle:
+ *
+ *   a₀ = √2·a < ponderomotive_max_a0        λ/(2π)·|∇a²|/a² < ponderomotive_max_gradient        |∂a²/∂t|/(ω·a²) < ponderomotive_max_gradient
+ *
+ * They are checked at the entry and after every step: when they fail the rest of the node motion is integrated with the
+ * full Lorentz equations by the configured integrator, starting from the last state where they held. Extracting the
+ * envelope from the field costs ponderomotive_samples field evaluations for every a², so the model pays off only when
+ * the steps of the averaged motion span many optical cycles (or with 'func_envelope').
+ */
+
+/**
+ * Cycle averaged a² at the local time t (A.U.) and local position x, y, z
+ */
+double get_ponderomotive_intensity(const Simulation& simulation, const Pulse& laser, const Particle& particle, FunctionFieldType function_field, double t, double x, double y, double z);
+
+/**
+ * Oscillating vector potential at the local time t and position
+ */
+void get_ponderomotive_potential(const Simulation& simulation, const Pulse& laser, FunctionFieldType function_field, double t, const double position[], double potential[]);
+
+/**
+ * Node motion with the averaged model, from state at local_time_current. Returns false if the envelope approximation
+ * failed: state and local_time_current are where the full integration must continue.
+ */
+bool simulate_node_ponderomotive(
+	Simulation& simulation,
+	Pulse& laser,
+	Node& node,
+	Particle& particle,
+	ParticleStateLocal& state,
+	double& local_time_current,
+	unsigned int interaction,
+	FunctionNodeTimeProgress& on_node_time_progress,
+	SimluationResultNodeSummary& summary,
+	FunctionFieldType function_field,
+	RecordPolicy record);
+
+PonderomotiveReport& get_ponderomotive_report();
+
+#endif
@@ -0,0 +1,296 @@
+#include <math.h>
+#include "type.hpp"
+
+#ifndef CIRCLESIM_PUSHER
+#define CIRCLESIM_PUSHER
+
+/**
+ * Fixed step particle pushers for the Lorentz force: Boris, Vay and Higuera-Cary.
+ *
+ * The kinematic is the same as the equations of motion integrated by the adaptive integrators:
+ *
+ *   dr/dt = v = p/(γ·m)       γ = √(1 + p²/c₀²)
+ *   dp/dt = Q·(E + v×B)       Q = -charge
+ *
+ * Every step is drift-kick-drift: the position moves by half a step, the momentum is updated with the fields evaluated
+ * there (only one field evaluation per step) and then the position moves by the other half step with the new momentum.
+ *
+ * The system is any object with a method field(t, position, field) returning the fields in A.U.
+ */
+
+inline double get_pusher_gamma(double p_x, double p_y, double p_z)
+{
+	return sqrt(1 + (p_x * p_x + p_y * p_y + p_z * p_z) / (C0 * C0));
+}
+
+/**
+ * Boris rotation: half electric kick, rotation around B and the other half electric kick.
+ */
+inline void push_momentum_boris(double p[], const Field& field, double charge, double rest_mass, double h)
+{
+	double u_x = p[0] + charge * field.e_x * h / 2;
+	double u_y = p[1] + charge * field.e_y * h / 2;
+	double u_z = p[2] + charge * field.e_z * h / 2;
+
+	double gamma = get_pusher_gamma(u_x, u_y, u_z);
+
+	double t_x = charge * field.b_x * h / (2 * gamma * rest_mass);
+	double t_y = charge * field.b_y * h / (2 * gamma * rest_mass);
+	double t_z = charge * field.b_z * h / (2 * gamma * rest_mass);
+
+	double w_x = u_x + (u_y * t_z - u_z * t_y);
+	double w_y = u_y + (u_z * t_x - u_x * t_z);
+	double w_z = u_z + (u_x * t_y - u_y * t_x);
+
+	double s = 2 / (1 + t_x * t_x + t_y * t_y + t_z * t_z);
+
+	u_x += s * (w_y * t_z - w_z * t_y);
+	u_y += s * (w_z * t_x - w_x * t_z);
+	u_z += s * (w_x * t_y - w_y * t_x);
+
+	p[0] = u_x + charge * field.e_x * h / 2;
+	p[1] = u_y + charge * field.e_y * h / 2;
+	p[2] = u_z + charge * field.e_z * h / 2;
+}
+
+/**
+ * Solve p⁺ = u + p⁺×τ/γ⁺ where γ⁺ = γ(p⁺), the implicit rotation shared by Vay and Higuera-Cary.
+ */
+inline void push_momentum_rotation(double u_x, double u_y, double u_z, const Field& field, double charge, double rest_mass, double h, double p[], double t[])
+{
+	double tau_x = charge * field.b_x * h / (2 * rest_mass);
+	double tau_y = charge * field.b_y * h / (2 * rest_mass);
+	double tau_z = charge * field.b_z * h / (2 * rest_mass);
+
+	double tau2   = tau_x * tau_x + tau_y * tau_y + tau_z * tau_z;
+	double u_star = (u_x * tau_x + u_y * tau_y + u_z * tau_z) / C0;
+	double sigma  = pow2(get_pusher_gamma(u_x, u_y, u_z)) - tau2;
+	double gamma  = sqrt((sigma + sqrt(sigma * sigma + 4 * (tau2 + u_star * u_star))) / 2);
+
+	t[0] = tau_x / gamma;
+	t[1] = tau_y / gamma;
+	t[2] = tau_z / gamma;
+
+	double s   = 1 / (1 + t[0] * t[0] + t[1] * t[1] + t[2] * t[2]);
+	double u_t = u_x * t[0] + u_y * t[1] + u_z * t[2];
+
+	p[0] = s * (u_x + u_t * t[0] + (u_y * t[2] - u_z * t[1]));
+	p[1] = s * (u_y + u_t * t[1] + (u_z * t[0] - u_x * t[2]));
+	p[2] = s * (u_z + u_t * t[2] + (u_x * t[1] - u_y * t[0]));
+}
+
+/**
+ * Vay (2008): the magnetic force is averaged on the velocities instead of the momenta, so E + v×B = 0 is kept exactly.
+ */
+inline void push_momentum_vay(double p[], const Field& field, double charge, double rest_mass, double h)
+{
+	double gamma = get_pusher_gamma(p[0], p[1], p[2]);
+
+	double v_x = p[0] / (gamma * rest_mass);
+	double v_y = p[1] / (gamma * rest_mass);
+	double v_z = p[2] / (gamma * rest_mass);
+
+	double u_x = p[0] + charge * h * (field.e_x + (v_y * field.b_z - v_z * field.b_y) / 2);
+	double u_y = p[1] + charge * h * (field.e_y + (v_z * field.b_x - v_x * field.b_z) / 2);
+	double u_z = p[2] + charge * h * (field.e_z + (v_x * field.b_y - v_y * field.b_x) / 2);
+
+	double t[3];
+	push_momentum_rotation(u_x, u_y, u_z, field, charge, rest_mass, h, p, t);
+}
+
+/**
+ * Higuera-Cary (2017): volume preserving like Boris and with the correct E×B drift like Vay.
+ */
+inline void push_momentum_higuera_cary(double p[], const Field& field, double charge, double rest_mass, double h)
+{
+	double u_x = p[0] + charge * field.e_x * h / 2;
+	double u_y = p[1] + charge * field.e_y * h / 2;
+	double u_z = p[2] + charge * field.e_z * h / 2;
+
+	double t[3];
+	double w[3];
+	push_momentum_rotation(u_x, u_y, u_z, field, charge, rest_mass, h, w, t);
+
+	p[0] = w[0] + charge * field.e_x * h / 2 + (w[1] * t[2] - w[2] * t[1]);
+	p[1] = w[1] + charge * field.e_y * h / 2 + (w[2] * t[0] - w[0] * t[2]);
+	p[2] = w[2] + charge * field.e_z * h / 2 + (w[0] * t[1] - w[1] * t[0]);
+}
+
+inline void push_position(double y[], double rest_mass, double h)
+{
+	double gamma = get_pusher_gamma(y[3], y[4], y[5]);
+
+	y[0] += y[3] / (gamma * rest_mass) * h;
+	y[1] += y[4] / (gamma * rest_mass) * h;
+	y[2] += y[5] / (gamma * rest_mass) * h;
+}
+
+/**
+ * One drift-kick-drift step of size h. y contains position and momentum like the state of the adaptive integrators.
+ */
+template <typename F> void push_step(IntegratorType pusher, F& system, const Particle& particle, double t, double y[], double h)
+{
+	double charge = -particle.charge;
+
+	push_position(y, particle.rest_mass, h / 2);
+
+	Field field;
+	system.field(t + h / 2, y, field);
+
+	switch (pusher)
+	{
+		case BORIS:			push_momentum_boris			(y + 3, field, charge, particle.rest_mass, h); break;
+		case VAY:			push_momentum_vay			(y + 3, field, charge, particle.rest_mass, h); break;
+		case HIGUERA_CARY:	push_momentum_higuera_cary	(y + 3, field, charge, particle.rest_mass, h); break;
+		default: break;
+	}
+
+	push_position(y, particle.rest_mass, h / 2);
+}
+
+/**
+ * Push from t to t_end with steps as near as possible to 'step' (the interval is divided in equal steps).
+ */
+template <typename F> void push_evolve(IntegratorType pusher, F& system, const Particle& particle, double& t, double y[], double t_end, double step)
+{
+	if (t_end <= t)
+		return;
+
+	double count = max(ceil((t_end - t) / step - 1e-9), 1.d);
+	double h     = (t_end - t) / count;
+	double start = t;
+
+	for (double i = 1; i <= count; i++)
+	{
+		push_step(pusher, system, particle, t, y, h);
+		t = (i == count) ? t_end : start + i * h;
+	}
+}
+
+/**
+ * Buffers of push_evolve_batch and push_step_batch for up to 'size' particles. They are allocated once for a chunk of
+ * particles (like Dop853Workspace), so the steps don't allocate.
+ */
+typedef struct PusherBatchWorkspace
+{
+	unsigned int size;
+
+	vector<double> t_middle;	// Time of the field evaluation
+	vector<double> fields;		// e_x, e_y, e_z, b_x, b_y, b_z of size elements each
+	vector<double> start;
+	vector<double> count;
+	vector<double> h;
+	vector<double> h_current;
+
+} PusherBatchWorkspace;
+
+inline void push_batch_init(PusherBatchWorkspace& workspace, unsigned int size)
+{
+	workspace.size = size;
+
+	workspace.t_middle.resize(size);
+	workspace.fields.resize(6 * size);
+	workspace.start.resize(size);
+	workspace.count.resize(size);
+	workspace.h.resize(size);
+	workspace.h_current.resize(size);
+}
+
+/**
+ * push_step for n particles at once, each one with its own time and step size. The state is in structure of arrays
+ * layout (y[k][i] is the component k of the particle i) and the fields of all the particles are evaluated by one call of
+ * system.field_batch(n, t, x, y, z, field). A step of size 0 leaves the particle unchanged.
+ */
+template <typename F> void push_step_batch(IntegratorType pusher, F& system, const Particle& particle, unsigned int n, const double t[], double* const y[], const double h[], PusherBatchWorkspace& workspace)
+{
+	double charge    = -particle.charge;
+	double rest_mass = particle.rest_mass;
+	
+	double* t_middle = workspace.t_middle.data();
+	double* buffer   = workspace.fields.data();
+	
+	FieldBatch field;
+	field.e_x = &buffer[0 * workspace.size];
+	field.e_y = &buffer[1 * workspace.size];
+	field.e_z = &buffer[2 * workspace.size];
+	field.b_x = &buffer[3 * workspace.size];
+	field.b_y = &buffer[4 * workspace.size];
+	field.b_z = &buffer[5 * workspace.size];
+	
+	auto push_position_batch = [&]()
+	{
+		for (unsigned int i = 0; i < n; i++)
+		{
+			double gamma = get_pusher_gamma(y[3][i], y[4][i], y[5][i]);
+			
+			y[0][i] += y[3][i] / (gamma * rest_mass) * (h[i] / 2);
+			y[1][i] += y[4][i] / (gamma * rest_mass) * (h[i] / 2);
+			y[2][i] += y[5][i] / (gamma * rest_mass) * (h[i] / 2);
+		}
+	};
+	
+	push_position_batch();
+	
+	for (unsigned int i = 0; i < n; i++)
+		t_middle[i] = t[i] + h[i] / 2;
+	
+	system.field_batch(n, t_middle, y[0], y[1], y[2], field);
+	
+	for (unsigned int i = 0; i < n; i++)
+	{
+		Field field_i = {field.e_x[i], field.e_y[i], field.e_z[i], field.b_x[i], field.b_y[i], field.b_z[i]};
+		double p[3]   = {y[3][i], y[4][i], y[5][i]};
+		
+		switch (pusher)
+		{
+			case BORIS:			push_momentum_boris			(p, field_i, charge, rest_mass, h[i]); break;
+			case VAY:			push_momentum_vay			(p, field_i, charge, rest_mass, h[i]); break;
+			case HIGUERA_CARY:	push_momentum_higuera_cary	(p, field_i, charge, rest_mass, h[i]); break;
+			default: break;
+		}
+		
+		y[3][i] = p[0];
+		y[4][i] = p[1];
+		y[5][i] = p[2];
+	}
+	
+	push_position_batch();
+}
+
+/**
+ * push_evolve for n particles at once, from t[i] to t_end[i]. Every particle divides its interval in its own equal
+ * steps (like push_evolve, so the result is the same as pushing it alone); the ones needing less steps than the others
+ * do steps of size 0 at the end. n must not exceed the size of the workspace.
+ */
+template <typename F> void push_evolve_batch(IntegratorType pusher, F& system, const Particle& particle, unsigned int n, double t[], double* const y[], const double t_end[], double step, PusherBatchWorkspace& workspace)
+{
+	vector<double>& start     = workspace.start;
+	vector<double>& count     = workspace.count;
+	vector<double>& h         = workspace.h;
+	vector<double>& h_current = workspace.h_current;
+	
+	double count_max = 0;
+	
+	for (unsigned int i = 0; i < n; i++)
+	{
+		start[i] = t[i];
+		count[i] = (t_end[i] > t[i]) ? max(ceil((t_end[i] - t[i]) / step - 1e-9), 1.d) : 0;
+		h[i]     = (count[i] > 0)    ? (t_end[i] - t[i]) / count[i] : 0;
+		
+		count_max = max(count_max, count[i]);
+	}
+	
+	for (double s = 1; s <= count_max; s++)
+	{
+		for (unsigned int i = 0; i < n; i++)
+			h_current[i] = (s <= count[i]) ? h[i] : 0;
+		
+		push_step_batch(pusher, system, particle, n, t, y, h_current.data(), workspace);
+		
+		for (unsigned int i = 0; i < n; i++)
+			if (s <= count[i])
+				t[i] = (s == count[i]) ? t_end[i] : start[i] + s * h[i];
+	}
+}
+
+#endif
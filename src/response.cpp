@@ -1,8 +1,13 @@
+#include <string.h>
+#include <algorithm>
+#include <iterator>
 #include "response.hpp"
 #include "type.hpp"
 #include "util.hpp"
 #include "output.hpp"
 #include "simulator.hpp"
+#include "response_design.hpp"
+#include "sensitivity.hpp"
 
 
 double get_attribute(Particle& particle, ParticleStateGlobal& particle_state, Pulse& laser, string object, string attribute)
@@ -11,17 +16,17 @@ double get_attribute(Particle& particle, ParticleStateGlobal& particle_state, Pu
 	{
 
 		if (attribute == "position_x")
-			return particle_state.position_x;
+			return (double) particle_state.position_x;
 		else if (attribute == "position_y")
-			return particle_state.position_y;
+			return (double) particle_state.position_y;
 		else if (attribute == "position_z")
-			return particle_state.position_z;
+			return (double) particle_state.position_z;
 		else if (attribute == "position_phi" || attribute == "position_theta") 
 		{
-			long double position_theta;
-			long double position_phi;
+			double position_theta;
+			double position_phi;
 			
-			cartesian_to_spherical<long double>(particle_state.position_x,	particle_state.position_y, particle_state.position_z, position_theta, position_phi);
+			cartesian_to_spherical<double>((double) particle_state.position_x, (double) particle_state.position_y, (double) particle_state.position_z, position_theta, position_phi);
 			
 			if (attribute == "position_phi")
 				return position_phi;
@@ -29,7 +34,7 @@ double get_attribute(Particle& particle, ParticleStateGlobal& particle_state, Pu
 				return position_theta;
 		}
 		else if (attribute == "position_rho")
-			return vector_module(particle_state.position_x,	particle_state.position_y, particle_state.position_z);
+			return vector_module((double) particle_state.position_x, (double) particle_state.position_y, (double) particle_state.position_z);
 		else if (attribute == "momentum_x")
 			return particle_state.momentum_x;
 		else if (attribute == "momentum_y")
@@ -99,12 +104,16 @@ void set_attribute(Particle& particle, ParticleStateGlobal& particle_state, Puls
 			particle_state.position_z = new_value;
 		else if (attribute == "position_phi" || attribute == "position_theta" || attribute == "position_rho") 
 		{
-			long double position_theta;
-			long double position_phi;
-			long double position_rho;
+			double position_x = (double) particle_state.position_x;
+			double position_y = (double) particle_state.position_y;
+			double position_z = (double) particle_state.position_z;
 			
-			cartesian_to_spherical<long double>(particle_state.position_x,	particle_state.position_y, particle_state.position_z, position_theta, position_phi);
-			position_rho = vector_module(particle_state.position_x,	particle_state.position_y, particle_state.position_z);
+			double position_theta;
+			double position_phi;
+			double position_rho;
+			
+			cartesian_to_spherical<double>(position_x, position_y, position_z, position_theta, position_phi);
+			position_rho = vector_module(position_x, position_y, position_z);
 			
 			if (attribute == "position_phi")
 				position_phi		= new_value;
@@ -115,7 +124,11 @@ void set_attribute(Particle& particle, ParticleStateGlobal& particle_state, Puls
 			else
 				error_attribute_unknown(object, attribute);
 				
-			spherical_to_cartesian(position_rho, position_theta, position_phi, particle_state.position_x, particle_state.position_y, particle_state.position_z);
+			spherical_to_cartesian(position_rho, position_theta, position_phi, position_x, position_y, position_z);
+			
+			particle_state.position_x = position_x;
+			particle_state.position_y = position_y;
+			particle_state.position_z = position_z;
 		}
 		else if (attribute == "momentum_x")
 			particle_state.momentum_x = new_value;
@@ -179,7 +192,13 @@ void set_attribute(Particle& particle, ParticleStateGlobal& particle_state, Puls
 	else if (object == "laser")
 	{	
 		if (laser.params.params_float.find(attribute) != laser.params.params_float.end())
+		{
 			laser.params.params_float[attribute] = new_value;
+			
+			// The custom functions read the attributes from params_data
+			if (laser.params_offsets.find(attribute) != laser.params_offsets.end())
+				memcpy((char*) laser.params_data.data() + laser.params_offsets[attribute], &new_value, sizeof(double));
+		}
 		else
 			error_attribute_unknown(object, attribute);
 	}
@@ -190,61 +209,133 @@ void set_attribute(Particle& particle, ParticleStateGlobal& particle_state, Puls
 }
 
 
+// Intervals of the adaptive sweeps narrower than this (as a fraction of the range of the input) aren't bisected
+#define RESPONSE_ADAPTIVE_MIN_WIDTH		1E-9
 
-void calculateResponseAnalyses(
+// Step of the central differences of the attribute maps, relative to the value (absolute if it is 0)
+#define RESPONSE_SENSITIVITY_STEP		1E-6
+
+/**
+ * Result of a step of a response analysis, waiting to be written
+ */
+typedef struct ResponseStepResult
+{
+	bool   done = false;
+	double point;		// Position of the first input in its range (adaptive sweeps)
+	
+	vector<double> perct_in;
+	vector<double> delta_in;
+	vector<double> value_in;
+	
+	vector<double> perct_out;
+	vector<double> delta_out;
+	vector<double> value_out;
+} ResponseStepResult;
+
+/**
+ * What the steps of a response analysis share
+ */
+typedef struct ResponseSweep
+{
+	vector<double>			base_value_in;
+	bool					shared_prefix;		// The steps are resumed from checkpoint_shared
+	bool					laser_changed;
+	SimulationCheckpoint	checkpoint_shared;
+} ResponseSweep;
+
+/**
+ * The laser parameters and the charge of the particle act only inside the nodes: changing them, the simulation is the
+ * same until the first node entry.
+ */
+bool is_attribute_node_only(string object, string attribute)
+{
+	return object == "laser" || (object == "particle" && attribute == "charge");
+}
+
+void init_response_sweep(
+	ResponseSweep& sweep,
 	ResponseAnalysis& analysis,
 	Simulation& simulation,
 	Particle& particle,
 	ParticleStateGlobal& particle_state_initial, 
-	ParticleStateGlobal& particle_state_final,
 	Pulse& laser,
 	Laboratory& laboratory,
-	fs::path output_dir,
-	FunctionFieldType 	function_field,
-	FunctionResponseAnalysisCalculated&  on_calculate)
+	FunctionFieldType function_field)
 {
-	fs::path output_response_dir = output_dir / fs::path("analyses") / fs::path((bo::format("response_%u_by_%s_%s") % analysis.id % analysis.object_in % analysis.attribute_in).str());
-	fs::create_directories(output_response_dir);
+	sweep.base_value_in.clear();
+	for (ResponseInput& input: analysis.inputs)
+		sweep.base_value_in.push_back(get_attribute(particle, particle_state_initial, laser, input.object, input.attribute));
 	
-	double base_value_in  = get_attribute(particle, particle_state_initial, laser, analysis.object_in,  analysis.attribute_in);
+	// The common part of the simulations (the free motion until the first node) is simulated once and every step is
+	// resumed from its end
+	sweep.shared_prefix    = true;
+	sweep.laser_changed    = false;
 	
-	ofstream stream_response_analysis;
-	stream_response_analysis.open((output_response_dir / fs::path("response.csv")).string());
-	setup_response_analysis(stream_response_analysis, analysis);
+	for (ResponseInput& input: analysis.inputs)
+	{
+		sweep.shared_prefix    = sweep.shared_prefix && is_attribute_node_only(input.object, input.attribute);
+		sweep.laser_changed    = sweep.laser_changed || input.object == "laser";
+	}
 	
-	unsigned int  sn = analysis.steps;
+	init_simulation_checkpoint(sweep.checkpoint_shared, particle_state_initial);
 	
-	// It is important to use schedule(static, 1) becouse in this way we ensure than for sn=50 and 4 cores we have these group of work (s=0,s=1,s=2, s=3) at t=0, (s=4,s=5,s=6, s=7) at t=1, etc. This will reduce time in the ordered section below
-	#pragma omp parallel for ordered schedule(static, 1)
-	for (unsigned int s = 0; s < sn; s++)
+	if (sweep.shared_prefix)
 	{
-		Particle            an_particle         = particle;
-		ParticleStateGlobal an_particle_state   = particle_state_initial;
-		Pulse               an_laser            = laser;
-		
-		
-		double perct_in;
-		double delta_in;
-		double value_in;
+		vector<SimluationResultFreeSummary> summaries_free;
+		vector<SimluationResultNodeSummary> summaries_node;
 		
+		simulate (simulation, laser, particle, sweep.checkpoint_shared, laboratory, summaries_free, summaries_node, *function_field, true, RECORD_NONE);
+	}
+}
+
+/**
+ * Simulate the step where the inputs are at point (fractions of their ranges)
+ */
+void calculate_response_step(
+	ResponseAnalysis& analysis,
+	ResponseSweep& sweep,
+	Simulation& simulation,
+	Particle& particle,
+	ParticleStateGlobal& particle_state_initial, 
+	ParticleStateGlobal& particle_state_final,
+	Pulse& laser,
+	Laboratory& laboratory,
+	FunctionFieldType function_field,
+	const double point[],
+	ResponseStepResult& result)
+{
+	unsigned int ni = analysis.inputs.size();
+	
+	Particle            an_particle         = particle;
+	ParticleStateGlobal an_particle_state   = particle_state_initial;
+	Pulse               an_laser            = laser;
+	
+	vector<double> perct_in(ni);
+	vector<double> delta_in(ni);
+	vector<double> value_in(ni);
+	
+	for (unsigned int i = 0; i < ni; i++)
+	{
+		ResponseInput& input = analysis.inputs[i];
+		double change = input.change_from + (input.change_to - input.change_from) * point[i];
 		
-		if (analysis.value_type == PERCENTUAL)
+		if (input.value_type == PERCENTUAL)
 		{
-			perct_in = analysis.change_from + (analysis.change_to - analysis.change_from) / analysis.steps * s;
-			delta_in = base_value_in * perct_in;
-			value_in = base_value_in + delta_in;
+			perct_in[i] = change;
+			delta_in[i] = sweep.base_value_in[i] * perct_in[i];
+			value_in[i] = sweep.base_value_in[i] + delta_in[i];
 		}
-		else if (analysis.value_type == VALUE_RELATIVE)
+		else if (input.value_type == VALUE_RELATIVE)
 		{
-			delta_in = analysis.change_from + (analysis.change_to - analysis.change_from) / analysis.steps * s;
-			perct_in = delta_in / base_value_in;
-			value_in = base_value_in + delta_in;
+			delta_in[i] = change;
+			perct_in[i] = delta_in[i] / sweep.base_value_in[i];
+			value_in[i] = sweep.base_value_in[i] + delta_in[i];
 		}
-		else if (analysis.value_type == VALUE_ABSOLUTE)
+		else if (input.value_type == VALUE_ABSOLUTE)
 		{
-			value_in = analysis.change_from + (analysis.change_to - analysis.change_from) / analysis.steps * s;
-			delta_in = value_in - base_value_in;
-			perct_in = delta_in / base_value_in;
+			value_in[i] = change;
+			delta_in[i] = value_in[i] - sweep.base_value_in[i];
+			perct_in[i] = delta_in[i] / sweep.base_value_in[i];
 		}
 		else
 		{
@@ -252,34 +343,456 @@ void calculateResponseAnalyses(
 			exit(-1);	
 		}
 		
-		set_attribute(an_particle, an_particle_state, an_laser, analysis.object_in, analysis.attribute_in, value_in);
+		set_attribute(an_particle, an_particle_state, an_laser, input.object, input.attribute, value_in[i]);
+	}
+	
+	// The tabulated fields are calculated with the original laser parameters
+	if (sweep.laser_changed)
+		an_laser.field_cache = NULL;
+	
+	// The steps run in parallel: with a shared transfer map cache the result of a step would depend on the steps
+	// finished before it (and the node motions depend on the laser, the rest mass and the charge)
+	an_laser.transfer_map_cache = NULL;
+	
+	SimulationCheckpoint an_checkpoint = sweep.checkpoint_shared;
+	
+	if (!sweep.shared_prefix)
+		init_simulation_checkpoint(an_checkpoint, an_particle_state);
+	
+	vector<SimluationResultFreeSummary> an_summaries_free;
+	vector<SimluationResultNodeSummary> an_summaries_node;
+	
+	simulate (simulation, an_laser, an_particle, an_checkpoint, laboratory, an_summaries_free, an_summaries_node, *function_field, false, RECORD_NONE);
+	an_particle_state = an_checkpoint.particle_state_global;
+	
+	vector<double> value_out;
+	vector<double> delta_out;
+	vector<double> perct_out;
+
+	for (unsigned int o = 0; o < analysis.attribute_out.size(); o++)
+	{   
+		
+		double base_value_out = get_attribute(particle, particle_state_final, laser, analysis.object_out[o], analysis.attribute_out[o]);
 		
-		vector<SimluationResultFreeSummary> an_summaries_free;
-		vector<SimluationResultNodeSummary> an_summaries_node;
+		value_out.push_back(get_attribute(an_particle, an_particle_state, an_laser, analysis.object_out[o], analysis.attribute_out[o]));
+		delta_out.push_back(value_out[o] - base_value_out);
+		perct_out.push_back(delta_out[o] / base_value_out);
+	}
+	
+	result.done      = true;
+	result.point     = point[0];
+	result.perct_in  = perct_in;
+	result.delta_in  = delta_in;
+	result.value_in  = value_in;
+	result.perct_out = perct_out;
+	result.delta_out = delta_out;
+	result.value_out = value_out;
+}
+
+/**
+ * Error of the sweep between the steps s and s + 1, relative to the range of the outputs: the largest between the
+ * change of the outputs and the error of the linear interpolation estimated with the second divided difference of the
+ * neighbour steps (|f''|·h²/8).
+ */
+double get_response_interval_error(vector<ResponseStepResult>& steps, vector<double>& range_out, unsigned int s)
+{
+	double error = 0;
+	double h     = steps[s + 1].point - steps[s].point;
+	
+	for (unsigned int o = 0; o < range_out.size(); o++)
+	{
+		if (range_out[o] == 0)
+			continue;
+		
+		double jump = abs(steps[s + 1].value_out[o] - steps[s].value_out[o]);
 		
-		simulate (simulation, an_laser, an_particle, an_particle_state, laboratory, an_summaries_free, an_summaries_node, *function_field);
+		double curvature = 0;
+		for (int c = (int) s - 1; c <= (int) s; c++)
+		{
+			if (c < 0 || c + 2 >= (int) steps.size())
+				continue;
+			
+			double x0 = steps[c].point;
+			double x1 = steps[c + 1].point;
+			double x2 = steps[c + 2].point;
+			
+			double d01 = (steps[c + 1].value_out[o] - steps[c].value_out[o])     / (x1 - x0);
+			double d12 = (steps[c + 2].value_out[o] - steps[c + 1].value_out[o]) / (x2 - x1);
+			
+			curvature = max(curvature, abs(d12 - d01) / (x2 - x0) * h * h / 4);
+		}
 		
-		vector<double> value_out;
-		vector<double> delta_out;
-		vector<double> perct_out;
+		error = max(error, max(jump, curvature) / range_out[o]);
+	}
 	
-		for (unsigned int o = 0; o < analysis.attribute_out.size(); o++)
-		{   
+	return error;
+}
+
+/**
+ * Adaptive sweep of a single input. It starts from a grid of adaptive_steps intervals (ends included), then it
+ * bisects the intervals whose error is above adaptive_tolerance, the largest errors first, until all of them are below
+ * it or analysis.samples steps have been simulated. The midpoints of every round are simulated in parallel.
+ */
+void calculate_response_adaptive(
+	ResponseAnalysis& analysis,
+	ResponseSweep& sweep,
+	Simulation& simulation,
+	Particle& particle,
+	ParticleStateGlobal& particle_state_initial, 
+	ParticleStateGlobal& particle_state_final,
+	Pulse& laser,
+	Laboratory& laboratory,
+	FunctionFieldType function_field,
+	FunctionResponseAnalysisCalculated& on_calculate,
+	vector<ResponseStepResult>& steps)
+{
+	unsigned int steps_completed = 0;
+	
+	vector<double> points;
+	for (unsigned int k = 0; k <= analysis.adaptive_steps; k++)
+		points.push_back((double) k / analysis.adaptive_steps);
+	
+	steps.clear();
+	
+	while (!points.empty())
+	{
+		vector<ResponseStepResult> round(points.size());
+		
+		#pragma omp parallel for schedule(dynamic, 1)
+		for (unsigned int p = 0; p < points.size(); p++)
+		{
+			calculate_response_step(analysis, sweep, simulation, particle, particle_state_initial, particle_state_final, laser, laboratory, function_field, &points[p], round[p]);
 			
-			double base_value_out = get_attribute(particle, particle_state_final, laser, analysis.object_out[o], analysis.attribute_out[o]);
+			#pragma omp critical (response_writer)
+			{
+				steps_completed++;
+				on_calculate(analysis, steps_completed);
+			}
+		}
+		
+		// The steps are kept sorted by the input
+		auto compare = [](const ResponseStepResult& a, const ResponseStepResult& b) { return a.point < b.point; };
+		sort(round.begin(), round.end(), compare);
+		
+		vector<ResponseStepResult> merged;
+		merge(steps.begin(), steps.end(), round.begin(), round.end(), back_inserter(merged), compare);
+		steps.swap(merged);
+		
+		points.clear();
+		
+		unsigned int budget = analysis.samples - steps.size();
+		if (budget == 0)
+			break;
+		
+		vector<double> range_out(analysis.attribute_out.size());
+		for (unsigned int o = 0; o < range_out.size(); o++)
+		{
+			double min_out = +INFINITY;
+			double max_out = -INFINITY;
 			
-			value_out.push_back(get_attribute(an_particle, an_particle_state, an_laser, analysis.object_out[o], analysis.attribute_out[o]));
-			delta_out.push_back(value_out[o] - base_value_out);
-			perct_out.push_back(delta_out[o] / base_value_out);
+			for (ResponseStepResult& step: steps)
+			{
+				min_out = min(min_out, step.value_out[o]);
+				max_out = max(max_out, step.value_out[o]);
+			}
+			
+			range_out[o] = isfinite(max_out - min_out) ? max_out - min_out : 0;
+		}
+		
+		vector<pair<double, unsigned int>> refine;
+		for (unsigned int s = 0; s + 1 < steps.size(); s++)
+		{
+			if (steps[s + 1].point - steps[s].point <= RESPONSE_ADAPTIVE_MIN_WIDTH)
+				continue;
+			
+			double error = get_response_interval_error(steps, range_out, s);
+			
+			if (error > analysis.adaptive_tolerance)
+				refine.push_back(make_pair(-error, s));
 		}
 		
-		#pragma omp ordered
-		write_response_analysis(stream_response_analysis, analysis, perct_in, delta_in, value_in, perct_out, delta_out, value_out);
-		on_calculate(analysis, s);
+		sort(refine.begin(), refine.end());
+		
+		for (unsigned int r = 0; r < refine.size() && r < budget; r++)
+		{
+			unsigned int s = refine[r].second;
+			points.push_back((steps[s].point + steps[s + 1].point) / 2);
+		}
+	}
+}
+
+/**
+ * Coordinate c of the tangent (see sensitivity.hpp)
+ */
+double get_tangent_coordinate(Particle& particle, ParticleStateGlobal& particle_state, Pulse& laser, unsigned int c)
+{
+	static const char* attributes[6] = {"position_x", "position_y", "position_z", "momentum_x", "momentum_y", "momentum_z"};
+	
+	if (c < 6)
+		return get_attribute(particle, particle_state, laser, "particle", attributes[c]);
+	else if (c == TANGENT_REST_MASS)
+		return particle.rest_mass;
+	else if (c == TANGENT_CHARGE)
+		return particle.charge;
+	else
+		return get_attribute(particle, particle_state, laser, "laser", laser.sensitivity_params[c - TANGENT_LASER]);
+}
+
+/**
+ * Move the coordinate c of the tangent (see sensitivity.hpp) by delta
+ */
+void move_tangent_coordinate(Particle& particle, ParticleStateGlobal& particle_state, Pulse& laser, unsigned int c, double delta)
+{
+	if (c == 0)
+		particle_state.position_x += delta;
+	else if (c == 1)
+		particle_state.position_y += delta;
+	else if (c == 2)
+		particle_state.position_z += delta;
+	else if (c == 3)
+		particle_state.momentum_x += delta;
+	else if (c == 4)
+		particle_state.momentum_y += delta;
+	else if (c == 5)
+		particle_state.momentum_z += delta;
+	else if (c == TANGENT_REST_MASS)
+		particle.rest_mass += delta;
+	else if (c == TANGENT_CHARGE)
+		particle.charge += delta;
+	else
+	{
+		string attribute = laser.sensitivity_params[c - TANGENT_LASER];
+		set_attribute(particle, particle_state, laser, "laser", attribute, get_attribute(particle, particle_state, laser, "laser", attribute) + delta);
+	}
+}
+
+/**
+ * Coordinates of the tangent of b minus the ones of a
+ */
+void get_tangent_coordinates_delta(
+	Particle& particle_a, ParticleStateGlobal& particle_state_a, Pulse& laser_a,
+	Particle& particle_b, ParticleStateGlobal& particle_state_b, Pulse& laser_b,
+	vector<double>& delta)
+{
+	delta.resize(TANGENT_LASER + laser_a.sensitivity_params.size());
+	
+	delta[0] = global_coord_delta(particle_state_b.position_x, particle_state_a.position_x);
+	delta[1] = global_coord_delta(particle_state_b.position_y, particle_state_a.position_y);
+	delta[2] = global_coord_delta(particle_state_b.position_z, particle_state_a.position_z);
+	delta[3] = particle_state_b.momentum_x - particle_state_a.momentum_x;
+	delta[4] = particle_state_b.momentum_y - particle_state_a.momentum_y;
+	delta[5] = particle_state_b.momentum_z - particle_state_a.momentum_z;
+	
+	delta[TANGENT_REST_MASS] = particle_b.rest_mass - particle_a.rest_mass;
+	delta[TANGENT_CHARGE]    = particle_b.charge    - particle_a.charge;
+	
+	for (unsigned int l = 0; l < laser_a.sensitivity_params.size(); l++)
+	{
+		string attribute = laser_a.sensitivity_params[l];
+		delta[TANGENT_LASER + l] = get_attribute(particle_b, particle_state_b, laser_b, "laser", attribute) - get_attribute(particle_a, particle_state_a, laser_a, "laser", attribute);
+	}
+}
+
+inline double get_sensitivity_step(double value)
+{
+	return RESPONSE_SENSITIVITY_STEP * (value != 0 ? abs(value) : 1);
+}
+
+/**
+ * Local derivatives of the outputs by the inputs at their current values, from a single simulation with the tangent
+ * (see sensitivity.hpp). The tangent holds the derivatives of the final state by the initial state, the rest mass, the
+ * charge and the laser attributes; the inputs and the outputs are functions of these coordinates (spherical
+ * coordinates, energies, ...) that are differentiated by central differences, without simulating again.
+ */
+void calculate_response_sensitivity(
+	ResponseAnalysis& analysis,
+	Simulation& simulation,
+	Particle& particle,
+	ParticleStateGlobal& particle_state_initial, 
+	Pulse& laser,
+	Laboratory& laboratory,
+	FunctionFieldType function_field,
+	fs::path output_response_dir)
+{
+	unsigned int ni = analysis.inputs.size();
+	unsigned int no = analysis.attribute_out.size();
+	
+	SimulationTangent tangent;
+	init_simulation_tangent(tangent, laser);
+	
+	SimulationCheckpoint checkpoint;
+	init_simulation_checkpoint(checkpoint, particle_state_initial);
+	checkpoint.tangent = &tangent;
+	
+	vector<SimluationResultFreeSummary> summaries_free;
+	vector<SimluationResultNodeSummary> summaries_node;
+	
+	simulate (simulation, laser, particle, checkpoint, laboratory, summaries_free, summaries_node, *function_field, false, RECORD_NONE);
+	ParticleStateGlobal& particle_state_final = checkpoint.particle_state_global;
+	
+	unsigned int columns = tangent.columns;
+	
+	// Derivatives of the final coordinates by the inputs: the tangent applied to the derivatives of the initial
+	// coordinates by the inputs (the parameters don't change during the simulation)
+	vector<vector<double>> final_by_in(ni);
+	vector<double> value_in(ni);
+	
+	for (unsigned int i = 0; i < ni; i++)
+	{
+		ResponseInput& input = analysis.inputs[i];
+		
+		value_in[i] = get_attribute(particle, particle_state_initial, laser, input.object, input.attribute);
+		double step = get_sensitivity_step(value_in[i]);
+		
+		Particle            particle_minus = particle,               particle_plus = particle;
+		ParticleStateGlobal state_minus    = particle_state_initial, state_plus    = particle_state_initial;
+		Pulse               laser_minus    = laser,                  laser_plus    = laser;
+		
+		set_attribute(particle_minus, state_minus, laser_minus, input.object, input.attribute, value_in[i] - step);
+		set_attribute(particle_plus,  state_plus,  laser_plus,  input.object, input.attribute, value_in[i] + step);
+		
+		vector<double> initial_by_in;
+		get_tangent_coordinates_delta(particle_minus, state_minus, laser_minus, particle_plus, state_plus, laser_plus, initial_by_in);
+		
+		for (double& derivative: initial_by_in)
+			derivative /= 2 * step;
+		
+		final_by_in[i] = initial_by_in;
+		
+		for (unsigned int c = 0; c < 6; c++)
+		{
+			final_by_in[i][c] = 0;
+			
+			for (unsigned int k = 0; k < columns; k++)
+				final_by_in[i][c] += tangent.state[6 * k + c] * initial_by_in[k];
+		}
+	}
+	
+	// Derivatives of the outputs by the final coordinates, then by the inputs
+	vector<double> value_out(no);
+	vector<vector<double>> out_by_in(no, vector<double>(ni, 0));
+	
+	for (unsigned int o = 0; o < no; o++)
+	{
+		value_out[o] = get_attribute(particle, particle_state_final, laser, analysis.object_out[o], analysis.attribute_out[o]);
+		
+		for (unsigned int c = 0; c < columns; c++)
+		{
+			double step = get_sensitivity_step(get_tangent_coordinate(particle, particle_state_final, laser, c));
+			
+			Particle            particle_minus = particle,             particle_plus = particle;
+			ParticleStateGlobal state_minus    = particle_state_final, state_plus    = particle_state_final;
+			Pulse               laser_minus    = laser,                laser_plus    = laser;
+			
+			move_tangent_coordinate(particle_minus, state_minus, laser_minus, c, -step);
+			move_tangent_coordinate(particle_plus,  state_plus,  laser_plus,  c, +step);
+			
+			double out_by_final = (get_attribute(particle_plus, state_plus, laser_plus, analysis.object_out[o], analysis.attribute_out[o]) - get_attribute(particle_minus, state_minus, laser_minus, analysis.object_out[o], analysis.attribute_out[o])) / (2 * step);
+			
+			for (unsigned int i = 0; i < ni; i++)
+				out_by_in[o][i] += out_by_final * final_by_in[i][c];
+		}
+	}
+	
+	ofstream stream_sensitivity;
+	stream_sensitivity.open((output_response_dir / fs::path("sensitivity.csv")).string());
+	setup_response_sensitivity(stream_sensitivity, analysis);
+	write_response_sensitivity(stream_sensitivity, analysis, value_in, value_out, out_by_in);
+	stream_sensitivity.close();
+}
+
+void calculateResponseAnalyses(
+	ResponseAnalysis& analysis,
+	Simulation& simulation,
+	Particle& particle,
+	ParticleStateGlobal& particle_state_initial, 
+	ParticleStateGlobal& particle_state_final,
+	Pulse& laser,
+	Laboratory& laboratory,
+	fs::path output_dir,
+	FunctionFieldType 	function_field,
+	FunctionResponseAnalysisCalculated&  on_calculate)
+{
+	unsigned int ni = analysis.inputs.size();
+	
+	string inputs_name = "";
+	for (unsigned int i = 0; i < ni; i++)
+		inputs_name += (bo::format("%s%s_%s") % (i > 0 ? "_and_" : "") % analysis.inputs[i].object % analysis.inputs[i].attribute).str();
+	
+	fs::path output_response_dir = output_dir / fs::path("analyses") / fs::path((bo::format("response_%u_by_%s") % analysis.id % inputs_name).str());
+	fs::create_directories(output_response_dir);
+	
+	if (analysis.sensitivity)
+	{
+		calculate_response_sensitivity(analysis, simulation, particle, particle_state_initial, laser, laboratory, function_field, output_response_dir);
+		on_calculate(analysis, 1);
+		return;
+	}
+	
+	ofstream stream_response_analysis;
+	stream_response_analysis.open((output_response_dir / fs::path("response.csv")).string());
+	setup_response_analysis(stream_response_analysis, analysis);
+	
+	ResponseSweep sweep;
+	init_response_sweep(sweep, analysis, simulation, particle, particle_state_initial, laser, laboratory, function_field);
+	
+	if (analysis.change_type == ADAPTIVE)
+	{
+		vector<ResponseStepResult> steps;
+		calculate_response_adaptive(analysis, sweep, simulation, particle, particle_state_initial, particle_state_final, laser, laboratory, function_field, on_calculate, steps);
+		
+		for (ResponseStepResult& step: steps)
+			write_response_analysis(stream_response_analysis, analysis, step.perct_in, step.delta_in, step.value_in, step.perct_out, step.delta_out, step.value_out);
+	}
+	else
+	{
+		unsigned int  sn = analysis.samples;
+		
+		ResponseDesign design;
+		init_response_design(design, analysis);
+		
+		// The cost of the steps varies a lot (a step can miss the laser or spend a long time in a node), so they are
+		// scheduled dynamically. The results wait in a reorder buffer and are written in step order as soon as all
+		// the previous ones are available.
+		vector<ResponseStepResult> results(sn);
+		unsigned int steps_written   = 0;
+		unsigned int steps_completed = 0;
+		
+		#pragma omp parallel for schedule(dynamic, 1)
+		for (unsigned int s = 0; s < sn; s++)
+		{
+			vector<double> point(ni);
+			get_response_design_point(design, s, point.data());
+			
+			ResponseStepResult result;
+			calculate_response_step(analysis, sweep, simulation, particle, particle_state_initial, particle_state_final, laser, laboratory, function_field, point.data(), result);
+			
+			#pragma omp critical (response_writer)
+			{
+				results[s] = result;
+				
+				for (; steps_written < sn && results[steps_written].done; steps_written++)
+				{
+					ResponseStepResult& next = results[steps_written];
+					
+					write_response_analysis(stream_response_analysis, analysis, next.perct_in, next.delta_in, next.value_in, next.perct_out, next.delta_out, next.value_out);
+					
+					// Written rows aren't needed anymore
+					vector<double>().swap(next.perct_in);
+					vector<double>().swap(next.delta_in);
+					vector<double>().swap(next.value_in);
+					vector<double>().swap(next.perct_out);
+					vector<double>().swap(next.delta_out);
+					vector<double>().swap(next.value_out);
+				}
+				
+				steps_completed++;
+				on_calculate(analysis, steps_completed);
+			}
+		}
 	}
 	
 	stream_response_analysis.close();
 	save_response_analysis_ct2(analysis, output_response_dir);
 	save_response_analysis_sh (analysis, output_response_dir);	
 }
-
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <random>
+#include <algorithm>
+#include "response_design.hpp"
+#include "type.hpp"
+
+// Streams drawn from the seed of the analysis
+#define RESPONSE_STREAM_SAMPLE			0
+#define RESPONSE_STREAM_PERMUTATION		1
+#define RESPONSE_STREAM_SCRAMBLING		2
+
+typedef struct SobolPolynomial
+{
+	unsigned int degree;		// s
+	unsigned int coefficients;	// a, the inner coefficients of the primitive polynomial
+	unsigned int m[7];			// Initial direction numbers m_1 … m_s
+} SobolPolynomial;
+
+// Joe-Kuo direction numbers (new-joe-kuo-6.21201) of the inputs 2 … 21, the first one is the van der Corput sequence
+static const SobolPolynomial sobol_polynomials[RESPONSE_SOBOL_DIMENSIONS - 1] =
+{
+	{1,  0, {1}},
+	{2,  1, {1, 3}},
+	{3,  1, {1, 3, 1}},
+	{3,  2, {1, 1, 1}},
+	{4,  1, {1, 1, 3, 3}},
+	{4,  4, {1, 3, 5, 13}},
+	{5,  2, {1, 1, 5, 5, 17}},
+	{5,  4, {1, 1, 5, 5, 5}},
+	{5,  7, {1, 1, 7, 11, 19}},
+	{5, 11, {1, 1, 5, 1, 1}},
+	{5, 13, {1, 1, 1, 3, 11}},
+	{5, 14, {1, 3, 5, 5, 31}},
+	{6,  1, {1, 3, 3, 9, 7, 49}},
+	{6, 13, {1, 1, 1, 15, 21, 21}},
+	{6, 16, {1, 3, 1, 13, 27, 49}},
+	{6, 19, {1, 1, 1, 15, 7, 5}},
+	{6, 22, {1, 3, 1, 15, 13, 25}},
+	{6, 25, {1, 1, 5, 5, 19, 61}},
+	{7,  1, {1, 3, 7, 11, 23, 15, 103}},
+	{7,  4, {1, 3, 7, 13, 13, 15, 69}}
+};
+
+/**
+ * Direction numbers v_k = m_k / 2^k of an input, as fractions of 2^32
+ */
+void get_sobol_directions(unsigned int input, vector<uint32_t>& directions)
+{
+	directions.resize(RESPONSE_SOBOL_BITS);
+
+	if (input == 0)
+	{
+		for (unsigned int k = 0; k < RESPONSE_SOBOL_BITS; k++)
+			directions[k] = (uint32_t) 1 << (RESPONSE_SOBOL_BITS - 1 - k);
+
+		return;
+	}
+
+	const SobolPolynomial& polynomial = sobol_polynomials[input - 1];
+	unsigned int s = polynomial.degree;
+
+	for (unsigned int k = 0; k < RESPONSE_SOBOL_BITS; k++)
+	{
+		if (k < s)
+		{
+			directions[k] = (uint32_t) polynomial.m[k] << (RESPONSE_SOBOL_BITS - 1 - k);
+			continue;
+		}
+
+		// v_k = a_1·v_(k-1) ⊕ … ⊕ a_(s-1)·v_(k-s+1) ⊕ v_(k-s) ⊕ v_(k-s)/2^s
+		directions[k] = directions[k - s] ^ (directions[k - s] >> s);
+
+		for (unsigned int j = 1; j < s; j++)
+			if ((polynomial.coefficients >> (s - 1 - j)) & 1)
+				directions[k] ^= directions[k - j];
+	}
+}
+
+/**
+ * Matoušek linear scrambling: the digits of every direction number are multiplied by a random lower triangular matrix
+ * with unit diagonal (the digit j of the result depends on the digits 1 … j). It keeps the net structure of the
+ * sequence.
+ */
+void scramble_sobol_directions(vector<uint32_t>& directions, mt19937_64& generator)
+{
+	uint32_t rows[RESPONSE_SOBOL_BITS];
+
+	for (unsigned int j = 0; j < RESPONSE_SOBOL_BITS; j++)
+	{
+		uint32_t diagonal = (uint32_t) 1 << (RESPONSE_SOBOL_BITS - 1 - j);
+		uint32_t previous = ~(uint32_t) ((((uint64_t) diagonal) << 1) - 1);	// The more significant digits
+
+		rows[j] = diagonal | ((uint32_t) generator() & previous);
+	}
+
+	for (uint32_t& direction: directions)
+	{
+		uint32_t scrambled = 0;
+
+		for (unsigned int j = 0; j < RESPONSE_SOBOL_BITS; j++)
+			if (__builtin_parity(rows[j] & direction))
+				scrambled |= (uint32_t) 1 << (RESPONSE_SOBOL_BITS - 1 - j);
+
+		direction = scrambled;
+	}
+}
+
+void init_response_design(ResponseDesign& design, ResponseAnalysis& analysis)
+{
+	design.type    = analysis.change_type;
+	design.steps   = analysis.steps;
+	design.samples = analysis.samples;
+	design.inputs  = analysis.inputs.size();
+	design.seed    = analysis.seed;
+	design.id      = analysis.id;
+
+	design.permutations.clear();
+	design.directions.clear();
+	design.shifts.clear();
+
+	if (design.type == LATIN_HYPERCUBE)
+	{
+		design.permutations.resize(design.inputs);
+
+		for (unsigned int i = 0; i < design.inputs; i++)
+		{
+			seed_seq    seed {design.seed, design.id, (unsigned int) RESPONSE_STREAM_PERMUTATION, i};
+			mt19937_64  generator(seed);
+
+			vector<unsigned int>& permutation = design.permutations[i];
+			permutation.resize(design.samples);
+
+			for (unsigned int s = 0; s < design.samples; s++)
+				permutation[s] = s;
+
+			shuffle(permutation.begin(), permutation.end(), generator);
+		}
+	}
+	else if (design.type == SOBOL)
+	{
+		if (design.inputs > RESPONSE_SOBOL_DIMENSIONS)
+		{
+			printf("ERROR - The sobol design supports up to %u inputs\n", RESPONSE_SOBOL_DIMENSIONS);
+			exit(-1);
+		}
+
+		design.directions.resize(design.inputs);
+		design.shifts.resize(design.inputs);
+
+		for (unsigned int i = 0; i < design.inputs; i++)
+		{
+			seed_seq    seed {design.seed, design.id, (unsigned int) RESPONSE_STREAM_SCRAMBLING, i};
+			mt19937_64  generator(seed);
+
+			get_sobol_directions(i, design.directions[i]);
+			scramble_sobol_directions(design.directions[i], generator);
+
+			design.shifts[i] = (uint32_t) generator();
+		}
+	}
+}
+
+void get_response_design_point(const ResponseDesign& design, unsigned int sample, double point[])
+{
+	seed_seq    seed {design.seed, design.id, (unsigned int) RESPONSE_STREAM_SAMPLE, sample};
+	mt19937_64  generator(seed);
+	uniform_real_distribution<double> uniform(0, 1);
+
+	if (design.type == LINEAR)
+	{
+		unsigned int index = sample;
+
+		for (int i = design.inputs - 1; i >= 0; i--)
+		{
+			point[i] = (double) (index % design.steps) / design.steps;
+			index   /= design.steps;
+		}
+	}
+	else if (design.type == RANDOM)
+	{
+		for (unsigned int i = 0; i < design.inputs; i++)
+			point[i] = uniform(generator);
+	}
+	else if (design.type == LATIN_HYPERCUBE)
+	{
+		for (unsigned int i = 0; i < design.inputs; i++)
+			point[i] = (design.permutations[i][sample] + uniform(generator)) / design.samples;
+	}
+	else if (design.type == SOBOL)
+	{
+		for (unsigned int i = 0; i < design.inputs; i++)
+		{
+			uint32_t x = design.shifts[i];
+
+			for (unsigned int k = 0; k < RESPONSE_SOBOL_BITS && (sample >> k) != 0; k++)
+				if ((sample >> k) & 1)
+					x ^= design.directions[i][k];
+
+			point[i] = ldexp((double) x, -(int) RESPONSE_SOBOL_BITS);
+		}
+	}
+	else
+	{
+		printf("ERROR - unexpected value for change_type\n");
+		exit(-1);
+	}
+}
@@ -0,0 +1,35 @@
+#include "type.hpp"
+
+#ifndef CIRCLESIM_RESPONSE_DESIGN
+#define CIRCLESIM_RESPONSE_DESIGN
+
+/**
+ * Designs of the response analyses: where the samples are taken in the space of the inputs.
+ *
+ * A sample is a point u of the unit hypercube [0, 1)^inputs, and u_i is the fraction of the range of the input i. The
+ * designs are:
+ *
+ *   grid (LINEAR)				full factorial: u_i = k_i/steps for every combination of k_i = 0 … steps - 1 (the last input
+ *								changes faster), steps^inputs samples
+ *   random (RANDOM)			independent uniform samples
+ *   latin hypercube			every input is split in 'samples' cells and every cell is taken by exactly one sample, at a
+ *								random position inside it (McKay et al.)
+ *   sobol (SOBOL)				Sobol low discrepancy sequence with the Joe-Kuo direction numbers, scrambled with a random
+ *								linear matrix and a random digital shift (Matoušek). Its balance is best with 2^k samples.
+ *
+ * The random numbers of every sample come from its own stream, seeded by (seed, analysis id, sample), so the samples
+ * can be generated by any thread in any order and don't depend on the scheduling. The Latin hypercube permutations and
+ * the Sobol scrambling are drawn once from other streams of the same seed.
+ */
+
+#define RESPONSE_SOBOL_DIMENSIONS	21		// Inputs supported by the table of the direction numbers
+#define RESPONSE_SOBOL_BITS			32
+
+void init_response_design(ResponseDesign& design, ResponseAnalysis& analysis);
+
+/**
+ * Point of the sample in the unit hypercube (inputs values)
+ */
+void get_response_design_point(const ResponseDesign& design, unsigned int sample, double point[]);
+
+#endif
@@ -1,38 +1,231 @@
 #include <stdio.h>
 #include "script.hpp"
-void build_auxiliary_library(vector<string>& headers, vector<string>& sources, fs::path output_dir)
+#include "util.hpp"
+
+/**
+ * Output of cmd (only the first line if first_line is true), empty if it can't be run
+ */
+string get_command_output(string cmd, bool first_line)
 {
-	
-	fs::path filename_cpp = output_dir / fs::path("custom_scripts.cpp");
-	fs::path filename_hpp = output_dir / fs::path("custom_scripts.hpp");
-	fs::path filename_so  = output_dir / fs::path("custom_scripts.so");
-	
-	// Writing cpp
-	
-	ofstream cpp;
-	cpp.open (filename_cpp.string());
-	
-	cpp << "#include <math.h>" 				<< endl;
-	cpp << "#include \"custom_scripts.hpp\""<< endl;
-	cpp 									<< endl;
-	cpp										<< endl;
+	string output = "";
+
+	FILE* pipe = popen(cmd.c_str(), "r");
+
+	if (pipe == NULL)
+		return output;
+
+	char buffer[256];
+	while (fgets(buffer, sizeof(buffer), pipe) != NULL)
+	{
+		output += buffer;
+
+		if (first_line)
+			break;
+	}
+
+	pclose(pipe);
+	return output;
+}
+
+/**
+ * First line of 'g++ --version', so a compiler update invalidates the cached objects
+ */
+string get_compiler_version()
+{
+	return get_command_output("g++ --version 2>&1", true);
+}
+
+/**
+ * The target options that -march=native resolves to on this machine (CPU and instruction sets). The cache directory
+ * can be shared by machines with different CPUs (a home directory on NFS), and an object built for a newer CPU would
+ * crash on an older one with an illegal instruction.
+ */
+string get_native_target()
+{
+	return get_command_output("g++ -march=native -Q --help=target 2>&1", false);
+}
+
+/**
+ * The common functions are wrapped in an anonymous namespace, but their includes and the declarations of external
+ * symbols (extern on a single line) must stay at file scope: they are moved before the namespace.
+ */
+void split_commons(vector<string>& sources, string& file_scope, string& body)
+{
+	static const bo::regex e_file_scope("^\\s*(#\\s*include\\b.*|extern\\b.*;\\s*)$");
 
 	for (string source: sources)
 	{
-		cpp << source				<< endl;
+		stringstream lines(source);
+		string line;
+
+		while (getline(lines, line))
+		{
+			if (bo::regex_match(line, e_file_scope))
+				file_scope += line + "\n";
+			else
+				body += line + "\n";
+		}
 	}
+}
+
+/**
+ * Run cmd to build 'output' (only if it is not already in the cache). The result is written in a temporary file and
+ * renamed at the end, so concurrent runs never see an half written file.
+ */
+bool build_cached(string cmd, fs::path output)
+{
+	if (fs::exists(output))
+		return true;
+
+	fs::path output_tmp = output.parent_path() / fs::unique_path("%%%%-%%%%-%%%%-%%%%" + output.extension().string());
+
+	cmd = (bo::format("%s -o %s") % cmd % output_tmp.string()).str();
+
+	#pragma omp critical(script_output)
+	{
+		cout << "-----------------------------------------------------------" << endl;
+		cout << cmd << endl;
+		cout << "-----------------------------------------------------------" << endl;
+	}
+
+	if (system(cmd.c_str()) != 0)
+	{
+		bo::system::error_code error;
+		fs::remove(output_tmp, error);
+		return false;
+	}
+
+	fs::rename(output_tmp, output);
+	return true;
+}
+
+/**
+ * Dual numbers with 'variables' derivatives (forward mode automatic differentiation). The field function is compiled
+ * again with 'double' defined as Dual, so every operation carries the derivatives by the seeded variables. The
+ * conversions to the built-in types are explicit: a value used as an integer or a condition has no derivative.
+ */
+string get_dual_numbers(unsigned int variables)
+{
+	stringstream s;
+
+	s << "static const unsigned int dual_variables = " << variables << ";"			<< endl;
+	s 																				<< endl;
+	s << "typedef struct Dual"															<< endl;
+	s << "{"																			<< endl;
+	s << "	double v;"																	<< endl;
+	s << "	double d[dual_variables];"													<< endl;
+	s 																				<< endl;
+	s << "	Dual() : v(0) { for (unsigned int i = 0; i < dual_variables; i++) d[i] = 0; }"	<< endl;
+	s << "	Dual(double value) : v(value) { for (unsigned int i = 0; i < dual_variables; i++) d[i] = 0; }"	<< endl;
+	s 																				<< endl;
+	s << "	explicit operator double() const { return v; }"								<< endl;
+	s << "	explicit operator float() const { return v; }"								<< endl;
+	s << "	explicit operator int() const { return v; }"								<< endl;
+	s << "	explicit operator long() const { return v; }"								<< endl;
+	s << "	explicit operator unsigned int() const { return v; }"						<< endl;
+	s << "	explicit operator bool() const { return v != 0; }"							<< endl;
+	s << "} Dual;"																		<< endl;
+	s 																				<< endl;
+	s << "inline Dual dual_variable(double value, unsigned int index) { Dual r(value); r.d[index] = 1; return r; }"	<< endl;
+	s 																				<< endl;
+	s << "// f(a) with f'(a) = derivative (a null derivative of a is kept null, also where f' is not finite)"	<< endl;
+	s << "inline Dual dual_chain(const Dual& a, double value, double derivative)"	<< endl;
+	s << "{"																			<< endl;
+	s << "	Dual r(value);"																<< endl;
+	s << "	for (unsigned int i = 0; i < dual_variables; i++) r.d[i] = a.d[i] == 0 ? 0 : derivative * a.d[i];"	<< endl;
+	s << "	return r;"																	<< endl;
+	s << "}"																			<< endl;
+	s 																				<< endl;
+	s << "// f(a, b) with ∂f/∂a = da and ∂f/∂b = db"										<< endl;
+	s << "inline Dual dual_chain(const Dual& a, const Dual& b, double value, double da, double db)"	<< endl;
+	s << "{"																			<< endl;
+	s << "	Dual r(value);"																<< endl;
+	s << "	for (unsigned int i = 0; i < dual_variables; i++) r.d[i] = (a.d[i] == 0 ? 0 : da * a.d[i]) + (b.d[i] == 0 ? 0 : db * b.d[i]);"	<< endl;
+	s << "	return r;"																	<< endl;
+	s << "}"																			<< endl;
+	s 																				<< endl;
+	s << "inline Dual operator+(const Dual& a) { return a; }"							<< endl;
+	s << "inline Dual operator-(const Dual& a) { Dual r(-a.v); for (unsigned int i = 0; i < dual_variables; i++) r.d[i] = -a.d[i]; return r; }"	<< endl;
+	s << "inline Dual operator+(const Dual& a, const Dual& b) { Dual r(a.v + b.v); for (unsigned int i = 0; i < dual_variables; i++) r.d[i] = a.d[i] + b.d[i]; return r; }"	<< endl;
+	s << "inline Dual operator-(const Dual& a, const Dual& b) { Dual r(a.v - b.v); for (unsigned int i = 0; i < dual_variables; i++) r.d[i] = a.d[i] - b.d[i]; return r; }"	<< endl;
+	s << "inline Dual operator*(const Dual& a, const Dual& b) { Dual r(a.v * b.v); for (unsigned int i = 0; i < dual_variables; i++) r.d[i] = a.d[i] * b.v + a.v * b.d[i]; return r; }"	<< endl;
+	s << "inline Dual operator/(const Dual& a, const Dual& b) { Dual r(a.v / b.v); for (unsigned int i = 0; i < dual_variables; i++) r.d[i] = (a.d[i] - r.v * b.d[i]) / b.v; return r; }"	<< endl;
+	s << "inline Dual& operator+=(Dual& a, const Dual& b) { return a = a + b; }"		<< endl;
+	s << "inline Dual& operator-=(Dual& a, const Dual& b) { return a = a - b; }"		<< endl;
+	s << "inline Dual& operator*=(Dual& a, const Dual& b) { return a = a * b; }"		<< endl;
+	s << "inline Dual& operator/=(Dual& a, const Dual& b) { return a = a / b; }"		<< endl;
+	s 																				<< endl;
+	s << "inline bool operator==(const Dual& a, const Dual& b) { return a.v == b.v; }"	<< endl;
+	s << "inline bool operator!=(const Dual& a, const Dual& b) { return a.v != b.v; }"	<< endl;
+	s << "inline bool operator< (const Dual& a, const Dual& b) { return a.v <  b.v; }"	<< endl;
+	s << "inline bool operator<=(const Dual& a, const Dual& b) { return a.v <= b.v; }"	<< endl;
+	s << "inline bool operator> (const Dual& a, const Dual& b) { return a.v >  b.v; }"	<< endl;
+	s << "inline bool operator>=(const Dual& a, const Dual& b) { return a.v >= b.v; }"	<< endl;
+	s 																				<< endl;
+	s << "inline Dual sqrt (const Dual& a) { double r = sqrt(a.v); return dual_chain(a, r, 0.5 / r); }"	<< endl;
+	s << "inline Dual cbrt (const Dual& a) { double r = cbrt(a.v); return dual_chain(a, r, 1 / (3 * r * r)); }"	<< endl;
+	s << "inline Dual exp  (const Dual& a) { double r = exp(a.v);  return dual_chain(a, r, r); }"	<< endl;
+	s << "inline Dual log  (const Dual& a) { return dual_chain(a, log(a.v), 1 / a.v); }"	<< endl;
+	s << "inline Dual log10(const Dual& a) { return dual_chain(a, log10(a.v), 1 / (a.v * M_LN10)); }"	<< endl;
+	s << "inline Dual sin  (const Dual& a) { return dual_chain(a, sin(a.v), cos(a.v)); }"	<< endl;
+	s << "inline Dual cos  (const Dual& a) { return dual_chain(a, cos(a.v), -sin(a.v)); }"	<< endl;
+	s << "inline Dual tan  (const Dual& a) { double r = tan(a.v);  return dual_chain(a, r, 1 + r * r); }"	<< endl;
+	s << "inline Dual asin (const Dual& a) { return dual_chain(a, asin(a.v), 1 / sqrt(1 - a.v * a.v)); }"	<< endl;
+	s << "inline Dual acos (const Dual& a) { return dual_chain(a, acos(a.v), -1 / sqrt(1 - a.v * a.v)); }"	<< endl;
+	s << "inline Dual atan (const Dual& a) { return dual_chain(a, atan(a.v), 1 / (1 + a.v * a.v)); }"	<< endl;
+	s << "inline Dual sinh (const Dual& a) { return dual_chain(a, sinh(a.v), cosh(a.v)); }"	<< endl;
+	s << "inline Dual cosh (const Dual& a) { return dual_chain(a, cosh(a.v), sinh(a.v)); }"	<< endl;
+	s << "inline Dual tanh (const Dual& a) { double r = tanh(a.v); return dual_chain(a, r, 1 - r * r); }"	<< endl;
+	s << "inline Dual erf  (const Dual& a) { return dual_chain(a, erf(a.v), 2 / sqrt(M_PI) * exp(-a.v * a.v)); }"	<< endl;
+	s << "inline Dual fabs (const Dual& a) { return dual_chain(a, fabs(a.v), a.v < 0 ? -1 : 1); }"	<< endl;
+	s << "inline Dual abs  (const Dual& a) { return fabs(a); }"							<< endl;
+	s << "inline Dual floor(const Dual& a) { return Dual(floor(a.v)); }"				<< endl;
+	s << "inline Dual ceil (const Dual& a) { return Dual(ceil(a.v)); }"					<< endl;
+	s << "inline Dual trunc(const Dual& a) { return Dual(trunc(a.v)); }"				<< endl;
+	s << "inline Dual round(const Dual& a) { return Dual(round(a.v)); }"				<< endl;
+	s 																				<< endl;
+	s << "inline Dual pow  (const Dual& a, const Dual& b) { double r = pow(a.v, b.v); return dual_chain(a, b, r, b.v * pow(a.v, b.v - 1), a.v > 0 ? r * log(a.v) : 0); }"	<< endl;
+	s << "inline Dual pow  (const Dual& a, double b)      { return dual_chain(a, pow(a.v, b), b * pow(a.v, b - 1)); }"	<< endl;
+	s << "inline Dual pow  (const Dual& a, int b)         { return dual_chain(a, pow(a.v, b), b * pow(a.v, b - 1)); }"	<< endl;
+	s << "inline Dual atan2(const Dual& a, const Dual& b) { double r2 = a.v * a.v + b.v * b.v; return dual_chain(a, b, atan2(a.v, b.v), b.v / r2, -a.v / r2); }"	<< endl;
+	s << "inline Dual hypot(const Dual& a, const Dual& b) { double r = hypot(a.v, b.v); return dual_chain(a, b, r, a.v / r, b.v / r); }"	<< endl;
+	s << "inline Dual fmod (const Dual& a, const Dual& b) { double q = trunc(a.v / b.v); return dual_chain(a, b, a.v - q * b.v, 1, -q); }"	<< endl;
+	s << "inline Dual fmin (const Dual& a, const Dual& b) { return b.v < a.v ? b : a; }"	<< endl;
+	s << "inline Dual fmax (const Dual& a, const Dual& b) { return a.v < b.v ? b : a; }"	<< endl;
+	s << "inline Dual min  (const Dual& a, const Dual& b) { return b.v < a.v ? b : a; }"	<< endl;
+	s << "inline Dual max  (const Dual& a, const Dual& b) { return a.v < b.v ? b : a; }"	<< endl;
+	s 																				<< endl;
+	s << "typedef struct FieldDual"													<< endl;
+	s << "{"																			<< endl;
+	s << "	Dual e_x;"																	<< endl;
+	s << "	Dual e_y;"																	<< endl;
+	s << "	Dual e_z;"																	<< endl;
+	s 																				<< endl;
+	s << "	Dual b_x;"																	<< endl;
+	s << "	Dual b_y;"																	<< endl;
+	s << "	Dual b_z;"																	<< endl;
+	s << "} FieldDual;"																	<< endl;
+	s 																				<< endl;
+
+	return s.str();
+}
+
+void build_auxiliary_library(CustomScripts& scripts, fs::path output_dir, bool fast_math)
+{
+
+	fs::path filename_hpp = output_dir / fs::path("custom_scripts.hpp");
+	fs::path filename_so  = output_dir / fs::path("custom_scripts.so");
 
-	cpp.close();
-	
 	// Writing hpp
-	
-	ofstream hpp;
-	hpp.open (filename_hpp.string());
-	
+
+	stringstream hpp;
+
 	hpp << "using namespace std;" 	<< endl;
 	hpp << "" 						<< endl;
 	hpp << "#include <vector>" 		<< endl;
 	hpp << "#include <map>" 		<< endl;
+	hpp << "#include <string>" 		<< endl;
+	hpp << "#include <cstddef>" 	<< endl;
 	hpp << "" 						<< endl;
 	hpp << "" 						<< endl;
 	hpp << "typedef struct Field" 	<< endl;
@@ -46,35 +239,193 @@ void build_auxiliary_library(vector<string>& headers, vector<string>& sources, f
 	hpp << "	double b_z;"		<< endl;
 	hpp << "} Field;"				<< endl;
 	hpp << ""						<< endl;
-	hpp << "typedef struct PulseParams"				<< endl;
-	hpp << "{"										<< endl;
-	hpp << "	// These are the only parameter that are not converted to A.U. (the main rule is that all values inside the program must be converted to A.U.)" << endl;
-	hpp << "	map<string, int>	params_int;"	<< endl;
-	hpp << "	map<string, long>	params_int64;"	<< endl;
-	hpp << "	map<string, double> params_float;"	<< endl;
-	hpp << "	map<string, string> params_string;"	<< endl;
-	hpp << "	map<string, bool>	params_boolean;"	<< endl;
-	hpp << "} PulseParams;"	<< endl;
-	
-	for (string header: headers)
+	hpp << "typedef struct FieldBatch"	<< endl;
+	hpp << "{"						<< endl;
+	hpp << "	double* e_x;"		<< endl;
+	hpp << "	double* e_y;"		<< endl;
+	hpp << "	double* e_z;"		<< endl;
+	hpp << ""						<< endl;
+	hpp << "	double* b_x;"		<< endl;
+	hpp << "	double* b_y;"		<< endl;
+	hpp << "	double* b_z;"		<< endl;
+	hpp << "} FieldBatch;"			<< endl;
+	hpp << ""						<< endl;
+
+	for (string header: scripts.headers)
 	{
 		hpp << header				<< endl;
 	}
-	hpp.close();
-	
+
+	ofstream file_hpp;
+	file_hpp.open(filename_hpp.string());
+	file_hpp << hpp.str();
+	file_hpp.close();
+
+	// Writing the translation units: the field functions and one for every render, so changing a render formula
+	// rebuilds only its unit. The common functions are copied in every unit inside an anonymous namespace.
+
+	string commons_file_scope;
+	string commons_body;
+	split_commons(scripts.commons, commons_file_scope, commons_body);
+
+	stringstream commons;
+
+	commons << "#include <math.h>" 				<< endl;
+	commons << "#include \"custom_scripts.hpp\""<< endl;
+	commons << commons_file_scope;
+	commons 									<< endl;
+	commons << "namespace"						<< endl;
+	commons << "{"								<< endl;
+	commons << commons_body;
+	commons << "}"								<< endl;
+	commons 									<< endl;
+
+	vector<fs::path> units_cpp;
+	vector<string>   units;
+
+	stringstream unit_fields;
+	unit_fields << commons.str();
+
+	for (string source: scripts.sources)
+	{
+		unit_fields << source		<< endl;
+	}
+
+	units_cpp.push_back(output_dir / fs::path("custom_scripts.cpp"));
+	units.push_back(unit_fields.str());
+
+	for (unsigned int r = 0; r < scripts.renders.size(); r++)
+	{
+		units_cpp.push_back(output_dir / fs::path((bo::format("custom_scripts_render_%u.cpp") % r).str()));
+		units.push_back(commons.str() + scripts.renders[r] + "\n");
+	}
+
+	// The field functions on dual numbers (see get_dual_numbers): the common functions and the field are compiled again
+	// with 'double' and 'Field' defined as Dual and FieldDual, and field_dual returns the values and the derivatives
+	if (scripts.dual_variables > 0)
+	{
+		stringstream unit_duals;
+
+		unit_duals << "#include <math.h>" 				<< endl;
+		unit_duals << "#include \"custom_scripts.hpp\""	<< endl;
+		unit_duals << commons_file_scope;
+		unit_duals 										<< endl;
+		unit_duals << get_dual_numbers(scripts.dual_variables);
+		unit_duals << "#define double Dual"				<< endl;
+		unit_duals << "#define Field FieldDual"			<< endl;
+		unit_duals 										<< endl;
+		unit_duals << "namespace"						<< endl;
+		unit_duals << "{"								<< endl;
+
+		unit_duals << commons_body;
+
+		for (string source: scripts.duals)
+		{
+			unit_duals << source		<< endl;
+		}
+
+		unit_duals << "}"								<< endl;
+		unit_duals 										<< endl;
+		unit_duals << "#undef double"					<< endl;
+		unit_duals << "#undef Field"						<< endl;
+		unit_duals 										<< endl;
+		unit_duals << "void field_dual(double t, double x, double y, double z, const FieldParams* params, double* field, double* jacobian)"	<< endl;
+		unit_duals << "{"								<< endl;
+		unit_duals << "	FieldDual f = field_dual_point(dual_variable(t, 0), dual_variable(x, 1), dual_variable(y, 2), dual_variable(z, 3), params);"	<< endl;
+		unit_duals << "	const Dual* components[6] = {&f.e_x, &f.e_y, &f.e_z, &f.b_x, &f.b_y, &f.b_z};"	<< endl;
+		unit_duals 										<< endl;
+		unit_duals << "	for (unsigned int k = 0; k < 6; k++)"	<< endl;
+		unit_duals << "	{"								<< endl;
+		unit_duals << "		field[k] = components[k]->v;"	<< endl;
+		unit_duals 										<< endl;
+		unit_duals << "		for (unsigned int j = 0; j < dual_variables; j++)"	<< endl;
+		unit_duals << "			jacobian[k * dual_variables + j] = components[k]->d[j];"	<< endl;
+		unit_duals << "	}"								<< endl;
+		unit_duals << "}"								<< endl;
+
+		units_cpp.push_back(output_dir / fs::path("custom_scripts_dual.cpp"));
+		units.push_back(unit_duals.str());
+	}
+
+	for (unsigned int u = 0; u < units.size(); u++)
+	{
+		ofstream cpp;
+		cpp.open(units_cpp[u].string());
+		cpp << units[u];
+		cpp.close();
+	}
+
 	// building
-	string cmd = (bo::format("g++ -std=c++11 -g -Wall -shared -fPIC -o %s %s -lm") % filename_so.string() % filename_cpp.string()).str();
-	
-	cout << bo::format("Building '%s' with cmd:") % filename_so.filename().string() << endl;
-	cout << "-----------------------------------------------------------" << endl;
-	cout << cmd << endl;
-	cout << "-----------------------------------------------------------" << endl;
-	
-	int result = system(cmd.c_str());
-	
-	if (result != 0)
+	// The library is built on the machine that runs it, so it can use all its vector instructions. Without semantic
+	// interposition the functions of func_commons can be inlined in the batched loop. With -ffast-math glibc declares
+	// the vector versions of the math functions (libmvec) and the batched loop can call them.
+	string flags = "-O3 -march=native -fopenmp-simd -fno-semantic-interposition";
+	if (fast_math)
+		flags += " -ffast-math";
+
+	// The objects and the library are stored in the cache directory with the hash of everything used to build them
+	// as name (with the CPU that -march=native resolves to), so a run with the same functions on the same kind of
+	// machine reuses them without calling the compiler
+	string compiler = get_compiler_version() + get_native_target();
+
+	fs::path cache_dir = get_cache_directory() / fs::path("scripts");
+	fs::create_directories(cache_dir);
+
+	uint64_t key_so = hash_fnv1a(compiler.data(), compiler.size());
+	key_so = hash_fnv1a(flags.data(), flags.size(), key_so);
+
+	vector<fs::path> units_o(units.size());
+
+	for (unsigned int u = 0; u < units.size(); u++)
 	{
-		cout << bo::format("ERROR - There was a problem while building %s library. Please check the output above.") % filename_cpp.string() << endl;
-		exit(-5);
+		string hpp_str = hpp.str();
+
+		uint64_t key = hash_fnv1a(compiler.data(), compiler.size());
+		key = hash_fnv1a(flags.data(),    flags.size(),    key);
+		key = hash_fnv1a(hpp_str.data(),  hpp_str.size(),  key);
+		key = hash_fnv1a(units[u].data(), units[u].size(), key);
+
+		units_o[u] = cache_dir / fs::path((bo::format("%016llx.o") % key).str());
+		key_so = hash_fnv1a(&key, sizeof(key), key_so);
 	}
+
+	fs::path cached_so = cache_dir / fs::path((bo::format("%016llx.so") % key_so).str());
+
+	if (fs::exists(cached_so))
+		cout << bo::format("Using cached '%s' (%s)") % filename_so.filename().string() % cached_so.string() << endl;
+	else
+	{
+		cout << bo::format("Building '%s' with cmd:") % filename_so.filename().string() << endl;
+
+		bool result = true;
+
+		#pragma omp parallel for schedule(dynamic)
+		for (unsigned int u = 0; u < units.size(); u++)
+		{
+			string cmd = (bo::format("g++ -std=c++11 %s -g -Wall -Wno-unused-function -fPIC -c -I %s %s") % flags % output_dir.string() % units_cpp[u].string()).str();
+
+			if (!build_cached(cmd, units_o[u]))
+			{
+				#pragma omp critical(script_result)
+				result = false;
+			}
+		}
+
+		if (result)
+		{
+			string objects = "";
+			for (fs::path& unit_o: units_o)
+				objects += unit_o.string() + " ";
+
+			result = build_cached((bo::format("g++ -shared -fPIC %s-lm") % objects).str(), cached_so);
+		}
+
+		if (!result)
+		{
+			cout << bo::format("ERROR - There was a problem while building %s library. Please check the output above.") % filename_so.string() << endl;
+			exit(-5);
+		}
+	}
+
+	fs::copy_file(cached_so, filename_so, fs::copy_option::overwrite_if_exists);
 }
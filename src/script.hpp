@@ -1,3 +1,3 @@
 #include "type.hpp"
 
-void build_auxiliary_library(vector<string>& headers, vector<string>& sources, fs::path output_dir);
+void build_auxiliary_library(CustomScripts& scripts, fs::path output_dir, bool fast_math);
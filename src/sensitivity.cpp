@@ -0,0 +1,386 @@
+#include <math.h>
+#include "sensitivity.hpp"
+#include "simulator.hpp"
+#include "type.hpp"
+#include "util.hpp"
+#include "frame.hpp"
+
+inline double dot3(const double a[], const double b[])
+{
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+inline void cross3(const double a[], const double b[], double c[])
+{
+	c[0] = a[1] * b[2] - a[2] * b[1];
+	c[1] = a[2] * b[0] - a[0] * b[2];
+	c[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+/**
+ * Velocity v = fac·p/m of the momentum and its variation for the variation of the momentum and of the rest mass
+ */
+inline void get_velocity_variation(const Particle& particle, const double momentum[], const double momentum_variation[], double mass_variation, double velocity[], double velocity_variation[])
+{
+	double fac  = C0 / sqrt(C0 * C0 + dot3(momentum, momentum));
+	double fac2 = fac * fac / (C0 * C0);
+	double pdp  = dot3(momentum, momentum_variation);
+
+	for (unsigned int i = 0; i < 3; i++)
+	{
+		velocity[i]           = fac * momentum[i] / particle.rest_mass;
+		velocity_variation[i] = fac / particle.rest_mass * (momentum_variation[i] - fac2 * pdp * momentum[i]) - velocity[i] * mass_variation / particle.rest_mass;
+	}
+}
+
+/**
+ * Fields (A.U.) at the local time t and position and their derivatives by t, x, y, z and by the laser attributes of
+ * sensitivity_params: derivatives[k·variables + j] for the component k (e_x, e_y, e_z, b_x, b_y, b_z)
+ */
+void calculate_fields_dual(const Pulse& laser, double t, const double position[], double field[], double derivatives[])
+{
+	unsigned int variables = TANGENT_DUAL_SPACE + laser.sensitivity_params.size();
+
+	laser.function_field_dual(t * AU_TIME, position[0] * AU_LENGTH, position[1] * AU_LENGTH, position[2] * AU_LENGTH, laser.params_data.data(), field, derivatives);
+
+	for (unsigned int k = 0; k < 6; k++)
+	{
+		double  unit       = k < 3 ? AU_ELECTRIC_FIELD : AU_MAGNETIC_FIELD;
+		double* derivative = derivatives + k * variables;
+
+		field[k]      /= unit;
+		derivative[0] *= AU_TIME / unit;
+
+		for (unsigned int j = 1; j < TANGENT_DUAL_SPACE; j++)
+			derivative[j] *= AU_LENGTH / unit;
+
+		for (unsigned int j = TANGENT_DUAL_SPACE; j < variables; j++)
+			derivative[j] /= unit;
+	}
+}
+
+/**
+ * Equations of motion of the particle (the same of calculate_derivatives) together with the variational equations of
+ * the columns of the tangent: y = (r, p, ∂y/∂c₀, ∂y/∂c₁, ...)
+ */
+typedef struct TangentSystem
+{
+	const Pulse*	laser;
+	const Particle*	particle;
+	unsigned int	columns;
+	const double*	time_local;		// ∂τ/∂c, constant during the node motion
+	double*			derivatives;	// Buffer of the derivatives of the fields
+
+	void operator()(double t, const double y[], double f[]) const
+	{
+		// The force is -q·E + s·q·(v × B), where s = (-1, 1, -1) are the signs used by calculate_derivatives
+		static const double sign[3] = {-1, 1, -1};
+
+		unsigned int variables = TANGENT_DUAL_SPACE + laser->sensitivity_params.size();
+		double charge = particle->charge;
+
+		double field[6];
+		calculate_fields_dual(*laser, t, y, field, derivatives);
+
+		const double* e = field;
+		const double* b = field + 3;
+
+		double velocity[3];
+		double velocity_variation[3];
+		double zero[3] = {0, 0, 0};
+		get_velocity_variation(*particle, y + 3, zero, 0, velocity, velocity_variation);
+
+		double v_b[3];
+		cross3(velocity, b, v_b);
+
+		for (unsigned int i = 0; i < 3; i++)
+		{
+			f[i]     = velocity[i];
+			f[i + 3] = - charge * e[i] + sign[i] * charge * v_b[i];
+		}
+
+		for (unsigned int c = 0; c < columns; c++)
+		{
+			const double* dy = y + 6 * (c + 1);
+			double*       df = f + 6 * (c + 1);
+
+			double mass_variation   = c == TANGENT_REST_MASS ? 1 : 0;
+			double charge_variation = c == TANGENT_CHARGE    ? 1 : 0;
+
+			get_velocity_variation(*particle, y + 3, dy + 3, mass_variation, velocity, velocity_variation);
+
+			// Variation of the fields: by the position, by the local time and by the laser attribute of the column
+			double field_variation[6];
+
+			for (unsigned int k = 0; k < 6; k++)
+			{
+				const double* derivative = derivatives + k * variables;
+
+				field_variation[k] = derivative[0] * time_local[c] + derivative[1] * dy[0] + derivative[2] * dy[1] + derivative[3] * dy[2];
+
+				if (c >= TANGENT_LASER)
+					field_variation[k] += derivative[TANGENT_DUAL_SPACE + c - TANGENT_LASER];
+			}
+
+			double dv_b[3];
+			double v_db[3];
+			cross3(velocity_variation, b, dv_b);
+			cross3(velocity, field_variation + 3, v_db);
+
+			for (unsigned int i = 0; i < 3; i++)
+			{
+				df[i]     = velocity_variation[i];
+				df[i + 3] = - charge * field_variation[i] - charge_variation * e[i] + sign[i] * (charge_variation * v_b[i] + charge * (dv_b[i] + v_db[i]));
+			}
+		}
+	}
+
+} TangentSystem;
+
+/**
+ * Variation of the local time of the node entry (see get_timing_local_time) for the variation of the entry state
+ */
+double get_timing_local_time_variation(Simulation& simulation, Pulse& laser, Particle& particle, ParticleStateLocal& state, const double variation[], double mass_variation)
+{
+	// The sampled reference points are constant for small variations
+	if (laser.timing_mode == ENTER || laser.timing_sampled)
+		return 0;
+
+	double position[3] = {state.position_x, state.position_y, state.position_z};
+	double momentum[3] = {state.momentum_x, state.momentum_y, state.momentum_z};
+
+	double velocity[3];
+	double velocity_variation[3];
+	get_velocity_variation(particle, momentum, variation + 3, mass_variation, velocity, velocity_variation);
+
+	double velocity2 = dot3(velocity, velocity);
+	double r_v       = dot3(position, velocity);
+
+	// t_nearest = -(r·v)/v²
+	double time_nearest           = -r_v / velocity2;
+	double time_nearest_variation = -(dot3(variation, velocity) + dot3(position, velocity_variation)) / velocity2 + 2 * r_v * dot3(velocity, velocity_variation) / (velocity2 * velocity2);
+
+	if (laser.timing_mode == NEAREST)
+		return -time_nearest_variation;
+
+	// t_exit = t_nearest + s, where s² = (R² - |r_nearest|²)/v² and r_nearest ⊥ v
+	double nearest[3];
+	double moved[3];
+
+	for (unsigned int i = 0; i < 3; i++)
+	{
+		nearest[i] = position[i]  + velocity[i] * time_nearest;
+		moved[i]   = variation[i] + velocity_variation[i] * time_nearest;
+	}
+
+	double s = sqrt(max(pow2(simulation.laser_influence_radius) - dot3(nearest, nearest), 0.d) / velocity2);
+	double s_variation = 0;
+
+	if (s > 0)
+		s_variation = -dot3(nearest, moved) / (s * velocity2) - s * dot3(velocity, velocity_variation) / velocity2;
+
+	return -(time_nearest_variation + s_variation);
+}
+
+void init_simulation_tangent(SimulationTangent& tangent, Pulse& laser)
+{
+	tangent.columns = TANGENT_LASER + laser.sensitivity_params.size();
+
+	tangent.state.assign(6 * tangent.columns, 0.d);
+	tangent.time_local.assign(tangent.columns, 0.d);
+	tangent.time_event.assign(tangent.columns, 0.d);
+
+	for (unsigned int c = 0; c < 6; c++)
+		tangent.state[6 * c + c] = 1;
+}
+
+void tangent_free(SimulationTangent& tangent, Laboratory& laboratory, Particle& particle, ParticleStateGlobal& state, double duration, int node_crossed)
+{
+	double momentum[3] = {state.momentum_x, state.momentum_y, state.momentum_z};
+	double velocity[3];
+	double velocity_variation[3];
+	double normal[3];
+
+	if (node_crossed >= 0)
+	{
+		Node& node = laboratory.nodes[node_crossed];
+
+		normal[0] = global_coord_delta(state.position_x, node.position_x);
+		normal[1] = global_coord_delta(state.position_y, node.position_y);
+		normal[2] = global_coord_delta(state.position_z, node.position_z);
+	}
+
+	for (unsigned int c = 0; c < tangent.columns; c++)
+	{
+		double* dy = &tangent.state[6 * c];
+
+		get_velocity_variation(particle, momentum, dy + 3, c == TANGENT_REST_MASS ? 1 : 0, velocity, velocity_variation);
+
+		for (unsigned int i = 0; i < 3; i++)
+			dy[i] += velocity_variation[i] * duration;
+
+		if (node_crossed >= 0)
+			tangent.time_event[c] = -dot3(normal, dy) / dot3(normal, velocity);
+	}
+}
+
+void tangent_node_enter(SimulationTangent& tangent, Simulation& simulation, Pulse& laser, Particle& particle, ParticleStateLocal& state, Node& node, double local_time)
+{
+	vector<double> derivatives(6 * (TANGENT_DUAL_SPACE + laser.sensitivity_params.size()));
+	TangentSystem system = {&laser, &particle, 0, NULL, derivatives.data()};
+
+	double y[6] = {state.position_x, state.position_y, state.position_z, state.momentum_x, state.momentum_y, state.momentum_z};
+	double f[6];
+	system(local_time, y, f);
+
+	for (unsigned int c = 0; c < tangent.columns; c++)
+	{
+		double* dy = &tangent.state[6 * c];
+		double  dt = tangent.time_event[c];
+
+		// The translation of the frame doesn't change the variations
+		Vec3 position = frame_to_local(node.axis, dy[0], dy[1], dy[2]);
+		Vec3 momentum = frame_to_local(node.axis, dy[3], dy[4], dy[5]);
+
+		// Variation on the influence sphere: the velocity is the same on both sides (f⁻ = (v, 0)), so only the
+		// momentum jumps
+		double variation[6] = {position.x + f[0] * dt, position.y + f[1] * dt, position.z + f[2] * dt, momentum.x, momentum.y, momentum.z};
+
+		tangent.time_local[c] = get_timing_local_time_variation(simulation, laser, particle, state, variation, c == TANGENT_REST_MASS ? 1 : 0) - dt;
+
+		dy[0] = position.x;
+		dy[1] = position.y;
+		dy[2] = position.z;
+		dy[3] = momentum.x - f[3] * dt;
+		dy[4] = momentum.y - f[4] * dt;
+		dy[5] = momentum.z - f[5] * dt;
+	}
+}
+
+void tangent_node_exit(SimulationTangent& tangent, Pulse& laser, Particle& particle, ParticleStateLocal& state, Node& node, double local_time)
+{
+	vector<double> derivatives(6 * (TANGENT_DUAL_SPACE + laser.sensitivity_params.size()));
+	TangentSystem system = {&laser, &particle, 0, NULL, derivatives.data()};
+
+	double y[6] = {state.position_x, state.position_y, state.position_z, state.momentum_x, state.momentum_y, state.momentum_z};
+	double f[6];
+	system(local_time, y, f);
+
+	for (unsigned int c = 0; c < tangent.columns; c++)
+	{
+		double* dy = &tangent.state[6 * c];
+
+		// The sphere is centered on the origin of the local frame
+		double dt = -dot3(y, dy) / dot3(y, f);
+
+		Vec3 position = frame_to_global(node.axis_t, dy[0], dy[1], dy[2]);
+		Vec3 momentum = frame_to_global(node.axis_t, dy[3] + f[3] * dt, dy[4] + f[4] * dt, dy[5] + f[5] * dt);
+
+		dy[0] = position.x;
+		dy[1] = position.y;
+		dy[2] = position.z;
+		dy[3] = momentum.x;
+		dy[4] = momentum.y;
+		dy[5] = momentum.z;
+
+		tangent.time_event[c] = dt;
+	}
+}
+
+void tangent_finish(SimulationTangent& tangent, Particle& particle, ParticleStateGlobal& state)
+{
+	double velocity_x;
+	double velocity_y;
+	double velocity_z;
+	get_free_velocity(particle, state, velocity_x, velocity_y, velocity_z);
+
+	for (unsigned int c = 0; c < tangent.columns; c++)
+	{
+		tangent.state[6 * c + 0] += velocity_x * tangent.time_event[c];
+		tangent.state[6 * c + 1] += velocity_y * tangent.time_event[c];
+		tangent.state[6 * c + 2] += velocity_z * tangent.time_event[c];
+	}
+}
+
+void simulate_node_tangent(
+	Simulation& simulation,
+	Pulse& laser,
+	Node& node,
+	Particle& particle,
+	ParticleStateLocal& state,
+	double& local_time_current,
+	unsigned int interaction,
+	FunctionNodeTimeProgress& on_node_time_progress,
+	SimluationResultNodeSummary& summary,
+	FunctionFieldType function_field,
+	Dop853Workspace& workspace,
+	SimulationTangent& tangent,
+	RecordPolicy record)
+{
+	unsigned int dimension = 6 * (tangent.columns + 1);
+
+	vector<double> derivatives(6 * (TANGENT_DUAL_SPACE + laser.sensitivity_params.size()));
+	TangentSystem system = {&laser, &particle, tangent.columns, tangent.time_local.data(), derivatives.data()};
+
+	// Only the state is part of the error control and the tangent follows its steps: many derivatives are null or
+	// cancellations of larger terms, which have no meaningful relative error. The step size is the one of workspace.
+	Dop853Workspace workspace_tangent;
+	dop853_init(workspace_tangent, dimension, simulation.error_abs, simulation.error_rel);
+	workspace_tangent.error_dimension = 6;
+	workspace_tangent.step = workspace.step;
+
+	vector<double> y(dimension);
+	vector<double> y_before(dimension);
+
+	y[0] = state.position_x;
+	y[1] = state.position_y;
+	y[2] = state.position_z;
+	y[3] = state.momentum_x;
+	y[4] = state.momentum_y;
+	y[5] = state.momentum_z;
+
+	copy(tangent.state.begin(), tangent.state.end(), y.begin() + 6);
+
+	// As in simulate_node, the motion ends exactly on the influence sphere
+	bool   crossed = false;
+	double radius  = simulation.laser_influence_radius;
+
+	while (!crossed)
+	{
+		double local_time_before = local_time_current;
+		y_before = y;
+
+		dop853_evolve(workspace_tangent, system, local_time_current, y.data(), local_time_current + simulation.time_resolution_laser);
+
+		if (!is_in_influence_radius(y.data(), radius))
+		{
+			double position[3];
+
+			crossed = true;
+			double local_time_crossing = find_sphere_crossing(local_time_before, local_time_current, [&](double time)
+			{
+				interpolate_position(particle, local_time_before, y_before.data(), local_time_current, y.data(), time, position);
+				return !is_in_influence_radius(position, radius);
+			});
+
+			// Integrate again from the previous sample, stopping on the crossing
+			y = y_before;
+			local_time_current = local_time_before;
+			dop853_restart(workspace_tangent);
+
+			dop853_evolve(workspace_tangent, system, local_time_current, y.data(), local_time_crossing);
+		}
+
+		state.position_x = y[0];
+		state.position_y = y[1];
+		state.position_z = y[2];
+		state.momentum_x = y[3];
+		state.momentum_y = y[4];
+		state.momentum_z = y[5];
+
+		record_node_sample(simulation, laser, node, particle, state, local_time_current, interaction, on_node_time_progress, summary, function_field, record);
+	}
+
+	copy(y.begin() + 6, y.end(), tangent.state.begin());
+	workspace.step = workspace_tangent.step;
+}
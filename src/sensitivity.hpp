@@ -0,0 +1,91 @@
+#include "type.hpp"
+#include "dop853.hpp"
+
+#ifndef CIRCLESIM_SENSITIVITY
+#define CIRCLESIM_SENSITIVITY
+
+/**
+ * Forward sensitivity of the simulation: the derivatives of the particle state y = (r, p) by the initial state and by
+ * the parameters π (rest mass, charge and the laser attributes of Pulse::sensitivity_params), integrated along the state
+ * of a single simulation (see SimulationTangent).
+ *
+ * A column δy = ∂y/∂c of the tangent follows the variational equations of the motion:
+ *
+ *   free motion      δr' = δv        δp' = 0        with δv = fac/m·(δp - fac²/c₀²·(p·δp)·p) - v·δm/m
+ *   node motion      δy' = ∂f/∂y·δy + ∂f/∂τ·δτ + ∂f/∂π·δπ
+ *
+ * The free motion is propagated in closed form, the node motion is integrated by DOP853 together with the state. The
+ * derivatives of the fields by the position, by the local time τ and by the laser attributes come from 'field_dual':
+ * the field function of the user compiled on dual numbers (forward mode automatic differentiation, see script.cpp).
+ *
+ * The dynamics change when the particle crosses an influence sphere, at a time that depends on the state. The columns
+ * are variations at a fixed time, so they jump on the crossings (saltation). With h(r) = |r - r_node| - R the crossing
+ * moves by δt = -(∇h·δr)/(∇h·v), the variation at the crossing is δy + f⁻·δt and after it:
+ *
+ *   δy⁺ = δy + (f⁻ - f⁺)·δt
+ *
+ * where f⁻ and f⁺ are the equations of motion before and after the crossing. Entering a node the local time starts from
+ * the timing reference τ₀(y) (see get_timing_local_time), so its variation is δτ = ∂τ₀/∂y·(δy + f⁻·δt) - δt: with the
+ * enter mode and the sampled timing only the term -δt is left.
+ *
+ * The simulation ends at the first free motion sample after the duration, counted from the end of the last node motion:
+ * the final time moves with the last exit and the final state gets δy + f·δt of the last crossing. The result is the
+ * exact derivative of the simulated model (the trajectory integrated with the given tolerances), not of a finite
+ * difference. It needs the dop853 integrator and is not available with the field cache, the transfer map cache and
+ * the ponderomotive model.
+ */
+
+// Columns of the tangent after the 6 of the initial state (the laser attributes follow)
+#define TANGENT_REST_MASS		6
+#define TANGENT_CHARGE			7
+#define TANGENT_LASER			8
+
+// Variables of the dual numbers of field_dual before the laser attributes: t, x, y, z
+#define TANGENT_DUAL_SPACE		4
+
+/**
+ * Identity tangent at the start of the simulation
+ */
+void init_simulation_tangent(SimulationTangent& tangent, Pulse& laser);
+
+/**
+ * Free motion lasting duration from state (the momentum is constant). If the motion ended entering the influence
+ * sphere of node_crossed (-1 otherwise) the variation of the crossing time is kept for the node entry.
+ */
+void tangent_free(SimulationTangent& tangent, Laboratory& laboratory, Particle& particle, ParticleStateGlobal& state, double duration, int node_crossed);
+
+/**
+ * Node entry: the tangent moves to the local frame of the node, state is the local entry state at local_time
+ */
+void tangent_node_enter(SimulationTangent& tangent, Simulation& simulation, Pulse& laser, Particle& particle, ParticleStateLocal& state, Node& node, double local_time);
+
+/**
+ * Node exit on the influence sphere: the tangent moves back to the global frame
+ */
+void tangent_node_exit(SimulationTangent& tangent, Pulse& laser, Particle& particle, ParticleStateLocal& state, Node& node, double local_time);
+
+/**
+ * End of the simulation: the final time moves with the last crossing
+ */
+void tangent_finish(SimulationTangent& tangent, Particle& particle, ParticleStateGlobal& state);
+
+/**
+ * Node motion with the tangent (in place of the configured integrator), from state at local_time_current until the
+ * exit from the influence sphere
+ */
+void simulate_node_tangent(
+	Simulation& simulation,
+	Pulse& laser,
+	Node& node,
+	Particle& particle,
+	ParticleStateLocal& state,
+	double& local_time_current,
+	unsigned int interaction,
+	FunctionNodeTimeProgress& on_node_time_progress,
+	SimluationResultNodeSummary& summary,
+	FunctionFieldType function_field,
+	Dop853Workspace& workspace,
+	SimulationTangent& tangent,
+	RecordPolicy record);
+
+#endif
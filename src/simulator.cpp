@@ -5,50 +5,35 @@
 #include "simulator.hpp"
 #include "type.hpp"
 #include "util.hpp"
-
-bool is_in_influence_radius(ParticleStateGlobal& state, Node& node, double laser_influence_radius)
-{
-	return vector_module(
-			state.position_x - node.position_x,
-			state.position_y - node.position_y,
-			state.position_z - node.position_z) <= laser_influence_radius;
-}
+#include "node_index.hpp"
+#include "dop853.hpp"
+#include "pusher.hpp"
+#include "field_cache.hpp"
+#include "transfer_map_cache.hpp"
+#include "ponderomotive.hpp"
+#include "sensitivity.hpp"
 
 bool is_in_influence_radius(ParticleStateLocal& state, double laser_influence_radius)
 {
 	return vector_module(state.position_x, state.position_y, state.position_z) <= laser_influence_radius;
 }
 
-int get_near_node_id(ParticleStateGlobal& state, Laboratory& laboratory, double laser_influence_radius)
-{
-	for (Node& node: laboratory.nodes)
-	{
-		if (is_in_influence_radius(state, node, laser_influence_radius))
-			return node.id;
-	}
-	
-	return -1;
-}
-
 
 
-typedef struct gsl_odeiv_custom_params
-{
-	Pulse* 					laser;
-	Particle*				particle;
-	FunctionFieldType*      function_field;
-
-} gsl_odeiv_custom_params;
 
       
 void calculate_fields(double pos_t, double pos_x, double pos_y, double pos_z, const Pulse& laser, Field& field, FunctionFieldType function_field)
 {
+	// Outside the tabulated lattice the field function is used
+	if (laser.field_cache != NULL && lookup_field_cache(*laser.field_cache, pos_t/C0, pos_x, pos_y, pos_z, field))
+		return;
+	
 	double param_time			=	pos_t/C0		* AU_TIME;
 	double param_x				=	pos_x 			* AU_LENGTH;
 	double param_y				=	pos_y 			* AU_LENGTH;
 	double param_z				=	pos_z 			* AU_LENGTH;
   
-	field = function_field(param_time, param_x, param_y, param_z, laser.params);
+	field = function_field(param_time, param_x, param_y, param_z, laser.params_data.data());
 
 	field.e_x /= AU_ELECTRIC_FIELD; 
 	field.e_y /= AU_ELECTRIC_FIELD;
@@ -59,48 +44,90 @@ void calculate_fields(double pos_t, double pos_x, double pos_y, double pos_z, co
 	field.b_z /= AU_MAGNETIC_FIELD; 
 
 }
-      
-      
-int gsl_odeiv_jac (double t, const double y[], double *dfdy, double dfdt[], void *params)
-{
-	cout << "jacobian used\n";
-	return GSL_SUCCESS;
-}
 
-int gsl_odeiv_func_laser_fake(double t, const double y[], double f[], void *params)
+/**
+ * Same as calculate_fields for n points at once. The points not covered by the field cache are evaluated all together
+ * by the batched field function.
+ */
+void calculate_fields_batch(unsigned int n, const double pos_t[], const double pos_x[], const double pos_y[], const double pos_z[], const Pulse& laser, FieldBatch& field, FunctionFieldBatchType function_field_batch)
 {
-	Particle& 	particle 				= *((gsl_odeiv_custom_params*)params)->particle;
-
-	//double pos_t = C0*t;
-	//double pos_x = y[0];
-	//double pos_y = y[1];
-	//double pos_z = y[2];
-	double mom_x = y[3];
-	double mom_y = y[4];
-	double mom_z = y[5];
+	vector<unsigned int> indexes;
+	indexes.reserve(n);
 	
-	// In out formulas we use B instead of H and we use the relation B = H/c₀
-	// Formulas (3),(4),(5)
+	for (unsigned int i = 0; i < n; i++)
+	{
+		Field item;
+		
+		if (laser.field_cache != NULL && lookup_field_cache(*laser.field_cache, pos_t[i]/C0, pos_x[i], pos_y[i], pos_z[i], item))
+		{
+			field.e_x[i] = item.e_x;
+			field.e_y[i] = item.e_y;
+			field.e_z[i] = item.e_z;
+			field.b_x[i] = item.b_x;
+			field.b_y[i] = item.b_y;
+			field.b_z[i] = item.b_z;
+		}
+		else
+			indexes.push_back(i);
+	}
 	
-	// fac =  1/√(1 + p/(c₀m)²) = c₀/√(c₀²+p²)
-	double fac = C0 / sqrt(C0 * C0 + mom_x * mom_x + mom_y * mom_y + mom_z * mom_z);
+	unsigned int count = indexes.size();
 	
-	f[0] = fac * mom_x / particle.rest_mass;
-	f[1] = fac * mom_y / particle.rest_mass;
-	f[2] = fac * mom_z / particle.rest_mass;
-	f[3] = 0.d;
-	f[4] = 0.d;
-	f[5] = 0.d;
-
+	if (count == 0)
+		return;
+	
+	vector<double> buffer(10 * count);
+	
+	double* param_time	= &buffer[0 * count];
+	double* param_x		= &buffer[1 * count];
+	double* param_y		= &buffer[2 * count];
+	double* param_z		= &buffer[3 * count];
+	
+	FieldBatch result;
+	result.e_x = &buffer[4 * count];
+	result.e_y = &buffer[5 * count];
+	result.e_z = &buffer[6 * count];
+	result.b_x = &buffer[7 * count];
+	result.b_y = &buffer[8 * count];
+	result.b_z = &buffer[9 * count];
+	
+	for (unsigned int k = 0; k < count; k++)
+	{
+		unsigned int i = indexes[k];
+		
+		param_time[k]	= pos_t[i]/C0	* AU_TIME;
+		param_x[k]		= pos_x[i]		* AU_LENGTH;
+		param_y[k]		= pos_y[i]		* AU_LENGTH;
+		param_z[k]		= pos_z[i]		* AU_LENGTH;
+	}
+	
+	function_field_batch(count, param_time, param_x, param_y, param_z, result, laser.params_data.data());
+	
+	for (unsigned int k = 0; k < count; k++)
+	{
+		unsigned int i = indexes[k];
+		
+		field.e_x[i] = result.e_x[k] / AU_ELECTRIC_FIELD;
+		field.e_y[i] = result.e_y[k] / AU_ELECTRIC_FIELD;
+		field.e_z[i] = result.e_z[k] / AU_ELECTRIC_FIELD;
+		field.b_x[i] = result.b_x[k] / AU_MAGNETIC_FIELD;
+		field.b_y[i] = result.b_y[k] / AU_MAGNETIC_FIELD;
+		field.b_z[i] = result.b_z[k] / AU_MAGNETIC_FIELD;
+	}
+}
+      
+      
+int gsl_odeiv_jac (double t, const double y[], double *dfdy, double dfdt[], void *params)
+{
+	cout << "jacobian used\n";
 	return GSL_SUCCESS;
 }
 
-int gsl_odeiv_func_laser(double t, const double y[], double f[], void *params)
+/**
+ * Equations of motion of the particle in the laser field (shared by every integrator).
+ */
+inline void calculate_derivatives(double t, const double y[], double f[], const Pulse& laser, const Particle& particle, FunctionFieldType function_field)
 {
-	Pulse& 	 	laser 	  				= *((gsl_odeiv_custom_params*)params)->laser;
-	Particle& 	particle 				= *((gsl_odeiv_custom_params*)params)->particle;
-	FunctionFieldType function_field    = *((gsl_odeiv_custom_params*)params)->function_field;
-
 	double pos_t = C0*t;
 	double pos_x = y[0];
 	double pos_y = y[1];
@@ -132,116 +159,170 @@ int gsl_odeiv_func_laser(double t, const double y[], double f[], void *params)
 	f[3] = - particle.charge * e_x - particle.charge / particle.rest_mass * fac * (mom_y * b_z - mom_z * b_y);
 	f[4] = - particle.charge * e_y + particle.charge / particle.rest_mass * fac * (mom_z * b_x - mom_x * b_z);
 	f[5] = - particle.charge * e_z - particle.charge / particle.rest_mass * fac * (mom_x * b_y - mom_y * b_x);
+}
+
+int gsl_odeiv_func_laser(double t, const double y[], double f[], void *params)
+{
+	Pulse& 	 	laser 	  				= *((gsl_odeiv_custom_params*)params)->laser;
+	Particle& 	particle 				= *((gsl_odeiv_custom_params*)params)->particle;
+	FunctionFieldType function_field    = *((gsl_odeiv_custom_params*)params)->function_field;
+
+	calculate_derivatives(t, y, f, laser, particle, function_field);
 
 	return GSL_SUCCESS;
 }
 
-int gsl_odeiv_func_free(double t, const double y[], double f[], void *params)
+/**
+ * Equations of motion as a functor, so that the templated integrators can inline them.
+ */
+typedef struct LaserSystem
 {
-	Particle& particle = *((gsl_odeiv_custom_params*)params)->particle;
-
-	// double pos_t = C0*t;
-	// double pos_x = y[0];
-	// double pos_y = y[1];
-	// double pos_z = y[2];
-	double mom_x = y[3];
-	double mom_y = y[4];
-	double mom_z = y[5];
+	const Pulse*		laser;
+	const Particle*		particle;
+	FunctionFieldType	function_field;
 	
-	double fac=C0/sqrt(C0 * C0 + mom_x * mom_x + mom_y * mom_y + mom_z * mom_z);
+	inline void operator()(double t, const double y[], double f[]) const
+	{
+		calculate_derivatives(t, y, f, *laser, *particle, function_field);
+	}
 	
-	f[0] = fac * mom_x / particle.rest_mass;
-	f[1] = fac * mom_y / particle.rest_mass;
-	f[2] = fac * mom_z / particle.rest_mass;
-	f[3] = 0;
-	f[4] = 0;
-	f[5] = 0;
+	inline void field(double t, const double position[], Field& field) const
+	{
+		calculate_fields(C0*t, position[0], position[1], position[2], *laser, field, function_field);
+	}
+	
+} LaserSystem;
 
-	return GSL_SUCCESS;
+bool is_in_influence_radius(const double position[], double laser_influence_radius)
+{
+	return vector_module(position[0], position[1], position[2]) <= laser_influence_radius;
 }
 
-void simulate_node_fake(
-	Simulation& simulation, 
-	Node& node,
-	Particle& particle,
-	ParticleStateLocal& state,
-	double&  local_time_current,
-	unsigned int interaction,
-	SimluationResultNodeSummary& summary)
+/**
+ * Cubic Hermite interpolation of the position between two integrated states (used when no dense output is available).
+ */
+void interpolate_position(Particle& particle, double time_a, const double y_a[], double time_b, const double y_b[], double time, double position[])
 {
-	// Trasforming global coordinates to local coordinates
+	double step = time_b - time_a;
+	double s    = (time - time_a) / step;
 	
+	double h00 =  2 * s * s * s - 3 * s * s + 1;
+	double h10 =      s * s * s - 2 * s * s + s;
+	double h01 = -2 * s * s * s + 3 * s * s;
+	double h11 =      s * s * s -     s * s;
 	
-	summary.local_time_enter = local_time_current;
-
-	gsl_odeiv_custom_params params;
-	params.laser 	  = NULL;
-	params.particle	  = &particle;
-	params.function_field = NULL;
+	double fac_a = C0 / sqrt(C0 * C0 + y_a[3] * y_a[3] + y_a[4] * y_a[4] + y_a[5] * y_a[5]);
+	double fac_b = C0 / sqrt(C0 * C0 + y_b[3] * y_b[3] + y_b[4] * y_b[4] + y_b[5] * y_b[5]);
+	
+	for (unsigned int i = 0; i < 3; i++)
+	{
+		double velocity_a = fac_a * y_a[i + 3] / particle.rest_mass;
+		double velocity_b = fac_b * y_b[i + 3] / particle.rest_mass;
+		
+		position[i] = h00 * y_a[i] + h10 * step * velocity_a + h01 * y_b[i] + h11 * step * velocity_b;
+	}
+}
 
-	const gsl_odeiv_step_type* 	step_type 	= gsl_odeiv_step_rk8pd;
-	gsl_odeiv_step* 			steps 		= gsl_odeiv_step_alloc(step_type, 6);
-	gsl_odeiv_control* 			control		= gsl_odeiv_control_y_new (simulation.error_abs, simulation.error_rel);
-	gsl_odeiv_evolve* 			evolve		= gsl_odeiv_evolve_alloc(6);
-	gsl_odeiv_system 			system 		= {gsl_odeiv_func_laser_fake, gsl_odeiv_jac, 6, &params};
 
+/**
+ * Calculate the local time when the particle enters the influence radius, according the NEAREST and EXIT timing modes.
+ * 
+ * The reference point is calculated as if there was no laser, so the particle moves along the straight line r(t) = r₀ + v·t
+ * and both the nearest point and the exit point are known in closed form:
+ * 
+ *   t_nearest = -(r₀·v)/v²
+ *   t_exit    = t_nearest + √((R² - |r(t_nearest)|²)/v²)
+ * 
+ * If laser.timing_sampled is enabled the reference point is rounded to the time_resolution_laser sampling, reproducing the
+ * values of the old implementation (which simulated the motion without laser and looked for the nearest/exit sample).
+ */
+double get_timing_local_time(Simulation& simulation, Pulse& laser, Particle& particle, ParticleStateLocal& state, Node& node)
+{
+	double fac = C0 / sqrt(C0 * C0 + state.momentum_x * state.momentum_x + state.momentum_y * state.momentum_y + state.momentum_z * state.momentum_z);
 	
-	double y[6];
-	y[0] = state.position_x;
-	y[1] = state.position_y;
-	y[2] = state.position_z;
-	y[3] = state.momentum_x;
-	y[4] = state.momentum_y;
-	y[5] = state.momentum_z;
+	double velocity_x = fac * state.momentum_x / particle.rest_mass;
+	double velocity_y = fac * state.momentum_y / particle.rest_mass;
+	double velocity_z = fac * state.momentum_z / particle.rest_mass;
 	
+	double velocity2 = velocity_x * velocity_x + velocity_y * velocity_y + velocity_z * velocity_z;
 	
-	while(true)
+	if (velocity2 == 0)
 	{
+		printf("ERROR - Unable to detect the nearest point for node %d: the particle is not moving\n", node.id);
+		exit(-6);
+	}
+	
+	double time_nearest = -(state.position_x * velocity_x + state.position_y * velocity_y + state.position_z * velocity_z) / velocity2;
+	
+	double nearest_x = state.position_x + velocity_x * time_nearest;
+	double nearest_y = state.position_y + velocity_y * time_nearest;
+	double nearest_z = state.position_z + velocity_z * time_nearest;
+	
+	double h2 = pow2(simulation.laser_influence_radius) - (nearest_x * nearest_x + nearest_y * nearest_y + nearest_z * nearest_z);
+	
+	double time_exit = time_nearest + sqrt(max(h2, 0.d) / velocity2);
+	
+	if (laser.timing_sampled)
+	{
+		double time_resolution = simulation.time_resolution_laser;
 		
-		double local_time_limit		= local_time_current + simulation.time_resolution_laser;
-		double local_time_step		= simulation.time_resolution_laser / 100;
+		// Samples are taken at k·Δt (k ≥ 1) and the last one is the first outside the influence radius
+		double step_exit = floor(time_exit / time_resolution) + 1;
 		
-		while (local_time_current < local_time_limit)
-		{
-			gsl_odeiv_evolve_apply(evolve, control, steps, &system, &local_time_current, local_time_limit, &local_time_step, y);
-		}
+		if (laser.timing_mode == EXIT)
+			return -(step_exit - 1) * time_resolution + laser.timing_offset;
 		
+		// The distance is convex in time, so the nearest sample is one of the two around t_nearest
+		double step_before = min(max(floor(time_nearest / time_resolution), 1.d), step_exit);
+		double step_after  = min(step_before + 1, step_exit);
 		
-		state.position_x = y[0];
-		state.position_y = y[1];
-		state.position_z = y[2];
-		state.momentum_x = y[3];
-		state.momentum_y = y[4];
-		state.momentum_z = y[5];
+		double distance_before = vector_module(state.position_x + velocity_x * step_before * time_resolution, state.position_y + velocity_y * step_before * time_resolution, state.position_z + velocity_z * step_before * time_resolution);
+		double distance_after  = vector_module(state.position_x + velocity_x * step_after  * time_resolution, state.position_y + velocity_y * step_after  * time_resolution, state.position_z + velocity_z * step_after  * time_resolution);
 		
-		Field field;
-		field.e_x = 0.d;
-		field.e_y = 0.d;
-		field.e_z = 0.d;
-		field.b_x = 0.d;
-		field.b_y = 0.d;
-		field.b_z = 0.d;
-		
-		SimluationResultNodeItem result;
-		result.local_time		= local_time_current;
-		result.local_state	= state;
-		result.field	= field;
-		summary.items.push_back(result);
-		
-		
-		// Checking if we are outside the laser influence radius.
-		if (!is_in_influence_radius(state, simulation.laser_influence_radius))
-			break;
+		double step_nearest = distance_after < distance_before ? step_after : step_before;
 		
+		return -(step_nearest - 1) * time_resolution + laser.timing_offset;
 	}
+	
+	if (laser.timing_mode == EXIT)
+		return -time_exit + laser.timing_offset;
+	else
+		return -time_nearest + laser.timing_offset;
+}
 
 
-
-	gsl_odeiv_evolve_free(evolve);
-	gsl_odeiv_control_free(control);
-	gsl_odeiv_step_free(steps);
+/**
+ * Sample of a node motion: the fields are calculated only if it is reported or recorded
+ */
+void record_node_sample(
+	Simulation& simulation,
+	Pulse& laser,
+	Node& node,
+	Particle& particle,
+	ParticleStateLocal& state,
+	double local_time,
+	unsigned int interaction,
+	FunctionNodeTimeProgress& on_node_time_progress,
+	SimluationResultNodeSummary& summary,
+	FunctionFieldType function_field,
+	RecordPolicy record)
+{
+	if (on_node_time_progress == NULL && record != RECORD_FULL)
+		return;
 	
-	summary.local_time_exit = local_time_current;
+	Field field;
+	calculate_fields(local_time*C0, state.position_x, state.position_y, state.position_z, laser, field, function_field);
+	
+	if (on_node_time_progress != NULL) on_node_time_progress(simulation, laser, particle, state, interaction, node, local_time, field);
+	
+	if (record == RECORD_FULL)
+	{
+		SimluationResultNodeItem result;
+		result.local_time	= local_time;
+		result.local_state	= state;
+		result.field		= field;
+		summary.items.push_back(result);
+	}
 }
 
 
@@ -255,23 +336,89 @@ void simulate_node(
 	unsigned int interaction,
 	FunctionNodeTimeProgress& on_node_time_progress,
 	SimluationResultNodeSummary& summary,
-	FunctionFieldType function_field)
+	FunctionFieldType function_field,
+	Dop853Workspace& workspace,
+	RecordPolicy record,
+	SimulationTangent* tangent)
 {
 	// Trasforming global coordinates to local coordinates
 	
 	
 	summary.local_time_enter = local_time_current;
+	
+	// The variational equations are integrated together with the state
+	if (tangent != NULL)
+	{
+		simulate_node_tangent(simulation, laser, node, particle, state, local_time_current, interaction, on_node_time_progress, summary, function_field, workspace, *tangent, record);
+		
+		summary.local_time_exit = local_time_current;
+		return;
+	}
+	
+	// A motion from a near entry state is already known: only the exit item
+	double entry[7];
+	double exit_state[7];
+	
+	if (laser.transfer_map_cache != NULL)
+	{
+		get_transfer_map_entry(state, local_time_current, entry);
+		
+		if (lookup_transfer_map_cache(*laser.transfer_map_cache, entry, exit_state))
+		{
+			state.position_x = exit_state[0];
+			state.position_y = exit_state[1];
+			state.position_z = exit_state[2];
+			state.momentum_x = exit_state[3];
+			state.momentum_y = exit_state[4];
+			state.momentum_z = exit_state[5];
+			local_time_current += exit_state[6];
+			
+			record_node_sample(simulation, laser, node, particle, state, local_time_current, interaction, on_node_time_progress, summary, function_field, record);
+			
+			summary.local_time_exit = local_time_current;
+			return;
+		}
+	}
+
+	// End of the node motion, whichever way it was integrated
+	auto finish = [&]()
+	{
+		summary.local_time_exit = local_time_current;
+		
+		if (laser.transfer_map_cache != NULL)
+		{
+			get_transfer_map_entry(state, local_time_current - summary.local_time_enter, exit_state);
+			insert_transfer_map_cache(*laser.transfer_map_cache, entry, exit_state);
+		}
+	};
+	
+	// Cycle averaged motion as long as the envelope approximation holds, then the full one continues from there
+	if (simulation.ponderomotive && simulate_node_ponderomotive(simulation, laser, node, particle, state, local_time_current, interaction, on_node_time_progress, summary, function_field, record))
+	{
+		finish();
+		return;
+	}
 
 	gsl_odeiv_custom_params params;
 	params.laser 	  = &laser;
 	params.particle	  = &particle;
 	params.function_field = &function_field;
 
-	const gsl_odeiv_step_type* 	step_type 	= gsl_odeiv_step_rk8pd;
-	gsl_odeiv_step* 			steps 		= gsl_odeiv_step_alloc(step_type, 6);
-	gsl_odeiv_control* 			control		= gsl_odeiv_control_y_new (simulation.error_abs, simulation.error_rel);
-	gsl_odeiv_evolve* 			evolve		= gsl_odeiv_evolve_alloc(6);
+	gsl_odeiv_step* 			steps 		= NULL;
+	gsl_odeiv_control* 			control		= NULL;
+	gsl_odeiv_evolve* 			evolve		= NULL;
 	gsl_odeiv_system 			system 		= {gsl_odeiv_func_laser, gsl_odeiv_jac, 6, &params};
+	
+	if (simulation.integrator == RK8PD)
+	{
+		steps 	= gsl_odeiv_step_alloc(gsl_odeiv_step_rk8pd, 6);
+		control	= gsl_odeiv_control_y_new (simulation.error_abs, simulation.error_rel);
+		evolve	= gsl_odeiv_evolve_alloc(6);
+	}
+	
+	// The step size of DOP853 is kept in the workspace, but the state is a new one
+	LaserSystem laser_system = {&laser, &particle, function_field};
+	dop853_restart(workspace);
 
 	
 	double y[6];
@@ -282,16 +429,100 @@ void simulate_node(
 	y[4] = state.momentum_y;
 	y[5] = state.momentum_z;
 	
+	// With dense output the integrator state runs ahead of the samples
+	double y_step[6];
+	double local_time_step_current = local_time_current;
+	
+	for (unsigned int i = 0; i < 6; i++)
+		y_step[i] = y[i];
+	
+	
+	// Integrate until the target time, with the configured integrator
+	auto advance = [&](double local_time_target)
+	{
+		if (simulation.integrator == DOP853)
+		{
+			dop853_evolve(workspace, laser_system, local_time_current, y, local_time_target);
+		}
+		else if (simulation.integrator != RK8PD)
+		{
+			push_evolve(simulation.integrator, laser_system, particle, local_time_current, y, local_time_target, simulation.time_resolution_laser / simulation.pusher_substeps);
+		}
+		else
+		{
+			double local_time_step		= simulation.time_resolution_laser / 100;
+			
+			while (local_time_current < local_time_target)
+			{
+				gsl_odeiv_evolve_apply(evolve, control, steps, &system, &local_time_current, local_time_target, &local_time_step, y);
+			}
+		}
+	};
+	
+	// The node motion ends exactly on the influence sphere. As soon as a sample (or a step of the dense output) is
+	// outside, the crossing time is located and the last item is placed there.
+	bool   crossed = false;
+	double local_time_crossing = INFINITY;
+	double radius = simulation.laser_influence_radius;
 	
 	while(true)
 	{
 		
 		double local_time_limit		= local_time_current + simulation.time_resolution_laser;
-		double local_time_step		= simulation.time_resolution_laser / 100;
 		
-		while (local_time_current < local_time_limit)
+		if (simulation.integrator == DOP853 && simulation.dense_output)
 		{
-			gsl_odeiv_evolve_apply(evolve, control, steps, &system, &local_time_current, local_time_limit, &local_time_step, y);
+			// Natural steps without any limit: the sample is interpolated inside the step containing it
+			while (!crossed && local_time_step_current < local_time_limit)
+			{
+				dop853_step(workspace, laser_system, local_time_step_current, y_step, INFINITY);
+				
+				if (!is_in_influence_radius(y_step, radius))
+				{
+					double y_dense[6];
+					
+					crossed = true;
+					local_time_crossing = find_sphere_crossing(workspace.dense_time, local_time_step_current, [&](double time)
+					{
+						dop853_dense(workspace, time, y_dense);
+						return !is_in_influence_radius(y_dense, radius);
+					});
+				}
+			}
+			
+			local_time_current = min(local_time_limit, local_time_crossing);
+			dop853_dense(workspace, local_time_current, y);
+		}
+		else
+		{
+			double y_before[6];
+			double local_time_before = local_time_current;
+			
+			for (unsigned int i = 0; i < 6; i++)
+				y_before[i] = y[i];
+			
+			advance(local_time_limit);
+			
+			if (!is_in_influence_radius(y, radius))
+			{
+				double position[3];
+				
+				crossed = true;
+				local_time_crossing = find_sphere_crossing(local_time_before, local_time_current, [&](double time)
+				{
+					interpolate_position(particle, local_time_before, y_before, local_time_current, y, time, position);
+					return !is_in_influence_radius(position, radius);
+				});
+				
+				// Integrate again from the previous sample, stopping on the crossing
+				for (unsigned int i = 0; i < 6; i++)
+					y[i] = y_before[i];
+				
+				local_time_current = local_time_before;
+				dop853_restart(workspace);
+				
+				advance(local_time_crossing);
+			}
 		}
 		
 		
@@ -302,125 +533,154 @@ void simulate_node(
 		state.momentum_y = y[4];
 		state.momentum_z = y[5];
 		
-		Field field;
 		// Print the particle interaction (local position, fields, etc)
-		calculate_fields(local_time_current*C0, y[0], y[1], y[2], laser, field, function_field);
-		
-		if (on_node_time_progress != NULL) on_node_time_progress(simulation, laser, particle, state, interaction, node, local_time_current, field);
-		
-		SimluationResultNodeItem result;
-		result.local_time		= local_time_current;
-		result.local_state	= state;
-		result.field	= field;
-		summary.items.push_back(result);
+		record_node_sample(simulation, laser, node, particle, state, local_time_current, interaction, on_node_time_progress, summary, function_field, record);
 		
 		
-		// Checking if we are outside the laser influence radius.
-		if (!is_in_influence_radius(state, simulation.laser_influence_radius))
+		// Checking if we reached the influence sphere.
+		if (crossed && local_time_current >= local_time_crossing)
 			break;
 		
 	}
 
 
 
-	gsl_odeiv_evolve_free(evolve);
-	gsl_odeiv_control_free(control);
-	gsl_odeiv_step_free(steps);
+	if (simulation.integrator == RK8PD)
+	{
+		gsl_odeiv_evolve_free(evolve);
+		gsl_odeiv_control_free(control);
+		gsl_odeiv_step_free(steps);
+	}
 	
-	summary.local_time_exit = local_time_current;
+	finish();
 }
 
 
-void simulate_free(Simulation& simulation, Laboratory& laboratory, Particle& particle, ParticleStateGlobal& state, long double& global_time_current, FunctionFreeTimeProgress& on_free_time_progress, SimluationResultFreeSummary& summary)
+void get_free_velocity(Particle& particle, ParticleStateGlobal& state, double& velocity_x, double& velocity_y, double& velocity_z)
 {
+	// Same kinematic used in the equations of motion: v = fac·p/m where fac = c₀/√(c₀²+p²)
+	double fac = C0 / sqrt(C0 * C0 + state.momentum_x * state.momentum_x + state.momentum_y * state.momentum_y + state.momentum_z * state.momentum_z);
 	
-	summary.time_enter = global_time_current;
+	velocity_x = fac * state.momentum_x / particle.rest_mass;
+	velocity_y = fac * state.momentum_y / particle.rest_mass;
+	velocity_z = fac * state.momentum_z / particle.rest_mass;
+}
+
+/**
+ * Where the free motion starting from state at global_time ends. The particle is sampled every time_resolution_free and
+ * the motion ends exactly when the particle enters an influence radius (node_entered ≥ 0, after time_entry) or at the
+ * first sample after the simulation duration (node_entered = -1). steps is the number of samples before the end.
+ */
+void get_free_motion_end(Simulation& simulation, Laboratory& laboratory, ParticleStateGlobal& state, const GlobalCoord& global_time, double velocity_x, double velocity_y, double velocity_z, int node_left, double& steps, double& time_entry, int& node_entered)
+{
+	double time_resolution = simulation.time_resolution_free;
+	double steps_limit     = max(ceil(global_coord_delta(simulation.duration, global_time) / time_resolution), 0.d);
 	
-	// Trasforming global coordinates to local coordinates
-	// We use the starting position of the particle as origin for the new reference system
-	// We do this to have smaller values and be able to handle them with double type.
-	// When updating the 'state' variable we must convert back to the global reference system.
+	steps        = steps_limit;
+	time_entry   = 0;
+	node_entered = -1;
 	
-	long double origin_x = state.position_x;
-	long double origin_y = state.position_y;
-	long double origin_z = state.position_z;
-	long double origin_t = global_time_current;
+	vector<NodeIndexHit> hits;
+	find_node_index_ray(laboratory, state.position_x, state.position_y, state.position_z, velocity_x, velocity_y, velocity_z, steps_limit * time_resolution, hits);
 	
-	double local_pos_x = state.position_x - origin_x; // = 0
-	double local_pos_y = state.position_y - origin_y; // = 0
-	double local_pos_z = state.position_z - origin_z; // = 0
-	double local_t     = global_time_current - origin_t; // = 0
+	for (NodeIndexHit& hit: hits)
+	{
+		// A straight line can't enter again the sphere it just left (and we are exactly on its surface)
+		if ((int) hit.node == node_left)
+			continue;
+		
+		// The hits are sorted by time_enter, so the first one is the nearest. If we are already inside a sphere (they
+		// can overlap) we enter it immediately.
+		node_entered = hit.node;
+		time_entry   = max(hit.time_enter, 0.d);
+		steps        = max(ceil(time_entry / time_resolution) - 1, 0.d);
+		break;
+	}
+}
+
+void simulate_free(Simulation& simulation, Laboratory& laboratory, Particle& particle, ParticleStateGlobal& state, GlobalCoord& global_time_current, FunctionFreeTimeProgress& on_free_time_progress, SimluationResultFreeSummary& summary, int node_left, int& node_entered, RecordPolicy record, SimulationTangent* tangent)
+{
 	
-	double local_mom_x = state.momentum_x;
-	double local_mom_y = state.momentum_y;
-	double local_mom_z = state.momentum_z;
+	summary.time_enter = (double) global_time_current;
 	
-	gsl_odeiv_custom_params params;
-	params.laser 	 = NULL;
-	params.particle	 = &particle;
-	params.function_field = NULL;
-
-	const gsl_odeiv_step_type* 	step_type 	= gsl_odeiv_step_rk8pd;
-	gsl_odeiv_step* 			steps 		= gsl_odeiv_step_alloc(step_type, 6);
-	gsl_odeiv_control* 			control		= gsl_odeiv_control_y_new (simulation.error_abs, simulation.error_rel);
-	gsl_odeiv_evolve* 			evolve		= gsl_odeiv_evolve_alloc(6);
-	gsl_odeiv_system 			system 		= {gsl_odeiv_func_free, gsl_odeiv_jac, 6, &params};
-
+	// Outside the influence radius there are no forces acting on the particle, so it moves along a straight line with constant momentum.
+	// Instead of integrating the equations of motion we calculate the trajectory in closed form:
+	//
+	//   r(t) = r₀ + v·(t - t₀)
+	//
+	// The starting position is used as origin, so only the (small) displacement v·(t - t₀) is calculated with double precision.
 	
-	double y[6];
-	y[0] = local_pos_x;
-	y[1] = local_pos_y;
-	y[2] = local_pos_z;
-	y[3] = local_mom_x;
-	y[4] = local_mom_y;
-	y[5] = local_mom_z;
+	GlobalCoord origin_x = state.position_x;
+	GlobalCoord origin_y = state.position_y;
+	GlobalCoord origin_z = state.position_z;
+	GlobalCoord origin_t = global_time_current;
 	
-	SimluationResultFreeItem head_result;
-	head_result.time		= global_time_current;
-	head_result.state	= state;
-	summary.items.push_back(head_result);
-
-
+	double velocity_x;
+	double velocity_y;
+	double velocity_z;
+	get_free_velocity(particle, state, velocity_x, velocity_y, velocity_z);
 	
-	while(global_time_current < simulation.duration)
+	if (record == RECORD_FULL)
+	{
+		SimluationResultFreeItem head_result;
+		head_result.time		= global_time_current;
+		head_result.state	= state;
+		summary.items.push_back(head_result);
+	}
+	
+	
+	double time_resolution = simulation.time_resolution_free;
+	double steps;
+	double time_entry;
+	
+	get_free_motion_end(simulation, laboratory, state, origin_t, velocity_x, velocity_y, velocity_z, node_left, steps, time_entry, node_entered);
+	
+	auto move = [&](double local_t)
 	{
-		double local_time_limit		= local_t + simulation.time_resolution_free;
-		double local_time_step		= simulation.time_resolution_free / 100;
-		
-		while (local_t < local_time_limit)
-		{
-			gsl_odeiv_evolve_apply(evolve, control, steps, &system, &local_t, local_time_limit, &local_time_step, y);
-		}
-		
 		// Update the state
-		state.position_x = origin_x + y[0];
-		state.position_y = origin_y + y[1];
-		state.position_z = origin_z + y[2];
-		state.momentum_x = y[3];
-		state.momentum_y = y[4];
-		state.momentum_z = y[5];
+		state.position_x = origin_x + velocity_x * local_t;
+		state.position_y = origin_y + velocity_y * local_t;
+		state.position_z = origin_z + velocity_z * local_t;
 		
 		global_time_current = origin_t + local_t;
 		
 		if (on_free_time_progress != NULL) on_free_time_progress(simulation, particle, state, laboratory, global_time_current);
 		
-		SimluationResultFreeItem result;
-		result.time		= global_time_current;
-		result.state	= state;
-		summary.items.push_back(result);
-		
-		// Checking if we are in a range of a laser.
-		if (get_near_node_id(state, laboratory, simulation.laser_influence_radius) >= 0)
-			break;
+		if (record == RECORD_FULL)
+		{
+			SimluationResultFreeItem result;
+			result.time		= global_time_current;
+			result.state	= state;
+			summary.items.push_back(result);
+		}
+	};
+	
+	// The last item is exactly on the influence sphere
+	bool entry = node_entered >= 0 && time_entry > 0;
+	
+	// If the samples aren't reported or recorded only the last one is needed (the positions are calculated from the
+	// origin, so it's the same)
+	if (on_free_time_progress == NULL && record != RECORD_FULL)
+	{
+		if (entry)
+			move(time_entry);
+		else if (steps >= 1)
+			move(floor(steps) * time_resolution);
+	}
+	else
+	{
+		for (double step = 1; step <= steps; step++)
+			move(step * time_resolution);
 		
+		if (entry)
+			move(time_entry);
 	}
-
-	gsl_odeiv_evolve_free(evolve);
-	gsl_odeiv_control_free(control);
-	gsl_odeiv_step_free(steps);
 	
+	// The variation of the entry time is needed also when the particle is already on the sphere (time_entry = 0)
+	if (tangent != NULL)
+		tangent_free(*tangent, laboratory, particle, state, global_coord_delta(global_time_current, origin_t), node_entered);
 	
-	summary.time_exit = global_time_current;
+	summary.time_exit = (double) global_time_current;
 
 }
 
@@ -429,11 +689,31 @@ void simulate_free(Simulation& simulation, Laboratory& laboratory, Particle& par
 
 
 	
-void simulate (
+void init_simulation_checkpoint(SimulationCheckpoint& checkpoint, ParticleStateGlobal& particle_state_global)
+{
+	checkpoint.current_range		= UNKN;
+	checkpoint.current_interaction	= 0;
+	checkpoint.current_node			= -1;
+	
+	checkpoint.time_current_global	= 0;
+	checkpoint.time_current_local	= 0;
+	checkpoint.time_global_offset	= 0;
+	
+	checkpoint.particle_state_global = particle_state_global;
+	
+	checkpoint.node_entered			= -1;
+	checkpoint.node_left			= -1;
+	
+	checkpoint.integrator_step		= 0;	// Estimated by the first step
+	
+	checkpoint.tangent				= NULL;
+}
+
+bool simulate (
 	Simulation& simulation,
 	Pulse& laser,
 	Particle& particle,
-	ParticleStateGlobal& particle_state_global,
+	SimulationCheckpoint& checkpoint,
 	Laboratory& laboratory,
 	
 	FunctionNodeEnter&        on_node_enter,
@@ -447,24 +727,45 @@ void simulate (
 	vector<SimluationResultFreeSummary>& summaries_free,
 	vector<SimluationResultNodeSummary>& summaries_node,
 	
-	FunctionFieldType function_field)
+	FunctionFieldType function_field,
+	bool stop_on_node_enter,
+	RecordPolicy record)
 {
 	
-	RangeMode 	  current_range = UNKN;
-	unsigned int  current_interaction = 0;
-	int 		  current_node = -1;
+	RangeMode& 	  current_range 		= checkpoint.current_range;
+	unsigned int& current_interaction	= checkpoint.current_interaction;
+	int& 		  current_node 			= checkpoint.current_node;
+	
+	GlobalCoord&  time_current_global	= checkpoint.time_current_global;
+	double&       time_current_local	= checkpoint.time_current_local;
+	GlobalCoord&  time_global_offset	= checkpoint.time_global_offset;
 	
-	long double time_current_global = 0;
-	double      time_current_local;
-	long double time_global_offset;
+	ParticleStateGlobal& particle_state_global	= checkpoint.particle_state_global;
+	ParticleStateLocal&  particle_state_local	= checkpoint.particle_state_local;
 	
-	ParticleStateLocal particle_state_local;
+	// Buffers and step size of DOP853, shared by all the node visits of this particle
+	Dop853Workspace workspace;
+	dop853_init(workspace, 6, simulation.error_abs, simulation.error_rel, simulation.dense_output);
+	workspace.step = checkpoint.integrator_step;
+	
+	// Node reached by the last free motion and node left by the last node motion
+	int& node_entered = checkpoint.node_entered;
+	int& node_left    = checkpoint.node_left;
 	
 	while (time_current_global < simulation.duration)
 	{
 		// Identifing if our particle is inside the laser action range or outside.
-		// If outside we use the free motion laws, if inside we calculate the integration between the laser and the particle	
-		int new_node = get_near_node_id(particle_state_global, laboratory, simulation.laser_influence_radius);
+		// If outside we use the free motion laws, if inside we calculate the integration between the laser and the particle.
+		// Both motions stop exactly on an influence sphere and tell where the particle goes, so the position is
+		// checked only at the beginning (checking it on the sphere surface would depend on the rounding).
+		int new_node;
+		
+		if (current_range == UNKN)
+			new_node = find_node_index_containing(laboratory, particle_state_global.position_x, particle_state_global.position_y, particle_state_global.position_z);
+		else if (current_range == FREE)
+			new_node = node_entered;
+		else
+			new_node = -1;
 		
 		if (current_range != FREE && new_node < 0 )
 		{
@@ -481,11 +782,19 @@ void simulate (
 			if (current_range != UNKN)
 				current_interaction++;
 			current_range = FREE;
+			node_left     = current_node;
 			current_node  = -1;
 			
 		}
 		else if (current_range != NODE && new_node != current_node)
 		{
+			// Nothing before this point depends on the laser or on the charge of the particle
+			if (stop_on_node_enter)
+			{
+				checkpoint.integrator_step = workspace.step;
+				return true;
+			}
+			
 			if (current_range == FREE && on_free_exit != NULL) on_free_exit(simulation, particle, particle_state_global, laboratory, time_current_global);
 			
 			current_range = NODE;
@@ -501,50 +810,19 @@ void simulate (
 			}
 			else
 			{
-				// To know the correct time local we have to launch a simulation without laser and detect correct value.
-				SimluationResultNodeSummary summary_fake;
-				double time_current_local_fake = 0.d;
-				ParticleStateLocal particle_state_local_fake;
-				state_global_to_local(particle_state_local_fake, particle_state_global, node);
-				
-				simulate_node_fake(simulation, node, particle, particle_state_local_fake, time_current_local_fake, 0, summary_fake);
-				
-				// Now detecting the right time_current_local
+				ParticleStateLocal particle_state_local_free;
+				state_global_to_local(particle_state_local_free, particle_state_global, node);
 				
-				if (laser.timing_mode == NEAREST)
-				{
-					SimluationResultNodeItem nearest_item;
-					nearest_item.local_time = 0.d;
-					double nearest_distance = INFINITY;
-					
-					for (SimluationResultNodeItem item: summary_fake.items)
-					{
-						double current_distance = vector_module(item.local_state.position_x, item.local_state.position_y, item.local_state.position_z);
-						if (current_distance < nearest_distance)
-						{
-							nearest_item = item;
-							nearest_distance = current_distance;
-						}
-					}
-					
-					if (nearest_distance == INFINITY)
-					{
-						printf("ERROR - Unable to detect the nearest point for node %d\n", node.id);
-						exit(-6);	
-					}
-					
-					time_current_local = -(nearest_item.local_time-summary_fake.items.front().local_time) + laser.timing_offset;
-				}
-				else if (laser.timing_mode == EXIT)
-				{
-					time_current_local = -(summary_fake.items.back().local_time-summary_fake.items.front().local_time) + laser.timing_offset;
-				}
+				time_current_local = get_timing_local_time(simulation, laser, particle, particle_state_local_free, node);
 			}
 			
 			time_global_offset = time_current_global - time_current_local;
 			
 			state_global_to_local(particle_state_local, particle_state_global, node);
 			
+			if (checkpoint.tangent != NULL)
+				tangent_node_enter(*checkpoint.tangent, simulation, laser, particle, particle_state_local, node, time_current_local);
+			
 			if (on_node_enter != NULL) on_node_enter(simulation, laser, particle,  particle_state_local, current_interaction, node, time_current_local);
 		}
 		
@@ -556,20 +834,32 @@ void simulate (
 			double before = time_current_local;
 			
 			SimluationResultNodeSummary summary;
-			summary.node = node;
-			summary.global_time_offset = time_global_offset;
-			simulate_node(simulation, laser, node, particle, particle_state_local, time_current_local, current_interaction, on_node_time_progress, summary, function_field);
-			summaries_node.push_back(summary);	
+			
+			if (record != RECORD_NONE)
+			{
+				summary.node = node;
+				summary.global_time_offset = (double) time_global_offset;
+			}
+			
+			simulate_node(simulation, laser, node, particle, particle_state_local, time_current_local, current_interaction, on_node_time_progress, summary, function_field, workspace, record, checkpoint.tangent);
+			
+			if (record != RECORD_NONE)
+				summaries_node.push_back(summary);
 			state_local_to_global(particle_state_global, particle_state_local, node);
 			
+			if (checkpoint.tangent != NULL)
+				tangent_node_exit(*checkpoint.tangent, laser, particle, particle_state_local, node, time_current_local);
+			
 			
 			time_current_global += time_current_local - before;
 		}
 		else if (current_range == FREE)
 		{
 			SimluationResultFreeSummary summary;
-			simulate_free(simulation, laboratory, particle, particle_state_global, time_current_global, on_free_time_progress, summary);
-			summaries_free.push_back(summary);
+			simulate_free(simulation, laboratory, particle, particle_state_global, time_current_global, on_free_time_progress, summary, node_left, node_entered, record, checkpoint.tangent);
+			
+			if (record != RECORD_NONE)
+				summaries_free.push_back(summary);
 		}
 	}
 	
@@ -580,6 +870,12 @@ void simulate (
 		if (on_node_exit != NULL) on_node_exit (simulation, laser, particle, particle_state_local, current_interaction, laboratory.nodes[current_node], time_current_local);
 			state_local_to_global(particle_state_global, particle_state_local, laboratory.nodes[current_node]);
 	}
+	
+	if (checkpoint.tangent != NULL)
+		tangent_finish(*checkpoint.tangent, particle, particle_state_global);
+	
+	checkpoint.integrator_step = workspace.step;
+	return false;
 }
 
 
@@ -590,24 +886,61 @@ void simulate (
 	Particle& particle,
 	ParticleStateGlobal& particle_state_global,
 	Laboratory& laboratory,
+	
+	FunctionNodeEnter&        on_node_enter,
+	FunctionNodeTimeProgress& on_node_time_progress,
+	FunctionNodeExit&         on_node_exit,
+	
+	FunctionFreeEnter&        on_free_enter,
+	FunctionFreeTimeProgress& on_free_time_progress,
+	FunctionFreeExit&         on_free_exit,
+	
 	vector<SimluationResultFreeSummary>& summaries_free,
 	vector<SimluationResultNodeSummary>& summaries_node,
+	
 	FunctionFieldType function_field)
 {
+	SimulationCheckpoint checkpoint;
+	init_simulation_checkpoint(checkpoint, particle_state_global);
 	
-	FunctionNodeEnter        on_node_enter			= [&](Simulation& simulation, Pulse& laser, Particle& particle, ParticleStateLocal&  particle_state, unsigned int current_interaction, Node& node, double time_local) mutable {};
-	FunctionNodeTimeProgress on_node_time_progress	= [&](Simulation& simulation, Pulse& laser, Particle& particle, ParticleStateLocal&  particle_state, unsigned int current_interaction, Node& node, double time_local, Field& field) mutable {};
-	FunctionNodeExit         on_node_exit			= [&](Simulation& simulation, Pulse& laser, Particle& particle, ParticleStateLocal&  particle_state, unsigned int current_interaction, Node& node, double time_local) mutable {};
+	simulate(simulation, laser, particle, checkpoint, laboratory,
+			on_node_enter, on_node_time_progress, on_node_exit,
+			on_free_enter, on_free_time_progress, on_free_exit,
+			summaries_free, summaries_node,
+			function_field, false, RECORD_FULL);
+	
+	particle_state_global = checkpoint.particle_state_global;
+}
 
-	FunctionFreeEnter        on_free_enter			= [&](Simulation& simulation, Particle& particle, ParticleStateGlobal& particle_state, Laboratory& laboratory, long double time_global) mutable {};
-	FunctionFreeTimeProgress on_free_time_progress	= [&](Simulation& simulation, Particle& particle, ParticleStateGlobal& particle_state, Laboratory& laboratory, long double time_global) mutable {};
-	FunctionFreeExit         on_free_exit			= [&](Simulation& simulation, Particle& particle, ParticleStateGlobal& particle_state, Laboratory& laboratory, long double time_global) mutable {};
+
+
+bool simulate (
+	Simulation& simulation,
+	Pulse& laser,
+	Particle& particle,
+	SimulationCheckpoint& checkpoint,
+	Laboratory& laboratory,
+	vector<SimluationResultFreeSummary>& summaries_free,
+	vector<SimluationResultNodeSummary>& summaries_node,
+	FunctionFieldType function_field,
+	bool stop_on_node_enter,
+	RecordPolicy record)
+{
+	
+	// Without callbacks the samples are calculated only if they are recorded
+	FunctionNodeEnter        on_node_enter			= NULL;
+	FunctionNodeTimeProgress on_node_time_progress	= NULL;
+	FunctionNodeExit         on_node_exit			= NULL;
+
+	FunctionFreeEnter        on_free_enter			= NULL;
+	FunctionFreeTimeProgress on_free_time_progress	= NULL;
+	FunctionFreeExit         on_free_exit			= NULL;
 	
-	simulate (
+	return simulate (
 		simulation,
 		laser,
 		particle,
-		particle_state_global,
+		checkpoint,
 		laboratory,
 		on_node_enter,
 		on_node_time_progress,
@@ -617,7 +950,27 @@ void simulate (
 		on_free_exit,
 		summaries_free,
 		summaries_node,
-		function_field);
+		function_field,
+		stop_on_node_enter,
+		record);
+}
+
+void simulate (
+	Simulation& simulation,
+	Pulse& laser,
+	Particle& particle,
+	ParticleStateGlobal& particle_state_global,
+	Laboratory& laboratory,
+	vector<SimluationResultFreeSummary>& summaries_free,
+	vector<SimluationResultNodeSummary>& summaries_node,
+	FunctionFieldType function_field)
+{
+	SimulationCheckpoint checkpoint;
+	init_simulation_checkpoint(checkpoint, particle_state_global);
+	
+	simulate(simulation, laser, particle, checkpoint, laboratory, summaries_free, summaries_node, function_field, false, RECORD_FULL);
+	
+	particle_state_global = checkpoint.particle_state_global;
 }
 
 	
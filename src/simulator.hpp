@@ -1,4 +1,8 @@
 #include "type.hpp"
+#include "dop853.hpp"
+
+#ifndef CIRCLESIM_SIMULATOR
+#define CIRCLESIM_SIMULATOR
 
 void simulate (
 	Simulation& simulation,
@@ -20,6 +24,49 @@ void simulate (
 	
 	FunctionFieldType function_field);
 
+/**
+ * Simulation starting from (and updating) a checkpoint. With stop_on_node_enter it stops just before the next node
+ * entry, where the laser and the charge of the particle start to matter, and returns true: the checkpoint can be copied
+ * and every copy resumed (with stop_on_node_enter = false) with different laser parameters. The summaries contain only
+ * the part simulated by this call, according to the record policy: when only the final state is needed RECORD_NONE
+ * doesn't store anything and, without callbacks, skips the samples.
+ */
+bool simulate (
+	Simulation& simulation,
+	Pulse& laser,
+	Particle& particle,
+	SimulationCheckpoint& checkpoint,
+	Laboratory& laboratory,
+	
+	FunctionNodeEnter&        on_node_enter,
+	FunctionNodeTimeProgress& on_node_time_progress,
+	FunctionNodeExit&         on_node_exit,
+	
+	FunctionFreeEnter&        on_free_enter,
+	FunctionFreeTimeProgress& on_free_time_progress,
+	FunctionFreeExit&         on_free_exit,
+	
+	vector<SimluationResultFreeSummary>& summaries_free,
+	vector<SimluationResultNodeSummary>& summaries_node,
+	
+	FunctionFieldType function_field,
+	bool stop_on_node_enter,
+	RecordPolicy record);
+
+bool simulate (
+	Simulation& simulation,
+	Pulse& laser,
+	Particle& particle,
+	SimulationCheckpoint& checkpoint,
+	Laboratory& laboratory,
+	vector<SimluationResultFreeSummary>& summaries_free,
+	vector<SimluationResultNodeSummary>& summaries_node,
+	FunctionFieldType function_field,
+	bool stop_on_node_enter,
+	RecordPolicy record);
+
+void init_simulation_checkpoint(SimulationCheckpoint& checkpoint, ParticleStateGlobal& particle_state_global);
+
 void simulate (
 	Simulation& simulation,
 	Pulse& laser,
@@ -32,3 +79,73 @@ void simulate (
 	
 
 void calculate_fields(double pos_t, double pos_x, double pos_y, double pos_z, const Pulse& laser, Field& field, FunctionFieldType function_field);
+void calculate_fields_batch(unsigned int n, const double pos_t[], const double pos_x[], const double pos_y[], const double pos_z[], const Pulse& laser, FieldBatch& field, FunctionFieldBatchType function_field_batch);
+
+typedef struct gsl_odeiv_custom_params
+{
+	Pulse* 					laser;
+	Particle*				particle;
+	FunctionFieldType*      function_field;
+
+} gsl_odeiv_custom_params;
+
+int gsl_odeiv_func_laser(double t, const double y[], double f[], void *params);
+int gsl_odeiv_jac (double t, const double y[], double *dfdy, double dfdt[], void *params);
+
+bool   is_in_influence_radius(const double position[], double laser_influence_radius);
+void   interpolate_position(Particle& particle, double time_a, const double y_a[], double time_b, const double y_b[], double time, double position[]);
+double get_timing_local_time(Simulation& simulation, Pulse& laser, Particle& particle, ParticleStateLocal& state, Node& node);
+void   get_free_velocity(Particle& particle, ParticleStateGlobal& state, double& velocity_x, double& velocity_y, double& velocity_z);
+void   get_free_motion_end(Simulation& simulation, Laboratory& laboratory, ParticleStateGlobal& state, const GlobalCoord& global_time, double velocity_x, double velocity_y, double velocity_z, int node_left, double& steps, double& time_entry, int& node_entered);
+
+void simulate_node(
+	Simulation& simulation, 
+	Pulse& laser,
+	Node& node,
+	Particle& particle,
+	ParticleStateLocal& state,
+	double&  local_time_current,
+	unsigned int interaction,
+	FunctionNodeTimeProgress& on_node_time_progress,
+	SimluationResultNodeSummary& summary,
+	FunctionFieldType function_field,
+	Dop853Workspace& workspace,
+	RecordPolicy record,
+	SimulationTangent* tangent = NULL);
+
+void record_node_sample(
+	Simulation& simulation,
+	Pulse& laser,
+	Node& node,
+	Particle& particle,
+	ParticleStateLocal& state,
+	double local_time,
+	unsigned int interaction,
+	FunctionNodeTimeProgress& on_node_time_progress,
+	SimluationResultNodeSummary& summary,
+	FunctionFieldType function_field,
+	RecordPolicy record);
+
+/**
+ * Locate the time when the particle leaves the influence sphere inside [time_inside, time_outside] by bisection.
+ * The returned time is always on the outside side of the crossing.
+ */
+template <typename F> double find_sphere_crossing(double time_inside, double time_outside, F is_outside)
+{
+	for (unsigned int i = 0; i < 100; i++)
+	{
+		double time_middle = 0.5 * (time_inside + time_outside);
+		
+		if (time_middle <= time_inside || time_middle >= time_outside)
+			break;
+		
+		if (is_outside(time_middle))
+			time_outside = time_middle;
+		else
+			time_inside = time_middle;
+	}
+	
+	return time_outside;
+}
+
+#endif
@@ -0,0 +1,293 @@
+#include <math.h>
+#include <omp.h>
+#include <random>
+#include "space_charge.hpp"
+#include "type.hpp"
+
+/**
+ * Build the cell containing the particles tree.index[first, first + count) inside the cube centered in (cx, cy, cz).
+ * Returns the position of the cell in tree.cells.
+ */
+int build_space_charge_cell(SpaceChargeTree& tree, vector<unsigned int>& buffer, const double x[], const double y[], const double z[], double charge, unsigned int first, unsigned int count, double cx, double cy, double cz, double size, unsigned int depth)
+{
+	SpaceChargeCell cell;
+	cell.size   = size;
+	cell.charge = charge * count;
+	cell.first  = first;
+	cell.count  = count;
+
+	cell.center_x = 0;
+	cell.center_y = 0;
+	cell.center_z = 0;
+
+	for (unsigned int k = first; k < first + count; k++)
+	{
+		cell.center_x += x[tree.index[k]];
+		cell.center_y += y[tree.index[k]];
+		cell.center_z += z[tree.index[k]];
+	}
+
+	cell.center_x /= count;
+	cell.center_y /= count;
+	cell.center_z /= count;
+
+	for (unsigned int o = 0; o < 8; o++)
+		cell.child[o] = -1;
+
+	int position = tree.cells.size();
+	tree.cells.push_back(cell);
+
+	if (count <= SPACE_CHARGE_LEAF_SIZE || depth >= SPACE_CHARGE_MAX_DEPTH)
+		return position;
+
+	// Sorting the particles by octant (counting sort)
+	unsigned int octant_count[8] = {0};
+	unsigned int octant_first[8];
+
+	auto get_octant = [&](unsigned int i)
+	{
+		return (x[i] >= cx ? 1 : 0) + (y[i] >= cy ? 2 : 0) + (z[i] >= cz ? 4 : 0);
+	};
+
+	for (unsigned int k = first; k < first + count; k++)
+		octant_count[get_octant(tree.index[k])]++;
+
+	octant_first[0] = first;
+	for (unsigned int o = 1; o < 8; o++)
+		octant_first[o] = octant_first[o - 1] + octant_count[o - 1];
+
+	unsigned int octant_next[8];
+	for (unsigned int o = 0; o < 8; o++)
+		octant_next[o] = octant_first[o];
+
+	for (unsigned int k = first; k < first + count; k++)
+		buffer[octant_next[get_octant(tree.index[k])]++] = tree.index[k];
+
+	for (unsigned int k = first; k < first + count; k++)
+		tree.index[k] = buffer[k];
+
+	for (unsigned int o = 0; o < 8; o++)
+	{
+		if (octant_count[o] == 0)
+			continue;
+
+		double quarter = size / 4;
+
+		int child = build_space_charge_cell(tree, buffer, x, y, z, charge, octant_first[o], octant_count[o],
+			cx + ((o & 1) ? quarter : -quarter),
+			cy + ((o & 2) ? quarter : -quarter),
+			cz + ((o & 4) ? quarter : -quarter),
+			size / 2, depth + 1);
+
+		// tree.cells can be reallocated by the recursion
+		tree.cells[position].child[o] = child;
+	}
+
+	return position;
+}
+
+void build_space_charge_tree(SpaceChargeTree& tree, unsigned int n, const double x[], const double y[], const double z[], double charge)
+{
+	tree.cells.clear();
+	tree.index.resize(n);
+
+	if (n == 0)
+		return;
+
+	double min_x = x[0], max_x = x[0];
+	double min_y = y[0], max_y = y[0];
+	double min_z = z[0], max_z = z[0];
+
+	for (unsigned int i = 0; i < n; i++)
+	{
+		tree.index[i] = i;
+
+		min_x = min(min_x, x[i]);	max_x = max(max_x, x[i]);
+		min_y = min(min_y, y[i]);	max_y = max(max_y, y[i]);
+		min_z = min(min_z, z[i]);	max_z = max(max_z, z[i]);
+	}
+
+	// A bit larger than the bounding box, so the particles on the border are inside
+	double size = max(max(max_x - min_x, max_y - min_y), max_z - min_z) * (1 + 1e-9) + 1e-300;
+
+	tree.buffer.resize(n);
+	tree.cells.reserve(2 * n / SPACE_CHARGE_LEAF_SIZE + 1);
+
+	build_space_charge_cell(tree, tree.buffer, x, y, z, charge, 0, n, (min_x + max_x) / 2, (min_y + max_y) / 2, (min_z + max_z) / 2, size, 0);
+
+	tree.rank.resize(n);
+
+	for (unsigned int k = 0; k < n; k++)
+		tree.rank[tree.index[k]] = k;
+}
+
+inline void add_coulomb_field(double source, double dx, double dy, double dz, double softening2, double& e_x, double& e_y, double& e_z)
+{
+	double r2  = dx * dx + dy * dy + dz * dz + softening2;
+	double fac = source / (r2 * sqrt(r2));
+
+	e_x += fac * dx;
+	e_y += fac * dy;
+	e_z += fac * dz;
+}
+
+void calculate_space_charge(SpaceChargeTree& tree, unsigned int n, unsigned int targets, const double x[], const double y[], const double z[], double charge, double opening_angle, double softening, FieldBatch& field)
+{
+	build_space_charge_tree(tree, n, x, y, z, charge);
+
+	if (tree.cells.empty())
+		return;
+
+	double opening_angle2 = opening_angle * opening_angle;
+	double softening2     = softening * softening;
+
+	#pragma omp parallel for schedule(dynamic, 64)
+	for (unsigned int i = 0; i < targets; i++)
+	{
+		double e_x = 0;
+		double e_y = 0;
+		double e_z = 0;
+
+		unsigned int stack[8 * SPACE_CHARGE_MAX_DEPTH + 8];
+		unsigned int stack_size = 0;
+		stack[stack_size++] = 0;
+
+		while (stack_size > 0)
+		{
+			const SpaceChargeCell& cell = tree.cells[stack[--stack_size]];
+
+			double dx = x[i] - cell.center_x;
+			double dy = y[i] - cell.center_y;
+			double dz = z[i] - cell.center_z;
+			double d2 = dx * dx + dy * dy + dz * dz;
+
+			bool leaf = true;
+			for (unsigned int o = 0; o < 8; o++)
+				leaf &= cell.child[o] < 0;
+
+			if (leaf)
+			{
+				for (unsigned int k = cell.first; k < cell.first + cell.count; k++)
+				{
+					unsigned int j = tree.index[k];
+
+					if (j != i)
+						add_coulomb_field(-charge, x[i] - x[j], y[i] - y[j], z[i] - z[j], softening2, e_x, e_y, e_z);
+				}
+			}
+			else if (cell.size * cell.size < opening_angle2 * d2 && (tree.rank[i] < cell.first || tree.rank[i] >= cell.first + cell.count))
+			{
+				add_coulomb_field(-cell.charge, dx, dy, dz, softening2, e_x, e_y, e_z);
+			}
+			else
+			{
+				for (unsigned int o = 0; o < 8; o++)
+					if (cell.child[o] >= 0)
+						stack[stack_size++] = cell.child[o];
+			}
+		}
+
+		field.e_x[i] += e_x;
+		field.e_y[i] += e_y;
+		field.e_z[i] += e_z;
+	}
+}
+
+void calculate_space_charge_direct(unsigned int n, const double x[], const double y[], const double z[], double charge, double softening, FieldBatch& field)
+{
+	double softening2 = softening * softening;
+
+	#pragma omp parallel for schedule(static)
+	for (unsigned int i = 0; i < n; i++)
+	{
+		double e_x = 0;
+		double e_y = 0;
+		double e_z = 0;
+
+		for (unsigned int j = 0; j < n; j++)
+			if (j != i)
+				add_coulomb_field(-charge, x[i] - x[j], y[i] - y[j], z[i] - z[j], softening2, e_x, e_y, e_z);
+
+		field.e_x[i] += e_x;
+		field.e_y[i] += e_y;
+		field.e_z[i] += e_z;
+	}
+}
+
+/**
+ * Compare the tree with the direct sum on a gaussian bunch of n particles: time and error (relative to the RMS field)
+ * for some opening angles.
+ */
+void benchmark_space_charge(unsigned int n)
+{
+	mt19937 generator(1);
+	normal_distribution<double> normal(0, 1);
+
+	vector<double> x(n), y(n), z(n);
+
+	// An elongated bunch, 10 × 10 × 100 a.u.
+	for (unsigned int i = 0; i < n; i++)
+	{
+		x[i] = 10  * normal(generator);
+		y[i] = 10  * normal(generator);
+		z[i] = 100 * normal(generator);
+	}
+
+	auto allocate = [&](vector<double>& buffer, FieldBatch& field)
+	{
+		buffer.assign(6 * n, 0);
+		field.e_x = &buffer[0 * n];
+		field.e_y = &buffer[1 * n];
+		field.e_z = &buffer[2 * n];
+		field.b_x = &buffer[3 * n];
+		field.b_y = &buffer[4 * n];
+		field.b_z = &buffer[5 * n];
+	};
+
+	vector<double> buffer_direct;
+	FieldBatch     field_direct;
+	allocate(buffer_direct, field_direct);
+
+	double time_start  = omp_get_wtime();
+	calculate_space_charge_direct(n, x.data(), y.data(), z.data(), 1, 0, field_direct);
+	double time_direct = omp_get_wtime() - time_start;
+
+	double rms = 0;
+	for (unsigned int i = 0; i < n; i++)
+		rms += pow2(field_direct.e_x[i]) + pow2(field_direct.e_y[i]) + pow2(field_direct.e_z[i]);
+	rms = sqrt(rms / n);
+
+	printf("Space charge of %u particles with %d threads\n\n", n, omp_get_max_threads());
+	printf("  %-14s %12s %12s %14s %14s\n", "method", "time (s)", "speedup", "rms error", "max error");
+	printf("  %-14s %12.4f %12.2f %14s %14s\n", "direct", time_direct, 1.0, "-", "-");
+
+	double opening_angles[] = {0.2, 0.3, 0.5, 0.7, 1.0};
+
+	for (double opening_angle: opening_angles)
+	{
+		vector<double> buffer_tree;
+		FieldBatch     field_tree;
+		allocate(buffer_tree, field_tree);
+
+		SpaceChargeTree tree;
+
+		time_start = omp_get_wtime();
+		calculate_space_charge(tree, n, n, x.data(), y.data(), z.data(), 1, opening_angle, 0, field_tree);
+		double time_tree = omp_get_wtime() - time_start;
+
+		double error_rms = 0;
+		double error_max = 0;
+
+		for (unsigned int i = 0; i < n; i++)
+		{
+			double error = sqrt(pow2(field_tree.e_x[i] - field_direct.e_x[i]) + pow2(field_tree.e_y[i] - field_direct.e_y[i]) + pow2(field_tree.e_z[i] - field_direct.e_z[i]));
+
+			error_rms += error * error;
+			error_max  = max(error_max, error);
+		}
+
+		error_rms = sqrt(error_rms / n);
+
+		printf("  θ = %-10.2f %12.4f %12.2f %14.3e %14.3e\n", opening_angle, time_tree, time_direct / time_tree, error_rms / rms, error_max / rms);
+	}
+}
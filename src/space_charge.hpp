@@ -0,0 +1,55 @@
+#include "type.hpp"
+
+#ifndef CIRCLESIM_SPACE_CHARGE
+#define CIRCLESIM_SPACE_CHARGE
+
+/**
+ * Coulomb field of a bunch of particles with the same charge (space charge), added to the laser field of the particles
+ * pushed together by the ensemble simulation.
+ *
+ * The field at every particle is the electrostatic field of all the others (A.U., where the Coulomb constant is 1):
+ *
+ *   E(rᵢ) = Σⱼ Q·(rᵢ - rⱼ) / (|rᵢ - rⱼ|² + ε²)^(3/2)        Q = -charge (like in the equations of motion)
+ *
+ * The direct sum costs O(N²), so it is approximated with a Barnes-Hut octree: a cell of side s seen from a distance d
+ * is replaced by its total charge in its charge center when s/d < θ (the opening angle). A cell containing the particle
+ * is always opened: for θ > 1/√3 the charge center can be far enough to pass the test, and the particle would push
+ * itself. θ = 0 gives the direct sum, θ ≈ 0.5 errors below 1% with O(N·log N) cost. The tree is rebuilt at every call
+ * and the evaluation is parallelized over the particles. The magnetic field of the bunch is neglected.
+ */
+
+#define SPACE_CHARGE_LEAF_SIZE	8	// Max particles in a leaf cell
+#define SPACE_CHARGE_MAX_DEPTH	32	// Coincident particles stay in the same leaf
+
+typedef struct SpaceChargeCell
+{
+	double			center_x;		// Charge center
+	double			center_y;
+	double			center_z;
+	double			size;			// Side of the cube
+	double			charge;			// Total charge of the particles inside
+	unsigned int	first;			// Particles inside (in SpaceChargeTree.index)
+	unsigned int	count;
+	int				child[8];		// -1 if missing (all -1 for a leaf)
+} SpaceChargeCell;
+
+typedef struct SpaceChargeTree
+{
+	vector<SpaceChargeCell>	cells;	// The root is the first one
+	vector<unsigned int>	index;	// Particles sorted by cell
+	vector<unsigned int>	rank;	// Position of every particle in index
+	vector<unsigned int>	buffer;
+} SpaceChargeTree;
+
+void build_space_charge_tree(SpaceChargeTree& tree, unsigned int n, const double x[], const double y[], const double z[], double charge);
+
+/**
+ * Field of the n particles (the sources) at the first 'targets' of them, added to field. The tree is rebuilt in place,
+ * so a tree kept between the calls doesn't allocate.
+ */
+void calculate_space_charge(SpaceChargeTree& tree, unsigned int n, unsigned int targets, const double x[], const double y[], const double z[], double charge, double opening_angle, double softening, FieldBatch& field);
+void calculate_space_charge_direct(unsigned int n, const double x[], const double y[], const double z[], double charge, double softening, FieldBatch& field);
+
+void benchmark_space_charge(unsigned int n);
+
+#endif
@@ -0,0 +1,248 @@
+#include <math.h>
+#include <algorithm>
+#include "transfer_map_cache.hpp"
+#include "type.hpp"
+#include "util.hpp"
+
+void init_transfer_map_cache(TransferMapCache& cache, Simulation& simulation)
+{
+	for (unsigned int k = 0; k < 3; k++)
+	{
+		cache.resolution[k]     = simulation.transfer_map_cache_position_resolution;
+		cache.resolution[k + 3] = simulation.transfer_map_cache_momentum_resolution;
+	}
+
+	cache.resolution[6]  = simulation.transfer_map_cache_time_resolution;
+	cache.error_position = simulation.transfer_map_cache_error_position;
+	cache.error_momentum = simulation.transfer_map_cache_error_momentum;
+
+	cache.cells.clear();
+	cache.lookups = 0;
+	cache.hits    = 0;
+	cache.clears  = 0;
+
+	pthread_rwlock_init(&cache.lock, NULL);
+}
+
+void get_transfer_map_entry(ParticleStateLocal& state, double local_time, double entry[])
+{
+	entry[0] = state.position_x;
+	entry[1] = state.position_y;
+	entry[2] = state.position_z;
+	entry[3] = state.momentum_x;
+	entry[4] = state.momentum_y;
+	entry[5] = state.momentum_z;
+	entry[6] = local_time;
+}
+
+vector<long long> get_transfer_map_key(TransferMapCache& cache, const double entry[])
+{
+	vector<long long> key(7);
+
+	for (unsigned int k = 0; k < 7; k++)
+		key[k] = (long long) floor(entry[k] / cache.resolution[k]);
+
+	return key;
+}
+
+/**
+ * Distance between two entry states, measured in cells
+ */
+double get_transfer_map_distance(TransferMapCache& cache, const double a[], const double b[])
+{
+	double d2 = 0;
+
+	for (unsigned int k = 0; k < 7; k++)
+		d2 += pow2((a[k] - b[k]) / cache.resolution[k]);
+
+	return sqrt(d2);
+}
+
+/**
+ * Parameter of the projection of point on the line through the entries of a and b (0 on a, 1 on b), in cells
+ */
+double get_transfer_map_projection(TransferMapCache& cache, const TransferMapSample& a, const TransferMapSample& b, const double point[])
+{
+	double dot    = 0;
+	double length = 0;
+
+	for (unsigned int k = 0; k < 7; k++)
+	{
+		double ab = (b.entry[k] - a.entry[k]) / cache.resolution[k];
+
+		dot    += ab * (point[k] - a.entry[k]) / cache.resolution[k];
+		length += ab * ab;
+	}
+
+	return dot / length;
+}
+
+bool lookup_transfer_map_cache_samples(TransferMapCache& cache, vector<const TransferMapSample*>& samples, const double entry[], double exit[])
+{
+	unsigned int n = samples.size();
+
+	vector<pair<double, const TransferMapSample*>> nearest(n);
+
+	for (unsigned int s = 0; s < n; s++)
+	{
+		double distance = get_transfer_map_distance(cache, entry, samples[s]->entry);
+
+		if (distance == 0)
+		{
+			for (unsigned int k = 0; k < 7; k++)
+				exit[k] = samples[s]->exit[k];
+
+			return true;
+		}
+
+		nearest[s] = make_pair(distance, samples[s]);
+	}
+
+	// The interpolation needs a third sample to check it
+	if (n < 3)
+		return false;
+
+	unsigned int m = min(n, (unsigned int) TRANSFER_MAP_CACHE_NEIGHBOURS);
+
+	partial_sort(nearest.begin(), nearest.begin() + m, nearest.end(),
+		[](const pair<double, const TransferMapSample*>& x, const pair<double, const TransferMapSample*>& y) { return x.first < y.first; });
+
+	const TransferMapSample& a = *nearest[0].second;
+	const TransferMapSample& b = *nearest[1].second;
+
+	if (get_transfer_map_distance(cache, a.entry, b.entry) == 0)
+		return false;
+
+	// The exit is linear along the segment between the two nearest samples: every other near sample is predicted by the
+	// same line and must match its exit within the tolerances (it measures the curvature along the segment and the
+	// variation across it)
+	for (unsigned int s = 2; s < m; s++)
+	{
+		const TransferMapSample& c = *nearest[s].second;
+
+		double lambda = get_transfer_map_projection(cache, a, b, c.entry);
+		double miss[6];
+
+		for (unsigned int k = 0; k < 6; k++)
+			miss[k] = a.exit[k] + lambda * (b.exit[k] - a.exit[k]) - c.exit[k];
+
+		if (vector_module(miss[0], miss[1], miss[2]) > cache.error_position || vector_module(miss[3], miss[4], miss[5]) > cache.error_momentum)
+			return false;
+	}
+
+	// Largest variation of the exit position and momentum per cell between the near samples
+	double lipschitz_position = 0;
+	double lipschitz_momentum = 0;
+
+	for (unsigned int s = 0; s < m; s++)
+	{
+		for (unsigned int r = s + 1; r < m; r++)
+		{
+			const TransferMapSample& sample_s = *nearest[s].second;
+			const TransferMapSample& sample_r = *nearest[r].second;
+
+			double distance = get_transfer_map_distance(cache, sample_s.entry, sample_r.entry);
+
+			if (distance == 0)
+				continue;
+
+			const double* exit_s = sample_s.exit;
+			const double* exit_r = sample_r.exit;
+
+			lipschitz_position = max(lipschitz_position, vector_module(exit_s[0] - exit_r[0], exit_s[1] - exit_r[1], exit_s[2] - exit_r[2]) / distance);
+			lipschitz_momentum = max(lipschitz_momentum, vector_module(exit_s[3] - exit_r[3], exit_s[4] - exit_r[4], exit_s[5] - exit_r[5]) / distance);
+		}
+	}
+
+	// Distance of the entry from the segment (in cells), out of the checked line
+	double lambda = min(max(get_transfer_map_projection(cache, a, b, entry), 0.d), 1.d);
+
+	double projection[7];
+	for (unsigned int k = 0; k < 7; k++)
+		projection[k] = a.entry[k] + lambda * (b.entry[k] - a.entry[k]);
+
+	double distance = get_transfer_map_distance(cache, entry, projection);
+
+	if (lipschitz_position * distance > cache.error_position || lipschitz_momentum * distance > cache.error_momentum)
+		return false;
+
+	for (unsigned int k = 0; k < 7; k++)
+		exit[k] = a.exit[k] + lambda * (b.exit[k] - a.exit[k]);
+
+	return true;
+}
+
+bool lookup_transfer_map_cache(TransferMapCache& cache, const double entry[], double exit[])
+{
+	vector<long long> key = get_transfer_map_key(cache, entry);
+	bool hit = false;
+
+	// The cell of the entry and the adjacent ones on the side of the entry along every axis: they contain every sample
+	// nearer than half a cell on all the axes
+	int side[7];
+
+	for (unsigned int k = 0; k < 7; k++)
+		side[k] = entry[k] / cache.resolution[k] - key[k] < 0.5 ? -1 : 1;
+
+	vector<const TransferMapSample*> samples;
+	vector<long long> neighbour(7);
+
+	pthread_rwlock_rdlock(&cache.lock);
+
+	for (unsigned int mask = 0; mask < (1u << 7); mask++)
+	{
+		for (unsigned int k = 0; k < 7; k++)
+			neighbour[k] = key[k] + (((mask >> k) & 1) ? side[k] : 0);
+
+		auto cell = cache.cells.find(neighbour);
+
+		if (cell != cache.cells.end())
+			for (const TransferMapSample& sample: cell->second)
+				samples.push_back(&sample);
+	}
+
+	hit = lookup_transfer_map_cache_samples(cache, samples, entry, exit);
+
+	pthread_rwlock_unlock(&cache.lock);
+
+	#pragma omp atomic
+	cache.lookups++;
+
+	if (hit)
+	{
+		#pragma omp atomic
+		cache.hits++;
+	}
+
+	return hit;
+}
+
+void insert_transfer_map_cache(TransferMapCache& cache, const double entry[], const double exit[])
+{
+	vector<long long> key = get_transfer_map_key(cache, entry);
+
+	TransferMapSample sample;
+
+	for (unsigned int k = 0; k < 7; k++)
+	{
+		sample.entry[k] = entry[k];
+		sample.exit[k]  = exit[k];
+	}
+
+	pthread_rwlock_wrlock(&cache.lock);
+
+	if (cache.cells.size() >= TRANSFER_MAP_CACHE_MAX_CELLS && cache.cells.find(key) == cache.cells.end())
+	{
+		cache.cells.clear();
+		cache.clears++;
+	}
+
+	vector<TransferMapSample>& samples = cache.cells[key];
+
+	if (samples.size() >= TRANSFER_MAP_CACHE_CELL_SIZE)
+		samples.erase(samples.begin());
+
+	samples.push_back(sample);
+
+	pthread_rwlock_unlock(&cache.lock);
+}
@@ -0,0 +1,51 @@
+#include "type.hpp"
+
+#ifndef CIRCLESIM_TRANSFER_MAP_CACHE
+#define CIRCLESIM_TRANSFER_MAP_CACHE
+
+/**
+ * Memoization of the node motions (transfer maps).
+ *
+ * Every node uses the same pulse in its local frame, so the motion inside the influence sphere depends only on the local
+ * state and the local laser time at the entry. The entry states are quantized on a 7D grid (position, momentum, time)
+ * and every cell keeps the last TRANSFER_MAP_CACHE_CELL_SIZE motions integrated from an entry inside it.
+ *
+ * A lookup of an entry state already integrated returns the stored exit. Otherwise the samples are taken from the cell
+ * of the entry and from the adjacent cells on its side, and the exit is interpolated along the segment between the two
+ * nearest entries. The interpolation is accepted only if the estimated error is within the tolerances:
+ *
+ *   - the other near samples (at least one) are predicted by the same line and must match their exit: it measures the
+ *     curvature of the map along the segment, which the two ends alone can't see
+ *   - the distance of the entry from the segment (in cells) multiplied by the largest variation of the exit per cell
+ *     seen between the near samples
+ *
+ * On a miss the node motion is integrated and inserted.
+ *
+ * The cache is shared by the threads of the ensemble, behind a reader/writer lock (the lookups run concurrently, an
+ * insertion waits for them): the interpolated exits depend on the motions already inserted, so with many threads the
+ * results can change with the scheduling (within the tolerances). The response analyses don't use it.
+ *
+ * The memory is bounded by TRANSFER_MAP_CACHE_MAX_CELLS: an insertion into a new cell beyond it empties the cache,
+ * which then fills again with the motions of the current entries.
+ *
+ * The cached motions don't have the intermediate samples: the node summary contains only the exit item.
+ */
+
+#define TRANSFER_MAP_CACHE_CELL_SIZE	8	// Max motions kept in a cell (the oldest one is replaced)
+#define TRANSFER_MAP_CACHE_NEIGHBOURS	8	// Nearest samples used by the interpolation and its error estimate
+#define TRANSFER_MAP_CACHE_MAX_CELLS	131072	// Max cells kept (about 1 KB each when full)
+
+void init_transfer_map_cache(TransferMapCache& cache, Simulation& simulation);
+
+/**
+ * Entry state of a node motion: local position, momentum and laser time
+ */
+void get_transfer_map_entry(ParticleStateLocal& state, double local_time, double entry[]);
+
+/**
+ * Exit state (local position, momentum and duration) of the motion starting from entry. Returns false on a miss.
+ */
+bool lookup_transfer_map_cache(TransferMapCache& cache, const double entry[], double exit[]);
+void insert_transfer_map_cache(TransferMapCache& cache, const double entry[], const double exit[]);
+
+#endif
@@ -3,12 +3,20 @@
 #include <boost/format.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/regex.hpp>
-#include <armadillo>
+#include <boost/unordered_map.hpp>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <pthread.h>
+
+#include "global_coord.hpp"
 
 #ifndef CIRCLESIM_TYPE
 #define CIRCLESIM_TYPE
 
-using namespace arma;
 using namespace std;
 
 namespace fs = boost::filesystem;
@@ -18,9 +26,37 @@ namespace bo = boost;
 typedef enum {ORIGIN, PARTICLE}								Anchor;
 typedef enum {FREE, NODE, UNKN}								RangeMode;
 typedef enum {XY, XZ, YZ} 									Plane;
-typedef enum {LINEAR, RANDOM} 								ResponseChangeType;
+typedef enum {LINEAR, RANDOM, LATIN_HYPERCUBE, SOBOL, ADAPTIVE} ResponseChangeType;	// Design of the samples: full factorial grid, uniform random, Latin hypercube, scrambled Sobol, adaptive bisection
 typedef enum {PERCENTUAL, VALUE_RELATIVE, VALUE_ABSOLUTE} 	ResponseValueType;
 typedef enum {ENTER, NEAREST, EXIT} 						TimingMode;
+typedef enum {RK8PD, DOP853, BORIS, VAY, HIGUERA_CARY} 		IntegratorType;
+typedef enum {RECORD_NONE, RECORD_SUMMARIES, RECORD_FULL}	RecordPolicy;	// What simulate stores: nothing, the summaries without the samples, everything
+
+// Classes of the units in util/unit/conversions.csv and of the 'unit_type' annotations of the config file
+typedef enum
+{
+	UNIT_MASS,
+	UNIT_LENGTH,
+	UNIT_CHARGE,
+	UNIT_ENERGY,
+	UNIT_TIME,
+	UNIT_FREQUENCY,
+	UNIT_PULSATION,
+	UNIT_SPEED,
+	UNIT_FORCE,
+	UNIT_ELECTRIC_FIELD,
+	UNIT_ELECTRIC_POTENTIAL,
+	UNIT_MOMENTUM,
+	UNIT_MAGNETIC_FIELD,
+	UNIT_ANGLE,
+	UNIT_PERCENTUAL,
+	UNIT_PURE_FLOAT,
+	UNIT_PURE_INT,
+	UNIT_IGNORE,
+	UNIT_IGNORE_START,
+	UNIT_IGNORE_END,
+	UNIT_CLASS_COUNT
+} UnitClass;
 
 #define pow2(a) ((a) * (a)) 
 #define pow3(a) ((a) * (a) * (a)) 
@@ -60,15 +96,68 @@ typedef struct Parameters
 	
 	string			timing_mode;
 	double			timing_offset;
+	bool			timing_sampled;
 
 	double 			error_abs;
 	double 			error_rel;
+	string			integrator;
+	bool			dense_output;
+	unsigned int	pusher_substeps;
+	
+	bool			field_cache;
+	double			field_cache_space_resolution;
+	double			field_cache_time_resolution;
+	double			field_cache_time_start;
+	double			field_cache_time_end;
+	double			field_cache_error;
+	
+	bool			ensemble;
+	unsigned int	ensemble_count;
+	unsigned int	ensemble_seed;
+	string			ensemble_file;
+	double			ensemble_position_sigma_x;
+	double			ensemble_position_sigma_y;
+	double			ensemble_position_sigma_z;
+	double			ensemble_momentum_sigma_x;
+	double			ensemble_momentum_sigma_y;
+	double			ensemble_momentum_sigma_z;
+	
+	bool			space_charge;
+	double			space_charge_bunch_charge;
+	double			space_charge_opening_angle;
+	double			space_charge_softening;
+	
+	bool			transfer_map_cache;
+	double			transfer_map_cache_position_resolution;
+	double			transfer_map_cache_momentum_resolution;
+	double			transfer_map_cache_time_resolution;
+	double			transfer_map_cache_error_position;
+	double			transfer_map_cache_error_momentum;
+	
+	bool			closed_orbit;
+	unsigned int	closed_orbit_interactions;
+	unsigned int	closed_orbit_max_iterations;
+	double			closed_orbit_tolerance_position;
+	double			closed_orbit_tolerance_momentum;
+	double			closed_orbit_step_position;
+	double			closed_orbit_step_momentum;
+	unsigned int	closed_orbit_turns;
+	
+	bool			ponderomotive;
+	double			ponderomotive_wavelength;
+	double			ponderomotive_time_step;
+	unsigned int	ponderomotive_samples;
+	double			ponderomotive_max_a0;
+	double			ponderomotive_max_gradient;
+	bool			ponderomotive_validation;
 	
 	unsigned int 	labmap_max_size;
 	bool		 	labmap_full;
 
 	string func_commons;
 	string func_fields;
+	string func_envelope;
+	bool   func_fast_math;
 
 	double rest_mass;
 	double charge;
@@ -105,6 +194,10 @@ typedef struct Parameters
 	unsigned int 	nodes;
 	
 	bool response_analyses_enabled;
+	unsigned int response_analyses_seed;
+	unsigned int response_analyses_adaptive_steps;
+	double response_analyses_adaptive_tolerance;
+	bool response_analyses_sensitivity;
 
 } Parameters;
 
@@ -121,9 +214,62 @@ typedef struct Simulation
 	double 			error_abs;
 	double 			error_rel;
 	
+	IntegratorType	integrator;
+	bool			dense_output;	// Samples interpolated inside the integrator steps (DOP853 only)
+	unsigned int	pusher_substeps;// Steps of the fixed step pushers (Boris, Vay, Higuera-Cary) for every time_resolution_laser
+	
+	bool			field_cache;					// Tabulate the fields inside the influence radius at the startup
+	double			field_cache_space_resolution;
+	double			field_cache_time_resolution;
+	double			field_cache_time_start;
+	double			field_cache_time_end;
+	double			field_cache_error;				// Max interpolation error allowed, relative to the max field in the lattice
+	
+	bool			ensemble;						// Simulate also a beam of particles around the initial state (see ensemble.hpp)
+	unsigned int	ensemble_count;					// Particles sampled with a gaussian distribution (if ensemble_file is empty)
+	unsigned int	ensemble_seed;
+	string			ensemble_file;					// CSV file with the initial states of the particles (SI units)
+	double			ensemble_position_sigma_x;		// Standard deviations of the sampled distribution
+	double			ensemble_position_sigma_y;
+	double			ensemble_position_sigma_z;
+	double			ensemble_momentum_sigma_x;
+	double			ensemble_momentum_sigma_y;
+	double			ensemble_momentum_sigma_z;
+	
+	bool			space_charge;					// Coulomb field between the particles of the ensemble (see space_charge.hpp)
+	double			space_charge_bunch_charge;		// Total charge of the ensemble, divided between its particles
+	double			space_charge_opening_angle;		// θ of the Barnes-Hut tree
+	double			space_charge_softening;			// ε of the Coulomb field
+	
+	bool			transfer_map_cache;							// Reuse the node motions of near entry states (see transfer_map_cache.hpp)
+	double			transfer_map_cache_position_resolution;		// Size of the cells of the entry states
+	double			transfer_map_cache_momentum_resolution;
+	double			transfer_map_cache_time_resolution;
+	double			transfer_map_cache_error_position;			// Max estimated error of the reused exit states
+	double			transfer_map_cache_error_momentum;
+	
+	bool			closed_orbit;							// Find the closed orbit and the one turn map (see closed_orbit.hpp)
+	unsigned int	closed_orbit_interactions;				// Node motions in a turn
+	unsigned int	closed_orbit_max_iterations;
+	double			closed_orbit_tolerance_position;		// Max difference between the start and the end of the orbit
+	double			closed_orbit_tolerance_momentum;
+	double			closed_orbit_step_position;				// Steps of the finite differences
+	double			closed_orbit_step_momentum;
+	unsigned int	closed_orbit_turns;						// Turns extrapolated with the one turn map
+	
+	bool			ponderomotive;							// Cycle averaged motion inside the nodes (see ponderomotive.hpp)
+	double			ponderomotive_wavelength;				// Carrier wavelength of the laser
+	double			ponderomotive_time_step;				// Time between the samples of the averaged motion
+	unsigned int	ponderomotive_samples;					// Samples of an optical cycle averaged to extract the envelope
+	double			ponderomotive_max_a0;					// Limits of the envelope approximation
+	double			ponderomotive_max_gradient;
+	bool			ponderomotive_validation;				// Integrate also the full motion and compare them
+	
 	unsigned int 	labmap_max_size;
 	bool		 	labmap_full;
 	
+	bool			func_fast_math;	// Build the custom functions with -ffast-math (vectorized math functions)
+	
 } Simulation;
 
 typedef struct PulseParams
@@ -136,11 +282,66 @@ typedef struct PulseParams
 	map<string, bool>	params_boolean;
 } PulseParams;
 
+typedef struct CustomScripts
+{
+	vector<string> headers;		// Declarations shared by all the translation units (custom_scripts.hpp)
+	vector<string> commons;		// Functions copied in every translation unit (with internal linkage)
+	vector<string> sources;		// Field functions (custom_scripts.cpp)
+	vector<string> renders;		// Field render functions, one translation unit each
+	vector<string> duals;		// Field functions on dual numbers (custom_scripts_dual.cpp, only if dual_variables > 0)
+	unsigned int   dual_variables;	// Derivatives carried by the dual numbers
+} CustomScripts;
+
+typedef struct FieldCache
+{
+	// Lattice of the fields (A.U.) in the node local frame: nt × nx × ny × nz points, every point is e_x,e_y,e_z,b_x,b_y,b_z
+	unsigned int nt;
+	unsigned int nx;
+	unsigned int ny;
+	unsigned int nz;
+	double		 time_start;
+	double		 time_step;
+	double		 space_start;	// The same for all the three axes
+	double		 space_step;
+	const double* data;
+	void*		 mapping;		// Memory mapped file containing the lattice
+	size_t		 mapping_size;
+} FieldCache;
+
+typedef struct TransferMapSample
+{
+	double entry[7];	// Local position, momentum and time at the entry of the influence sphere
+	double exit[7];		// Local position and momentum at the exit, duration of the motion inside the sphere
+} TransferMapSample;
+
+typedef struct TransferMapCache
+{
+	double resolution[7];	// Size of the cells for every component of the entry state
+	double error_position;
+	double error_momentum;
+	boost::unordered_map<vector<long long>, vector<TransferMapSample>> cells;
+	pthread_rwlock_t lock;	// Shared by the lookups, exclusive for the insertions
+	unsigned long lookups;
+	unsigned long hits;
+	unsigned long clears;	// Times the cache was emptied on reaching TRANSFER_MAP_CACHE_MAX_CELLS
+} TransferMapCache;
+
+typedef double (*FunctionEnvelopeType) (double t, double x, double y, double z, const void* params);
+typedef void   (*FunctionFieldDualType) (double t, double x, double y, double z, const void* params, double* field, double* jacobian);
+
 typedef struct Pulse
 {
 	TimingMode	timing_mode;
 	double		timing_offset;
+	bool		timing_sampled;		// Round the NEAREST/EXIT reference point to the time_resolution_laser samples (old behaviour)
 	PulseParams params;
+	vector<double>		params_data;	// The attributes as the FieldParams struct of the custom library (see init_laser_params_data)
+	map<string, size_t>	params_offsets;	// Position of the float attributes inside params_data
+	const FieldCache* field_cache;	// Tabulated fields used instead of the field function (NULL if disabled)
+	TransferMapCache* transfer_map_cache;	// Node motions reused for near entry states (NULL if disabled)
+	FunctionEnvelopeType function_envelope;	// Envelope of the electric field given by the user (NULL if extracted from the field)
+	FunctionFieldDualType function_field_dual;	// Fields and their derivatives by t, x, y, z and sensitivity_params (NULL if not needed)
+	vector<string>		sensitivity_params;	// Float attributes which are variables of function_field_dual
 } Pulse;
 
 typedef struct Field
@@ -155,6 +356,19 @@ typedef struct Field
 
 } Field;
 
+typedef struct FieldBatch
+{
+	// Fields of many points (one array for every component)
+	double* e_x;
+	double* e_y;
+	double* e_z;
+
+	double* b_x;
+	double* b_y;
+	double* b_z;
+
+} FieldBatch;
+
 
 typedef struct Particle
 {
@@ -181,16 +395,14 @@ typedef struct ParticleStateGlobal
 	 * 
 	 * [64 bit mantiss] + [4 bit exponent]
 	 * 
-	 * C++ has a type named long double structured so:
-	 * [S][  Exponent  ][I][  Fraction  ]
-	 *  1       15       1       63
-	 * 
-	 * This fit exaxtly our needs so we can use it. Every position component will expressed by a 10 byte variable full supported by processor FPU (in x386 architecture)
+	 * The x87 long double (1 + 15 + 64 bits) fits exactly, but it is not vectorized, it is slow compared to SSE/AVX and
+	 * on other architectures (AArch64) it is a different type. GlobalCoord (a double-double) has a 106 bit mantiss
+	 * and uses only double arithmetic (see global_coord.hpp). The global time is a GlobalCoord for the same reason.
 	 */
 	
-	long double position_x;
-	long double position_y;
-	long double position_z;
+	GlobalCoord position_x;
+	GlobalCoord position_y;
+	GlobalCoord position_z;
 	
 	double momentum_x;
 	double momentum_y;
@@ -198,6 +410,29 @@ typedef struct ParticleStateGlobal
 } ParticleStateGlobal;
 
 
+/**
+ * The particles of an ensemble in structure of arrays layout: every attribute is contiguous, so the particles of a
+ * group can be passed together to the batched field function and pushed by a vectorized loop.
+ */
+typedef struct EnsembleState
+{
+	unsigned int count;
+	
+	vector<GlobalCoord> position_x;
+	vector<GlobalCoord> position_y;
+	vector<GlobalCoord> position_z;
+	
+	vector<double> momentum_x;
+	vector<double> momentum_y;
+	vector<double> momentum_z;
+	
+	vector<GlobalCoord>  time;			// Global time reached by every particle
+	vector<int>          node;			// Node the particle is inside (-1 during the free motion)
+	vector<int>          node_left;		// Last node left (a straight line can't enter it again)
+	vector<unsigned int> interactions;	// Node motions done
+	
+} EnsembleState;
+
 typedef struct ParticleStateLocal
 {	
 	double position_x;
@@ -209,41 +444,187 @@ typedef struct ParticleStateLocal
 	double momentum_z;
 } ParticleStateLocal;
 
+/**
+ * Fixed size vector and matrix for the frame transformations (see frame.hpp). They are values without heap storage, so
+ * they can be copied and created on every node transition.
+ */
+typedef struct Vec3
+{
+	double x;
+	double y;
+	double z;
+} Vec3;
+
+typedef struct Mat3
+{
+	double m[3][3];		// m[row][column]
+	
+	double& 		operator()(unsigned int r, unsigned int c)			{ return m[r][c]; }
+	const double& 	operator()(unsigned int r, unsigned int c) const	{ return m[r][c]; }
+} Mat3;
+
 typedef struct Node
 {
 	unsigned int	id;
-	long double 	position_x;
-	long double 	position_y;
-	long double 	position_z;
-	mat				axis; 				// Axis rotation 3x3 matrix
+	GlobalCoord 	position_x;
+	GlobalCoord 	position_y;
+	GlobalCoord 	position_z;
+	Mat3			axis; 				// Axis rotation 3x3 matrix: global to local
+	Mat3			axis_t; 			// Its transpose: local to global
 } Node;
 
+/**
+ * Statistics of the ponderomotive model (see ponderomotive.hpp)
+ */
+typedef struct PonderomotiveReport
+{
+	unsigned long	nodes;					// Node motions started with the averaged model
+	unsigned long	switched;				// ... continued with the full integration
+	unsigned long	validated;				// ... integrated also with the full equations
+	double			max_position_error;		// Max deviation at the exit from the full integration
+	double			max_momentum_error;		// (relative to the momentum)
+	double			time_ponderomotive;		// Wall time of the averaged and of the full integrations (validation only)
+	double			time_lorentz;
+} PonderomotiveReport;
+
+/**
+ * Result of the closed orbit search (see closed_orbit.hpp). The phase space coordinates are (x, p_x, y, p_y, τ, δ):
+ * positions and momenta along u and v on the section, arrival delay and momentum along n minus the reference one.
+ */
+typedef struct ClosedOrbit
+{
+	GlobalCoord	origin_x;				// Section: the plane through the origin normal to n
+	GlobalCoord	origin_y;
+	GlobalCoord	origin_z;
+	Mat3		frame;					// Rows u, v, n
+	double		momentum_reference;
+	
+	double		orbit[6];				// The fixed point
+	double		turn_time;				// Duration of a turn on the closed orbit
+	double		matrix[6][6];			// One turn map linearized around the fixed point
+	double		eigen_real[6];
+	double		eigen_imag[6];
+	bool		eigen_valid;			// False if the eigenvalues of the matrix could not be computed
+	
+	unsigned int	iterations;
+	bool			converged;
+	vector<double>	residuals;			// Max difference between the start and the end of every iteration (in tolerances)
+} ClosedOrbit;
+
+/**
+ * Bounding volume hierarchy built over the node influence spheres.
+ * Every box contains either two children (count == 0) or a leaf with 'count' spheres listed in NodeIndex.items.
+ */
+typedef struct NodeIndexBox
+{
+	GlobalCoord		min_x;
+	GlobalCoord		min_y;
+	GlobalCoord		min_z;
+	GlobalCoord		max_x;
+	GlobalCoord		max_y;
+	GlobalCoord		max_z;
+	
+	unsigned int	first;				// Leaf: first entry in NodeIndex.items. Otherwise: position of the left child (the right one is first + 1)
+	unsigned int	count;				// Number of spheres inside the leaf (0 for inner boxes)
+} NodeIndexBox;
+
+typedef struct NodeIndex
+{
+	double					radius;		// Influence radius used to build the boxes
+	vector<NodeIndexBox>	boxes;		// boxes[0] is the root
+	vector<unsigned int>	items;		// Positions inside Laboratory.nodes
+} NodeIndex;
+
+typedef struct NodeIndexHit
+{
+	unsigned int	node;				// Position inside Laboratory.nodes
+	double			time_enter;
+	double			time_exit;
+} NodeIndexHit;
+
 typedef struct Laboratory
 {  
 	vector<Node> 	nodes;
+	NodeIndex		index;
 } Laboratory;
 
+typedef struct Unit
+{
+	string			symbol;
+	double			si_value;	// Value of 1 unit in the SI unit of its class
+	string			name;
+	bool			system_si;
+	bool			system_au;
+	string			note;
+} Unit;
+
+typedef struct UnitPrefix
+{
+	string			name;
+	string			symbol;
+	int				power;
+} UnitPrefix;
+
+typedef struct UnitConversions
+{
+	vector<Unit>		units[UNIT_CLASS_COUNT];	// Sorted by decreasing symbol length, so the longest symbol matches first
+	vector<UnitPrefix>	prefixes;
+} UnitConversions;
+
+/**
+ * Input changed by a response analysis
+ */
+typedef struct ResponseInput
+{
+	string 			object;
+	string 			attribute;
+	unsigned int	attribute_id;		// Index in the table of the SI conversions (see get_attribute_id)
+	
+	double 			change_from;
+	double 			change_to;
+	
+	ResponseValueType	value_type;
+} ResponseInput;
+
 typedef struct ResponseAnalysis
 {
 	unsigned int	id;
 	bool			enabled;
 	
-	string 			object_in;
-	string 			attribute_in;
+	vector<ResponseInput> inputs;
 	
 	vector<string> 	object_out;
 	vector<string>	attribute_out;
+	vector<unsigned int> attribute_out_id;
 	
-	double 			change_from;
-	double 			change_to;
-	
-	unsigned int 	steps;
+	unsigned int 	steps;				// Steps along every input for the grid, samples for the other designs
+	unsigned int 	samples;			// Simulations: steps^inputs for the grid, steps otherwise (at most, for the adaptive design)
+	unsigned int	seed;				// Seed of the random designs
+	unsigned int	adaptive_steps;		// Intervals of the initial grid of the adaptive design
+	double			adaptive_tolerance;	// Largest error of an interval of the adaptive design, relative to the range of the outputs
+	bool			sensitivity;		// Local derivatives of the outputs by the inputs (variational equations) instead of the sweep
 	
 	ResponseChangeType	change_type;
-	ResponseValueType	value_type;
 	
 } ResponseAnalysis;
 
+/**
+ * Samples of a response analysis in the unit hypercube (see response_design.hpp)
+ */
+typedef struct ResponseDesign
+{
+	ResponseChangeType	type;
+	unsigned int		steps;
+	unsigned int		samples;
+	unsigned int		inputs;
+	unsigned int		seed;
+	unsigned int		id;
+	
+	vector<vector<unsigned int>>	permutations;	// Latin hypercube: cell of every sample along every input
+	vector<vector<uint32_t>>		directions;		// Sobol: scrambled direction numbers of every input
+	vector<uint32_t>				shifts;			// Sobol: random digital shift of every input
+} ResponseDesign;
+
 
 /**
  * This struct contains the result of simulation in a laser
@@ -275,7 +656,7 @@ typedef struct SimluationResultNodeSummary
  */
 typedef struct SimluationResultFreeItem
 {
-	long double time;
+	GlobalCoord time;
 	ParticleStateGlobal state;
 	
 } SimluationResultFreeItem;
@@ -288,7 +669,45 @@ typedef struct SimluationResultFreeSummary
 	vector<SimluationResultFreeItem> items;
 } SimluationResultFreeSummary;
 
-typedef Field          (*FunctionFieldType) (double t, double x, double y, double z, const PulseParams& params);
+/**
+ * Derivatives of the particle state by the initial state and by the parameters, integrated along the state (see
+ * sensitivity.hpp). The columns are the initial position and momentum (global frame), the rest mass, the charge and
+ * the laser attributes of Pulse::sensitivity_params.
+ */
+typedef struct SimulationTangent
+{
+	unsigned int	columns;
+	vector<double>	state;				// ∂y_i/∂c in state[6·c + i]: local frame during the node motions, global frame outside
+	vector<double>	time_local;			// ∂τ/∂c of the local time of the node motion
+	vector<double>	time_event;			// ∂t/∂c of the last crossing of an influence sphere
+} SimulationTangent;
+
+/**
+ * Complete state of the main simulation loop: a simulation resumed from a copy continues exactly as the original one
+ */
+typedef struct SimulationCheckpoint
+{
+	RangeMode			current_range;
+	unsigned int		current_interaction;
+	int					current_node;
+	
+	GlobalCoord			time_current_global;
+	double				time_current_local;
+	GlobalCoord			time_global_offset;
+	
+	ParticleStateGlobal	particle_state_global;
+	ParticleStateLocal	particle_state_local;
+	
+	int					node_entered;			// Node reached by the last free motion
+	int					node_left;				// Node left by the last node motion
+	
+	double				integrator_step;		// Step size of DOP853 carried between the node motions
+	
+	SimulationTangent*	tangent;				// Derivatives integrated along the state (NULL if not needed)
+} SimulationCheckpoint;
+
+typedef Field          (*FunctionFieldType) (double t, double x, double y, double z, const void* params);
+typedef void           (*FunctionFieldBatchType) (unsigned int n, const double* t, const double* x, const double* y, const double* z, const FieldBatch& field, const void* params);
 typedef vector<double> (*FunctionRenderType)(double t, double x, double y, double z);
 
 typedef struct FieldRender
@@ -386,12 +805,13 @@ typedef struct FieldRenderData
 typedef function<void(Simulation& simulation, Pulse& laser, Particle& particle, ParticleStateLocal&  particle_state, unsigned int interaction, Node& node, double time_local)>					FunctionNodeEnter; 
 typedef function<void(Simulation& simulation, Pulse& laser, Particle& particle, ParticleStateLocal&  particle_state, unsigned int interaction, Node& node, double time_local)>					FunctionNodeExit; 
 typedef function<void(Simulation& simulation, Pulse& laser, Particle& particle, ParticleStateLocal&  particle_state, unsigned int interaction, Node& node, double time_local, Field& field)>	FunctionNodeTimeProgress;
-typedef function<void(Simulation& simulation, 				Particle& particle, ParticleStateGlobal& particle_state, Laboratory& laboratory, long double time_global)>							FunctionFreeEnter;
-typedef function<void(Simulation& simulation, 				Particle& particle, ParticleStateGlobal& particle_state, Laboratory& laboratory, long double time_global)> 							FunctionFreeExit;
-typedef function<void(Simulation& simulation, 				Particle& particle, ParticleStateGlobal& particle_state, Laboratory& laboratory, long double time_global)> 							FunctionFreeTimeProgress;
+typedef function<void(Simulation& simulation, 				Particle& particle, ParticleStateGlobal& particle_state, Laboratory& laboratory, GlobalCoord time_global)>							FunctionFreeEnter;
+typedef function<void(Simulation& simulation, 				Particle& particle, ParticleStateGlobal& particle_state, Laboratory& laboratory, GlobalCoord time_global)> 							FunctionFreeExit;
+typedef function<void(Simulation& simulation, 				Particle& particle, ParticleStateGlobal& particle_state, Laboratory& laboratory, GlobalCoord time_global)> 							FunctionFreeTimeProgress;
 
 typedef function<void(double time_local, FieldRenderResult render_result)> 	FunctionFieldRenderCalculated;
-typedef function<void(ResponseAnalysis& analisys, unsigned int step)> 		FunctionResponseAnalysisCalculated;
+typedef function<void(ResponseAnalysis& analisys, unsigned int steps_completed)> 		FunctionResponseAnalysisCalculated;
+typedef function<void(unsigned int particles_done, unsigned int particles_count)>	FunctionEnsembleProgress;
 
 
 inline bool operator<(const FieldRender& lhs, 		const FieldRender& rhs) 		{ return lhs.id <  rhs.id; }
@@ -0,0 +1,588 @@
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include "unit.hpp"
+#include "util.hpp"
+
+// Names of the unit classes, in the order of UnitClass
+static const char* unit_class_names[UNIT_CLASS_COUNT] =
+{
+	"MASS",
+	"LENGTH",
+	"CHARGE",
+	"ENERGY",
+	"TIME",
+	"FREQUENCY",
+	"PULSATION",
+	"SPEED",
+	"FORCE",
+	"ELECTRIC_FIELD",
+	"ELECTRIC_POTENTIAL",
+	"MOMENTUM",
+	"MAGNETIC_FIELD",
+	"ANGLE",
+	"PERCENTUAL",
+	"PURE_FLOAT",
+	"PURE_INT",
+	"IGNORE",
+	"IGNORE_START",
+	"IGNORE_END"
+};
+
+typedef struct UnitAttribute
+{
+	const char*	object;
+	const char*	attribute;	// "*" matches every attribute of the object
+	UnitClass	unit_class;
+	const char*	unit;		// SI unit used in the outputs
+} UnitAttribute;
+
+// The attributes that can be used in the response analyses. The attribute ID is the index in this table.
+static const UnitAttribute unit_attributes[] =
+{
+	{"particle",	"position_x",		UNIT_LENGTH,		"m"},
+	{"particle",	"position_y",		UNIT_LENGTH,		"m"},
+	{"particle",	"position_z",		UNIT_LENGTH,		"m"},
+	{"particle",	"position_phi",		UNIT_ANGLE,			"rad"},
+	{"particle",	"position_theta",	UNIT_ANGLE,			"rad"},
+	{"particle",	"position_rho",		UNIT_LENGTH,		"m"},
+	{"particle",	"momentum_x",		UNIT_MOMENTUM,		"Kg m/s"},
+	{"particle",	"momentum_y",		UNIT_MOMENTUM,		"Kg m/s"},
+	{"particle",	"momentum_z",		UNIT_MOMENTUM,		"Kg m/s"},
+	{"particle",	"momentum_phi",		UNIT_ANGLE,			"rad"},
+	{"particle",	"momentum_theta",	UNIT_ANGLE,			"rad"},
+	{"particle",	"momentum_rho",		UNIT_MOMENTUM,		"Ns"},
+	{"particle",	"energy_x",			UNIT_ENERGY,		"J"},
+	{"particle",	"energy_y",			UNIT_ENERGY,		"J"},
+	{"particle",	"energy_z",			UNIT_ENERGY,		"J"},
+	{"particle",	"energy_phi",		UNIT_ANGLE,			"rad"},
+	{"particle",	"energy_theta",		UNIT_ANGLE,			"rad"},
+	{"particle",	"energy_rho",		UNIT_ENERGY,		"J"},
+	{"particle",	"rest_mass",		UNIT_MASS,			"Kg"},
+	{"particle",	"charge",			UNIT_CHARGE,		"C"},
+	{"laser",		"*",				UNIT_PURE_FLOAT,	"arbitrary"}
+};
+
+#define UNIT_ATTRIBUTES_COUNT (sizeof(unit_attributes) / sizeof(unit_attributes[0]))
+
+/**
+ * Value of 1 atomic unit in SI units
+ */
+double get_unit_au_value(UnitClass unit_class)
+{
+	switch (unit_class)
+	{
+		case UNIT_MASS:					return AU_MASS;
+		case UNIT_LENGTH:				return AU_LENGTH;
+		case UNIT_CHARGE:				return AU_CHARGE;
+		case UNIT_ENERGY:				return AU_ENERGY;
+		case UNIT_TIME:					return AU_TIME;
+		case UNIT_SPEED:				return AU_SPEED;
+		case UNIT_FORCE:				return AU_FORCE;
+		case UNIT_ELECTRIC_FIELD:		return AU_ELECTRIC_FIELD;
+		case UNIT_ELECTRIC_POTENTIAL:	return AU_ELECTRIC_POTENTIAL;
+		case UNIT_MOMENTUM:				return AU_MOMENTUM;
+		case UNIT_MAGNETIC_FIELD:		return AU_MAGNETIC_FIELD;
+		default:						return 1.d;
+	}
+}
+
+bool parse_unit_class(string name, UnitClass& unit_class)
+{
+	for (unsigned int c = 0; c < UNIT_CLASS_COUNT; c++)
+	{
+		if (name == unit_class_names[c])
+		{
+			unit_class = (UnitClass) c;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+string get_unit_class_names()
+{
+	string names = "";
+
+	for (unsigned int c = 0; c < UNIT_CLASS_COUNT; c++)
+		names += string("\n") + unit_class_names[c];
+
+	return names;
+}
+
+string get_unit_symbols(const vector<Unit>& units)
+{
+	string symbols = "";
+
+	for (const Unit& unit: units)
+		symbols += (bo::format("\n%s \t (%s)") % unit.symbol % unit.name).str();
+
+	return symbols;
+}
+
+/**
+ * Pad s with spaces up to 'width' characters. The symbols contain UTF-8 characters (τ, °, ‰), so the continuation bytes
+ * are not counted.
+ */
+string pad_unit_string(string s, unsigned int width)
+{
+	unsigned int length = 0;
+
+	for (char c: s)
+	{
+		if ((c & 0xC0) != 0x80)
+			length++;
+	}
+
+	if (length < width)
+		s.append(width - length, ' ');
+
+	return s;
+}
+
+/**
+ * The first unit of the class that belongs to the SI system. It is the unit of the converted config.
+ */
+const Unit* get_unit_si(const vector<Unit>& units)
+{
+	for (const Unit& unit: units)
+	{
+		if (unit.system_si)
+			return &unit;
+	}
+
+	return NULL;
+}
+
+void load_unit_conversions(fs::path filename, UnitConversions& conversions)
+{
+	ifstream file(filename.string());
+
+	if (!file.is_open())
+	{
+		printf("ERROR - Unable to open file '%s'\n", filename.c_str());
+		exit(-1);
+	}
+
+	for (unsigned int c = 0; c < UNIT_CLASS_COUNT; c++)
+		conversions.units[c].clear();
+
+	string line;
+	unsigned int i = 0;
+
+	while (getline(file, line))
+	{
+		i++;
+
+		string line_trim = ba::trim_copy(line);
+
+		if (line_trim.empty() || line_trim[0] == '#')
+			continue;
+
+		// Class, symbol, value in SI, name, systems (SI|AU) and an optional note
+		vector<string> fields;
+		bo::split(fields, line, bo::is_any_of(","));
+
+		for (string& field: fields)
+			ba::trim(field);
+
+		if (fields.size() < 5)
+		{
+			printf("ERROR in file '%s' at line %u: the line is not composed by 6 fields separated by comma.\n", filename.c_str(), i);
+			exit(-1);
+		}
+
+		UnitClass unit_class;
+		if (!parse_unit_class(fields[0], unit_class))
+		{
+			printf("ERROR in file '%s' at line %u: the 1st field must be one of %s\n", filename.c_str(), i, get_unit_class_names().c_str());
+			exit(-1);
+		}
+
+		Unit unit;
+
+		unit.symbol = fields[1];
+		if (unit.symbol.empty())
+		{
+			printf("ERROR in file '%s' at line %u: the 2nd field is mandatory\n", filename.c_str(), i);
+			exit(-1);
+		}
+
+		try
+		{
+			size_t parsed;
+			unit.si_value = stod(fields[2], &parsed);
+
+			if (parsed != fields[2].size())
+				throw invalid_argument(fields[2]);
+		}
+		catch (logic_error& e)
+		{
+			printf("ERROR in file '%s' at line %u: the 3rd field is not a valid number\n", filename.c_str(), i);
+			exit(-1);
+		}
+
+		unit.name = fields[3];
+		if (unit.name.empty())
+		{
+			printf("ERROR in file '%s' at line %u: the 4th field is mandatory\n", filename.c_str(), i);
+			exit(-1);
+		}
+
+		unit.system_si = false;
+		unit.system_au = false;
+
+		vector<string> systems;
+		string systems_str = ba::to_upper_copy(fields[4]);
+
+		if (!systems_str.empty())
+			bo::split(systems, systems_str, bo::is_any_of("|"));
+
+		for (string& system: systems)
+		{
+			ba::trim(system);
+
+			if (system == "SI")
+				unit.system_si = true;
+			else if (system == "AU")
+				unit.system_au = true;
+			else
+			{
+				printf("ERROR in file '%s' at line %u: the 5th field must be one of\nSI\nAU\n", filename.c_str(), i);
+				exit(-1);
+			}
+		}
+
+		unit.note = (fields.size() >= 6) ? fields[5] : "";
+
+		conversions.units[unit_class].push_back(unit);
+	}
+
+	// The longest symbols are checked first, so 'rad/s' is not recognized as 's' with the prefix 'rad/'
+	for (unsigned int c = 0; c < UNIT_CLASS_COUNT; c++)
+	{
+		stable_sort(conversions.units[c].begin(), conversions.units[c].end(), [](const Unit& u1, const Unit& u2)
+		{
+			return u1.symbol.size() > u2.symbol.size();
+		});
+	}
+
+	conversions.prefixes =
+	{
+		{"yotta",	"Y",	+24},
+		{"zetta",	"Z",	+21},
+		{"exa",		"E",	+18},
+		{"peta",	"P",	+15},
+		{"tera",	"T",	+12},
+		{"giga",	"G",	+9 },
+		{"mega",	"M",	+6 },
+		{"kilo",	"k",	+3 },
+		{"centi",	"c",	-2 },
+		{"milli",	"m",	-3 },
+		{"micro",	"μ",	-6 },
+		{"nano",	"n",	-9 },
+		{"pico",	"p",	-12},
+		{"femto",	"f",	-15},
+		{"atto",	"a",	-18},
+		{"zepto",	"z",	-21},
+		{"yocto",	"y",	-24}
+	};
+}
+
+/**
+ * Convert a value with its unit (and optional prefix) to the SI unit of its class, appending to 'output' the converted
+ * key and a comment with the details of the conversion.
+ */
+void convert_value_units(const UnitConversions& conversions, fs::path& cfg_file, unsigned int i, UnitClass unit_class, string key, string value, string prefix_and_unit, stringstream& output)
+{
+	if (unit_class == UNIT_PURE_INT && prefix_and_unit.empty())
+	{
+		try
+		{
+			output << bo::format("%s\t\t = %d") % key % stoll(value) << endl;
+		}
+		catch (logic_error& e)
+		{
+			printf("ERROR in file '%s' at line %u: unable parse %s value %s\n", cfg_file.c_str(), i, "integer", value.c_str());
+			exit(-1);
+		}
+		return;
+	}
+
+	if (unit_class == UNIT_PURE_FLOAT && prefix_and_unit.empty())
+	{
+		output << bo::format("%s\t\t = %.16E") % key % stod(value) << endl;
+		return;
+	}
+
+	const vector<Unit>& units = conversions.units[unit_class];
+
+	if (prefix_and_unit.empty())
+	{
+		printf("ERROR in file '%s' at line %u: no unit was specified for key '%s'. Expected types are: %s\n", cfg_file.c_str(), i, key.c_str(), get_unit_symbols(units).c_str());
+		exit(-1);
+	}
+
+	string class_name = ba::to_lower_copy(string(unit_class_names[unit_class]));
+
+	// The pure numbers accept only the prefix
+	const Unit* unit = NULL;
+
+	if (unit_class != UNIT_PURE_INT && unit_class != UNIT_PURE_FLOAT)
+	{
+		for (const Unit& u: units)
+		{
+			if (ba::ends_with(prefix_and_unit, u.symbol))
+			{
+				unit = &u;
+				break;
+			}
+		}
+
+		if (unit == NULL)
+		{
+			printf("ERROR in file '%s' at line %u: unable to undestand the %s unit for the key '%s'. Unknown symbol '%s'.\nExpected symbols are:%s\n", cfg_file.c_str(), i, class_name.c_str(), key.c_str(), prefix_and_unit.c_str(), get_unit_symbols(units).c_str());
+			exit(-1);
+		}
+	}
+
+	string prefix_symbol = prefix_and_unit.substr(0, prefix_and_unit.size() - (unit != NULL ? unit->symbol.size() : 0));
+	const UnitPrefix* prefix = NULL;
+
+	if (!prefix_symbol.empty())
+	{
+		for (const UnitPrefix& p: conversions.prefixes)
+		{
+			if (prefix_symbol == p.symbol)
+			{
+				prefix = &p;
+				break;
+			}
+		}
+
+		if (prefix == NULL)
+		{
+			string prefixes = "";
+			for (const UnitPrefix& p: conversions.prefixes)
+				prefixes += (bo::format("\n%s (%s) 10^%d") % p.symbol % p.name % p.power).str();
+
+			printf("ERROR in file '%s' at line %u: unable to undestand the prefix for the key '%s'.\nUnknown symbol '%s'.\nPossible prefixes are: %s\n", cfg_file.c_str(), i, key.c_str(), prefix_symbol.c_str(), prefixes.c_str());
+			exit(-1);
+		}
+	}
+
+	if (unit_class == UNIT_PURE_INT)
+	{
+		long long value_old = stoll(value);
+		long long value_new = value_old * (long long) llround(pow(10, prefix->power));
+
+		output << bo::format("# converted %s from %d %s (%s) to %d") % "integer" % value_old % prefix->symbol % prefix->name % value_new << endl;
+		output << bo::format("%s\t\t = %d") % key % value_new << endl;
+	}
+	else if (unit_class == UNIT_PURE_FLOAT)
+	{
+		double value_old = stod(value);
+		double value_new = value_old * pow(10, prefix->power);
+
+		output << bo::format("# converted %s from %f %s (%s) to %.16E") % "float" % value_old % prefix->symbol % prefix->name % value_new << endl;
+		output << bo::format("%s\t\t = %.16E") % key % value_new << endl;
+	}
+	else
+	{
+		const Unit* unit_si = get_unit_si(units);
+
+		if (unit_si == NULL)
+		{
+			printf("ERROR in file '%s' at line %u: unable to find a SI unit representing an %s. Complete the 'conversion' file\n", cfg_file.c_str(), i, class_name.c_str());
+			exit(-1);
+		}
+
+		double value_old = stod(value);
+		double value_new = value_old / unit_si->si_value * unit->si_value;
+
+		if (prefix != NULL)
+			value_new *= pow(10, prefix->power);
+
+		output << bo::format("# converted %s from %f %s%s (%s%s) to %.16E %s")
+			% class_name
+			% value_old
+			% (prefix != NULL ? prefix->symbol : "")
+			% unit->symbol
+			% (prefix != NULL ? prefix->name : "")
+			% unit->name
+			% value_new
+			% unit_si->symbol << endl;
+		output << bo::format("%s\t\t = %.16E") % key % value_new << endl;
+	}
+}
+
+/**
+ * Config file with all the values converted to SI units. Every 'unit_type' annotation applies to the keys that follow it,
+ * until a line that is not a key. The keys between 'ignore_start' and 'ignore_end' are copied as they are.
+ */
+string convert_config_units(const UnitConversions& conversions, fs::path cfg_file)
+{
+	static const bo::regex e_key("^\\s*(\\w+)\\s*=.*$");
+	static const bo::regex e_value("^\\s*(\\w+)\\s*=\\s*([-+]?[0-9]*\\.?[0-9]+([eE][-+]?[0-9]+)?)\\s*(\\S*)\\s*$");
+	static const bo::regex e_unit_type("^\\s*\\#\\s*unit\\_type\\s*:\\s*\\[([\\s\\w]+)\\].*$");
+
+	ifstream file(cfg_file.string());
+
+	if (!file.is_open())
+	{
+		printf("ERROR - Unable to open file '%s'\n", cfg_file.c_str());
+		exit(-1);
+	}
+
+	char date[64];
+	time_t now = time(NULL);
+	strftime(date, sizeof(date), "%a %b %d %H:%M:%S %Z %Y", localtime(&now));
+
+	stringstream output;
+	output << bo::format("# Generated to SI units on %s by circlesim") % date << endl;
+	output << "# " << endl;
+
+	UnitClass unit_class = UNIT_CLASS_COUNT;	// No annotation
+	bool ignore = false;
+
+	string line;
+	unsigned int i = 0;
+
+	while (getline(file, line))
+	{
+		i++;
+
+		if (!line.empty() && line[line.size() - 1] == '\r')
+			line.erase(line.size() - 1);
+
+		string line_trim = ba::trim_copy(line);
+
+		if (line_trim.empty() || line_trim[0] == '#')
+		{
+			output << line << endl;
+
+			bo::smatch what;
+			if (bo::regex_match(line, what, e_unit_type))
+			{
+				string name = bo::regex_replace(ba::to_upper_copy(ba::trim_copy(string(what[1]))), bo::regex("\\s+"), "_");
+
+				if (!parse_unit_class(name, unit_class))
+				{
+					printf("ERROR in file '%s' at line %u: unknown unit_type '%s'. Expected values are:%s\n", cfg_file.c_str(), i, string(what[1]).c_str(), get_unit_class_names().c_str());
+					exit(-1);
+				}
+
+				if (unit_class == UNIT_IGNORE_START || unit_class == UNIT_IGNORE_END)
+				{
+					ignore     = (unit_class == UNIT_IGNORE_START);
+					unit_class = UNIT_CLASS_COUNT;
+				}
+			}
+			continue;
+		}
+
+		bo::smatch what;
+		if (ignore || !bo::regex_match(line, what, e_key))
+		{
+			output << line << endl;
+			unit_class = UNIT_CLASS_COUNT;
+			continue;
+		}
+
+		string key = what[1];
+
+		if (unit_class == UNIT_CLASS_COUNT)
+		{
+			printf("ERROR in file '%s' at line %u: unspecified unit_type for key '%s'.\n", cfg_file.c_str(), i, key.c_str());
+			exit(-1);
+		}
+
+		if (unit_class == UNIT_IGNORE)
+		{
+			output << line << endl;
+			continue;
+		}
+
+		if (!bo::regex_match(line, what, e_value))
+		{
+			printf("ERROR in file '%s' at line %u: unable parse the line.\n", cfg_file.c_str(), i);
+			exit(-1);
+		}
+
+		convert_value_units(conversions, cfg_file, i, unit_class, key, what[2], what[4], output);
+	}
+
+	return output.str();
+}
+
+/**
+ * Table of the units of every class with the conversion from and to the SI unit
+ */
+void print_units(const UnitConversions& conversions, ostream& stream)
+{
+	for (unsigned int c = 0; c < UNIT_CLASS_COUNT; c++)
+	{
+		if (c == UNIT_PURE_FLOAT || c == UNIT_PURE_INT || c == UNIT_IGNORE || c == UNIT_IGNORE_START || c == UNIT_IGNORE_END)
+			continue;
+
+		const vector<Unit>& units = conversions.units[c];
+		const Unit* unit_si = get_unit_si(units);
+
+		if (unit_si == NULL)
+		{
+			printf("ERROR - unable to find a SI unit representing an %s. Complete the 'conversion' file.\n", unit_class_names[c]);
+			exit(-1);
+		}
+
+		stream << unit_class_names[c] << ":" << endl;
+
+		for (const Unit& unit: units)
+		{
+			string conversion1 = (bo::format("1 %s = % .16E %s") % pad_unit_string(unit.symbol,    6) % (unit.si_value / unit_si->si_value) % pad_unit_string(unit_si->symbol, 6)).str();
+			string conversion2 = (bo::format("1 %s = % .16E %s") % pad_unit_string(unit_si->symbol, 6) % (unit_si->si_value / unit.si_value) % pad_unit_string(unit.symbol,    6)).str();
+
+			stream << "  " << pad_unit_string(unit.name, 40) << ": " << pad_unit_string(conversion1, 40) << " " << pad_unit_string(conversion2, 40) << endl;
+		}
+
+		stream << endl;
+	}
+}
+
+unsigned int get_attribute_id(string object, string attribute)
+{
+	for (unsigned int a = 0; a < UNIT_ATTRIBUTES_COUNT; a++)
+	{
+		if (object == unit_attributes[a].object && (attribute == unit_attributes[a].attribute || string(unit_attributes[a].attribute) == "*"))
+			return a;
+	}
+
+	error_attribute_unknown(object, attribute);
+	return 0;
+}
+
+string get_conversion_si_unit(unsigned int attribute_id)
+{
+	return unit_attributes[attribute_id].unit;
+}
+
+/**
+ * Value of 1 A.U. of every attribute in SI units, indexed by attribute ID
+ */
+vector<double> resolve_conversion_si_values()
+{
+	vector<double> values(UNIT_ATTRIBUTES_COUNT);
+
+	for (unsigned int a = 0; a < UNIT_ATTRIBUTES_COUNT; a++)
+		values[a] = get_unit_au_value(unit_attributes[a].unit_class);
+
+	return values;
+}
+
+double get_conversion_si_value(unsigned int attribute_id)
+{
+	// Resolved once: it is read for every row of the outputs
+	static const vector<double> values = resolve_conversion_si_values();
+
+	return values[attribute_id];
+}
@@ -0,0 +1,22 @@
+#include "type.hpp"
+
+#ifndef CIRCLESIM_UNIT
+#define CIRCLESIM_UNIT
+
+/**
+ * Units of measure.
+ *
+ * The config file is written with any unit listed in util/unit/conversions.csv (with an optional SI prefix) and every key
+ * is preceded by a '# unit_type: [class]' comment. Before being read the config is converted to SI units, which
+ * read_config then converts to atomic units. The outputs are written in SI units.
+ */
+
+void load_unit_conversions(fs::path filename, UnitConversions& conversions);
+string convert_config_units(const UnitConversions& conversions, fs::path cfg_file);
+void print_units(const UnitConversions& conversions, ostream& stream);
+
+unsigned int get_attribute_id(string object, string attribute);
+string get_conversion_si_unit(unsigned int attribute_id);
+double get_conversion_si_value(unsigned int attribute_id);
+
+#endif
@@ -1,10 +1,9 @@
 #include <math.h>
-#include <armadillo>
 #include "type.hpp"
 #include "util.hpp"
+#include "frame.hpp"
 
 
-using namespace arma;
 
 double energy_kinetic_to_momentum(double rest_mass, double energy_kinetic)
 {
@@ -64,61 +63,72 @@ double momentum_to_energy_total(double rest_mass, double momentum)
 
 void state_global_to_local(ParticleStateLocal&  state_local, ParticleStateGlobal& state_global, Node& node)
 {
-	// Position
+	Vec3 position = frame_to_local(node.axis, state_global.position_x, state_global.position_y, state_global.position_z, node.position_x, node.position_y, node.position_z);
+	Vec3 momentum = frame_to_local(node.axis, state_global.momentum_x, state_global.momentum_y, state_global.momentum_z);
 	
-	vec tr_pos = zeros<vec>(3);
-	tr_pos(0) = state_global.position_x - node.position_x;
-	tr_pos(1) = state_global.position_y - node.position_y;
-	tr_pos(2) = state_global.position_z - node.position_z;
+	state_local.position_x = position.x;
+	state_local.position_y = position.y;
+	state_local.position_z = position.z;
 	
-	vec loc_pos = node.axis * tr_pos;
-	
-	state_local.position_x = loc_pos(0);
-	state_local.position_y = loc_pos(1);
-	state_local.position_z = loc_pos(2);
-	
-	// Momentum
-	
-	vec mom = zeros<vec>(3);
-	mom(0) = state_global.momentum_x;
-	mom(1) = state_global.momentum_y;
-	mom(2) = state_global.momentum_z;
+	state_local.momentum_x = momentum.x;
+	state_local.momentum_y = momentum.y;
+	state_local.momentum_z = momentum.z;
+}
+
+void state_local_to_global(ParticleStateGlobal& state_global, ParticleStateLocal& state_local, Node& node)
+{
+	frame_to_global(node.axis_t, state_local.position_x, state_local.position_y, state_local.position_z, node.position_x, node.position_y, node.position_z, state_global.position_x, state_global.position_y, state_global.position_z);
 	
-	vec loc_mom = node.axis * mom;
+	Vec3 momentum = frame_to_global(node.axis_t, state_local.momentum_x, state_local.momentum_y, state_local.momentum_z);
 	
-	state_local.momentum_x = loc_mom(0);
-	state_local.momentum_y = loc_mom(1);
-	state_local.momentum_z = loc_mom(2);
+	state_global.momentum_x = momentum.x;
+	state_global.momentum_y = momentum.y;
+	state_global.momentum_z = momentum.z;
 }
 
-void state_local_to_global(ParticleStateGlobal& state_global, ParticleStateLocal& state_local, Node& node)
+
+/**
+ * Intersect the ray r(t) = origin + direction·t with a sphere.
+ * If the ray (extended in both directions) crosses the sphere it returns true and sets time_enter and time_exit, the values of t
+ * where the ray enters and leaves the sphere. They can be negative if the crossing happens before the origin.
+ *
+ * The calculation is done relative to the point of closest approach, avoiding the cancellation of the classic
+ * quadratic formula when the sphere is very far from the origin compared to its radius.
+ */
+bool ray_sphere_intersection(const GlobalCoord& origin_x, const GlobalCoord& origin_y, const GlobalCoord& origin_z, double direction_x, double direction_y, double direction_z, const GlobalCoord& center_x, const GlobalCoord& center_y, const GlobalCoord& center_z, double radius, double& time_enter, double& time_exit)
 {
-	vec loc_pos = zeros<vec>(3);
-	loc_pos(0) = state_local.position_x;
-	loc_pos(1) = state_local.position_y;
-	loc_pos(2) = state_local.position_z;
+	double a = direction_x * direction_x + direction_y * direction_y + direction_z * direction_z;
+	
+	if (a == 0)
+		return false;
+	
+	// The difference of the global coordinates is exact, the rest is done near the sphere
+	double delta_x = global_coord_delta(center_x, origin_x);
+	double delta_y = global_coord_delta(center_y, origin_y);
+	double delta_z = global_coord_delta(center_z, origin_z);
+	
+	// Time of closest approach
+	double time_nearest = (delta_x * direction_x + delta_y * direction_y + delta_z * direction_z) / a;
 	
-	vec pos = node.axis.t() * loc_pos;
+	// Distance vector between the center and the point of closest approach
+	double nearest_x = delta_x - direction_x * time_nearest;
+	double nearest_y = delta_y - direction_y * time_nearest;
+	double nearest_z = delta_z - direction_z * time_nearest;
 	
-	state_global.position_x = pos(0) + node.position_x;
-	state_global.position_y = pos(1) + node.position_y;
-	state_global.position_z = pos(2) + node.position_z;
+	double h2 = radius * radius - (nearest_x * nearest_x + nearest_y * nearest_y + nearest_z * nearest_z);
 	
-	// Momentum
-	vec loc_mom = zeros<vec>(3);
-	loc_mom(0) = state_local.momentum_x;
-	loc_mom(1) = state_local.momentum_y;
-	loc_mom(2) = state_local.momentum_z;
+	if (h2 < 0)
+		return false;
 	
-	vec mom = node.axis.t() * loc_mom;
+	double time_half = sqrt(h2 / a);
 	
-	state_global.momentum_x = mom(0);
-	state_global.momentum_y = mom(1);
-	state_global.momentum_z = mom(2);
+	time_enter = time_nearest - time_half;
+	time_exit  = time_nearest + time_half;
+	
+	return true;
 }
 
 
-
 /**
  * 
  * Trasform a number into a string using SI prefixes:
@@ -182,83 +192,6 @@ void error_attribute_unknown(string object, string attribute)
 	exit(-1);	
 }
 
-string get_conversion_si_unit(string object, string attribute)
-{
-	if (object == "particle")
-	{
-
-		if (attribute == "position_x" || attribute == "position_y" || attribute == "position_z")
-			return "m";
-		else if (attribute == "position_phi" || attribute == "position_theta") 
-			return "rad";
-		else if (attribute == "position_rho")
-			return "m";
-		else if (attribute == "momentum_x" 	 || attribute == "momentum_y" || attribute == "momentum_z")
-			return "Kg m/s";
-		else if (attribute == "momentum_phi" || attribute == "momentum_theta")
-			return "rad";
-		else if (attribute == "momentum_rho")
-			return "Ns";
-		else if (attribute == "energy_x" 	|| attribute == "energy_y" || attribute == "energy_z")
-			return "J";
-		else if (attribute == "energy_phi" 	|| attribute == "energy_theta")
-			return "rad";
-		else if (attribute == "energy_rho")
-			return "J";
-		else if (attribute == "rest_mass")
-			return "Kg";
-		else if (attribute == "charge")
-			return "C";
-	}
-	else if (object == "laser")
-	{
-		return "arbitrary";
-	}
-	
-	error_attribute_unknown(object, attribute);
-	return "unknown";	
-}
-
-double get_conversion_si_value(string object, string attribute)
-{
-	if (object == "particle")
-	{
-
-		if (attribute == "position_x" || attribute == "position_y" || attribute == "position_z")
-			return AU_LENGTH;
-		else if (attribute == "position_phi" || attribute == "position_theta") 
-			return 1.d;
-		else if (attribute == "position_rho")
-			return AU_LENGTH;
-		else if (attribute == "momentum_x" || attribute == "momentum_y" || attribute == "momentum_z")
-			return AU_MOMENTUM;
-		else if (attribute == "momentum_phi" || attribute == "momentum_theta")
-			return 1.d;
-		else if (attribute == "momentum_rho")
-			return AU_MOMENTUM;
-		else if (attribute == "energy_x" || attribute == "energy_y" || attribute == "energy_z")
-			return AU_ENERGY;
-		else if (attribute == "energy_phi" || attribute == "energy_theta")
-			return 1.d;
-		else if (attribute == "energy_rho")
-			return AU_ENERGY;
-		else if (attribute == "rest_mass")
-			return AU_MASS;
-		else if (attribute == "charge")
-			return AU_CHARGE;
-	}
-	else if (object == "laser")
-	{
-		return 1.d;
-	}
-	
-	error_attribute_unknown(object, attribute);
-	return 0.d;	
-}
-
-
-
-
  /*
   * This description is taken from Unblend v1.0 plugin by Legorol
   *
@@ -376,3 +309,42 @@ unsigned int unblend_color(unsigned int blended, unsigned int background)
 		return (alpha << 24) | (unblended_r << 16) | (unblended_g <<  8) | (unblended_b <<  0);
 	}
 }
+
+/**
+ * FNV-1a 64 bit hash. Pass the previous result as hash to continue hashing more data.
+ */
+uint64_t hash_fnv1a(const void* data, size_t size, uint64_t hash)
+{
+	const unsigned char* bytes = (const unsigned char*) data;
+	
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	
+	return hash;
+}
+
+/**
+ * Directory where the files reused between different runs are stored ($XDG_CACHE_HOME/circlesim or ~/.cache/circlesim)
+ */
+fs::path get_cache_directory()
+{
+	fs::path cache_dir;
+	
+	const char* xdg_cache = getenv("XDG_CACHE_HOME");
+	const char* home      = getenv("HOME");
+	
+	if (xdg_cache != NULL && xdg_cache[0] != '\0')
+		cache_dir = fs::path(xdg_cache) / fs::path("circlesim");
+	else if (home != NULL && home[0] != '\0')
+		cache_dir = fs::path(home) / fs::path(".cache") / fs::path("circlesim");
+	else
+		cache_dir = fs::temp_directory_path() / fs::path("circlesim");
+	
+	bo::system::error_code error;
+	fs::create_directories(cache_dir, error);
+	
+	return cache_dir;
+}
@@ -1,4 +1,5 @@
 #include "type.hpp"
+#include "frame.hpp"
 
 template <typename T> T vector_module(T x1, T x2, T x3);
 
@@ -8,8 +9,6 @@ double energy_total_to_momentum(double rest_mass, double energy);
 double momentum_to_energy_total(double rest_mass, double momentum);
 
 void error_attribute_unknown(string object, string attribute);
-string get_conversion_si_unit(string object, string attribute);
-double get_conversion_si_value(string object, string attribute);
 
 template <typename T> void spherical_to_cartesian(T rho, T theta, T phi, T& x, T& y, T& z);
 template <typename T> void cartesian_to_spherical(T x, T y, T z, T& theta, T& phi);
@@ -20,11 +19,18 @@ template <typename T> void rotate_euler		(T& x, T& y, T& z, T alpha, T beta, T g
 void state_global_to_local(ParticleStateLocal&  state_local,  ParticleStateGlobal& state_global, Node& node);
 void state_local_to_global(ParticleStateGlobal& state_global, ParticleStateLocal&  state_local,  Node& node);
 
+bool ray_sphere_intersection(const GlobalCoord& origin_x, const GlobalCoord& origin_y, const GlobalCoord& origin_z, double direction_x, double direction_y, double direction_z, const GlobalCoord& center_x, const GlobalCoord& center_y, const GlobalCoord& center_z, double radius, double& time_enter, double& time_exit);
+
 void scale_image(unsigned int& w, unsigned int& h, unsigned int max_w, unsigned int max_h);
 
 unsigned int blend_color(unsigned int unblended, unsigned int background);
 unsigned int unblend_color(unsigned int blended, unsigned int background);
 
+#define FNV1A_OFFSET_BASIS	14695981039346656037ULL
+
+uint64_t hash_fnv1a(const void* data, size_t size, uint64_t hash = FNV1A_OFFSET_BASIS);
+fs::path get_cache_directory();
+
 
 template <typename T> T vector_module(T x1, T x2, T x3)
 {
@@ -119,66 +125,20 @@ template<typename T> void cartesian_to_spherical(T x, T y, T z, T& theta, T& phi
   */
 template <typename T> void rotate_euler(T& x, T& y, T& z, T alpha, T beta, T gamma)
 {
-	vec v = zeros<vec>(3);
+	Vec3 v = {(double) x, (double) y, (double) z};
 	
-	v(0) = x;
-	v(1) = y;
-	v(2) = z;
-	
-	if (alpha != 0.0)
-	{
-		mat rx = zeros<mat>(3,3);
-		
-		rx(0, 0) = 1.0;
-		rx(0, 1) = 0.0;
-		rx(0, 2) = 0.0;
-		rx(1, 0) = 0.0;
-		rx(1, 1) =  cos(gamma);
-		rx(1, 2) = -sin(gamma);
-		rx(2, 0) = 0.0;
-		rx(2, 1) =  sin(gamma);
-		rx(2, 2) =  cos(gamma);
-	
-		v = rx * v;
-	}
+	if (gamma != 0.0)
+		v = mat3_mul(mat3_rotation_x(gamma), v);
 	
 	if (beta  != 0.0)
-	{
-		mat ry = zeros<mat>(3,3);
-			
-		ry(0, 0) =  cos(beta);
-		ry(0, 1) = 0.0;
-		ry(0, 2) =  sin(beta);
-		ry(1, 0) = 0.0;
-		ry(1, 1) = 1.0;
-		ry(1, 2) = 0.0;
-		ry(2, 0) = -sin(beta);
-		ry(2, 1) = 0.0;
-		ry(2, 2) =  cos(beta);
-	
-		v = ry * v;
-	}
-	
-	if (gamma  != 0.0)
-	{
-		mat rz = zeros<mat>(3,3);
+		v = mat3_mul(mat3_rotation_y(beta),  v);
 	
-		rz(0, 0) =  cos(alpha);
-		rz(0, 1) = -sin(alpha);
-		rz(0, 2) = 0.0;
-		rz(1, 0) =  sin(alpha);
-		rz(1, 1) =  cos(alpha);
-		rz(1, 2) = 0.0;
-		rz(2, 0) = 0.0;
-		rz(2, 1) = 0.0;
-		rz(2, 2) = 1.0;
-		
-		v = rz * v;
-	}
+	if (alpha != 0.0)
+		v = mat3_mul(mat3_rotation_z(alpha), v);
 	
-	x = v(0);
-	y = v(1);
-	z = v(2);
+	x = v.x;
+	y = v.y;
+	z = v.z;
 }
 
 
@@ -411,10 +411,9 @@ int main(int argc, char *argv[])
     ParticleStateGlobal         particle_state;
     vector<FieldRender>         field_renders;
     vector<ResponseAnalysis>    response_analyses;
-    vector<std::string> headers;
-    vector<std::string> sources;
+    CustomScripts scripts;
     
-    read_config(cfg_file, simulation, laser, particle, particle_state, laboratory, field_renders, response_analyses, headers, sources);
+    read_config(cfg_file, simulation, laser, particle, particle_state, laboratory, field_renders, response_analyses, scripts);
     
     
     